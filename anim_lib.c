@@ -0,0 +1,274 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file anim_lib.c
+ * @brief animated PNG images, balanced frame by frame
+ *
+ * The APNG image is split in standalone PNG frames by io_png, and the
+ * frames are processed by a pool of workers, each one decoding,
+ * balancing and encoding whole frames in memory; the encoded frames
+ * are then spliced in the output APNG image, with the same frame
+ * control. The frames are balanced in rgb mode, gray frames in one
+ * plane, and the alpha channel is kept.
+ *
+ * With per-frame statistics, each frame is processed in one pass.
+ * With shared statistics, the workers first compute the histograms of
+ * each frame; they are summed, the normalization tables are computed
+ * once for the whole animation, and the workers decode the frames
+ * again to normalize and encode them, as in balance_mosaic.
+ *
+ * The workers are run by pool_lib, in threads if the code is compiled
+ * with POSIX threads; otherwise the frames are processed in sequence,
+ * with the same result. The runtime statistics are not locked, they
+ * are collected with one worker.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "io_png.h"
+#include "balance_lib.h"
+#include "colorbalance_lib.h"
+#include "stats_lib.h"
+#include "pool_lib.h"
+
+/* ensure consistency */
+#include "anim_lib.h"
+
+/** @brief animation state, shared by the workers */
+typedef struct anim_s {
+    io_png_anim_t png;          /* frames, replaced when encoded */
+    size_t np, na;              /* color planes, 1 or 3, and alpha planes */
+    float smin, smax;           /* saturated percentage */
+    io_png_opt_t opt;           /* read option */
+    int shared;                 /* shared statistics, else per frame */
+    int apply;                  /* apply pass, histograms pass otherwise */
+    size_t *histo;              /* frame histograms, 3 x (UCHAR_MAX + 1)
+                                 * cells per frame */
+    unsigned char lut[3 * (UCHAR_MAX + 1)];     /* shared tables */
+} anim_t;
+
+/** @brief worker state, its frame buffer */
+typedef struct anim_worker_s {
+    anim_t *anim;
+    unsigned char *buf;         /* frame planes */
+    size_t buf_size;
+} anim_worker_t;
+
+/**
+ * @brief process a frame
+ *
+ * The frame is decoded in the worker buffer. In the histograms pass,
+ * its histograms are computed; in the apply pass, it is balanced with
+ * the shared tables or its own statistics, and encoded in place of
+ * the input frame. The transparent pixels are excluded from the
+ * statistics, unless all are.
+ */
+static void frame_work(void *worker, size_t i)
+{
+    anim_worker_t *w = (anim_worker_t *) worker;
+    anim_t *a = w->anim;
+    io_png_frame_t *frame = a->png.frame + i;
+    unsigned char *ch[4];
+    unsigned char *png;
+    balance_roi_t roi;
+    size_t nx, ny, size, nb_size, c, len, png_size;
+
+    /* decode */
+    io_png_probe_mem(frame->png, frame->len, &nx, &ny, NULL, NULL);
+    size = nx * ny;
+    if ((a->np + a->na) * size > w->buf_size) {
+        STATS_FREE(w->buf);
+        free(w->buf);
+        w->buf_size = (a->np + a->na) * size;
+        if (NULL == (w->buf = (unsigned char *) malloc(w->buf_size)))
+            pool_abort("not enough memory");
+        STATS_ALLOC(w->buf, w->buf_size);
+    }
+    for (c = 0; c < a->np + a->na; c++)
+        ch[c] = w->buf + c * size;
+    io_png_read_uchar_into_mem(frame->png, frame->len, ch, nx, ny,
+                               a->np + a->na, nx,
+                               (io_png_opt_t) ((1 == a->np
+                                                ? IO_PNG_OPT_GRAY
+                                                : IO_PNG_OPT_RGB) | a->opt));
+
+    /* statistics region */
+    roi.stride = nx;
+    roi.x0 = 0;
+    roi.y0 = 0;
+    roi.nx = nx;
+    roi.ny = ny;
+    roi.mask = (0 != a->na ? ch[a->np] : NULL);
+    roi.mask_stride = nx;
+    if (0 == (nb_size = balance_roi_size(&roi))) {
+        roi.mask = NULL;
+        nb_size = size;
+    }
+
+    if (!a->apply) {
+        STATS_TOGGLE(STATS_STATISTICS);
+        for (c = 0; c < a->np; c++)
+            balance_histo_roi_u8(ch[c], &roi, a->histo
+                                 + (3 * i + c) * (UCHAR_MAX + 1));
+        STATS_TOGGLE(STATS_STATISTICS);
+        return;
+    }
+
+    /* balance */
+    STATS_ADD(pixels, (unsigned long) size);
+    if (a->shared) {
+        STATS_TOGGLE(STATS_APPLY);
+        balance_lut_apply_u8(w->buf, size, size, a->np, a->lut);
+        STATS_TOGGLE(STATS_APPLY);
+    }
+    else if (1 == a->np)
+        (void) colorbalance_gray_roi_u8(w->buf, size, &roi,
+                                        nb_size * (a->smin / 100.),
+                                        nb_size * (a->smax / 100.));
+    else
+        (void) colorbalance_rgb_roi_u8(w->buf, size, &roi,
+                                       nb_size * (a->smin / 100.),
+                                       nb_size * (a->smax / 100.));
+
+    /* encode */
+    png = NULL;
+    png_size = 0;
+    len = io_png_write_uchar_from_mem(&png, &png_size,
+                                      (const unsigned char *const *) ch,
+                                      nx, ny, a->np + a->na, nx,
+                                      IO_PNG_OPT_NONE);
+    STATS_FREE(frame->png);
+    free(frame->png);
+    frame->png = png;
+    frame->len = len;
+    frame->size = png_size;
+    return;
+}
+
+/**
+ * @brief balance an animated PNG image, frame by frame
+ *
+ * The frames are balanced in rgb mode, with their own statistics or
+ * with the statistics of all the frames of the animation; the default
+ * image of an APNG image, if it is not a frame of the animation, is
+ * not in the shared statistics but is normalized with them. A still
+ * PNG image is balanced as one frame.
+ *
+ * @param fname_in input file name, "-" for stdin
+ * @param fname_out output file name, "-" for stdout
+ * @param shared shared statistics, per-frame statistics if 0
+ * @param smin, smax saturated percentages
+ * @param nb_workers number of worker threads, in [1-256]
+ * @param opt read option, IO_PNG_OPT_TRUSTED or IO_PNG_OPT_NONE
+ * @return number of frames, abort() on error
+ */
+size_t anim_balance(const char *fname_in, const char *fname_out,
+                    int shared, float smin, float smax,
+                    size_t nb_workers, io_png_opt_t opt)
+{
+    anim_t anim;
+    anim_worker_t *worker;
+    size_t histo[3 * (UCHAR_MAX + 1)];  /* shared histograms */
+    size_t nb_frames, nb_size, i, c;
+    unsigned char min, max;
+
+    /* sanity checks */
+    if (NULL == fname_in || NULL == fname_out) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+    if (1 > nb_workers || POOL_WORKERS_MAX < nb_workers) {
+        fprintf(stderr, "bad parameters\n");
+        abort();
+    }
+
+    /* split the frames */
+    io_png_read_anim(fname_in, &anim.png, opt);
+    anim.np = (3 > anim.png.nc ? 1 : 3);
+    anim.na = (2 == anim.png.nc || 4 == anim.png.nc ? 1 : 0);
+    anim.smin = smin;
+    anim.smax = smax;
+    anim.opt = opt;
+    anim.shared = shared;
+    anim.histo = NULL;
+    nb_frames = anim.png.nb_frames;
+
+    /* worker pool, one worker for the runtime statistics */
+    if (nb_workers > nb_frames)
+        nb_workers = nb_frames;
+    if (stats.on)
+        nb_workers = 1;
+    if (NULL == (worker = (anim_worker_t *)
+                 calloc(nb_workers, sizeof(anim_worker_t))))
+        pool_abort("not enough memory");
+    for (i = 0; i < nb_workers; i++)
+        worker[i].anim = &anim;
+
+    if (shared) {
+        /* map: frame histograms */
+        if (NULL == (anim.histo = (size_t *)
+                     calloc(3 * (UCHAR_MAX + 1) * nb_frames,
+                            sizeof(size_t))))
+            pool_abort("not enough memory");
+        STATS_ALLOC(anim.histo,
+                    3 * (UCHAR_MAX + 1) * nb_frames * sizeof(size_t));
+        anim.apply = 0;
+        pool_run(nb_frames, nb_workers, &frame_work, (void *) worker,
+                 sizeof(anim_worker_t));
+
+        /* reduce: shared histograms and tables, without the default
+         * image out of the animation */
+        STATS_TOGGLE(STATS_STATISTICS);
+        memset(histo, 0x00, sizeof(histo));
+        for (i = (anim.png.hidden ? 1 : 0); i < nb_frames; i++)
+            for (c = 0; c < 3 * (UCHAR_MAX + 1); c++)
+                histo[c] += anim.histo[3 * (UCHAR_MAX + 1) * i + c];
+        nb_size = 0;
+        for (c = 0; c <= UCHAR_MAX; c++)
+            nb_size += histo[c];
+        for (c = 0; c < anim.np; c++) {
+            balance_bounds_histo_u8(histo + c * (UCHAR_MAX + 1),
+                                    nb_size * (smin / 100.),
+                                    nb_size * (smax / 100.), &min, &max);
+            STATS_BOUNDS(c, min, max);
+            balance_lut_u8(min, max, anim.lut + c * (UCHAR_MAX + 1));
+        }
+        STATS_TOGGLE(STATS_STATISTICS);
+        STATS_FREE(anim.histo);
+        free(anim.histo);
+    }
+
+    /* apply: balance and encode the frames, and splice them */
+    anim.apply = 1;
+    pool_run(nb_frames, nb_workers, &frame_work, (void *) worker,
+             sizeof(anim_worker_t));
+    io_png_write_anim(fname_out, &anim.png);
+
+    for (i = 0; i < nb_workers; i++) {
+        STATS_FREE(worker[i].buf);
+        free(worker[i].buf);
+    }
+    free(worker);
+    io_png_free_anim(&anim.png);
+    return nb_frames;
+}
@@ -0,0 +1,11 @@
+#ifndef _ANIM_LIB_H
+#define _ANIM_LIB_H
+
+#include <stddef.h>
+
+#include "io_png.h"
+
+/* anim_lib.c */
+size_t anim_balance(const char *fname_in, const char *fname_out, int shared, float smin, float smax, size_t nb_workers, io_png_opt_t opt);
+
+#endif /* !_ANIM_LIB_H */
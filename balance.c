@@ -30,9 +30,260 @@
 #include <limits.h>
 
 #include "io_png.h"
+#include "pipeline_lib.h"
+#include "balance_lib.h"
 #include "colorbalance_lib.h"
+#include "stats_lib.h"
+#include "cache_lib.h"
+#include "video_lib.h"
+#include "anim_lib.h"
 #include "debug.h"
 
+/** @brief maximum number of downscaled outputs */
+#define BALANCE_DOWN_MAX 4
+/** @brief default number of local balance threads */
+#define BALANCE_WORKERS_DEFAULT 4
+/** @brief maximum number of local balance threads */
+#define BALANCE_WORKERS_MAX 256
+/**
+ * @brief revision of the outputs, in the result cache keys
+ *
+ * Increment it with any change of the balanced outputs, so that the
+ * results of the previous versions are not used.
+ */
+#define BALANCE_REVISION 1
+
+/**
+ * @brief set the statistics region from the command-line options
+ *
+ * @param rect "x0,y0,nx,ny" rectangle, NULL for the whole image
+ * @param mask_fname mask PNG file name, NULL for no mask
+ * @param nx, ny image size
+ * @param alpha alpha plane, NULL for an opaque image; the fully
+ *        transparent pixels are excluded from the region
+ * @param roi region to set
+ * @param maskp pointer to the mask plane, set to NULL or to a new
+ *        plane to be freed by the caller
+ * @return 0 on success, -1 on error with a message
+ */
+static int set_roi(const char *rect, const char *mask_fname,
+                   size_t nx, size_t ny, const unsigned char *alpha,
+                   balance_roi_t * roi, unsigned char **maskp)
+{
+    unsigned long x0, y0, rx, ry;
+    size_t mx, my, i;
+    char end;
+
+    roi->stride = nx;
+    roi->x0 = 0;
+    roi->y0 = 0;
+    roi->nx = nx;
+    roi->ny = ny;
+    roi->mask = NULL;
+    roi->mask_stride = nx;
+    *maskp = NULL;
+
+    if (NULL != rect) {
+        if (4 != sscanf(rect, "%lu,%lu,%lu,%lu%c", &x0, &y0, &rx, &ry, &end)
+            || x0 + rx > nx || y0 + ry > ny) {
+            fprintf(stderr, "the region must be x0,y0,nx,ny"
+                    " within the image\n");
+            return -1;
+        }
+        roi->x0 = (size_t) x0;
+        roi->y0 = (size_t) y0;
+        roi->nx = (size_t) rx;
+        roi->ny = (size_t) ry;
+    }
+
+    if (NULL != mask_fname) {
+        io_png_probe(mask_fname, &mx, &my, NULL, NULL);
+        if (mx != nx || my != ny) {
+            fprintf(stderr, "the mask and the image sizes differ\n");
+            return -1;
+        }
+        if (NULL == (*maskp = (unsigned char *)
+                     malloc(nx * ny * sizeof(unsigned char)))) {
+            fprintf(stderr, "not enough memory\n");
+            return -1;
+        }
+        STATS_ALLOC(*maskp, nx * ny * sizeof(unsigned char));
+        io_png_read_uchar_into(mask_fname, maskp, nx, ny, 1, nx,
+                               IO_PNG_OPT_GRAY);
+        if (NULL != alpha)
+            for (i = 0; i < nx * ny; i++)
+                if (0 == alpha[i])
+                    (*maskp)[i] = 0;
+        roi->mask = *maskp;
+    }
+    else
+        roi->mask = alpha;
+
+    /* a fully transparent image is balanced as an opaque one */
+    if (NULL == rect && NULL == mask_fname && NULL != alpha
+        && 0 == balance_roi_size(roi))
+        roi->mask = NULL;
+
+    if (0 == balance_roi_size(roi)) {
+        fprintf(stderr, "the statistics region is empty\n");
+        STATS_FREE(*maskp);
+        free(*maskp);
+        *maskp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief color balance with preview statistics
+ *
+ * The normalization bounds are estimated on the first Adam7 passes of
+ * the input image, see pipeline_preview_u8(), and the rank error of
+ * this estimation is reported. Without output file, the decoding
+ * stops after these passes, and the report has the expected rank
+ * error. Otherwise the image is completely decoded, normalized with
+ * the estimated bounds, and the report has the measured rank error.
+ *
+ * @param mode color mode, rgb or irgb
+ * @param passes number of Adam7 passes for the statistics
+ * @param smin, smax saturated percentage
+ * @param fname_in input file name
+ * @param fname_out output file name, NULL for the report only
+ * @return 0 on success, -1 on error with a message
+ */
+static int balance_preview(const char *mode, int passes,
+                           float smin, float smax,
+                           const char *fname_in, const char *fname_out)
+{
+    size_t sample[3 * (UCHAR_MAX + 1)];        /* preview histograms */
+    size_t histo[3 * (UCHAR_MAX + 1)];  /* complete histograms */
+    size_t nb_sample, size, nx, ny, np, c, nb_min, nb_max;
+    unsigned char min[3], max[3];
+    char bounds[128];
+    double err;
+    int irgb;
+    FILE *fp;
+
+    irgb = (0 == strcmp(mode, "irgb"));
+    if (!irgb && 0 != strcmp(mode, "rgb")) {
+        fprintf(stderr, "preview statistics need the rgb or irgb mode\n");
+        return -1;
+    }
+    if (NULL != fname_out && 0 == strcmp(fname_in, "-")) {
+        fprintf(stderr, "preview statistics need an input file\n");
+        return -1;
+    }
+
+    /* estimate the bounds on the first passes */
+    DBG_CLOCK_START(0);
+    nb_sample = pipeline_preview_u8(fname_in, passes, irgb, sample, &size);
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("preview\t%0.2fs\n", DBG_CLOCK_S(0));
+    STATS_ADD(pixels, (unsigned long) size);
+    nb_min = size * (smin / 100.);
+    nb_max = size * (smax / 100.);
+    err = balance_rank_error_expected(size, nb_sample, nb_min, nb_max);
+
+    if (!irgb) {
+        unsigned char lut[3 * (UCHAR_MAX + 1)];
+        unsigned char *rgb, *ch[3];
+
+        for (c = 0; c < 3; c++) {
+            balance_bounds_histo_u8(sample + c * (UCHAR_MAX + 1),
+                                    nb_sample * (smin / 100.),
+                                    nb_sample * (smax / 100.),
+                                    min + c, max + c);
+            balance_lut_u8(min[c], max[c], lut + c * (UCHAR_MAX + 1));
+            STATS_BOUNDS(c, min[c], max[c]);
+        }
+        sprintf(bounds, "[%u,%u] [%u,%u] [%u,%u]",
+                min[0], max[0], min[1], max[1], min[2], max[2]);
+
+        if (NULL != fname_out) {
+            /* normalize while decoding, measure the rank error */
+            DBG_CLOCK_START(0);
+            rgb = pipeline_read_lut_u8(fname_in, &nx, &ny, &np, lut, histo,
+                                       IO_PNG_OPT_NONE);
+            DBG_CLOCK_TOGGLE(0);
+            DBG_PRINTF1("read\t%0.2fs\n", DBG_CLOCK_S(0));
+            err = 0.;
+            for (c = 0; c < np; c++) {
+                double e = balance_rank_error_histo(histo
+                                                    + c * (UCHAR_MAX + 1),
+                                                    UCHAR_MAX + 1,
+                                                    nb_min, nb_max,
+                                                    min[c], max[c]);
+                err = (e > err ? e : err);
+            }
+            for (c = 0; c < np; c++)
+                ch[c] = rgb + c * size;
+            DBG_CLOCK_START(0);
+            io_png_write_uchar_from(fname_out,
+                                    (const unsigned char *const *) ch,
+                                    nx, ny, np, nx, IO_PNG_OPT_NONE);
+            DBG_CLOCK_TOGGLE(0);
+            DBG_PRINTF1("write\t%0.2fs\n", DBG_CLOCK_S(0));
+            STATS_FREE(rgb);
+            free(rgb);
+        }
+    }
+    else {
+        colorbalance_irgb_out_u8_t out; /* output rows */
+        unsigned char *rgb, *ch[3];
+
+        colorbalance_irgb_bounds_histo(sample, nb_sample * (smin / 100.),
+                                       nb_sample * (smax / 100.),
+                                       &out.min, &out.max);
+        STATS_BOUNDS(0, out.min, out.max);
+        sprintf(bounds, "[%g,%g]", out.min, out.max);
+
+        if (NULL != fname_out) {
+            /* decode, measure the rank error on the I histogram */
+            DBG_CLOCK_START(0);
+            io_png_probe(fname_in, &nx, &ny, NULL, NULL);
+            if (NULL == (rgb = (unsigned char *)
+                         malloc(3 * size * sizeof(unsigned char)))) {
+                fprintf(stderr, "not enough memory\n");
+                return -1;
+            }
+            STATS_ALLOC(rgb, 3 * size * sizeof(unsigned char));
+            for (c = 0; c < 3; c++)
+                ch[c] = rgb + c * size;
+            io_png_read_uchar_into(fname_in, ch, nx, ny, 3, nx,
+                                   IO_PNG_OPT_RGB);
+            DBG_CLOCK_TOGGLE(0);
+            DBG_PRINTF1("read\t%0.2fs\n", DBG_CLOCK_S(0));
+            memset(histo, 0x00, sizeof(histo));
+            colorbalance_irgb_histo_u8(rgb, size, histo);
+            err = balance_rank_error_histo(histo, 3 * UCHAR_MAX + 1,
+                                           nb_min, nb_max,
+                                           (size_t) (out.min * UCHAR_MAX
+                                                     + .5),
+                                           (size_t) (out.max * UCHAR_MAX
+                                                     + .5));
+            DBG_CLOCK_START(0);
+            out.ch = (const unsigned char *const *) ch;
+            out.alpha = NULL;
+            out.nx = nx;
+            out.stride = nx;
+            io_png_write_rows(fname_out, nx, ny, 3, IO_PNG_OPT_NONE,
+                              &colorbalance_irgb_fill_from_u8, (void *) &out);
+            DBG_CLOCK_TOGGLE(0);
+            DBG_PRINTF1("write\t%0.2fs\n", DBG_CLOCK_S(0));
+            STATS_FREE(rgb);
+            free(rgb);
+        }
+    }
+
+    /* the report is the only output without output file */
+    fp = (NULL == fname_out ? stdout : stderr);
+    fprintf(fp, "preview: %lu of %lu pixels, bounds %s,"
+            " %s rank error %.3g%%\n", (unsigned long) nb_sample,
+            (unsigned long) size, bounds,
+            (NULL == fname_out ? "expected" : "measured"), 100. * err);
+    return 0;
+}
+
 /**
  * @brief main function call
  */
@@ -40,23 +291,259 @@ int main(int argc, char *const *argv)
 {
     float smin, smax;           /* saturated percentage */
     size_t nx, ny, size;        /* data size and index */
+    const char *prog = argv[0];
+    const char *rect = NULL;    /* statistics rectangle option */
+    const char *mask_fname = NULL;      /* statistics mask option */
+    balance_roi_t roi;          /* statistics region */
+    balance_roi_t *roi_ptr;     /* NULL for the whole image */
+    unsigned char *mask;        /* statistics mask plane */
+    size_t nb_size;             /* number of pixels in the statistics */
+    size_t nc, na;              /* number of channels and alpha planes */
+    int print_stats = 0;        /* runtime statistics option */
+    int passes = 0;             /* preview statistics option */
+    pipeline_down_t down[BALANCE_DOWN_MAX];     /* downscaled outputs */
+    size_t nb_down = 0;         /* number of downscaled outputs */
+    const char *cache_dir = NULL;       /* result cache option */
+    size_t cache_size = 0;      /* result cache size, in bytes */
+    char params[256];           /* parameters of the cache key */
+    char key[CACHE_KEY_LEN + 1];        /* cache key, empty if no cache */
+    io_png_opt_t read_opt = IO_PNG_OPT_NONE;    /* input read profile */
+    int video = 0;              /* raw video stream option */
+    video_fmt_t vfmt = VIDEO_Y4M;       /* raw video format */
+    unsigned long vx = 0, vy = 0;       /* raw video frame size */
+    unsigned long gx = 0, gy = 0;       /* local balance grid, 0 if none */
+    int nb_workers = BALANCE_WORKERS_DEFAULT;   /* local balance and
+                                                 * frame threads */
+    int anim = 0;               /* APNG option, 1 per frame, 2 shared */
 
     /* "-v" option : version info */
     if (2 <= argc && 0 == strcmp("-v", argv[1])) {
         fprintf(stdout, "%s version " __DATE__ "\n", argv[0]);
         return EXIT_SUCCESS;
     }
+    /* "-r" and "-m" options : statistics region */
+    /* "--stats" option : runtime statistics */
+    /* "-p" option : preview statistics */
+    /* "-d" option : downscaled outputs */
+    /* "-c" option : result cache */
+    /* "-t" option : trusted input */
+    /* "-f" and "-s" options : raw video stream */
+    /* "-l" and "-j" options : local balance */
+    /* "-a" option : animated PNG image */
+    for (;;) {
+        if (2 <= argc && 0 == strcmp("--stats", argv[1])) {
+            print_stats = 1;
+            argc -= 1;
+            argv += 1;
+        }
+        else if (3 <= argc && 0 == strcmp("-p", argv[1])) {
+            passes = atoi(argv[2]);
+            if (1 > passes || 7 < passes) {
+                fprintf(stderr, "the number of passes must be in [1-7]\n");
+                return EXIT_FAILURE;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else if (4 <= argc && 0 == strcmp("-d", argv[1])) {
+            if (BALANCE_DOWN_MAX == nb_down || 1 > atoi(argv[2])) {
+                fprintf(stderr, "at most %d downscaled outputs,"
+                        " with a factor of at least 1\n", BALANCE_DOWN_MAX);
+                return EXIT_FAILURE;
+            }
+            down[nb_down].factor = (size_t) atoi(argv[2]);
+            down[nb_down].fname = argv[3];
+            nb_down++;
+            argc -= 3;
+            argv += 3;
+        }
+        else if (2 <= argc && 0 == strcmp("-t", argv[1])) {
+            read_opt = IO_PNG_OPT_TRUSTED;
+            argc -= 1;
+            argv += 1;
+        }
+        else if (4 <= argc && 0 == strcmp("-c", argv[1])) {
+            if (1 > atoi(argv[2])) {
+                fprintf(stderr, "the cache size must be at least 1MB\n");
+                return EXIT_FAILURE;
+            }
+            cache_size = (size_t) atoi(argv[2]) * 1024 * 1024;
+            cache_dir = argv[3];
+            argc -= 3;
+            argv += 3;
+        }
+        else if (3 <= argc && 0 == strcmp("-f", argv[1])) {
+            if (0 != video_fmt(argv[2], &vfmt)) {
+                fprintf(stderr, "the video format must be y4m, yuv420,"
+                        " yuvj420 or rgb24\n");
+                return EXIT_FAILURE;
+            }
+            video = 1;
+            argc -= 2;
+            argv += 2;
+        }
+        else if (3 <= argc && 0 == strcmp("-s", argv[1])) {
+            if (2 != sscanf(argv[2], "%lux%lu", &vx, &vy)
+                || 0 == vx || 0 == vy) {
+                fprintf(stderr, "the frame size must be WxH\n");
+                return EXIT_FAILURE;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else if (3 <= argc && 0 == strcmp("-l", argv[1])) {
+            if (2 != sscanf(argv[2], "%lux%lu", &gx, &gy)
+                || 0 == gx || 0 == gy) {
+                fprintf(stderr, "the grid size must be GXxGY\n");
+                return EXIT_FAILURE;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else if (3 <= argc && 0 == strcmp("-a", argv[1])) {
+            if (0 == strcmp(argv[2], "frames"))
+                anim = 1;
+            else if (0 == strcmp(argv[2], "shared"))
+                anim = 2;
+            else {
+                fprintf(stderr, "the animation statistics must be frames"
+                        " or shared\n");
+                return EXIT_FAILURE;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else if (3 <= argc && 0 == strcmp("-j", argv[1])) {
+            nb_workers = atoi(argv[2]);
+            if (1 > nb_workers || BALANCE_WORKERS_MAX < nb_workers) {
+                fprintf(stderr, "the number of threads must be in [1-%i]\n",
+                        BALANCE_WORKERS_MAX);
+                return EXIT_FAILURE;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else if (3 <= argc && (0 == strcmp("-r", argv[1])
+                               || 0 == strcmp("-m", argv[1]))) {
+            if ('r' == argv[1][1])
+                rect = argv[2];
+            else
+                mask_fname = argv[2];
+            argc -= 2;
+            argv += 2;
+        }
+        else
+            break;
+    }
     /* wrong number of parameters : simple help info */
-    if (6 != argc) {
-        fprintf(stderr, "usage : %s mode Smin Smax in.png out.png\n",
-                argv[0]);
-        fprintf(stderr, "        mode is rgb or irgb\n");
+    if (6 != argc && !(5 == argc && 0 < passes)) {
+        fprintf(stderr, "usage : %s [--stats] [-r x0,y0,nx,ny]"
+                " [-m mask.png] [-d factor small.png]\n", prog);
+        fprintf(stderr, "          [-c size dir] [-t] [-l GXxGY [-j workers]]"
+                " mode Smin Smax\n");
+        fprintf(stderr, "          in.png out.png\n");
+        fprintf(stderr, "        %s [--stats] [-c size dir] [-t]"
+                " -a frames|shared [-j workers]\n", prog);
+        fprintf(stderr, "          rgb Smin Smax in.png out.png\n");
+        fprintf(stderr, "        %s [--stats] -p passes"
+                " mode Smin Smax in.png [out.png]\n", prog);
+        fprintf(stderr, "        %s [--stats] -f format [-s WxH]"
+                " rgb Smin Smax in out\n", prog);
+        fprintf(stderr, "        mode is rgb, irgb, hsl, hsv or ycbcr\n");
         fprintf(stderr, "          (see README.txt for details)\n");
         fprintf(stderr, "        Smin and Smax are percentage of pixels\n");
         fprintf(stderr, "          saturated to min and max,\n");
         fprintf(stderr, "          in [0-100[\n");
+        fprintf(stderr, "        -r and -m restrict the statistics to a\n");
+        fprintf(stderr, "          rectangle and to the mask non-zero"
+                " pixels\n");
+        fprintf(stderr, "        -d also writes out.png downscaled by"
+                " factor, box-filtered,\n");
+        fprintf(stderr, "          in small.png; up to %d times\n",
+                BALANCE_DOWN_MAX);
+        fprintf(stderr, "        -c keeps the outputs in a cache"
+                " directory of size MB,\n");
+        fprintf(stderr, "          reused for the same input and"
+                " parameters\n");
+        fprintf(stderr, "        -t skips the CRC and Adler-32 checks"
+                " of a trusted in.png\n");
+        fprintf(stderr, "        --stats prints the runtime statistics"
+                " in JSON\n");
+        fprintf(stderr, "        -p estimates the statistics on the"
+                " first Adam7 passes,\n");
+        fprintf(stderr, "          in [1-7], of an interlaced image;"
+                " without out.png,\n");
+        fprintf(stderr, "          only these passes are decoded\n");
+        fprintf(stderr, "        -f balances a y4m, yuv420, yuvj420 or"
+                " rgb24 video stream frame\n");
+        fprintf(stderr, "          by frame, - for stdin/stdout; -s is"
+                " the raw frames size\n");
+        fprintf(stderr, "        -l balances with the statistics of the"
+                " tiles of a grid,\n");
+        fprintf(stderr, "          blended over the image, in rgb mode;"
+                " with -j threads,\n");
+        fprintf(stderr, "          default %i\n", BALANCE_WORKERS_DEFAULT);
+        fprintf(stderr, "        -a balances the frames of an APNG"
+                " image, with their own\n");
+        fprintf(stderr, "          or shared statistics, in -j"
+                " threads\n");
+        return EXIT_FAILURE;
+    }
+    if (0 < passes && (NULL != rect || NULL != mask_fname)) {
+        fprintf(stderr, "-p can not be used with -r or -m\n");
         return EXIT_FAILURE;
     }
+    if (0 < passes && 0 < nb_down) {
+        fprintf(stderr, "-p can not be used with -d\n");
+        return EXIT_FAILURE;
+    }
+    if (0 < passes && IO_PNG_OPT_NONE != read_opt) {
+        fprintf(stderr, "-p can not be used with -t\n");
+        return EXIT_FAILURE;
+    }
+    if (video && (0 < passes || 0 < nb_down || NULL != cache_dir
+                  || NULL != rect || NULL != mask_fname
+                  || IO_PNG_OPT_NONE != read_opt)) {
+        fprintf(stderr, "-f can not be used with -p, -d, -c, -r, -m"
+                " or -t\n");
+        return EXIT_FAILURE;
+    }
+    if (0 != gx && (0 < passes || video
+                    || NULL != rect || NULL != mask_fname)) {
+        fprintf(stderr, "-l can not be used with -p, -f, -r or -m\n");
+        return EXIT_FAILURE;
+    }
+    if (0 != strcmp(argv[1], "rgb") && 0 != strcmp(argv[1], "irgb")
+        && 0 != strcmp(argv[1], "hsl") && 0 != strcmp(argv[1], "hsv")
+        && 0 != strcmp(argv[1], "ycbcr")) {
+        fprintf(stderr, "mode must be rgb, irgb, hsl, hsv or ycbcr\n");
+        return EXIT_FAILURE;
+    }
+    if (0 != gx && 0 != strcmp(argv[1], "rgb")) {
+        fprintf(stderr, "the local balance is in rgb mode\n");
+        return EXIT_FAILURE;
+    }
+    if (0 != anim && (0 < passes || video || 0 != gx || 0 < nb_down
+                      || NULL != rect || NULL != mask_fname)) {
+        fprintf(stderr, "-a can not be used with -p, -f, -l, -d, -r"
+                " or -m\n");
+        return EXIT_FAILURE;
+    }
+    if (0 != anim && 0 != strcmp(argv[1], "rgb")) {
+        fprintf(stderr, "the animations are balanced in rgb mode\n");
+        return EXIT_FAILURE;
+    }
+    if (video && 0 != strcmp(argv[1], "rgb")) {
+        fprintf(stderr, "the video streams are balanced in rgb mode\n");
+        return EXIT_FAILURE;
+    }
+    if (video && VIDEO_Y4M != vfmt && 0 == vx) {
+        fprintf(stderr, "-s is needed for the raw video frames\n");
+        return EXIT_FAILURE;
+    }
+    if (print_stats)
+        stats_enable();
+    roi_ptr = (NULL == rect && NULL == mask_fname ? NULL : &roi);
 
     /* saturation percentage */
     smin = atof(argv[2]);
@@ -66,55 +553,295 @@ int main(int argc, char *const *argv)
         return EXIT_FAILURE;
     }
 
+    /* raw video stream */
+    if (video) {
+        if (0 > video_balance(argv[4], argv[5], vfmt, (size_t) vx,
+                              (size_t) vy, smin, smax))
+            return EXIT_FAILURE;
+        if (print_stats)
+            stats_print_json(stderr);
+        return EXIT_SUCCESS;
+    }
+
+    /* result cache, not used with standard input/output, and for one
+     * output file; the key is computed from the validated options */
+    key[0] = '\0';
+    if (NULL != cache_dir && 0 == passes && 0 == nb_down
+        && 0 != strcmp(argv[4], "-") && 0 != strcmp(argv[5], "-")) {
+        sprintf(params, "balance r%i %.16s %.9g %.9g %.100s"
+                " %lux%lu %i", BALANCE_REVISION, argv[1], smin, smax,
+                (NULL != rect ? rect : "-"), gx, gy, anim);
+        if (0 == cache_key(argv[4], mask_fname, params, key)) {
+            if (cache_get(cache_dir, key, argv[5])) {
+                STATS_ADD(cache_hits, 1);
+                if (print_stats)
+                    stats_print_json(stderr);
+                return EXIT_SUCCESS;
+            }
+            STATS_ADD(cache_misses, 1);
+        }
+    }
+
+    /* animated PNG image */
+    if (0 != anim) {
+        (void) anim_balance(argv[4], argv[5], (2 == anim), smin, smax,
+                            (size_t) nb_workers, read_opt);
+        if ('\0' != key[0])
+            (void) cache_put(cache_dir, key, argv[5], cache_size);
+        if (print_stats)
+            stats_print_json(stderr);
+        return EXIT_SUCCESS;
+    }
+
+    /* preview statistics */
+    if (0 < passes) {
+        if (0 != balance_preview(argv[1], passes, smin, smax, argv[4],
+                                 (6 == argc ? argv[5] : NULL)))
+            return EXIT_FAILURE;
+        if (print_stats)
+            stats_print_json(stderr);
+        return EXIT_SUCCESS;
+    }
+
+    /* image size, the alpha channel is kept in one more plane */
+    io_png_probe(argv[4], &nx, &ny, &nc, NULL);
+    na = (2 == nc || 4 == nc ? 1 : 0);
+    size = nx * ny;
+
     /* select the color mode */
-    if (0 == strcmp(argv[1], "rgb")) {
+    if (0 == strcmp(argv[1], "rgb") && 0 == nb_down && 0 == gx
+        && io_png_probe_pal(argv[4])) {
+        unsigned char *idx;     /* palette indexes */
+        unsigned char pal[3 * (UCHAR_MAX + 1)]; /* R, G and B entries */
+        unsigned char trns[UCHAR_MAX + 1];      /* entries alpha values */
+        size_t count[UCHAR_MAX + 1];    /* number of pixels per entry */
+        size_t npal, ntrns, i;
+
+        /* read the PNG image as indexes, the rgb color balance is
+         * applied to the palette */
+        DBG_CLOCK_START(0);
+        idx = io_png_read_pal(argv[4], &nx, &ny, pal, &npal, trns, &ntrns,
+                              read_opt);
+        DBG_CLOCK_TOGGLE(0);
+        DBG_PRINTF1("read\t%0.2fs\n", DBG_CLOCK_S(0));
+        STATS_ADD(pixels, (unsigned long) size);
+
+        /* pixels per entry in the statistics region */
+        memset(count, 0x00, sizeof(count));
+        if (NULL == roi_ptr)
+            balance_histo_u8(idx, size, count);
+        else {
+            if (0 != set_roi(rect, mask_fname, nx, ny, NULL, &roi, &mask)) {
+                STATS_FREE(idx);
+                free(idx);
+                return EXIT_FAILURE;
+            }
+            balance_histo_roi_u8(idx, &roi, count);
+            STATS_FREE(mask);
+            free(mask);
+        }
+        /* without the transparent entries, unless all are */
+        nb_size = 0;
+        for (i = 0; i <= UCHAR_MAX; i++)
+            nb_size += (0 != trns[i] ? count[i] : 0);
+        if (0 != nb_size)
+            for (i = 0; i <= UCHAR_MAX; i++)
+                count[i] = (0 != trns[i] ? count[i] : 0);
+        else
+            for (i = 0; i <= UCHAR_MAX; i++)
+                nb_size += count[i];
+
+        /* execute the algorithm */
+        (void) colorbalance_rgb_pal_u8(pal, UCHAR_MAX + 1, count,
+                                       nb_size * (smin / 100.),
+                                       nb_size * (smax / 100.));
+
+        /* write the palette PNG image and free the memory space */
+        DBG_CLOCK_START(0);
+        io_png_write_pal(argv[5], idx, nx, ny, pal, npal, trns, ntrns,
+                         IO_PNG_OPT_NONE);
+        DBG_CLOCK_TOGGLE(0);
+        DBG_PRINTF1("write\t%0.2fs\n", DBG_CLOCK_S(0));
+        STATS_FREE(idx);
+        free(idx);
+    }
+    else if (0 == strcmp(argv[1], "rgb")
+             || 0 == strcmp(argv[1], "hsl")
+             || 0 == strcmp(argv[1], "hsv")
+             || 0 == strcmp(argv[1], "ycbcr")) {
         unsigned char *rgb;     /* input/output data */
+        unsigned char *ch[4];   /* channel planes and alpha plane */
+        size_t histo[3 * (UCHAR_MAX + 1)];      /* channel histograms */
+        size_t np, c;           /* number of planes, 1 for gray images */
+        int stream;             /* histograms computed while reading */
 
-        /* read the PNG image in [0-UCHAR_MAX] */
+        /* read the PNG image in [0-UCHAR_MAX], a gray image in one
+         * plane: these modes only normalize the gray values */
         DBG_CLOCK_START(0);
-        rgb = io_png_read_uchar_opt(argv[4], &nx, &ny, NULL, IO_PNG_OPT_RGB);
+        np = (3 > nc ? 1 : 3);
+        stream = (0 == strcmp(argv[1], "rgb") && NULL == roi_ptr && 0 == na
+                  && 0 == gx);
+        if (stream) {
+            /* decoding overlaps with the histogram computation */
+            rgb = pipeline_read_histo_u8(argv[4], &nx, &ny, &np, histo,
+                                         read_opt);
+        }
+        else {
+            if (NULL == (rgb = (unsigned char *)
+                         malloc((np + na) * size * sizeof(unsigned char)))) {
+                fprintf(stderr, "not enough memory\n");
+                return EXIT_FAILURE;
+            }
+            STATS_ALLOC(rgb, (np + na) * size * sizeof(unsigned char));
+        }
+        for (c = 0; c < np + na; c++)
+            ch[c] = rgb + c * size;
+        if (!stream)
+            io_png_read_uchar_into(argv[4], ch, nx, ny, np + na, nx,
+                                   (io_png_opt_t) ((1 == np
+                                                    ? IO_PNG_OPT_GRAY
+                                                    : IO_PNG_OPT_RGB)
+                                                   | read_opt));
         DBG_CLOCK_TOGGLE(0);
         DBG_PRINTF1("read\t%0.2fs\n", DBG_CLOCK_S(0));
-        size = nx * ny;
+        STATS_ADD(pixels, (unsigned long) size);
+
+        /* statistics region, without the transparent pixels; the
+         * local statistics are on all the pixels of the tiles */
+        mask = NULL;
+        nb_size = size;
+        if ((NULL != roi_ptr || 0 != na) && 0 == gx) {
+            if (0 != set_roi(rect, mask_fname, nx, ny,
+                             (0 != na ? ch[np] : NULL), &roi, &mask)) {
+                STATS_FREE(rgb);
+                free(rgb);
+                return EXIT_FAILURE;
+            }
+            roi_ptr = &roi;
+            nb_size = balance_roi_size(&roi);
+        }
 
         /* execute the algorithm */
-        (void) colorbalance_rgb_u8(rgb, size,
-                                   size * (smin / 100.),
-                                   size * (smax / 100.));
+        if (0 != gx && 1 == np)
+            (void) balance_local_u8(rgb, nx, ny, (size_t) gx, (size_t) gy,
+                                    smin, smax, (size_t) nb_workers);
+        else if (0 != gx)
+            (void) colorbalance_rgb_local_u8(rgb, nx, ny, (size_t) gx,
+                                             (size_t) gy, smin, smax,
+                                             (size_t) nb_workers);
+        else if (stream && 1 == np)
+            (void) colorbalance_gray_histo_u8(rgb, size, histo,
+                                              size * (smin / 100.),
+                                              size * (smax / 100.));
+        else if (stream)
+            (void) colorbalance_rgb_histo_u8(rgb, size, histo,
+                                             size * (smin / 100.),
+                                             size * (smax / 100.));
+        else if (1 == np)
+            (void) colorbalance_gray_roi_u8(rgb, size, roi_ptr,
+                                            nb_size * (smin / 100.),
+                                            nb_size * (smax / 100.));
+        else if (0 == strcmp(argv[1], "rgb"))
+            (void) colorbalance_rgb_roi_u8(rgb, size, roi_ptr,
+                                           nb_size * (smin / 100.),
+                                           nb_size * (smax / 100.));
+        else if (0 == strcmp(argv[1], "hsl"))
+            (void) colorbalance_hsl_roi_u8(rgb, size, roi_ptr,
+                                           nb_size * (smin / 100.),
+                                           nb_size * (smax / 100.));
+        else if (0 == strcmp(argv[1], "hsv"))
+            (void) colorbalance_hsv_roi_u8(rgb, size, roi_ptr,
+                                           nb_size * (smin / 100.),
+                                           nb_size * (smax / 100.));
+        else
+            (void) colorbalance_ycbcr_roi_u8(rgb, size, roi_ptr,
+                                             nb_size * (smin / 100.),
+                                             nb_size * (smax / 100.));
+        STATS_FREE(mask);
+        free(mask);
 
         /* write the PNG image from [0,UCHAR_MAX] and free the memory space */
         DBG_CLOCK_START(0);
-        io_png_write_uchar(argv[5], rgb, nx, ny, 3);
+        pipeline_write_u8(argv[5], (const unsigned char *const *) ch,
+                          nx, ny, np + na, nx, down, nb_down);
         DBG_CLOCK_TOGGLE(0);
         DBG_PRINTF1("write\t%0.2fs\n", DBG_CLOCK_S(0));
+        STATS_FREE(rgb);
         free(rgb);
     }
     else if (0 == strcmp(argv[1], "irgb")) {
-        float *rgb;             /* input/output data */
+        unsigned char *rgb;     /* input data */
+        unsigned char *ch[4];   /* channel planes and alpha plane */
+        colorbalance_irgb_out_u8_t out; /* output rows */
+        size_t c;
 
-        /* read the PNG image in [0-1] */
+        /* read the PNG image in [0-UCHAR_MAX], the 8bit samples are
+         * kept as they are and converted to floats row by row */
         DBG_CLOCK_START(0);
-        rgb = io_png_read_flt_opt(argv[4], &nx, &ny, NULL, IO_PNG_OPT_RGB);
+        if (NULL == (rgb = (unsigned char *)
+                     malloc((3 + na) * size * sizeof(unsigned char)))) {
+            fprintf(stderr, "not enough memory\n");
+            return EXIT_FAILURE;
+        }
+        STATS_ALLOC(rgb, (3 + na) * size * sizeof(unsigned char));
+        for (c = 0; c < 3 + na; c++)
+            ch[c] = rgb + c * size;
+        io_png_read_uchar_into(argv[4], ch, nx, ny, 3 + na, nx,
+                               (io_png_opt_t) (IO_PNG_OPT_RGB | read_opt));
         DBG_CLOCK_TOGGLE(0);
         DBG_PRINTF1("read\t%0.2fs\n", DBG_CLOCK_S(0));
-        size = nx * ny;
+        STATS_ADD(pixels, (unsigned long) size);
 
-        /* execute the algorithm */
-        (void) colorbalance_irgb_f32(rgb, size,
-                                     size * (smin / 100.),
-                                     size * (smax / 100.));
+        /* statistics region, without the transparent pixels */
+        mask = NULL;
+        nb_size = size;
+        if (NULL != roi_ptr || 0 != na) {
+            if (0 != set_roi(rect, mask_fname, nx, ny,
+                             (0 != na ? ch[3] : NULL), &roi, &mask)) {
+                STATS_FREE(rgb);
+                free(rgb);
+                return EXIT_FAILURE;
+            }
+            roi_ptr = &roi;
+            nb_size = balance_roi_size(&roi);
+        }
 
-        /* write the PNG image from [0,1] and free the memory space */
+        /* execute the algorithm, the bounds are computed on the exact
+         * I histogram */
         DBG_CLOCK_START(0);
-        io_png_write_flt(argv[5], rgb, nx, ny, 3);
+        colorbalance_irgb_bounds_u8(rgb, size, roi_ptr,
+                                    nb_size * (smin / 100.),
+                                    nb_size * (smax / 100.),
+                                    &out.min, &out.max);
+        STATS_FREE(mask);
+        free(mask);
+        DBG_CLOCK_TOGGLE(0);
+        DBG_PRINTF1("irgb\t%0.2fs\n", DBG_CLOCK_S(0));
+
+        /* write the balanced PNG image and free the memory space */
+        DBG_CLOCK_START(0);
+        out.ch = (const unsigned char *const *) ch;
+        out.alpha = (0 != na ? ch[3] : NULL);
+        out.nx = nx;
+        out.stride = nx;
+        pipeline_write_rows(argv[5], nx, ny, 3 + na,
+                            &colorbalance_irgb_fill_from_u8, (void *) &out,
+                            down, nb_down);
         DBG_CLOCK_TOGGLE(0);
         DBG_PRINTF1("write\t%0.2fs\n", DBG_CLOCK_S(0));
+        STATS_FREE(rgb);
         free(rgb);
     }
     else {
-        fprintf(stderr, "mode must be rgb or irgb\n");
+        fprintf(stderr, "mode must be rgb, irgb, hsl, hsv or ycbcr\n");
         return EXIT_FAILURE;
     }
 
+    /* the output is kept for the next identical inputs */
+    if ('\0' != key[0])
+        (void) cache_put(cache_dir, key, argv[5], cache_size);
+
+    if (print_stats)
+        stats_print_json(stderr);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file balance_client.c
+ * @brief command-line client of the balanced daemon
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "daemon_lib.h"
+
+/**
+ * @brief read a whole file, "-" means stdin
+ *
+ * @return a new buffer, NULL on error
+ */
+static unsigned char *read_file(const char *fname, size_t * lenp)
+{
+    FILE *fp;
+    unsigned char *buf, *tmp;
+    size_t size, len;
+
+    if (0 == strcmp(fname, "-"))
+        fp = stdin;
+    else if (NULL == (fp = fopen(fname, "rb")))
+        return NULL;
+
+    size = 1 << 16;
+    len = 0;
+    buf = (unsigned char *) malloc(size);
+    while (NULL != buf) {
+        len += fread(buf + len, 1, size - len, fp);
+        if (len < size)
+            break;
+        size *= 2;
+        if (NULL == (tmp = (unsigned char *) realloc(buf, size)))
+            free(buf);
+        buf = tmp;
+    }
+    if (NULL != buf && ferror(fp)) {
+        free(buf);
+        buf = NULL;
+    }
+    if (stdin != fp)
+        (void) fclose(fp);
+    *lenp = len;
+    return buf;
+}
+
+/**
+ * @brief write a buffer to a file, "-" means stdout
+ *
+ * @return 0 on success, -1 on error
+ */
+static int write_file(const char *fname, const unsigned char *buf,
+                      size_t len)
+{
+    FILE *fp;
+    int ret;
+
+    if (0 == strcmp(fname, "-"))
+        fp = stdout;
+    else if (NULL == (fp = fopen(fname, "wb")))
+        return -1;
+
+    ret = (len == fwrite(buf, 1, len, fp) ? 0 : -1);
+    if (stdout != fp) {
+        if (0 != fclose(fp))
+            ret = -1;
+    }
+    else if (0 != fflush(fp))
+        ret = -1;
+    return ret;
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    char line[DAEMON_LINE_MAX];
+    unsigned char *data, *reply;
+    unsigned long len;
+    size_t data_len;
+    int fd, path, ok;
+    const char *out;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+    /* "-p" option : send the input file path instead of its data */
+    path = (2 <= argc && 0 == strcmp("-p", argv[1]));
+    if (path) {
+        argc--;
+        argv++;
+    }
+    /* wrong number of parameters : simple help info */
+    if (!(3 == argc && 0 == strcmp("stats", argv[2])) && 7 != argc) {
+        fprintf(stderr, "usage : %s [-p] socket mode Smin Smax"
+                " in.png out.png\n", argv[0]);
+        fprintf(stderr, "        %s socket stats\n", argv[0]);
+        fprintf(stderr, "        socket is the balanced socket path\n");
+        fprintf(stderr, "        mode, Smin and Smax are the same as"
+                " for balance\n");
+        fprintf(stderr, "        -p sends the path of in.png, to be"
+                " read by balanced\n");
+        fprintf(stderr, "          (see README.txt for details)\n");
+        return EXIT_FAILURE;
+    }
+
+    /* prepare the request */
+    if (3 == argc) {
+        data = NULL;
+        data_len = 0;
+        strcpy(line, "STATS\n");
+        out = "-";
+    }
+    else {
+        if (path) {
+            /* relative paths are completed, balanced has its own cwd */
+            char cwd[4096];
+
+            if ('/' == argv[5][0])
+                cwd[0] = '\0';
+            else if (NULL == getcwd(cwd, sizeof(cwd) - 1))
+                cwd[0] = '\0';
+            else
+                strcat(cwd, "/");
+            data_len = strlen(cwd) + strlen(argv[5]);
+            data = (unsigned char *) malloc(data_len + 1);
+            if (NULL != data) {
+                strcpy((char *) data, cwd);
+                strcat((char *) data, argv[5]);
+            }
+        }
+        else
+            data = read_file(argv[5], &data_len);
+        if (NULL == data) {
+            fprintf(stderr, "failed to read the input file\n");
+            return EXIT_FAILURE;
+        }
+        if (DAEMON_LINE_MAX - 32 < strlen(argv[2]) + strlen(argv[3])
+            + strlen(argv[4])) {
+            fprintf(stderr, "bad parameters\n");
+            free(data);
+            return EXIT_FAILURE;
+        }
+        sprintf(line, "BALANCE %s %s %s %s %lu\n", argv[2], argv[3],
+                argv[4], (path ? "path" : "png"), (unsigned long) data_len);
+        out = argv[6];
+    }
+
+    /* send the request, a closed connection is reported below */
+    (void) signal(SIGPIPE, SIG_IGN);
+    if (0 > (fd = daemon_connect(argv[1]))) {
+        fprintf(stderr, "failed to connect to %s\n", argv[1]);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    /* on a write error, balanced may still have sent an error reply */
+    if (0 == daemon_write_full(fd, line, strlen(line)))
+        (void) daemon_write_full(fd, data, data_len);
+    free(data);
+
+    /* receive the reply */
+    if (0 != daemon_read_line(fd, line, DAEMON_LINE_MAX)
+        || (1 != sscanf(line, "OK %lu", &len)
+            && 1 != sscanf(line, "ERROR %lu", &len))
+        || DAEMON_DATA_MAX < len
+        || NULL == (reply = (unsigned char *) malloc(len + 1))) {
+        fprintf(stderr, "no reply from the daemon\n");
+        (void) close(fd);
+        return EXIT_FAILURE;
+    }
+    ok = (0 == strncmp(line, "OK", 2));
+    if (0 != daemon_read_full(fd, reply, (size_t) len)) {
+        fprintf(stderr, "no reply from the daemon\n");
+        (void) close(fd);
+        free(reply);
+        return EXIT_FAILURE;
+    }
+    (void) close(fd);
+
+    if (!ok) {
+        reply[len] = '\0';
+        fprintf(stderr, "%s\n", (char *) reply);
+        free(reply);
+        return EXIT_FAILURE;
+    }
+    if (0 != write_file(out, reply, (size_t) len)) {
+        fprintf(stderr, "failed to write the output file\n");
+        free(reply);
+        return EXIT_FAILURE;
+    }
+    free(reply);
+    return EXIT_SUCCESS;
+}
@@ -30,6 +30,21 @@
 #include <limits.h>
 #include <string.h>
 
+/*
+ * The SIMD table lookups need instructions out of the amd64 baseline:
+ * they are compiled for their own target and selected at runtime,
+ * with the GCC and clang function attributes and builtins.
+ */
+#if ((defined(__x86_64__) || defined(__i386__)) \
+     && ((defined(__clang__) && __clang_major__ >= 7) \
+         || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 5)))
+#define LUT_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "stats_lib.h"
+#include "pool_lib.h"
+
 /* ensure consistency */
 #include "balance_lib.h"
 
@@ -65,26 +80,82 @@ static void minmax_u8(const unsigned char *data, size_t size,
 }
 
 /**
- * @brief get the min/max of a float array
+ * @brief set a region covering a whole array
  *
- * @param data input array
+ * @param roi region
  * @param size array size
+ */
+static void roi_full(balance_roi_t * roi, size_t size)
+{
+    roi->stride = size;
+    roi->x0 = 0;
+    roi->y0 = 0;
+    roi->nx = size;
+    roi->ny = 1;
+    roi->mask = NULL;
+    roi->mask_stride = 0;
+    return;
+}
+
+/** @brief first sample of the row y of a region */
+#define ROI_ROW(DATA, ROI, Y) \
+    ((DATA) + ((ROI)->y0 + (Y)) * (ROI)->stride + (ROI)->x0)
+
+/** @brief first mask value of the row y of a region, NULL without mask */
+#define ROI_MASK(ROI, Y)                                                \
+    (NULL == (ROI)->mask ? NULL                                         \
+     : (ROI)->mask + ((ROI)->y0 + (Y)) * (ROI)->mask_stride + (ROI)->x0)
+
+/**
+ * @brief get the min/max of a float array region
+ *
+ * @param data input array
+ * @param roi region, not empty
  * @param ptr_min, ptr_max pointers to the returned values, ignored if NULL
  */
-static void minmax_f32(const float *data, size_t size,
+static void minmax_f32(const float *data, const balance_roi_t * roi,
                        float *ptr_min, float *ptr_max)
 {
+    const float *row;
+    const unsigned char *mask;
     float min, max;
-    size_t i;
+    size_t x, y;
 
-    /* compute min and max */
-    min = data[0];
-    max = data[0];
-    for (i = 1; i < size; i++) {
-        if (data[i] < min)
-            min = data[i];
-        if (data[i] > max)
-            max = data[i];
+    /* start from the first pixel of the region */
+    min = 0.;
+    for (y = 0; y < roi->ny; y++) {
+        row = ROI_ROW(data, roi, y);
+        mask = ROI_MASK(roi, y);
+        for (x = 0; x < roi->nx; x++)
+            if (NULL == mask || 0 != mask[x])
+                break;
+        if (x < roi->nx) {
+            min = row[x];
+            break;
+        }
+    }
+    max = min;
+
+    /* compute min and max, the mask test is out of the plain loop */
+    for (; y < roi->ny; y++) {
+        row = ROI_ROW(data, roi, y);
+        mask = ROI_MASK(roi, y);
+        if (NULL == mask)
+            for (x = 0; x < roi->nx; x++) {
+                if (row[x] < min)
+                    min = row[x];
+                if (row[x] > max)
+                    max = row[x];
+            }
+        else
+            for (x = 0; x < roi->nx; x++) {
+                if (0 == mask[x])
+                    continue;
+                if (row[x] < min)
+                    min = row[x];
+                if (row[x] > max)
+                    max = row[x];
+            }
     }
 
     /* save min and max to the returned pointers if available */
@@ -95,57 +166,129 @@ static void minmax_f32(const float *data, size_t size,
     return;
 }
 
+/*
+ * HISTOGRAM
+ *
+ * The histogram of an unsigned char array is accumulated in
+ * HISTO_SUB interleaved sub-histograms: successive values go to
+ * different sub-histograms, so a run of equal values updates
+ * different counters, and the increments do not wait for the
+ * previous one (store-to-load forwarding). The sub-histogram
+ * counters are 32 bits, so the HISTO_SUB sub-histograms fit in 4KB,
+ * and they are added to the size_t histogram every HISTO_BLOCK
+ * values, before they can overflow.
+ *
+ * Short arrays are counted directly in the size_t histogram, the
+ * sub-histogram initialization and flush would cost more than the
+ * counting.
+ *
+ * There is no SIMD version: an AVX-512 conflict-detection version
+ * (vpconflictd, then gather and scatter of the counters of 16 values)
+ * was measured twice as slow as this loop on random and natural data,
+ * and as fast on constant data: the gather and scatter cost more than
+ * the scalar increments.
+ */
+
+/** @brief number of interleaved sub-histograms */
+#define HISTO_SUB 4
+/** @brief values counted between two sub-histogram flushes */
+#define HISTO_BLOCK ((size_t) HISTO_SUB << 20)
+/** @brief shortest array counted with sub-histograms */
+#define HISTO_MIN 4096
+
+/** @brief sub-histogram counter, at least 32 bits */
+#if (UINT_MAX >= 0xfffffffful)
+typedef unsigned int histo_cnt_t;
+#else
+typedef unsigned long histo_cnt_t;
+#endif
+
+/**
+ * @brief add the values of an unsigned char array to an histogram
+ *
+ * @param data input array
+ * @param size array size
+ * @param histo histogram, UCHAR_MAX + 1 cells, updated
+ */
+static void histo_u8(const unsigned char *data, size_t size, size_t *histo)
+{
+    histo_cnt_t sub[HISTO_SUB][UCHAR_MAX + 1];
+    size_t i, n, v;
+
+    if (HISTO_MIN > size) {
+        for (i = 0; i < size; i++)
+            histo[(size_t) data[i]] += 1;
+        return;
+    }
+
+    while (0 < size) {
+        n = (HISTO_BLOCK < size ? HISTO_BLOCK : size);
+        memset(sub, 0x00, sizeof(sub));
+        /* unrolled for HISTO_SUB = 4 */
+        for (i = 0; i + HISTO_SUB <= n; i += HISTO_SUB) {
+            sub[0][(size_t) data[i]] += 1;
+            sub[1][(size_t) data[i + 1]] += 1;
+            sub[2][(size_t) data[i + 2]] += 1;
+            sub[3][(size_t) data[i + 3]] += 1;
+        }
+        for (; i < n; i++)
+            sub[0][(size_t) data[i]] += 1;
+        for (v = 0; v <= UCHAR_MAX; v++)
+            histo[v] += (size_t) sub[0][v] + sub[1][v] + sub[2][v]
+                + sub[3][v];
+        data += n;
+        size -= n;
+    }
+    return;
+}
+
 /**
- * @brief get quantiles from an unsigned char array such that a given
- * number of pixels is out of this interval
+ * @brief get quantiles from an histogram such that a given number of
+ * pixels is out of this interval
  *
- * This function computes min (resp. max) such that the number of
- * pixels < min (resp. > max) is inferior or equal to nb_min
- * (resp. nb_max). It uses an histogram algorithm.
+ * See quantiles_u8(). The cumulative histogram is computed on the
+ * fly, from the beginning for the min and from the end for the max.
  *
- * @param data input/output
- * @param size data array size
- * @param nb_min, nb_max number of pixels to flatten
- * @param ptr_min, ptr_max computed min/max output, ignored if NULL
+ * @param histo histogram
+ * @param h_size number of histogram cells
+ * @param nb_min, nb_max number of pixels to flatten, less than the
+ *        number of values in the histogram
+ * @param ptr_min, ptr_max computed min/max cells output, ignored if NULL
  */
-static void quantiles_u8(const unsigned char *data, size_t size,
-                         size_t nb_min, size_t nb_max,
-                         unsigned char *ptr_min, unsigned char *ptr_max)
+static void quantiles_histo(const size_t *histo, size_t h_size,
+                            size_t nb_min, size_t nb_max,
+                            size_t *ptr_min, size_t *ptr_max)
 {
-    /*
-     * the histogram must hold all possible "unsigned char" values,
-     * including 0
-     */
-    size_t h_size = UCHAR_MAX + 1;
-    size_t histo[UCHAR_MAX + 1];
+    size_t cumul;
     size_t i;
 
-    /* make a cumulative histogram */
-    memset(histo, 0x00, h_size * sizeof(size_t));
-    for (i = 0; i < size; i++)
-        histo[(size_t) data[i]] += 1;
-    for (i = 1; i < h_size; i++)
-        histo[i] += histo[i - 1];
-
     /* get the new min/max */
 
     if (NULL != ptr_min) {
         /* simple forward traversal of the cumulative histogram */
         /* search the first value > nb_min */
         i = 0;
-        while (i < h_size && histo[i] <= nb_min)
+        cumul = histo[0];
+        while (i < h_size && cumul <= nb_min) {
             i++;
+            if (i < h_size)
+                cumul += histo[i];
+        }
         /* the corresponding histogram value is the current cell position */
-        *ptr_min = (unsigned char) i;
+        *ptr_min = i;
     }
 
     if (NULL != ptr_max) {
         /* simple backward traversal of the cumulative histogram */
-        /* search the first value <= size - nb_max */
+        /* search the first value <= size - nb_max, that is the first
+         * cell with less than nb_max values after it */
         i = h_size - 1;
+        cumul = 0;
         /* i is unsigned, we check i<h_size instead of i>=0 */
-        while (i < h_size && histo[i] > (size - nb_max))
+        while (i < h_size && cumul < nb_max) {
+            cumul += histo[i];
             i--;
+        }
         /*
          * if we are not at the end of the histogram,
          * get to the next cell,
@@ -153,11 +296,47 @@ static void quantiles_u8(const unsigned char *data, size_t size,
          */
         if (i < h_size - 1)
             i++;
-        *ptr_max = (unsigned char) i;
+        *ptr_max = i;
     }
     return;
 }
 
+/**
+ * @brief get quantiles from an unsigned char array such that a given
+ * number of pixels is out of this interval
+ *
+ * This function computes min (resp. max) such that the number of
+ * pixels < min (resp. > max) is inferior or equal to nb_min
+ * (resp. nb_max). It uses an histogram algorithm.
+ *
+ * @param data input/output
+ * @param size data array size
+ * @param nb_min, nb_max number of pixels to flatten
+ * @param ptr_min, ptr_max computed min/max output, ignored if NULL
+ */
+static void quantiles_u8(const unsigned char *data, size_t size,
+                         size_t nb_min, size_t nb_max,
+                         unsigned char *ptr_min, unsigned char *ptr_max)
+{
+    /*
+     * the histogram must hold all possible "unsigned char" values,
+     * including 0
+     */
+    size_t histo[UCHAR_MAX + 1];
+    size_t min, max;
+
+    memset(histo, 0x00, (UCHAR_MAX + 1) * sizeof(size_t));
+    histo_u8(data, size, histo);
+    quantiles_histo(histo, UCHAR_MAX + 1, nb_min, nb_max,
+                    (NULL == ptr_min ? NULL : &min),
+                    (NULL == ptr_max ? NULL : &max));
+    if (NULL != ptr_min)
+        *ptr_min = (unsigned char) min;
+    if (NULL != ptr_max)
+        *ptr_max = (unsigned char) max;
+    return;
+}
+
 /**
  * @brief float comparison
  *
@@ -174,42 +353,299 @@ static int cmp_f32(const void *a, const void *b)
     return 0;
 }
 
+/** @brief number of bins of the float quantile selection histogram */
+#define QUANTILES_F32_BINS 4096
+
+/** @brief histogram bin of a float value, (value - min) * scale */
+#define BIN_F32(V, MIN, SCALE)                                         \
+    ((size_t) (((V) - (MIN)) * (SCALE)) < QUANTILES_F32_BINS           \
+     ? (size_t) (((V) - (MIN)) * (SCALE)) : QUANTILES_F32_BINS - 1)
+
+/**
+ * @brief get the value of a given rank in a float array region,
+ * knowing the histogram bin it belongs to
+ *
+ * The values in the bin are copied and sorted, the value at the
+ * given rank within the bin is returned.
+ *
+ * @param data input array
+ * @param roi region
+ * @param min, scale histogram parameters, bin = (value - min) * scale
+ * @param bin bin index
+ * @param nb number of values in the bin
+ * @param rank rank of the value in the bin
+ */
+static float select_bin_f32(const float *data, const balance_roi_t * roi,
+                            float min, float scale, size_t bin,
+                            size_t nb, size_t rank)
+{
+    const float *row;
+    const unsigned char *mask;
+    float *data_tmp;
+    float value;
+    size_t x, y, j, b;
+
+    data_tmp = (float *) malloc(nb * sizeof(float));
+    STATS_ALLOC(data_tmp, nb * sizeof(float));
+
+    /* copy the values of this bin and sort */
+    j = 0;
+    for (y = 0; y < roi->ny; y++) {
+        row = ROI_ROW(data, roi, y);
+        mask = ROI_MASK(roi, y);
+        for (x = 0; x < roi->nx; x++) {
+            if (NULL != mask && 0 == mask[x])
+                continue;
+            b = BIN_F32(row[x], min, scale);
+            if (b == bin)
+                data_tmp[j++] = row[x];
+        }
+    }
+    qsort(data_tmp, nb, sizeof(float), &cmp_f32);
+
+    value = data_tmp[rank];
+    STATS_FREE(data_tmp);
+    free(data_tmp);
+    return value;
+}
+
 /**
- * @brief get quantiles from a float array such that a given
+ * @brief get quantiles from a float array region such that a given
  * number of pixels is out of this interval
  *
  * This function computes min (resp. max) such that the number of
  * pixels < min (resp. > max) is inferior or equal to nb_min
- * (resp. nb_max). It uses a sorting algorithm.
+ * (resp. nb_max). It uses an histogram to select the pertinent
+ * values, then sorts the values in the bins around the quantiles,
+ * giving the same result as a sort of the whole region.
+ *
+ * The histogram binning (value - min) * scale is monotonic with
+ * IEEE754 rounding, the value of rank r is in the bin where the
+ * cumulative histogram goes past r.
  *
  * @param data input/output
- * @param size data array size
+ * @param roi region, not empty
+ * @param size number of pixels in the region
  * @param nb_min, nb_max number of pixels to flatten
  * @param ptr_min, ptr_max computed min/max output, ignored if NULL
- *
- * @todo instead of sorting the whole array (expensive), select
- * pertinent values with a 128 bins histogram then sort the bins
- * around the good bin
  */
-static void quantiles_f32(const float *data, size_t size,
-                          size_t nb_min, size_t nb_max,
+static void quantiles_f32(const float *data, const balance_roi_t * roi,
+                          size_t size, size_t nb_min, size_t nb_max,
                           float *ptr_min, float *ptr_max)
 {
-    float *data_tmp;
+    const float *row;
+    const unsigned char *mask;
+    size_t *histo;
+    size_t x, y, i, b, rank;
+    float min, max, scale;
 
-    data_tmp = (float *) malloc(size * sizeof(float));
+    /* constant data, nothing to select */
+    minmax_f32(data, roi, &min, &max);
+    if (max <= min) {
+        if (NULL != ptr_min)
+            *ptr_min = min;
+        if (NULL != ptr_max)
+            *ptr_max = max;
+        return;
+    }
 
-    /* copy the data and sort */
-    memcpy(data_tmp, data, size * sizeof(float));
-    qsort(data_tmp, size, sizeof(float), &cmp_f32);
+    /* make a cumulative histogram */
+    histo = (size_t *) calloc(QUANTILES_F32_BINS, sizeof(size_t));
+    STATS_ALLOC(histo, QUANTILES_F32_BINS * sizeof(size_t));
+    scale = (float) QUANTILES_F32_BINS / (max - min);
+    for (y = 0; y < roi->ny; y++) {
+        row = ROI_ROW(data, roi, y);
+        mask = ROI_MASK(roi, y);
+        for (x = 0; x < roi->nx; x++) {
+            if (NULL != mask && 0 == mask[x])
+                continue;
+            b = BIN_F32(row[x], min, scale);
+            histo[b] += 1;
+        }
+    }
+    for (i = 1; i < QUANTILES_F32_BINS; i++)
+        histo[i] += histo[i - 1];
 
-    /* get the min/max */
-    if (NULL != ptr_min)
-        *ptr_min = data_tmp[nb_min];
-    if (NULL != ptr_max)
-        *ptr_max = data_tmp[size - 1 - nb_max];
+    /* get the min/max in the bins holding the ranks nb_min and
+     * size - 1 - nb_max */
+    if (NULL != ptr_min) {
+        rank = nb_min;
+        b = 0;
+        while (histo[b] <= rank)
+            b++;
+        *ptr_min = select_bin_f32(data, roi, min, scale, b,
+                                  histo[b] - (0 == b ? 0 : histo[b - 1]),
+                                  rank - (0 == b ? 0 : histo[b - 1]));
+    }
+    if (NULL != ptr_max) {
+        rank = size - 1 - nb_max;
+        b = 0;
+        while (histo[b] <= rank)
+            b++;
+        *ptr_max = select_bin_f32(data, roi, min, scale, b,
+                                  histo[b] - (0 == b ? 0 : histo[b - 1]),
+                                  rank - (0 == b ? 0 : histo[b - 1]));
+    }
 
-    free(data_tmp);
+    STATS_FREE(histo);
+    free(histo);
+    return;
+}
+
+/**
+ * @brief build the normalization table of rescale_u8()
+ *
+ * @param norm output table, UCHAR_MAX + 1 cells
+ * @param min, max the minimum and maximum of the input array, max > min
+ */
+static void norm_u8(unsigned char *norm, unsigned char min, unsigned char max)
+{
+    size_t i;
+
+    for (i = 0; i < min; i++)
+        norm[i] = 0;
+    for (i = min; i < max; i++)
+        /*
+         * we can't store and reuse UCHAR_MAX / (max - min) because
+         *     105 * 255 / 126.            -> 212.5, rounded to 213
+         *     105 * (double) (255 / 126.) -> 212.4999, rounded to 212
+         */
+        norm[i] = (unsigned char) ((i - min) * UCHAR_MAX
+                                   / (double) (max - min) + .5);
+    for (i = max; i < UCHAR_MAX + 1; i++)
+        norm[i] = UCHAR_MAX;
+    return;
+}
+
+/*
+ * TABLE LOOKUP
+ */
+
+/**
+ * @brief apply a 256 cells table to an unsigned char array, scalar
+ *
+ * This is the reference of the SIMD versions, which give exactly the
+ * same values.
+ *
+ * @param data input/output array
+ * @param size array size
+ * @param lut table, UCHAR_MAX + 1 cells
+ */
+static void lut_scalar_u8(unsigned char *data, size_t size,
+                          const unsigned char *lut)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        data[i] = lut[(size_t) data[i]];
+    return;
+}
+
+#ifdef LUT_DISPATCH
+
+/**
+ * @brief apply a 256 cells table, AVX2
+ *
+ * Each half of the table is split in 8 rows of 16 cells, looked up by
+ * vpshufb with the low nibble. vpshufb gives 0 for an index with the
+ * high bit set, so with the index v - 16 k the row k is only looked
+ * up for k <= v / 16: the rows are stored as the XOR difference with
+ * the previous row and the lookups are XORed. The bytes of the other
+ * half get an index with the high bit set. The bytes left over are
+ * processed by lut_scalar_u8().
+ */
+__attribute__ ((target("avx2")))
+static void lut_avx2_u8(unsigned char *data, size_t size,
+                        const unsigned char *lut)
+{
+    unsigned char diff[16];
+    __m256i row[16], c16, v, high, lo, hi, r;
+    size_t i, j, k;
+
+    for (k = 0; k < 16; k++) {
+        for (j = 0; j < 16; j++)
+            diff[j] = lut[16 * k + j] ^ (0 == k % 8 ? 0
+                                         : lut[16 * (k - 1) + j]);
+        row[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128
+                                             ((const __m128i *) diff));
+    }
+    c16 = _mm256_set1_epi8(16);
+    for (i = 0; i + 32 <= size; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (data + i));
+        /* 0xff for the bytes of the high half, 0 otherwise */
+        high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+        lo = _mm256_or_si256(v, high);
+        hi = _mm256_or_si256(_mm256_xor_si256(v, _mm256_set1_epi8(-128)),
+                             _mm256_xor_si256(high, _mm256_set1_epi8(-1)));
+        r = _mm256_setzero_si256();
+        for (k = 0; k < 8; k++) {
+            r = _mm256_xor_si256(r, _mm256_shuffle_epi8(row[k], lo));
+            r = _mm256_xor_si256(r, _mm256_shuffle_epi8(row[8 + k], hi));
+            lo = _mm256_sub_epi8(lo, c16);
+            hi = _mm256_sub_epi8(hi, c16);
+        }
+        _mm256_storeu_si256((__m256i *) (data + i), r);
+    }
+    lut_scalar_u8(data + i, size - i, lut);
+    return;
+}
+
+/**
+ * @brief apply a 256 cells table, AVX-512 VBMI
+ *
+ * The table is held in 4 registers of 64 cells. Each half is looked
+ * up with the low 7 bits by vpermi2b, and the high bit selects the
+ * half. The bytes left over are processed by lut_scalar_u8().
+ */
+__attribute__ ((target("avx512f,avx512bw,avx512vbmi")))
+static void lut_vbmi_u8(unsigned char *data, size_t size,
+                        const unsigned char *lut)
+{
+    __m512i t0, t1, t2, t3, v, lo, hi;
+    size_t i;
+
+    t0 = _mm512_loadu_si512((const void *) lut);
+    t1 = _mm512_loadu_si512((const void *) (lut + 64));
+    t2 = _mm512_loadu_si512((const void *) (lut + 128));
+    t3 = _mm512_loadu_si512((const void *) (lut + 192));
+    for (i = 0; i + 64 <= size; i += 64) {
+        v = _mm512_loadu_si512((const void *) (data + i));
+        lo = _mm512_permutex2var_epi8(t0, v, t1);
+        hi = _mm512_permutex2var_epi8(t2, v, t3);
+        _mm512_storeu_si512((void *) (data + i),
+                            _mm512_mask_blend_epi8(_mm512_movepi8_mask(v),
+                                                   lo, hi));
+    }
+    lut_scalar_u8(data + i, size - i, lut);
+    return;
+}
+
+#endif                          /* LUT_DISPATCH */
+
+/**
+ * @brief apply a 256 cells table to an unsigned char array
+ *
+ * The fastest version supported by the CPU is selected at each call;
+ * the CPU features are detected once, at the program startup.
+ *
+ * @param data input/output array
+ * @param size array size
+ * @param lut table, UCHAR_MAX + 1 cells
+ */
+static void lut_u8(unsigned char *data, size_t size, const unsigned char *lut)
+{
+#ifdef LUT_DISPATCH
+    if (__builtin_cpu_supports("avx512vbmi")
+        && __builtin_cpu_supports("avx512bw")) {
+        lut_vbmi_u8(data, size, lut);
+        return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        lut_avx2_u8(data, size, lut);
+        return;
+    }
+#endif
+    lut_scalar_u8(data, size, lut);
     return;
 }
 
@@ -236,21 +672,9 @@ static unsigned char *rescale_u8(unsigned char *data, size_t size,
     else {
         /* build a normalization table */
         unsigned char norm[UCHAR_MAX + 1];
-        for (i = 0; i < min; i++)
-            norm[i] = 0;
-        for (i = min; i < max; i++)
-            /*
-             * we can't store and reuse UCHAR_MAX / (max - min) because
-             *     105 * 255 / 126.            -> 212.5, rounded to 213
-             *     105 * (double) (255 / 126.) -> 212.4999, rounded to 212
-             */
-            norm[i] = (unsigned char) ((i - min) * UCHAR_MAX
-                                       / (double) (max - min) + .5);
-        for (i = max; i < UCHAR_MAX + 1; i++)
-            norm[i] = UCHAR_MAX;
+        norm_u8(norm, min, max);
         /* use the normalization table to transform the data */
-        for (i = 0; i < size; i++)
-            data[i] = norm[(size_t) data[i]];
+        lut_u8(data, size, norm);
     }
     return data;
 }
@@ -285,25 +709,23 @@ static float *rescale_f32(float *data, size_t size, float min, float max)
 }
 
 /**
- * @brief normalize an unsigned char array
+ * @brief get the bounds used to normalize an unsigned char array
  *
- * This function operates in-place. It computes the minimum and
- * maximum values of the data, and rescales the data to
- * [0-UCHAR_MAX], with optionally flattening some extremal pixels.
+ * This function computes the minimum and maximum values of the data,
+ * optionally flattening some extremal pixels, such that
+ * rescale_u8() with these bounds is balance_u8().
  *
- * @param data input/output array
+ * @param data input array
  * @param size array size
  * @param nb_min, nb_max number extremal pixels flattened
- *
- * @return data
+ * @param ptr_min, ptr_max pointers to the returned values
  */
-unsigned char *balance_u8(unsigned char *data, size_t size,
-                          size_t nb_min, size_t nb_max)
+void balance_bounds_u8(const unsigned char *data, size_t size,
+                       size_t nb_min, size_t nb_max,
+                       unsigned char *ptr_min, unsigned char *ptr_max)
 {
-    unsigned char min, max;
-
     /* sanity checks */
-    if (NULL == data) {
+    if (NULL == data || NULL == ptr_min || NULL == ptr_max) {
         fprintf(stderr, "a pointer is NULL and should not be so\n");
         abort();
     }
@@ -316,50 +738,751 @@ unsigned char *balance_u8(unsigned char *data, size_t size,
 
     /* get the min/max */
     if (0 != nb_min || 0 != nb_max)
-        quantiles_u8(data, size, nb_min, nb_max, &min, &max);
+        quantiles_u8(data, size, nb_min, nb_max, ptr_min, ptr_max);
     else
-        minmax_u8(data, size, &min, &max);
+        minmax_u8(data, size, ptr_min, ptr_max);
+    return;
+}
 
-    /* rescale */
-    (void) rescale_u8(data, size, min, max);
+/**
+ * @brief get the bounds used to normalize a float array
+ *
+ * See balance_bounds_u8().
+ */
+void balance_bounds_f32(const float *data, size_t size,
+                        size_t nb_min, size_t nb_max,
+                        float *ptr_min, float *ptr_max)
+{
+    balance_roi_t roi;
 
-    return data;
+    roi_full(&roi, size);
+    balance_bounds_roi_f32(data, &roi, nb_min, nb_max, ptr_min, ptr_max);
+    return;
 }
 
 /**
- * @brief normalize a float array
+ * @brief number of pixels in a region
  *
- * This function operates in-place. It computes the minimum and
- * maximum values of the data, and rescales the data to
- * [0-1], with optionally flattening some extremal pixels.
+ * @param roi region
+ * @return number of pixels in the rectangle and not masked
+ */
+size_t balance_roi_size(const balance_roi_t * roi)
+{
+    const unsigned char *mask;
+    size_t x, y, size;
+
+    /* sanity checks */
+    if (NULL == roi) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    if (NULL == roi->mask)
+        return roi->nx * roi->ny;
+    size = 0;
+    for (y = 0; y < roi->ny; y++) {
+        mask = ROI_MASK(roi, y);
+        for (x = 0; x < roi->nx; x++)
+            size += (0 != mask[x]);
+    }
+    return size;
+}
+
+/**
+ * @brief add the values of an unsigned char array region to an
+ * histogram
  *
- * @param data input/output array
- * @param size array size
- * @param nb_min, nb_max number extremal pixels flattened
+ * Only the region is read, in place.
  *
- * @return data
+ * @param data input array
+ * @param roi region
+ * @param histo histogram, UCHAR_MAX + 1 cells, updated
  */
-float *balance_f32(float *data, size_t size, size_t nb_min, size_t nb_max)
+void balance_histo_roi_u8(const unsigned char *data,
+                          const balance_roi_t * roi, size_t *histo)
 {
-    float min, max;
+    const unsigned char *row, *mask;
+    size_t x, y;
 
     /* sanity checks */
-    if (NULL == data) {
+    if (NULL == data || NULL == roi || NULL == histo) {
         fprintf(stderr, "a pointer is NULL and should not be so\n");
         abort();
     }
-    if (nb_min + nb_max >= size) {
-        nb_min = (size - 1) / 2;
-        nb_max = (size - 1) / 2;
-        fprintf(stderr, "the number of pixels to flatten is too large\n");
-        fprintf(stderr, "using (size - 1) / 2\n");
+
+    for (y = 0; y < roi->ny; y++) {
+        row = ROI_ROW(data, roi, y);
+        mask = ROI_MASK(roi, y);
+        if (NULL == mask)
+            histo_u8(row, roi->nx, histo);
+        else
+            for (x = 0; x < roi->nx; x++)
+                if (0 != mask[x])
+                    histo[(size_t) row[x]] += 1;
     }
+    return;
+}
 
-    /* get the min/max */
-    if (0 != nb_min || 0 != nb_max)
-        quantiles_f32(data, size, nb_min, nb_max, &min, &max);
-    else
-        minmax_f32(data, size, &min, &max);
+/**
+ * @brief get the bounds used to normalize an unsigned char array,
+ * from the statistics of a region
+ *
+ * See balance_bounds_u8(); nb_min and nb_max are numbers of pixels
+ * of the region, see balance_roi_size().
+ *
+ * @param data input array
+ * @param roi region
+ * @param nb_min, nb_max number extremal pixels flattened
+ * @param ptr_min, ptr_max pointers to the returned values
+ */
+void balance_bounds_roi_u8(const unsigned char *data,
+                           const balance_roi_t * roi,
+                           size_t nb_min, size_t nb_max,
+                           unsigned char *ptr_min, unsigned char *ptr_max)
+{
+    size_t histo[UCHAR_MAX + 1];
+
+    memset(histo, 0x00, (UCHAR_MAX + 1) * sizeof(size_t));
+    balance_histo_roi_u8(data, roi, histo);
+    balance_bounds_histo_u8(histo, nb_min, nb_max, ptr_min, ptr_max);
+    return;
+}
+
+/**
+ * @brief get the bounds used to normalize a float array, from the
+ * statistics of a region
+ *
+ * See balance_bounds_roi_u8().
+ */
+void balance_bounds_roi_f32(const float *data, const balance_roi_t * roi,
+                            size_t nb_min, size_t nb_max,
+                            float *ptr_min, float *ptr_max)
+{
+    size_t size;
+
+    /* sanity checks */
+    if (NULL == data || NULL == ptr_min || NULL == ptr_max) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+    if (0 == (size = balance_roi_size(roi))) {
+        fprintf(stderr, "the statistics region is empty\n");
+        abort();
+    }
+    if (nb_min + nb_max >= size) {
+        nb_min = (size - 1) / 2;
+        nb_max = (size - 1) / 2;
+        fprintf(stderr, "the number of pixels to flatten is too large\n");
+        fprintf(stderr, "using (size - 1) / 2\n");
+    }
+
+    /* get the min/max */
+    if (0 != nb_min || 0 != nb_max)
+        quantiles_f32(data, roi, size, nb_min, nb_max, ptr_min, ptr_max);
+    else
+        minmax_f32(data, roi, ptr_min, ptr_max);
+    return;
+}
+
+/**
+ * @brief add the values of an unsigned char array to an histogram
+ *
+ * The histogram can be filled by successive calls on parts of the
+ * data, then used by balance_bounds_histo_u8().
+ *
+ * @param data input array
+ * @param size array size
+ * @param histo histogram, UCHAR_MAX + 1 cells, updated
+ */
+void balance_histo_u8(const unsigned char *data, size_t size, size_t *histo)
+{
+    /* sanity checks */
+    if (NULL == data || NULL == histo) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    histo_u8(data, size, histo);
+    return;
+}
+
+/**
+ * @brief get the bounds used to normalize an array from its histogram
+ *
+ * Same as balance_bounds_u8(), on the data accumulated in an
+ * histogram of any number of cells; the bounds are cell indexes.
+ *
+ * @param histo histogram
+ * @param h_size number of histogram cells
+ * @param nb_min, nb_max number extremal pixels flattened
+ * @param ptr_min, ptr_max pointers to the returned values
+ */
+void balance_bounds_histo(const size_t *histo, size_t h_size,
+                          size_t nb_min, size_t nb_max,
+                          size_t *ptr_min, size_t *ptr_max)
+{
+    size_t size, i;
+
+    /* sanity checks */
+    if (NULL == histo || NULL == ptr_min || NULL == ptr_max) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+    size = 0;
+    for (i = 0; i < h_size; i++)
+        size += histo[i];
+    if (0 == size) {
+        fprintf(stderr, "the statistics region is empty\n");
+        abort();
+    }
+    if (nb_min + nb_max >= size) {
+        nb_min = (size - 1) / 2;
+        nb_max = (size - 1) / 2;
+        fprintf(stderr, "the number of pixels to flatten is too large\n");
+        fprintf(stderr, "using (size - 1) / 2\n");
+    }
+
+    /* get the min/max */
+    if (0 != nb_min || 0 != nb_max)
+        quantiles_histo(histo, h_size, nb_min, nb_max, ptr_min, ptr_max);
+    else {
+        /* min/max, the first and last non-empty cells */
+        i = 0;
+        while (i < h_size - 1 && 0 == histo[i])
+            i++;
+        *ptr_min = i;
+        i = h_size - 1;
+        while (i > 0 && 0 == histo[i])
+            i--;
+        *ptr_max = i;
+    }
+    return;
+}
+
+/**
+ * @brief get the bounds used to normalize an unsigned char array
+ * from its histogram
+ *
+ * Same as balance_bounds_u8(), on the data accumulated in the
+ * histogram, see balance_bounds_histo().
+ *
+ * @param histo histogram, UCHAR_MAX + 1 cells
+ * @param nb_min, nb_max number extremal pixels flattened
+ * @param ptr_min, ptr_max pointers to the returned values
+ */
+void balance_bounds_histo_u8(const size_t *histo,
+                             size_t nb_min, size_t nb_max,
+                             unsigned char *ptr_min, unsigned char *ptr_max)
+{
+    size_t min, max;
+
+    /* sanity checks */
+    if (NULL == ptr_min || NULL == ptr_max) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    balance_bounds_histo(histo, UCHAR_MAX + 1, nb_min, nb_max, &min, &max);
+    *ptr_min = (unsigned char) min;
+    *ptr_max = (unsigned char) max;
+    return;
+}
+
+/**
+ * @brief rescale an unsigned char array
+ *
+ * This function operates in-place. It rescales the data by a bounded
+ * affine function such that min becomes 0 and max becomes UCHAR_MAX,
+ * see rescale_u8().
+ *
+ * @param data input/output array
+ * @param size array size
+ * @param min, max the normalization bounds
+ *
+ * @return data
+ */
+unsigned char *balance_apply_u8(unsigned char *data, size_t size,
+                                unsigned char min, unsigned char max)
+{
+    /* sanity checks */
+    if (NULL == data) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    return rescale_u8(data, size, min, max);
+}
+
+/**
+ * @brief get the normalization table of balance_apply_u8()
+ *
+ * balance_apply_u8() is the same as data[i] = lut[data[i]], the table
+ * can be used while the data is produced.
+ *
+ * @param min, max the normalization bounds
+ * @param lut output table, UCHAR_MAX + 1 cells
+ */
+void balance_lut_u8(unsigned char min, unsigned char max, unsigned char *lut)
+{
+    /* sanity checks */
+    if (NULL == lut) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    if (max <= min)
+        memset(lut, UCHAR_MAX / 2, UCHAR_MAX + 1);
+    else
+        norm_u8(lut, min, max);
+    return;
+}
+
+/**
+ * @brief apply tables to unsigned char planes
+ *
+ * The plane c is transformed by data[i] = lut[data[i]] with the table
+ * c, see balance_lut_u8(). The SIMD version for the CPU is selected
+ * at runtime, with the same values as the scalar loop.
+ *
+ * @param data input/output planes, the plane c starts at data + c stride
+ * @param size plane size
+ * @param stride distance between two planes
+ * @param np number of planes
+ * @param lut tables, np x (UCHAR_MAX + 1) cells
+ */
+void balance_lut_apply_u8(unsigned char *data, size_t size, size_t stride,
+                          size_t np, const unsigned char *lut)
+{
+    size_t c;
+
+    /* sanity checks */
+    if (NULL == data || NULL == lut) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    for (c = 0; c < np; c++)
+        lut_u8(data + c * stride, size, lut + c * (UCHAR_MAX + 1));
+    return;
+}
+
+/*
+ * LOCAL BALANCE
+ */
+
+/** @brief rows blended per work item */
+#define LOCAL_ROWS 32
+
+/** @brief local balance state, shared by the workers */
+typedef struct local_s {
+    unsigned char *data;        /* input/output plane */
+    size_t nx, ny;              /* plane size */
+    size_t gx, gy;              /* grid size */
+    float smin, smax;           /* saturated percentage, per tile */
+    size_t *tx, *ty;            /* tile bounds, gx + 1 and gy + 1 */
+    size_t *ix, *iy;            /* first blended tile, per column and row */
+    unsigned int *wx, *wy;      /* next tile weight in [0-256[, same */
+    unsigned char *lut;         /* tile tables, gx x gy x (UCHAR_MAX + 1) */
+    int blend;                  /* blend pass, tables pass otherwise */
+} local_t;
+
+/** @brief local balance worker, its work space */
+typedef struct local_worker_s {
+    const local_t *l;
+    void *buf;                  /* histograms or row tables */
+} local_worker_t;
+
+/**
+ * @brief split an axis in tiles and set the blending weights
+ *
+ * The n samples are split in g tiles, the tile i is [t[i], t[i + 1][.
+ * Between the centers of the tiles i and i + 1, the sample x is
+ * blended from these tiles, idx[x] = i, with the weight w[x] of the
+ * tile i + 1 proportional to the distance to the center of the tile
+ * i; before the first center and after the last one, the weight is 0.
+ *
+ * @param n number of samples
+ * @param g number of tiles, in [1-n]
+ * @param t output tile bounds, g + 1 cells
+ * @param idx, w output tile indexes and weights, n cells
+ */
+static void local_axis(size_t n, size_t g, size_t *t,
+                       size_t *idx, unsigned int *w)
+{
+    size_t i, x, c0, c1;
+
+    for (i = 0; i <= g; i++)
+        t[i] = i * n / g;
+    /* the centers are doubled to stay integer */
+    i = 0;
+    for (x = 0; x < n; x++) {
+        while (i + 1 < g && 2 * x >= t[i + 1] + t[i + 2] - 1)
+            i++;
+        c0 = t[i] + t[i + 1] - 1;
+        idx[x] = i;
+        if (i + 1 == g || 2 * x <= c0)
+            w[x] = 0;
+        else {
+            c1 = t[i + 1] + t[i + 2] - 1;
+            w[x] = (unsigned int) ((256 * (2 * x - c0) + (c1 - c0) / 2)
+                                   / (c1 - c0));
+        }
+    }
+    return;
+}
+
+/**
+ * @brief tables pass, the tables of a row of tiles
+ *
+ * The histograms of the gx tiles are accumulated in one pass over
+ * the rows, the row segments of a tile are contiguous.
+ *
+ * @param l local balance state
+ * @param j tile row
+ * @param histo work space, gx x (UCHAR_MAX + 1) cells
+ */
+static void local_tables(const local_t * l, size_t j, size_t *histo)
+{
+    const unsigned char *row;
+    size_t *h;
+    size_t i, x, y, size;
+    unsigned char min, max;
+
+    memset(histo, 0x00, l->gx * (UCHAR_MAX + 1) * sizeof(size_t));
+    for (y = l->ty[j]; y < l->ty[j + 1]; y++) {
+        row = l->data + y * l->nx;
+        for (i = 0; i < l->gx; i++) {
+            h = histo + i * (UCHAR_MAX + 1);
+            for (x = l->tx[i]; x < l->tx[i + 1]; x++)
+                h[row[x]] += 1;
+        }
+    }
+    for (i = 0; i < l->gx; i++) {
+        size = (l->tx[i + 1] - l->tx[i]) * (l->ty[j + 1] - l->ty[j]);
+        balance_bounds_histo_u8(histo + i * (UCHAR_MAX + 1),
+                                size * (l->smin / 100.),
+                                size * (l->smax / 100.), &min, &max);
+        balance_lut_u8(min, max,
+                       l->lut + (j * l->gx + i) * (UCHAR_MAX + 1));
+    }
+    return;
+}
+
+/**
+ * @brief blend pass, normalize LOCAL_ROWS rows
+ *
+ * For each row, the tables of the two tile rows around it are blended
+ * in a row table, in 1/256 steps; each pixel then blends the row
+ * table of the two tiles around it, in 1/65536 steps, rounded.
+ *
+ * @param l local balance state
+ * @param k rows item
+ * @param rl work space, (gx + 1) x (UCHAR_MAX + 1) cells
+ */
+static void local_blend(const local_t * l, size_t k, unsigned long *rl)
+{
+    const unsigned char *lut0, *lut1;
+    const unsigned long *r;
+    unsigned char *row;
+    size_t y, y_end, x, v, nv, j1;
+    unsigned long w;
+
+    nv = l->gx * (UCHAR_MAX + 1);
+    y_end = (k + 1) * LOCAL_ROWS;
+    if (y_end > l->ny)
+        y_end = l->ny;
+    for (y = k * LOCAL_ROWS; y < y_end; y++) {
+        /* row table, the last tile is repeated as the next one of
+         * the last column */
+        j1 = (l->iy[y] + 1 < l->gy ? l->iy[y] + 1 : l->iy[y]);
+        lut0 = l->lut + l->iy[y] * nv;
+        lut1 = l->lut + j1 * nv;
+        w = l->wy[y];
+        for (v = 0; v < nv; v++)
+            rl[v] = lut0[v] * (256 - w) + lut1[v] * w;
+        memcpy(rl + nv, rl + nv - (UCHAR_MAX + 1),
+               (UCHAR_MAX + 1) * sizeof(unsigned long));
+        /* pixels */
+        row = l->data + y * l->nx;
+        for (x = 0; x < l->nx; x++) {
+            r = rl + l->ix[x] * (UCHAR_MAX + 1) + row[x];
+            w = l->wx[x];
+            row[x] = (unsigned char)
+                ((r[0] * (256 - w) + r[UCHAR_MAX + 1] * w + 32768) >> 16);
+        }
+    }
+    return;
+}
+
+/**
+ * @brief process an item in the current pass
+ */
+static void local_work(void *worker, size_t k)
+{
+    local_worker_t *w = (local_worker_t *) worker;
+
+    if (w->l->blend)
+        local_blend(w->l, k, (unsigned long *) w->buf);
+    else
+        local_tables(w->l, k, (size_t *) w->buf);
+    return;
+}
+
+/**
+ * @brief run a pass on all the items, see pool_run()
+ */
+static void local_run(local_t * l, local_worker_t * w, size_t nb_workers,
+                      int blend)
+{
+    l->blend = blend;
+    pool_run((blend ? (l->ny + LOCAL_ROWS - 1) / LOCAL_ROWS : l->gy),
+             nb_workers, &local_work, (void *) w, sizeof(local_worker_t));
+    return;
+}
+
+/**
+ * @brief normalize an unsigned char plane with local statistics
+ *
+ * This function operates in-place. The plane is split in a grid of
+ * gx x gy tiles, the histograms of a row of tiles are computed in one
+ * pass and each tile gets its own normalization table, see
+ * balance_lut_u8(), flattening smin and smax percent of its pixels.
+ * Every pixel is then normalized by the bilinear blending of the
+ * tables of the four tiles around it, weighted by the distance to
+ * their centers; the table of a 1 x 1 grid is applied as it is. The
+ * rows of tiles, then the bands of rows, are processed in parallel by
+ * nb_workers threads if the code is compiled with POSIX threads, with
+ * the same result.
+ *
+ * @param data input/output plane
+ * @param nx, ny plane size
+ * @param gx, gy grid size, reduced to nx and ny
+ * @param smin, smax saturated percentage, per tile
+ * @param nb_workers number of threads, in [1-256]
+ *
+ * @return data
+ */
+unsigned char *balance_local_u8(unsigned char *data, size_t nx, size_t ny,
+                                size_t gx, size_t gy, float smin,
+                                float smax, size_t nb_workers)
+{
+    local_t l;
+    local_worker_t w[POOL_WORKERS_MAX];
+    size_t *axes;
+    unsigned int *weights;
+    size_t size, k;
+
+    /* sanity checks */
+    if (NULL == data) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+    if (0 == nx || 0 == ny || 0 == gx || 0 == gy
+        || 1 > nb_workers || POOL_WORKERS_MAX < nb_workers) {
+        fprintf(stderr, "bad parameters\n");
+        abort();
+    }
+
+    l.data = data;
+    l.nx = nx;
+    l.ny = ny;
+    l.gx = (gx < nx ? gx : nx);
+    l.gy = (gy < ny ? gy : ny);
+    l.smin = smin;
+    l.smax = smax;
+    axes = (size_t *) malloc((l.gx + l.gy + 2 + nx + ny) * sizeof(size_t));
+    weights = (unsigned int *) malloc((nx + ny) * sizeof(unsigned int));
+    l.lut = (unsigned char *) malloc(l.gx * l.gy * (UCHAR_MAX + 1));
+    if (NULL == axes || NULL == weights || NULL == l.lut) {
+        fprintf(stderr, "not enough memory\n");
+        abort();
+    }
+    STATS_ALLOC(axes, (l.gx + l.gy + 2 + nx + ny) * sizeof(size_t));
+    STATS_ALLOC(weights, (nx + ny) * sizeof(unsigned int));
+    STATS_ALLOC(l.lut, l.gx * l.gy * (UCHAR_MAX + 1));
+    l.tx = axes;
+    l.ty = l.tx + l.gx + 1;
+    l.ix = l.ty + l.gy + 1;
+    l.iy = l.ix + nx;
+    l.wx = weights;
+    l.wy = l.wx + nx;
+    local_axis(nx, l.gx, l.tx, l.ix, l.wx);
+    local_axis(ny, l.gy, l.ty, l.iy, l.wy);
+
+    /* worker work spaces, for the histograms of a row of tiles or
+     * the row tables */
+    size = (l.gx + 1) * (UCHAR_MAX + 1) * sizeof(unsigned long);
+    if (size < l.gx * (UCHAR_MAX + 1) * sizeof(size_t))
+        size = l.gx * (UCHAR_MAX + 1) * sizeof(size_t);
+    for (k = 0; k < nb_workers; k++) {
+        w[k].l = &l;
+        if (NULL == (w[k].buf = malloc(size))) {
+            fprintf(stderr, "not enough memory\n");
+            abort();
+        }
+        STATS_ALLOC(w[k].buf, size);
+    }
+
+    /* tile tables, then blended normalization */
+    STATS_TOGGLE(STATS_STATISTICS);
+    local_run(&l, w, nb_workers, 0);
+    STATS_TOGGLE(STATS_STATISTICS);
+    STATS_TOGGLE(STATS_APPLY);
+    local_run(&l, w, nb_workers, 1);
+    STATS_TOGGLE(STATS_APPLY);
+
+    for (k = 0; k < nb_workers; k++) {
+        STATS_FREE(w[k].buf);
+        free(w[k].buf);
+    }
+    STATS_FREE(l.lut);
+    free(l.lut);
+    STATS_FREE(weights);
+    free(weights);
+    STATS_FREE(axes);
+    free(axes);
+    return data;
+}
+
+/*
+ * PREVIEW STATISTICS
+ */
+
+/**
+ * @brief rank error of normalization bounds, measured on an histogram
+ *
+ * The exact bounds min and max, see balance_bounds_histo(), are such
+ * that the numbers of values < min and > max are at most nb_min and
+ * nb_max, and the numbers of values <= min and >= max are more than
+ * nb_min and nb_max. The rank error of other bounds, estimated for
+ * example on a subsample of the data, is the number of values missing
+ * or in excess to meet these conditions.
+ *
+ * @param histo histogram of the data
+ * @param h_size number of histogram cells
+ * @param nb_min, nb_max number extremal pixels flattened
+ * @param min, max normalization bounds, histogram cell indexes
+ * @return the largest rank error of min and max, as a fraction of the
+ *         number of values
+ */
+double balance_rank_error_histo(const size_t *histo, size_t h_size,
+                                size_t nb_min, size_t nb_max,
+                                size_t min, size_t max)
+{
+    size_t size, below, above, i;
+    double err_min, err_max;
+
+    /* sanity checks */
+    if (NULL == histo || min >= h_size || max >= h_size) {
+        fprintf(stderr, "bad parameters\n");
+        abort();
+    }
+
+    size = 0;
+    below = 0;
+    above = 0;
+    for (i = 0; i < h_size; i++) {
+        size += histo[i];
+        below += (i < min ? histo[i] : 0);
+        above += (i > max ? histo[i] : 0);
+    }
+    if (0 == size)
+        return 0.;
+
+    /* values < min in [0, nb_min], values <= min in ]nb_min, size] */
+    err_min = 0.;
+    if (below > nb_min)
+        err_min = (double) (below - nb_min);
+    else if (below + histo[min] <= nb_min)
+        err_min = (double) (nb_min + 1 - (below + histo[min]));
+    err_max = 0.;
+    if (above > nb_max)
+        err_max = (double) (above - nb_max);
+    else if (above + histo[max] <= nb_max)
+        err_max = (double) (nb_max + 1 - (above + histo[max]));
+
+    return (err_min > err_max ? err_min : err_max) / size;
+}
+
+/**
+ * @brief expected rank error of normalization bounds estimated on a
+ * random subsample
+ *
+ * The rank of a quantile estimated on nb_sample values has a standard
+ * deviation of sqrt(p (1 - p) / nb_sample), as a fraction of the
+ * number of values, for a quantile p. For the extreme quantiles, it
+ * is at least 1 / (nb_sample + 1), the expected rank of the minimum
+ * of the subsample. A regular subsample of a natural image, like the
+ * first Adam7 pass, behaves about the same.
+ *
+ * @param size number of values
+ * @param nb_sample number of values in the subsample
+ * @param nb_min, nb_max number extremal pixels flattened
+ * @return the largest standard deviation of the rank of min and max,
+ *         as a fraction of the number of values, 0 if the subsample
+ *         is the whole data
+ */
+double balance_rank_error_expected(size_t size, size_t nb_sample,
+                                   size_t nb_min, size_t nb_max)
+{
+    double p, err;
+
+    if (0 == nb_sample || nb_sample >= size)
+        return 0.;
+    /* the variance is largest for the quantile closest to 1/2 */
+    p = (double) (nb_min > nb_max ? nb_min : nb_max) / size;
+    if (p > .5)
+        p = .5;
+    err = sqrt(p * (1. - p) / nb_sample);
+    return (err > 1. / (nb_sample + 1) ? err : 1. / (nb_sample + 1));
+}
+
+/**
+ * @brief normalize an unsigned char array
+ *
+ * This function operates in-place. It computes the minimum and
+ * maximum values of the data, and rescales the data to
+ * [0-UCHAR_MAX], with optionally flattening some extremal pixels.
+ *
+ * @param data input/output array
+ * @param size array size
+ * @param nb_min, nb_max number extremal pixels flattened
+ *
+ * @return data
+ */
+unsigned char *balance_u8(unsigned char *data, size_t size,
+                          size_t nb_min, size_t nb_max)
+{
+    unsigned char min, max;
+
+    /* get the min/max */
+    balance_bounds_u8(data, size, nb_min, nb_max, &min, &max);
+
+    /* rescale */
+    (void) rescale_u8(data, size, min, max);
+
+    return data;
+}
+
+/**
+ * @brief normalize a float array
+ *
+ * This function operates in-place. It computes the minimum and
+ * maximum values of the data, and rescales the data to
+ * [0-1], with optionally flattening some extremal pixels.
+ *
+ * @param data input/output array
+ * @param size array size
+ * @param nb_min, nb_max number extremal pixels flattened
+ *
+ * @return data
+ */
+float *balance_f32(float *data, size_t size, size_t nb_min, size_t nb_max)
+{
+    float min, max;
+
+    /* get the min/max */
+    balance_bounds_f32(data, size, nb_min, nb_max, &min, &max);
 
     /* rescale */
     (void) rescale_f32(data, size, min, max);
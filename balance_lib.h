@@ -1,3 +1,40 @@
+#ifndef _BALANCE_LIB_H
+#define _BALANCE_LIB_H
+
+#include <stddef.h>
+
+/**
+ * @brief region of a plane used for the statistics
+ *
+ * The region is the rectangle [x0, x0 + nx[ x [y0, y0 + ny[ of a
+ * plane with rows of stride samples. If mask is not NULL, the pixels
+ * with a 0 mask value are excluded; the mask value of the pixel (x, y)
+ * is mask[y * mask_stride + x].
+ */
+typedef struct balance_roi_s {
+    size_t stride;              /* plane row stride, in samples */
+    size_t x0, y0, nx, ny;      /* rectangle */
+    const unsigned char *mask;  /* pixel mask, NULL for no mask */
+    size_t mask_stride;         /* mask row stride */
+} balance_roi_t;
+
 /* balance_lib.c */
+void balance_bounds_u8(const unsigned char *data, size_t size, size_t nb_min, size_t nb_max, unsigned char *ptr_min, unsigned char *ptr_max);
+void balance_bounds_f32(const float *data, size_t size, size_t nb_min, size_t nb_max, float *ptr_min, float *ptr_max);
+size_t balance_roi_size(const balance_roi_t *roi);
+void balance_histo_roi_u8(const unsigned char *data, const balance_roi_t *roi, size_t *histo);
+void balance_bounds_roi_u8(const unsigned char *data, const balance_roi_t *roi, size_t nb_min, size_t nb_max, unsigned char *ptr_min, unsigned char *ptr_max);
+void balance_bounds_roi_f32(const float *data, const balance_roi_t *roi, size_t nb_min, size_t nb_max, float *ptr_min, float *ptr_max);
+void balance_histo_u8(const unsigned char *data, size_t size, size_t *histo);
+void balance_bounds_histo(const size_t *histo, size_t h_size, size_t nb_min, size_t nb_max, size_t *ptr_min, size_t *ptr_max);
+void balance_bounds_histo_u8(const size_t *histo, size_t nb_min, size_t nb_max, unsigned char *ptr_min, unsigned char *ptr_max);
+unsigned char *balance_apply_u8(unsigned char *data, size_t size, unsigned char min, unsigned char max);
+void balance_lut_u8(unsigned char min, unsigned char max, unsigned char *lut);
+void balance_lut_apply_u8(unsigned char *data, size_t size, size_t stride, size_t np, const unsigned char *lut);
+unsigned char *balance_local_u8(unsigned char *data, size_t nx, size_t ny, size_t gx, size_t gy, float smin, float smax, size_t nb_workers);
+double balance_rank_error_histo(const size_t *histo, size_t h_size, size_t nb_min, size_t nb_max, size_t min, size_t max);
+double balance_rank_error_expected(size_t size, size_t nb_sample, size_t nb_min, size_t nb_max);
 unsigned char *balance_u8(unsigned char *data, size_t size, size_t nb_min, size_t nb_max);
 float *balance_f32(float *data, size_t size, size_t nb_min, size_t nb_max);
+
+#endif /* !_BALANCE_LIB_H */
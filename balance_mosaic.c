@@ -0,0 +1,292 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file balance_mosaic.c
+ * @brief color balance of a mosaic of tiles, with global statistics
+ *
+ * All the tiles of a mosaic get the same transform, so no seam
+ * appears between them. The tiles are processed in two passes by a
+ * pool of worker threads, each holding one tile at a time:
+ * - map: each worker decodes tiles and adds them to its own
+ *   histograms, the R, G and B histograms in 'rgb' mode or the
+ *   I = R + G + B histogram in 'irgb' mode;
+ * - reduce: the worker histograms are summed, and the normalization
+ *   bounds are computed once for the whole mosaic;
+ * - apply: each worker decodes the tiles again, normalizes them with
+ *   the global bounds and encodes them.
+ *
+ * The workers are run by pool_lib, in threads if the code is compiled
+ * with POSIX threads; otherwise the tiles are processed in sequence,
+ * with the same result.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "io_png.h"
+#include "balance_lib.h"
+#include "colorbalance_lib.h"
+#include "pool_lib.h"
+#include "debug.h"
+
+/** @brief default number of worker threads */
+#define WORKERS_DEFAULT 4
+
+/** @brief number of histogram cells, enough for rgb and irgb */
+#define HISTO_SIZE (3 * (UCHAR_MAX + 1))
+
+/** @brief mosaic state, shared by the workers */
+typedef struct mosaic_s {
+    char *const *fname;         /* input and output file names */
+    size_t nb_tiles;            /* number of tiles */
+    int irgb;                   /* irgb mode, rgb otherwise */
+    int apply;                  /* apply pass, map pass otherwise */
+    unsigned char min[3], max[3];       /* rgb bounds */
+    float fmin, fmax;           /* irgb bounds */
+} mosaic_t;
+
+/** @brief worker state, its tile buffer and histograms */
+typedef struct worker_s {
+    mosaic_t *mosaic;
+    void *buf;                  /* tile planes */
+    size_t buf_size;
+    size_t histo[HISTO_SIZE];   /* partial histograms */
+    size_t nb_pixels;           /* pixels in the partial histograms */
+} worker_t;
+
+/**
+ * @brief grow the worker buffer, keep it if it is large enough
+ *
+ * @return the buffer, abort() if the memory allocation failed
+ */
+static void *grow(worker_t * w, size_t size)
+{
+    void *tmp;
+
+    if (size <= w->buf_size && NULL != w->buf)
+        return w->buf;
+    if (NULL == (tmp = realloc(w->buf, size)))
+        pool_abort("not enough memory");
+    w->buf = tmp;
+    w->buf_size = size;
+    return tmp;
+}
+
+/**
+ * @brief map pass, add a tile to the worker histograms
+ */
+static void tile_histo(worker_t * w, const char *fname)
+{
+    unsigned char *rgb, *ch[3];
+    size_t nx, ny, size, c;
+
+    io_png_probe(fname, &nx, &ny, NULL, NULL);
+    size = nx * ny;
+    rgb = (unsigned char *) grow(w, 3 * size * sizeof(unsigned char));
+    for (c = 0; c < 3; c++)
+        ch[c] = rgb + c * size;
+    io_png_read_uchar_into(fname, ch, nx, ny, 3, nx, IO_PNG_OPT_RGB);
+
+    if (w->mosaic->irgb)
+        colorbalance_irgb_histo_u8(rgb, size, w->histo);
+    else
+        for (c = 0; c < 3; c++)
+            balance_histo_u8(ch[c], size, w->histo + c * (UCHAR_MAX + 1));
+    w->nb_pixels += size;
+    return;
+}
+
+/**
+ * @brief apply pass, normalize a tile with the global bounds
+ */
+static void tile_apply(worker_t * w, const char *fname_in,
+                       const char *fname_out)
+{
+    const mosaic_t *m = w->mosaic;
+    unsigned char *rgb, *ch[3];
+    size_t nx, ny, size, c;
+
+    io_png_probe(fname_in, &nx, &ny, NULL, NULL);
+    size = nx * ny;
+    rgb = (unsigned char *) grow(w, 3 * size * sizeof(unsigned char));
+    for (c = 0; c < 3; c++)
+        ch[c] = rgb + c * size;
+    io_png_read_uchar_into(fname_in, ch, nx, ny, 3, nx, IO_PNG_OPT_RGB);
+    if (m->irgb) {
+        colorbalance_irgb_out_u8_t out;
+
+        out.ch = (const unsigned char *const *) ch;
+        out.alpha = NULL;
+        out.nx = nx;
+        out.stride = nx;
+        out.min = m->fmin;
+        out.max = m->fmax;
+        io_png_write_rows(fname_out, nx, ny, 3, IO_PNG_OPT_NONE,
+                          &colorbalance_irgb_fill_from_u8, (void *) &out);
+    }
+    else {
+        for (c = 0; c < 3; c++)
+            (void) balance_apply_u8(ch[c], size, m->min[c], m->max[c]);
+        io_png_write_uchar_from(fname_out,
+                                (const unsigned char *const *) ch,
+                                nx, ny, 3, nx, IO_PNG_OPT_NONE);
+    }
+    return;
+}
+
+/**
+ * @brief process a tile in the current pass
+ */
+static void tile_work(void *worker, size_t i)
+{
+    worker_t *w = (worker_t *) worker;
+    const mosaic_t *m = w->mosaic;
+
+    if (m->apply)
+        tile_apply(w, m->fname[2 * i], m->fname[2 * i + 1]);
+    else
+        tile_histo(w, m->fname[2 * i]);
+    return;
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    mosaic_t mosaic;
+    worker_t *worker;
+    size_t histo[HISTO_SIZE];   /* global histograms */
+    size_t nb_workers, nb_pixels, nb_min, nb_max, i, c;
+    float smin, smax;
+    int j;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+    /* "-j" option : number of workers */
+    nb_workers = WORKERS_DEFAULT;
+    if (3 <= argc && 0 == strcmp("-j", argv[1])) {
+        nb_workers = (size_t) atoi(argv[2]);
+        if (1 > nb_workers || POOL_WORKERS_MAX < nb_workers) {
+            fprintf(stderr, "the number of workers must be in [1-%i]\n",
+                    POOL_WORKERS_MAX);
+            return EXIT_FAILURE;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    /* wrong number of parameters : simple help info */
+    if (6 > argc || 0 != (argc - 4) % 2) {
+        fprintf(stderr, "usage : %s [-j workers] mode Smin Smax"
+                " in.png out.png [in.png out.png ...]\n", argv[0]);
+        fprintf(stderr, "        mode is rgb or irgb\n");
+        fprintf(stderr, "        Smin and Smax are percentage of pixels\n");
+        fprintf(stderr, "          saturated to min and max, in all the"
+                " tiles,\n");
+        fprintf(stderr, "          in [0-100[\n");
+        fprintf(stderr, "        workers is the number of worker"
+                " threads, default %i\n", WORKERS_DEFAULT);
+        fprintf(stderr, "          (see README.txt for details)\n");
+        return EXIT_FAILURE;
+    }
+
+    /* saturation percentage */
+    smin = atof(argv[2]);
+    smax = atof(argv[3]);
+    if (0. > smin || 100. <= smin || 0. > smax || 100. <= smax) {
+        fprintf(stderr, "the saturation percentages must be in [0-100[\n");
+        return EXIT_FAILURE;
+    }
+
+    /* select the color mode */
+    if (0 == strcmp(argv[1], "rgb"))
+        mosaic.irgb = 0;
+    else if (0 == strcmp(argv[1], "irgb"))
+        mosaic.irgb = 1;
+    else {
+        fprintf(stderr, "mode must be rgb or irgb\n");
+        return EXIT_FAILURE;
+    }
+
+    /* the tiles are read twice, no standard input/output */
+    for (j = 4; j < argc; j++)
+        if (0 == strcmp(argv[j], "-")) {
+            fprintf(stderr, "the tiles must be files\n");
+            return EXIT_FAILURE;
+        }
+    mosaic.fname = argv + 4;
+    mosaic.nb_tiles = (size_t) (argc - 4) / 2;
+    if (nb_workers > mosaic.nb_tiles)
+        nb_workers = mosaic.nb_tiles;
+
+    /* worker pool */
+    if (NULL == (worker = (worker_t *)
+                 calloc(nb_workers, sizeof(worker_t)))) {
+        fprintf(stderr, "not enough memory\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < nb_workers; i++)
+        worker[i].mosaic = &mosaic;
+
+    /* map: partial histograms */
+    DBG_CLOCK_START(0);
+    mosaic.apply = 0;
+    pool_run(mosaic.nb_tiles, nb_workers, &tile_work, (void *) worker,
+             sizeof(worker_t));
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("histo\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    /* reduce: global histograms and bounds */
+    memset(histo, 0x00, sizeof(histo));
+    nb_pixels = 0;
+    for (i = 0; i < nb_workers; i++) {
+        for (c = 0; c < HISTO_SIZE; c++)
+            histo[c] += worker[i].histo[c];
+        nb_pixels += worker[i].nb_pixels;
+    }
+    nb_min = nb_pixels * (smin / 100.);
+    nb_max = nb_pixels * (smax / 100.);
+    if (mosaic.irgb)
+        colorbalance_irgb_bounds_histo(histo, nb_min, nb_max,
+                                       &mosaic.fmin, &mosaic.fmax);
+    else
+        for (c = 0; c < 3; c++)
+            balance_bounds_histo_u8(histo + c * (UCHAR_MAX + 1),
+                                    nb_min, nb_max,
+                                    mosaic.min + c, mosaic.max + c);
+
+    /* apply: normalize and write the tiles */
+    DBG_CLOCK_START(0);
+    mosaic.apply = 1;
+    pool_run(mosaic.nb_tiles, nb_workers, &tile_work, (void *) worker,
+             sizeof(worker_t));
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("apply\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    for (i = 0; i < nb_workers; i++)
+        free(worker[i].buf);
+    free(worker);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,455 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file balanced.c
+ * @brief color balance daemon, on a Unix domain socket
+ *
+ * The daemon forks a pool of worker processes, which accept the
+ * connections on the same socket and keep their buffers from one
+ * request to the next. The libraries abort() on invalid images; a
+ * worker process stopped this way is replaced by a new one, and the
+ * client sees the connection closed without reply.
+ *
+ * The request counters and latency histograms of the workers are in
+ * a shared memory area, and summed by the STATS request.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "io_png.h"
+#include "balance_lib.h"
+#include "colorbalance_lib.h"
+#include "daemon_lib.h"
+
+/** @brief default number of worker processes */
+#define WORKERS_DEFAULT 4
+/** @brief maximum number of worker processes */
+#define WORKERS_MAX 256
+
+/** @brief buffers kept by a worker between requests */
+typedef struct worker_buf_s {
+    unsigned char *data;        /* request data */
+    size_t data_size;
+    unsigned char *png;         /* reply PNG data */
+    size_t png_size;
+    unsigned char *u8;          /* unsigned char planes */
+    size_t u8_size;
+} worker_buf_t;
+
+/** @brief shared counters, one per worker and one for the master */
+static daemon_stats_t *stats;
+static size_t nb_workers;
+
+/** @brief set by SIGTERM and SIGINT in the master process */
+static volatile sig_atomic_t stop = 0;
+
+/** @brief signal handler of the master process */
+static void on_stop(int sig)
+{
+    (void) sig;
+    stop = 1;
+    return;
+}
+
+/**
+ * @brief grow a buffer, keep it if it is large enough
+ *
+ * @return the buffer, NULL if the memory allocation failed, then the
+ *         previous buffer is freed
+ */
+static void *grow(void *buf, size_t * sizep, size_t size)
+{
+    void *tmp;
+
+    if (size <= *sizep && NULL != buf)
+        return buf;
+    if (NULL == (tmp = realloc(buf, size))) {
+        free(buf);
+        *sizep = 0;
+        return NULL;
+    }
+    *sizep = size;
+    return tmp;
+}
+
+/** @brief elapsed time since a start time, in microseconds */
+static unsigned long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) ((now.tv_sec - start->tv_sec) * 1000000l
+                            + (now.tv_nsec - start->tv_nsec) / 1000l);
+}
+
+/** @brief reply with an error message, and count it */
+static void reject(int fd, daemon_stats_t * st, const char *msg)
+{
+    (void) daemon_send_reply(fd, 0, msg, strlen(msg));
+    st->nb_err++;
+    return;
+}
+
+/**
+ * @brief reply to a STATS request
+ *
+ * The counters of all the workers are summed.
+ */
+static void serve_stats(int fd)
+{
+    daemon_stats_t sum;
+    char text[DAEMON_LINE_MAX];
+    size_t i, bin;
+
+    memset(&sum, 0x00, sizeof(sum));
+    for (i = 0; i <= nb_workers; i++) {
+        sum.nb_req += stats[i].nb_req;
+        sum.nb_err += stats[i].nb_err;
+        for (bin = 0; bin < DAEMON_LAT_BINS; bin++)
+            sum.lat[bin] += stats[i].lat[bin];
+    }
+    sprintf(text, "requests %lu\nerrors %lu\np50_us %lu\np99_us %lu\n",
+            sum.nb_req, sum.nb_err,
+            daemon_lat_quantile(sum.lat, .50),
+            daemon_lat_quantile(sum.lat, .99));
+    (void) daemon_send_reply(fd, 1, text, strlen(text));
+    return;
+}
+
+/**
+ * @brief handle one connection
+ *
+ * @param fd connected socket
+ * @param buf worker buffers
+ * @param st worker counters
+ */
+static void serve(int fd, worker_buf_t * buf, daemon_stats_t * st)
+{
+    char line[DAEMON_LINE_MAX];
+    char mode[16], str_min[32], str_max[32], kind[8];
+    unsigned char *ch[4];       /* channel planes and alpha plane */
+    balance_roi_t roi;          /* statistics region */
+    balance_roi_t *roi_ptr;     /* NULL for the whole image */
+    unsigned long len;
+    float smin, smax;           /* saturated percentage */
+    size_t nx, ny, np, na, size, nb_size, png_len, c;
+    int path;                   /* the data is a file path */
+    struct timespec start;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* read and check the request */
+    if (0 != daemon_read_line(fd, line, DAEMON_LINE_MAX)) {
+        st->nb_err++;
+        return;
+    }
+    if (0 == strcmp(line, "STATS")) {
+        serve_stats(fd);
+        return;
+    }
+    if (5 != sscanf(line, "BALANCE %15s %31s %31s %7s %lu",
+                    mode, str_min, str_max, kind, &len)
+        || (0 != strcmp(kind, "png") && 0 != strcmp(kind, "path"))
+        || DAEMON_DATA_MAX < len) {
+        reject(fd, st, "bad request");
+        return;
+    }
+    path = (0 == strcmp(kind, "path"));
+    smin = atof(str_min);
+    smax = atof(str_max);
+    if (0. > smin || 100. <= smin || 0. > smax || 100. <= smax) {
+        reject(fd, st, "the saturation percentages must be in [0-100[");
+        return;
+    }
+    if (0 != strcmp(mode, "rgb") && 0 != strcmp(mode, "irgb")
+        && 0 != strcmp(mode, "hsl") && 0 != strcmp(mode, "hsv")
+        && 0 != strcmp(mode, "ycbcr")) {
+        reject(fd, st, "mode must be rgb, irgb, hsl, hsv or ycbcr");
+        return;
+    }
+    /* one more byte, for the file path null terminator */
+    if (NULL == (buf->data = (unsigned char *)
+                 grow(buf->data, &buf->data_size, (size_t) len + 1))) {
+        reject(fd, st, "not enough memory");
+        return;
+    }
+    if (0 != daemon_read_full(fd, buf->data, (size_t) len)) {
+        st->nb_err++;
+        return;
+    }
+    buf->data[len] = '\0';
+
+    /* read the image */
+    if (path)
+        io_png_probe((const char *) buf->data, &nx, &ny, &np, NULL);
+    else
+        io_png_probe_mem(buf->data, (size_t) len, &nx, &ny, &np, NULL);
+    size = nx * ny;
+    /* a gray image is balanced in one plane, except in irgb mode, and
+     * the alpha channel is kept in one more plane */
+    na = (2 == np || 4 == np ? 1 : 0);
+    np = (3 > np && 0 != strcmp(mode, "irgb") ? 1 : 3);
+
+    if (NULL == (buf->u8 = (unsigned char *)
+                 grow(buf->u8, &buf->u8_size, (np + na) * size))) {
+        reject(fd, st, "not enough memory");
+        return;
+    }
+    for (c = 0; c < np + na; c++)
+        ch[c] = buf->u8 + c * size;
+    if (path)
+        io_png_read_uchar_into((const char *) buf->data, ch, nx, ny,
+                               np + na, nx,
+                               (1 == np ? IO_PNG_OPT_GRAY : IO_PNG_OPT_RGB));
+    else
+        io_png_read_uchar_into_mem(buf->data, (size_t) len, ch,
+                                   nx, ny, np + na, nx,
+                                   (1 == np ? IO_PNG_OPT_GRAY
+                                    : IO_PNG_OPT_RGB));
+
+    /* statistics region, without the transparent pixels */
+    roi_ptr = NULL;
+    nb_size = size;
+    if (0 != na) {
+        roi.stride = nx;
+        roi.x0 = 0;
+        roi.y0 = 0;
+        roi.nx = nx;
+        roi.ny = ny;
+        roi.mask = ch[np];
+        roi.mask_stride = nx;
+        /* a fully transparent image is balanced as an opaque one */
+        if (0 != (nb_size = balance_roi_size(&roi)))
+            roi_ptr = &roi;
+        else
+            nb_size = size;
+    }
+
+    if (0 == strcmp(mode, "irgb")) {
+        colorbalance_irgb_out_u8_t out;
+
+        /* the normalization is fused with the output quantization */
+        colorbalance_irgb_bounds_u8(buf->u8, size, roi_ptr,
+                                    nb_size * (smin / 100.),
+                                    nb_size * (smax / 100.),
+                                    &out.min, &out.max);
+        out.ch = (const unsigned char *const *) ch;
+        out.alpha = (0 != na ? ch[3] : NULL);
+        out.nx = nx;
+        out.stride = nx;
+        png_len = io_png_write_rows_mem(&buf->png, &buf->png_size,
+                                        nx, ny, 3 + na, IO_PNG_OPT_NONE,
+                                        &colorbalance_irgb_fill_from_u8,
+                                        (void *) &out);
+    }
+    else {
+        if (1 == np)
+            (void) colorbalance_gray_roi_u8(buf->u8, size, roi_ptr,
+                                            nb_size * (smin / 100.),
+                                            nb_size * (smax / 100.));
+        else if (0 == strcmp(mode, "rgb"))
+            (void) colorbalance_rgb_roi_u8(buf->u8, size, roi_ptr,
+                                           nb_size * (smin / 100.),
+                                           nb_size * (smax / 100.));
+        else if (0 == strcmp(mode, "hsl"))
+            (void) colorbalance_hsl_roi_u8(buf->u8, size, roi_ptr,
+                                           nb_size * (smin / 100.),
+                                           nb_size * (smax / 100.));
+        else if (0 == strcmp(mode, "hsv"))
+            (void) colorbalance_hsv_roi_u8(buf->u8, size, roi_ptr,
+                                           nb_size * (smin / 100.),
+                                           nb_size * (smax / 100.));
+        else
+            (void) colorbalance_ycbcr_roi_u8(buf->u8, size, roi_ptr,
+                                             nb_size * (smin / 100.),
+                                             nb_size * (smax / 100.));
+        png_len = io_png_write_uchar_from_mem(&buf->png, &buf->png_size,
+                                              (const unsigned char *const *)
+                                              ch, nx, ny, np + na, nx,
+                                              IO_PNG_OPT_NONE);
+    }
+
+    /* reply */
+    if (0 != daemon_send_reply(fd, 1, buf->png, png_len)) {
+        st->nb_err++;
+        return;
+    }
+    st->lat[daemon_lat_bin(elapsed_us(&start))]++;
+    st->nb_req++;
+    return;
+}
+
+/**
+ * @brief worker process loop, never returns
+ *
+ * @param lfd listening socket
+ * @param id worker index
+ */
+static void worker(int lfd, size_t id)
+{
+    worker_buf_t buf;
+    int fd;
+
+    /* the master handles the termination */
+    (void) signal(SIGTERM, SIG_DFL);
+    (void) signal(SIGINT, SIG_IGN);
+
+    memset(&buf, 0x00, sizeof(buf));
+    for (;;) {
+        if (0 > (fd = accept(lfd, NULL, NULL))) {
+            if (EINTR == errno || ECONNABORTED == errno)
+                continue;
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        serve(fd, &buf, stats + id);
+        (void) close(fd);
+    }
+}
+
+/**
+ * @brief start a worker process
+ *
+ * @return the worker pid, -1 on error
+ */
+static pid_t spawn(int lfd, size_t id)
+{
+    pid_t pid;
+
+    if (0 == (pid = fork()))
+        worker(lfd, id);
+    return pid;
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    struct sockaddr_un addr;
+    struct sigaction act;
+    pid_t pid[WORKERS_MAX], dead;
+    int lfd, zfd, status;
+    size_t i;
+
+    /* "-v" option : version info */
+    if (2 <= argc && 0 == strcmp("-v", argv[1])) {
+        fprintf(stdout, "%s version " __DATE__ "\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+    /* wrong number of parameters : simple help info */
+    if (2 != argc && 3 != argc) {
+        fprintf(stderr, "usage : %s socket [workers]\n", argv[0]);
+        fprintf(stderr, "        socket is the Unix socket path\n");
+        fprintf(stderr, "        workers is the number of worker"
+                " processes, default %i\n", WORKERS_DEFAULT);
+        fprintf(stderr, "          (see README.txt for details)\n");
+        return EXIT_FAILURE;
+    }
+    nb_workers = (3 == argc ? (size_t) atoi(argv[2]) : WORKERS_DEFAULT);
+    if (1 > nb_workers || WORKERS_MAX < nb_workers) {
+        fprintf(stderr, "the number of workers must be in [1-%i]\n",
+                WORKERS_MAX);
+        return EXIT_FAILURE;
+    }
+
+    /* shared counters, the last ones are updated by the master */
+    if (0 > (zfd = open("/dev/zero", O_RDWR))
+        || MAP_FAILED == (stats = (daemon_stats_t *)
+                          mmap(NULL, (nb_workers + 1)
+                               * sizeof(daemon_stats_t),
+                               PROT_READ | PROT_WRITE, MAP_SHARED,
+                               zfd, 0))) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    (void) close(zfd);
+
+    /* listening socket */
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "the socket path is too long\n");
+        return EXIT_FAILURE;
+    }
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    (void) unlink(argv[1]);
+    if (0 > (lfd = socket(AF_UNIX, SOCK_STREAM, 0))
+        || 0 != bind(lfd, (struct sockaddr *) &addr, sizeof(addr))
+        || 0 != listen(lfd, 64)) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    /* a client closing its connection must not stop a worker */
+    (void) signal(SIGPIPE, SIG_IGN);
+    /* SIGTERM and SIGINT interrupt waitpid() in the master */
+    memset(&act, 0x00, sizeof(act));
+    act.sa_handler = &on_stop;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    (void) sigaction(SIGTERM, &act, NULL);
+    (void) sigaction(SIGINT, &act, NULL);
+
+    for (i = 0; i < nb_workers; i++)
+        if (0 > (pid[i] = spawn(lfd, i))) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+
+    /* replace the stopped workers until the master is stopped */
+    while (!stop) {
+        if (0 > (dead = waitpid(-1, &status, 0)))
+            continue;
+        for (i = 0; i < nb_workers; i++)
+            if (pid[i] == dead) {
+                stats[nb_workers].nb_err++;
+                if (!stop && 0 > (pid[i] = spawn(lfd, i)))
+                    perror("fork");
+            }
+    }
+
+    /* stop the workers and clean up */
+    for (i = 0; i < nb_workers; i++)
+        if (0 < pid[i])
+            (void) kill(pid[i], SIGTERM);
+    for (i = 0; i < nb_workers; i++)
+        if (0 < pid[i])
+            (void) waitpid(pid[i], &status, 0);
+    (void) close(lfd);
+    (void) unlink(argv[1]);
+    (void) munmap((void *) stats, (nb_workers + 1) * sizeof(daemon_stats_t));
+    return EXIT_SUCCESS;
+}
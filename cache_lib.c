@@ -0,0 +1,515 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file cache_lib.c
+ * @brief content-addressed result cache
+ *
+ * The outputs are stored in a directory, named by a hash of the input
+ * bytes and of the parameters, see cache_lib.h for the layout. The
+ * cache can be shared by concurrent processes:
+ * - an entry is written in a temporary file, then renamed, so it is
+ *   never seen incomplete;
+ * - an entry removed while it is copied stays readable until the copy
+ *   is complete;
+ * - the counters are files opened in append mode, the count is their
+ *   size.
+ *
+ * The cache is an optimization: any error is a miss, or an entry not
+ * inserted, and the image is processed as without the cache.
+ *
+ * The hash is a non-cryptographic 128 bits hash, two sets of four
+ * xxHash32 lanes, about as fast as reading the file. An input crafted
+ * to collide with another one would get its output: do not share a
+ * cache directory between untrusted users.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* ensure consistency */
+#include "cache_lib.h"
+
+/** @brief size of the file copy and hash buffers */
+#define CACHE_BUF_SIZE (64 * 1024)
+/** @brief age of a stale temporary entry, in seconds */
+#define CACHE_TMP_AGE 3600
+
+/*
+ * HASH
+ */
+
+/** @brief xxHash32 primes */
+#define P1 2654435761ul
+#define P2 2246822519ul
+#define P3 3266489917ul
+
+/** @brief 32 bits arithmetic on unsigned long */
+#define U32(X) ((X) & 0xfffffffful)
+#define ROTL32(X, R) U32(((X) << (R)) | (U32(X) >> (32 - (R))))
+
+/** @brief hash state, the input is processed by 16 bytes stripes */
+typedef struct cache_hash_s {
+    unsigned long a[4], b[4];   /* lanes */
+    unsigned long len;          /* number of bytes hashed */
+    unsigned char tail[16];     /* incomplete stripe */
+    size_t nb_tail;
+} cache_hash_t;
+
+/**
+ * @brief xxHash32 round
+ */
+static unsigned long hash_round(unsigned long acc, unsigned long w)
+{
+    acc = U32(acc + U32(w * P2));
+    return U32(ROTL32(acc, 13) * P1);
+}
+
+/**
+ * @brief xxHash32 final mix
+ */
+static unsigned long hash_avalanche(unsigned long h)
+{
+    h ^= h >> 15;
+    h = U32(h * P2);
+    h ^= h >> 13;
+    h = U32(h * P3);
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * @brief hash one stripe
+ *
+ * The word j feeds the lane j of the first set and the lane j + 1 of
+ * the second set, with another seed, so the two sets are independent.
+ */
+static void hash_stripe(cache_hash_t * h, const unsigned char *p)
+{
+    unsigned long w;
+    size_t j;
+
+    for (j = 0; j < 4; j++) {
+        w = (unsigned long) p[4 * j]
+            | (unsigned long) p[4 * j + 1] << 8
+            | (unsigned long) p[4 * j + 2] << 16
+            | (unsigned long) p[4 * j + 3] << 24;
+        h->a[j] = hash_round(h->a[j], w);
+        h->b[(j + 1) % 4] = hash_round(h->b[(j + 1) % 4], w);
+    }
+    return;
+}
+
+/**
+ * @brief initialize a hash state
+ */
+static void hash_init(cache_hash_t * h)
+{
+    h->a[0] = U32(P1 + P2);
+    h->a[1] = P2;
+    h->a[2] = 0;
+    h->a[3] = U32(0 - P1);
+    h->b[0] = U32(P3 + P1 + P2);
+    h->b[1] = U32(P3 + P2);
+    h->b[2] = P3;
+    h->b[3] = U32(P3 - P1);
+    h->len = 0;
+    h->nb_tail = 0;
+    return;
+}
+
+/**
+ * @brief hash some more bytes
+ */
+static void hash_update(cache_hash_t * h, const unsigned char *buf,
+                        size_t len)
+{
+    size_t n;
+
+    h->len = U32(h->len + (unsigned long) len);
+    if (0 < h->nb_tail) {
+        n = (16 - h->nb_tail < len ? 16 - h->nb_tail : len);
+        memcpy(h->tail + h->nb_tail, buf, n);
+        h->nb_tail += n;
+        buf += n;
+        len -= n;
+        if (16 > h->nb_tail)
+            return;
+        hash_stripe(h, h->tail);
+        h->nb_tail = 0;
+    }
+    for (; 16 <= len; buf += 16, len -= 16)
+        hash_stripe(h, buf);
+    memcpy(h->tail, buf, len);
+    h->nb_tail = len;
+    return;
+}
+
+/**
+ * @brief finish a hash, in CACHE_KEY_LEN hexadecimal digits
+ *
+ * The last stripe is padded with zeros, and the length is mixed in
+ * all the lanes.
+ */
+static void hash_final(cache_hash_t * h, char *hex)
+{
+    size_t j;
+
+    if (0 < h->nb_tail) {
+        memset(h->tail + h->nb_tail, 0x00, 16 - h->nb_tail);
+        hash_stripe(h, h->tail);
+    }
+    for (j = 0; j < 4; j++)
+        sprintf(hex + 8 * j, "%08lx",
+                hash_avalanche(h->a[j] ^ ROTL32(h->b[j], 16) ^ h->len));
+    return;
+}
+
+/**
+ * @brief hash a buffer
+ *
+ * @param buf, len data
+ * @param hex output hash, CACHE_KEY_LEN hexadecimal digits and a
+ * null character
+ */
+void cache_hash(const unsigned char *buf, size_t len, char *hex)
+{
+    cache_hash_t h;
+
+    hash_init(&h);
+    hash_update(&h, buf, len);
+    hash_final(&h, hex);
+    return;
+}
+
+/**
+ * @brief hash a file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int hash_file(const char *fname, char *hex)
+{
+    unsigned char *buf;
+    cache_hash_t h;
+    FILE *fp;
+    size_t n;
+    int ret;
+
+    if (NULL == (fp = fopen(fname, "rb")))
+        return -1;
+    if (NULL == (buf = (unsigned char *) malloc(CACHE_BUF_SIZE))) {
+        (void) fclose(fp);
+        return -1;
+    }
+    hash_init(&h);
+    while (0 < (n = fread(buf, 1, CACHE_BUF_SIZE, fp)))
+        hash_update(&h, buf, n);
+    ret = (ferror(fp) ? -1 : 0);
+    hash_final(&h, hex);
+    free(buf);
+    (void) fclose(fp);
+    return ret;
+}
+
+/**
+ * @brief cache key of a processing
+ *
+ * The key is the hash of the hashes of the input and mask files and
+ * of the parameters string, which must hold all the other parameters
+ * changing the output.
+ *
+ * @param fname input file name
+ * @param mask_fname mask file name, or NULL
+ * @param params parameters string
+ * @param key output key, CACHE_KEY_LEN hexadecimal digits and a null
+ * character
+ *
+ * @return 0 on success, -1 if a file can not be read
+ */
+int cache_key(const char *fname, const char *mask_fname,
+              const char *params, char *key)
+{
+    char hex[2 * (CACHE_KEY_LEN + 1)];
+    char *str;
+    int ret;
+
+    if (0 != hash_file(fname, hex))
+        return -1;
+    hex[CACHE_KEY_LEN] = ' ';
+    if (NULL == mask_fname)
+        strcpy(hex + CACHE_KEY_LEN + 1, "-");
+    else if (0 != hash_file(mask_fname, hex + CACHE_KEY_LEN + 1))
+        return -1;
+    if (NULL == (str = (char *) malloc(strlen(hex) + strlen(params) + 2)))
+        return -1;
+    ret = sprintf(str, "%s %s", hex, params);
+    cache_hash((const unsigned char *) str, (size_t) ret, key);
+    free(str);
+    return 0;
+}
+
+/*
+ * CACHE DIRECTORY
+ */
+
+/**
+ * @brief allocate a file path in a directory
+ */
+static char *cache_path(const char *dir, const char *name)
+{
+    char *path;
+
+    if (NULL != (path = (char *) malloc(strlen(dir) + strlen(name) + 2)))
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/**
+ * @brief copy a file
+ *
+ * The destination file is not created if the source file can not be
+ * opened.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int cache_copy(const char *src, const char *dst)
+{
+    unsigned char *buf;
+    FILE *fp_src, *fp_dst;
+    size_t n;
+    int ret = 0;
+
+    if (NULL == (fp_src = fopen(src, "rb")))
+        return -1;
+    if (NULL == (buf = (unsigned char *) malloc(CACHE_BUF_SIZE))
+        || NULL == (fp_dst = fopen(dst, "wb"))) {
+        free(buf);
+        (void) fclose(fp_src);
+        return -1;
+    }
+    while (0 < (n = fread(buf, 1, CACHE_BUF_SIZE, fp_src)))
+        if (n != fwrite(buf, 1, n, fp_dst)) {
+            ret = -1;
+            break;
+        }
+    if (ferror(fp_src))
+        ret = -1;
+    if (0 != fclose(fp_dst))
+        ret = -1;
+    (void) fclose(fp_src);
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief create the cache directory if needed
+ *
+ * @return 0 on success, -1 on error
+ */
+static int cache_mkdir(const char *dir)
+{
+    return (0 != mkdir(dir, 0755) && EEXIST != errno ? -1 : 0);
+}
+
+/**
+ * @brief increment a counter file, by appending one byte
+ */
+static void cache_count(const char *dir, const char *name)
+{
+    char *path;
+    int fd;
+
+    if (NULL == (path = cache_path(dir, name)))
+        return;
+    if (0 <= (fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644))) {
+        (void) write(fd, "1", 1);
+        (void) close(fd);
+    }
+    free(path);
+    return;
+}
+
+/**
+ * @brief copy a cached output
+ *
+ * On a hit, the entry is marked as recently used. The hits and misses
+ * counters are updated.
+ *
+ * @param dir cache directory, created if needed
+ * @param key cache key
+ * @param fname_out output file name
+ *
+ * @return 1 on a hit, 0 on a miss
+ */
+int cache_get(const char *dir, const char *key, const char *fname_out)
+{
+    char name[CACHE_KEY_LEN + 5];
+    char *path;
+    int hit;
+
+    if (0 != cache_mkdir(dir))
+        return 0;
+    sprintf(name, "%.*s.png", CACHE_KEY_LEN, key);
+    if (NULL == (path = cache_path(dir, name)))
+        return 0;
+    hit = (0 == cache_copy(path, fname_out));
+    if (hit)
+        (void) utime(path, NULL);
+    free(path);
+    cache_count(dir, (hit ? "hits" : "misses"));
+    return hit;
+}
+
+/** @brief a cached output, for the eviction */
+typedef struct cache_entry_s {
+    char name[CACHE_KEY_LEN + 5];
+    size_t size;
+    time_t mtime;               /* last use */
+} cache_entry_t;
+
+/**
+ * @brief compare the last use of two entries, for qsort()
+ */
+static int cmp_entry(const void *a, const void *b)
+{
+    time_t ta = ((const cache_entry_t *) a)->mtime;
+    time_t tb = ((const cache_entry_t *) b)->mtime;
+
+    return (ta > tb) - (ta < tb);
+}
+
+/**
+ * @brief remove the least recently used entries
+ *
+ * The temporary entries left by the interrupted processes are removed
+ * when they are older than CACHE_TMP_AGE. Another process may remove
+ * the same entries at the same time, the unlink() errors are ignored.
+ *
+ * @param dir cache directory
+ * @param max_size maximum total size of the entries, in bytes
+ */
+static void cache_evict(const char *dir, size_t max_size)
+{
+    cache_entry_t *entry = NULL, *tmp;
+    size_t nb_entry = 0, nb_alloc = 0, total = 0, i;
+    struct dirent *de;
+    struct stat st;
+    char *path;
+    size_t len;
+    DIR *dp;
+
+    if (NULL == (dp = opendir(dir)))
+        return;
+    while (NULL != (de = readdir(dp))) {
+        len = strlen(de->d_name);
+        if (NULL == (path = cache_path(dir, de->d_name)))
+            break;
+        if (0 != stat(path, &st)) {
+            free(path);
+            continue;
+        }
+        if (0 == strncmp(de->d_name, "tmp.", 4)) {
+            if (CACHE_TMP_AGE < difftime(time(NULL), st.st_mtime))
+                (void) unlink(path);
+        }
+        else if (CACHE_KEY_LEN + 4 == len
+                 && 0 == strcmp(de->d_name + CACHE_KEY_LEN, ".png")) {
+            if (nb_entry == nb_alloc) {
+                nb_alloc = (0 == nb_alloc ? 64 : 2 * nb_alloc);
+                if (NULL == (tmp = (cache_entry_t *)
+                             realloc(entry,
+                                     nb_alloc * sizeof(cache_entry_t)))) {
+                    free(path);
+                    break;
+                }
+                entry = tmp;
+            }
+            strcpy(entry[nb_entry].name, de->d_name);
+            entry[nb_entry].size = (size_t) st.st_size;
+            entry[nb_entry].mtime = st.st_mtime;
+            total += entry[nb_entry].size;
+            nb_entry++;
+        }
+        free(path);
+    }
+    (void) closedir(dp);
+
+    qsort(entry, nb_entry, sizeof(cache_entry_t), &cmp_entry);
+    for (i = 0; i < nb_entry && total > max_size; i++) {
+        if (NULL == (path = cache_path(dir, entry[i].name)))
+            break;
+        (void) unlink(path);
+        total -= entry[i].size;
+        free(path);
+    }
+    free(entry);
+    return;
+}
+
+/**
+ * @brief insert an output in the cache
+ *
+ * The output is copied in a temporary file and renamed, an existing
+ * entry with the same key is atomically replaced. Then the least
+ * recently used entries are removed until the cache size is not
+ * larger than max_size; an output larger than max_size is not kept.
+ *
+ * @param dir cache directory, created if needed
+ * @param key cache key
+ * @param fname_out output file name
+ * @param max_size maximum total size of the entries, in bytes
+ *
+ * @return 0 on success, -1 on error
+ */
+int cache_put(const char *dir, const char *key, const char *fname_out,
+              size_t max_size)
+{
+    char name[CACHE_KEY_LEN + 32];
+    char *path, *path_tmp;
+    int ret = -1;
+
+    if (0 != cache_mkdir(dir))
+        return -1;
+    sprintf(name, "tmp.%ld.%.*s", (long) getpid(), CACHE_KEY_LEN, key);
+    path_tmp = cache_path(dir, name);
+    sprintf(name, "%.*s.png", CACHE_KEY_LEN, key);
+    path = cache_path(dir, name);
+    if (NULL != path && NULL != path_tmp) {
+        if (0 == cache_copy(fname_out, path_tmp)
+            && 0 == rename(path_tmp, path))
+            ret = 0;
+        else
+            (void) unlink(path_tmp);
+    }
+    free(path);
+    free(path_tmp);
+    cache_evict(dir, max_size);
+    return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef _CACHE_LIB_H
+#define _CACHE_LIB_H
+
+#include <stddef.h>
+
+/*
+ * result cache directory
+ *
+ *   <key>.png          cached output, the mtime is the last use
+ *   tmp.<pid>.<key>    entry being inserted, renamed when complete
+ *   hits, misses       counters, one byte appended per lookup
+ */
+
+/** @brief length of a cache key, in hexadecimal digits */
+#define CACHE_KEY_LEN 32
+
+/* cache_lib.c */
+void cache_hash(const unsigned char *buf, size_t len, char *hex);
+int cache_key(const char *fname, const char *mask_fname, const char *params, char *key);
+int cache_get(const char *dir, const char *key, const char *fname_out);
+int cache_put(const char *dir, const char *key, const char *fname_out, size_t max_size);
+
+#endif /* !_CACHE_LIB_H */
@@ -22,36 +22,171 @@
  * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
  * @author Jose-Luis Lisani <joseluis.lisani@uib.es>
  * @author Catalina Sbert <catalina.sbert@uib.es>
- *
- * @todo check precision loss, maybe use double precision values
  */
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <float.h>
+#include <limits.h>
+
+/* SSE and SSE2 are part of the amd64 baseline, use them if available */
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "balance_lib.h"
+#include "stats_lib.h"
 #include "debug.h"
 
 /* ensure consistency */
 #include "colorbalance_lib.h"
 
+/**
+ * @brief balance an unsigned char plane, with the statistics of a
+ * region
+ *
+ * @param data input/output plane
+ * @param size plane size
+ * @param roi statistics region, NULL for the whole plane
+ * @param nb_min, nb_max number of pixels to flatten
+ * @param c channel index, for the runtime statistics
+ */
+static void balance_roi_u8(unsigned char *data, size_t size,
+                           const balance_roi_t * roi,
+                           size_t nb_min, size_t nb_max, size_t c)
+{
+    unsigned char min, max;
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    if (NULL == roi)
+        balance_bounds_u8(data, size, nb_min, nb_max, &min, &max);
+    else
+        balance_bounds_roi_u8(data, roi, nb_min, nb_max, &min, &max);
+    STATS_TOGGLE(STATS_STATISTICS);
+    STATS_BOUNDS(c, min, max);
+
+    STATS_TOGGLE(STATS_APPLY);
+    (void) balance_apply_u8(data, size, min, max);
+    STATS_TOGGLE(STATS_APPLY);
+    return;
+}
+
 /**
  * @brief simplest color balance on RGB channels
  *
  * The input image is normalized by affine transformation on each RGB
  * channel, saturating a percentage of the pixels at the beginning and
  * end of the color space on each channel.
+ *
+ * The saturated pixels are counted in a region of the image, the
+ * normalization is applied to the whole image.
+ *
+ * @param rgb input/output buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, in each channel, NULL for the whole
+ *        image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_rgb_roi_u8(unsigned char *rgb, size_t size,
+                                       const balance_roi_t * roi,
+                                       size_t nb_min, size_t nb_max)
+{
+    DBG_CLOCK_RESET(0);
+
+    balance_roi_u8(rgb, size, roi, nb_min, nb_max, 0);
+    balance_roi_u8(rgb + size, size, roi, nb_min, nb_max, 1);
+    balance_roi_u8(rgb + 2 * size, size, roi, nb_min, nb_max, 2);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("rgb\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return rgb;
+}
+
+/**
+ * @brief simplest color balance on RGB channels
+ *
+ * See colorbalance_rgb_roi_u8(), with the statistics of the whole image.
  */
 unsigned char *colorbalance_rgb_u8(unsigned char *rgb, size_t size,
                                    size_t nb_min, size_t nb_max)
 {
-    DBG_CLOCK_RESET(0);
+    return colorbalance_rgb_roi_u8(rgb, size, NULL, nb_min, nb_max);
+}
+
+/**
+ * @brief simplest color balance on RGB channels, from histograms
+ *
+ * Same as colorbalance_rgb_u8(), with the channel histograms already
+ * computed, for example while the image was read. Only the rescaling
+ * pass is left.
+ *
+ * @param rgb input/output buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param histo R, G and B histograms, 3 x (UCHAR_MAX + 1) cells
+ * @param nb_min, nb_max number of pixels to flatten
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_rgb_histo_u8(unsigned char *rgb, size_t size,
+                                         const size_t *histo,
+                                         size_t nb_min, size_t nb_max)
+{
+    unsigned char min, max;
+    size_t c;
+
+    DBG_CLOCK_START(0);
+
+    for (c = 0; c < 3; c++) {
+        STATS_TOGGLE(STATS_STATISTICS);
+        balance_bounds_histo_u8(histo + c * (UCHAR_MAX + 1),
+                                nb_min, nb_max, &min, &max);
+        STATS_TOGGLE(STATS_STATISTICS);
+        STATS_BOUNDS(c, min, max);
+        STATS_TOGGLE(STATS_APPLY);
+        (void) balance_apply_u8(rgb + c * size, size, min, max);
+        STATS_TOGGLE(STATS_APPLY);
+    }
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("rgb\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return rgb;
+}
+
+/**
+ * @brief simplest color balance on RGB channels, with local statistics
+ *
+ * Same as colorbalance_rgb_u8(), with the statistics of the tiles of
+ * a grid blended over the image, see balance_local_u8().
+ *
+ * @param rgb input/output buffer
+ * @param nx, ny size of the R, G and B arrays in the buffer
+ * @param gx, gy grid size
+ * @param smin, smax saturated percentage, per tile
+ * @param nb_workers number of threads
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_rgb_local_u8(unsigned char *rgb,
+                                         size_t nx, size_t ny,
+                                         size_t gx, size_t gy,
+                                         float smin, float smax,
+                                         size_t nb_workers)
+{
+    size_t c;
+
+    DBG_CLOCK_START(0);
 
-    (void) balance_u8(rgb, size, nb_min, nb_max);
-    (void) balance_u8(rgb + size, size, nb_min, nb_max);
-    (void) balance_u8(rgb + 2 * size, size, nb_min, nb_max);
+    for (c = 0; c < 3; c++)
+        (void) balance_local_u8(rgb + c * nx * ny, nx, ny, gx, gy,
+                                smin, smax, nb_workers);
 
     DBG_CLOCK_TOGGLE(0);
     DBG_PRINTF1("rgb\t%0.2fs\n", DBG_CLOCK_S(0));
@@ -59,12 +194,772 @@ unsigned char *colorbalance_rgb_u8(unsigned char *rgb, size_t size,
     return rgb;
 }
 
+/**
+ * @brief simplest color balance on RGB channels, on a palette
+ *
+ * The rgb color balance is a per-channel table: on a palette image,
+ * the same result is obtained by balancing the palette entries, with
+ * the channel histograms of the pixels weighted by the number of
+ * pixels of each entry. The cost does not depend on the image size.
+ *
+ * @param pal input/output palette, R, G and B arrays of size entries
+ * @param size number of palette entries
+ * @param count number of pixels of each entry, size cells
+ * @param nb_min, nb_max number of pixels to flatten
+ *
+ * @return pal
+ */
+unsigned char *colorbalance_rgb_pal_u8(unsigned char *pal, size_t size,
+                                       const size_t *count,
+                                       size_t nb_min, size_t nb_max)
+{
+    size_t histo[3 * (UCHAR_MAX + 1)];
+    size_t i, c;
+
+    /* sanity check */
+    if (NULL == pal || NULL == count) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    memset(histo, 0x00, sizeof(histo));
+    for (c = 0; c < 3; c++)
+        for (i = 0; i < size; i++)
+            histo[c * (UCHAR_MAX + 1) + pal[c * size + i]] += count[i];
+    STATS_TOGGLE(STATS_STATISTICS);
+
+    return colorbalance_rgb_histo_u8(pal, size, histo, nb_min, nb_max);
+}
+
+/**
+ * @brief simplest color balance on interleaved RGB samples
+ *
+ * Same as colorbalance_rgb_u8(), on RGB RGB RGB pixels, for example
+ * the rgb24 raw video frames. The three histograms are counted in one
+ * pass, and the three tables are applied in one pass.
+ *
+ * @param rgb input/output pixels, 3 x size samples
+ * @param size number of pixels
+ * @param nb_min, nb_max number of pixels to flatten
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_rgb24_u8(unsigned char *rgb, size_t size,
+                                     size_t nb_min, size_t nb_max)
+{
+    size_t histo[3 * (UCHAR_MAX + 1)];
+    unsigned char lut[3 * (UCHAR_MAX + 1)];
+    unsigned char min, max;
+    size_t i, c;
+
+    /* sanity check */
+    if (NULL == rgb) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    DBG_CLOCK_START(0);
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    memset(histo, 0x00, sizeof(histo));
+    for (i = 0; i < 3 * size; i += 3) {
+        histo[rgb[i]] += 1;
+        histo[UCHAR_MAX + 1 + rgb[i + 1]] += 1;
+        histo[2 * (UCHAR_MAX + 1) + rgb[i + 2]] += 1;
+    }
+    for (c = 0; c < 3; c++) {
+        balance_bounds_histo_u8(histo + c * (UCHAR_MAX + 1),
+                                nb_min, nb_max, &min, &max);
+        STATS_BOUNDS(c, min, max);
+        balance_lut_u8(min, max, lut + c * (UCHAR_MAX + 1));
+    }
+    STATS_TOGGLE(STATS_STATISTICS);
+
+    STATS_TOGGLE(STATS_APPLY);
+    for (i = 0; i < 3 * size; i += 3) {
+        rgb[i] = lut[rgb[i]];
+        rgb[i + 1] = lut[UCHAR_MAX + 1 + rgb[i + 1]];
+        rgb[i + 2] = lut[2 * (UCHAR_MAX + 1) + rgb[i + 2]];
+    }
+    STATS_TOGGLE(STATS_APPLY);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("rgb24\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return rgb;
+}
+
+/**
+ * @brief simplest color balance on a gray plane
+ *
+ * On a gray image, R = G = B and the rgb, hsl, hsv and ycbcr variants
+ * give the same result as the normalization of the gray plane, with
+ * one histogram and one table instead of three.
+ *
+ * The saturated pixels are counted in a region of the image, the
+ * normalization is applied to the whole image.
+ *
+ * @param gray input/output plane
+ * @param size plane size
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ *
+ * @return gray
+ */
+unsigned char *colorbalance_gray_roi_u8(unsigned char *gray, size_t size,
+                                        const balance_roi_t * roi,
+                                        size_t nb_min, size_t nb_max)
+{
+    DBG_CLOCK_START(0);
+
+    balance_roi_u8(gray, size, roi, nb_min, nb_max, 0);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("gray\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return gray;
+}
+
+/**
+ * @brief simplest color balance on a gray plane
+ *
+ * See colorbalance_gray_roi_u8(), with the statistics of the whole image.
+ */
+unsigned char *colorbalance_gray_u8(unsigned char *gray, size_t size,
+                                    size_t nb_min, size_t nb_max)
+{
+    return colorbalance_gray_roi_u8(gray, size, NULL, nb_min, nb_max);
+}
+
+/**
+ * @brief simplest color balance on a gray plane, from its histogram
+ *
+ * Same as colorbalance_gray_u8(), with the histogram already
+ * computed, see colorbalance_rgb_histo_u8().
+ *
+ * @param gray input/output plane
+ * @param size plane size
+ * @param histo histogram, UCHAR_MAX + 1 cells
+ * @param nb_min, nb_max number of pixels to flatten
+ *
+ * @return gray
+ */
+unsigned char *colorbalance_gray_histo_u8(unsigned char *gray, size_t size,
+                                          const size_t *histo,
+                                          size_t nb_min, size_t nb_max)
+{
+    unsigned char min, max;
+
+    DBG_CLOCK_START(0);
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    balance_bounds_histo_u8(histo, nb_min, nb_max, &min, &max);
+    STATS_TOGGLE(STATS_STATISTICS);
+    STATS_BOUNDS(0, min, max);
+    STATS_TOGGLE(STATS_APPLY);
+    (void) balance_apply_u8(gray, size, min, max);
+    STATS_TOGGLE(STATS_APPLY);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("gray\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return gray;
+}
+
 /** @brief max of A and B */
 #define MAX(A,B) (((A) >= (B)) ? (A) : (B))
 
 /** @brief max of A, B, and C */
 #define MAX3(A,B,C) (((A) >= (B)) ? MAX(A,C) : MAX(B,C))
 
+/** @brief number of pixels processed per block by the irgb kernel */
+#define IRGB_BLOCK 4096
+
+/**
+ * @brief apply the I normalization to a block of RGB pixels
+ *
+ * With I = R + G + B, M = max(R, G, B) and the normalized intensity
+ * Inorm = (I - min) / (max - min) bounded to [0, 1], the RGB channels
+ * are multiplied by S = 3 Inorm / I, with a projection towards
+ * (0,0,0) on the RGB cube if M * S > 1, ie S = min(3 Inorm / I, 1 / M).
+ * This is computed without branches and with one division per pixel
+ * as S = min(3 Inorm M, I) / (I M), with S = 0 for black pixels.
+ *
+ * The vector and scalar code perform the same single precision
+ * operations and give the same result.
+ *
+ * @param r, g, b input/output channels
+ * @param n number of pixels
+ * @param min lower normalization bound of I
+ * @param scale 1 / (max - min), or 0 if max <= min
+ * @param bias 0, or .5 if max <= min
+ */
+static void irgb_scale_f32(float *r, float *g, float *b, size_t n,
+                           float min, float scale, float bias)
+{
+    float i, m, t, s;
+    size_t j = 0;
+
+#ifdef __SSE__
+    {
+        const __m128 vmin = _mm_set1_ps(min);
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128 vbias = _mm_set1_ps(bias);
+        const __m128 vzero = _mm_setzero_ps();
+        const __m128 vone = _mm_set1_ps(1.f);
+        const __m128 vthree = _mm_set1_ps(3.f);
+        const __m128 vtiny = _mm_set1_ps(FLT_MIN);
+        __m128 vr, vg, vb, vi, vm, vt, vs;
+
+        for (; j + 4 <= n; j += 4) {
+            vr = _mm_loadu_ps(r + j);
+            vg = _mm_loadu_ps(g + j);
+            vb = _mm_loadu_ps(b + j);
+            vi = _mm_add_ps(_mm_add_ps(vr, vg), vb);
+            vm = _mm_max_ps(vr, _mm_max_ps(vg, vb));
+            vt = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(vi, vmin), vscale), vbias);
+            vt = _mm_min_ps(_mm_max_ps(vt, vzero), vone);
+            vs = _mm_div_ps(_mm_min_ps(_mm_mul_ps(_mm_mul_ps(vthree, vt),
+                                                  vm), vi),
+                            _mm_max_ps(_mm_mul_ps(vi, vm), vtiny));
+            _mm_storeu_ps(r + j, _mm_mul_ps(vr, vs));
+            _mm_storeu_ps(g + j, _mm_mul_ps(vg, vs));
+            _mm_storeu_ps(b + j, _mm_mul_ps(vb, vs));
+        }
+    }
+#endif                          /* __SSE__ */
+
+    for (; j < n; j++) {
+        i = (r[j] + g[j]) + b[j];
+        m = MAX3(r[j], g[j], b[j]);
+        t = (i - min) * scale + bias;
+        t = (t > 0.f ? t : 0.f);
+        t = (t < 1.f ? t : 1.f);
+        t = 3.f * t * m;
+        s = (t < i ? t : i) / (i * m > FLT_MIN ? i * m : FLT_MIN);
+        r[j] *= s;
+        g[j] *= s;
+        b[j] *= s;
+    }
+    return;
+}
+
+/**
+ * @brief irgb_scale_f32() parameters of the [min, max] normalization
+ */
+static void irgb_param_f32(float min, float max, float *scale, float *bias)
+{
+    if (max <= min) {
+        *scale = 0.f;
+        *bias = .5f;
+    }
+    else {
+        *scale = 1.f / (max - min);
+        *bias = 0.f;
+    }
+    return;
+}
+
+/**
+ * @brief apply the I normalization to a row of RGB pixels, and
+ * quantize it into interlaced 8bit samples
+ *
+ * The pixel scaling is the same as irgb_scale_f32(), and the
+ * quantization is the same as io_png_write_flt_from(): v * 255 + .5
+ * in single precision, bounded to [0, 255] and truncated.
+ *
+ * @param row output row, 3 x n interlaced samples (RGB RGB RGB)
+ * @param r, g, b input channels
+ * @param n number of pixels
+ * @param min, scale, bias see irgb_scale_f32()
+ */
+static void irgb_quant_u8(unsigned char *row,
+                          const float *r, const float *g, const float *b,
+                          size_t n, float min, float scale, float bias)
+{
+    float i, m, t, s, q[3];
+    size_t j = 0, c;
+
+#ifdef __SSE2__
+    {
+        const __m128 vmin = _mm_set1_ps(min);
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128 vbias = _mm_set1_ps(bias);
+        const __m128 vzero = _mm_setzero_ps();
+        const __m128 vone = _mm_set1_ps(1.f);
+        const __m128 vthree = _mm_set1_ps(3.f);
+        const __m128 vtiny = _mm_set1_ps(FLT_MIN);
+        const __m128 vmax = _mm_set1_ps(255.f);
+        const __m128 vhalf = _mm_set1_ps(.5f);
+        __m128 vr, vg, vb, vi, vm, vt, vs;
+        __m128i vq;
+        unsigned char tmp[16];
+
+        for (; j + 4 <= n; j += 4) {
+            vr = _mm_loadu_ps(r + j);
+            vg = _mm_loadu_ps(g + j);
+            vb = _mm_loadu_ps(b + j);
+            vi = _mm_add_ps(_mm_add_ps(vr, vg), vb);
+            vm = _mm_max_ps(vr, _mm_max_ps(vg, vb));
+            vt = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(vi, vmin), vscale), vbias);
+            vt = _mm_min_ps(_mm_max_ps(vt, vzero), vone);
+            vs = _mm_div_ps(_mm_min_ps(_mm_mul_ps(_mm_mul_ps(vthree, vt),
+                                                  vm), vi),
+                            _mm_max_ps(_mm_mul_ps(vi, vm), vtiny));
+            /* quantize, bounded to [0, 255] */
+            vr = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(vr, vs), vmax), vhalf);
+            vg = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(vg, vs), vmax), vhalf);
+            vb = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(vb, vs), vmax), vhalf);
+            vr = _mm_min_ps(_mm_max_ps(vr, vzero), vmax);
+            vg = _mm_min_ps(_mm_max_ps(vg, vzero), vmax);
+            vb = _mm_min_ps(_mm_max_ps(vb, vzero), vmax);
+            /* pack to bytes, RRRR GGGG BBBB 0000, and interlace */
+            vq = _mm_packus_epi16(_mm_packs_epi32(_mm_cvttps_epi32(vr),
+                                                  _mm_cvttps_epi32(vg)),
+                                  _mm_packs_epi32(_mm_cvttps_epi32(vb),
+                                                  _mm_setzero_si128()));
+            _mm_storeu_si128((__m128i *) tmp, vq);
+            for (c = 0; c < 4; c++) {
+                row[3 * (j + c)] = tmp[c];
+                row[3 * (j + c) + 1] = tmp[4 + c];
+                row[3 * (j + c) + 2] = tmp[8 + c];
+            }
+        }
+    }
+#endif                          /* __SSE2__ */
+
+    for (; j < n; j++) {
+        i = (r[j] + g[j]) + b[j];
+        m = MAX3(r[j], g[j], b[j]);
+        t = (i - min) * scale + bias;
+        t = (t > 0.f ? t : 0.f);
+        t = (t < 1.f ? t : 1.f);
+        t = 3.f * t * m;
+        s = (t < i ? t : i) / (i * m > FLT_MIN ? i * m : FLT_MIN);
+        q[0] = r[j] * s * 255.f + .5f;
+        q[1] = g[j] * s * 255.f + .5f;
+        q[2] = b[j] * s * 255.f + .5f;
+        for (c = 0; c < 3; c++)
+            row[3 * j + c] = (unsigned char) (q[c] < 0.f ? 0.f
+                                              : (q[c] > 255.f ? 255.f
+                                                 : q[c]));
+    }
+    return;
+}
+
+/**
+ * @brief convert unsigned char samples to [0,1] floats
+ *
+ * The conversion is the same float division as io_png_read_flt(), so
+ * the irgb kernels see the same values as with float planes.
+ *
+ * @param dst output samples
+ * @param src input samples
+ * @param n number of samples
+ */
+static void irgb_u8_to_f32(float *dst, const unsigned char *src, size_t n)
+{
+    size_t j = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128 vmax = _mm_set1_ps(255.f);
+        const __m128i vzero = _mm_setzero_si128();
+        __m128i v, vlo, vhi;
+
+        for (; j + 16 <= n; j += 16) {
+            v = _mm_loadu_si128((const __m128i *) (src + j));
+            vlo = _mm_unpacklo_epi8(v, vzero);
+            vhi = _mm_unpackhi_epi8(v, vzero);
+            v = _mm_unpacklo_epi16(vlo, vzero);
+            _mm_storeu_ps(dst + j, _mm_div_ps(_mm_cvtepi32_ps(v), vmax));
+            v = _mm_unpackhi_epi16(vlo, vzero);
+            _mm_storeu_ps(dst + j + 4, _mm_div_ps(_mm_cvtepi32_ps(v), vmax));
+            v = _mm_unpacklo_epi16(vhi, vzero);
+            _mm_storeu_ps(dst + j + 8, _mm_div_ps(_mm_cvtepi32_ps(v), vmax));
+            v = _mm_unpackhi_epi16(vhi, vzero);
+            _mm_storeu_ps(dst + j + 12, _mm_div_ps(_mm_cvtepi32_ps(v), vmax));
+        }
+    }
+#endif                          /* __SSE2__ */
+
+    for (; j < n; j++)
+        dst[j] = (float) src[j] / 255.f;
+    return;
+}
+
+/**
+ * @brief normalization bounds of the I axis, for the irgb color
+ * balance
+ *
+ * I is computed as R + G + B, and its bounds are computed as with
+ * balance_bounds_roi_f32(); I is only stored when quantiles are
+ * needed, and only in the region rectangle.
+ *
+ * @param rgb input buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ * @param ptr_min, ptr_max pointers to the returned bounds
+ */
+void colorbalance_irgb_bounds_f32(const float *rgb, size_t size,
+                                  const balance_roi_t * roi,
+                                  size_t nb_min, size_t nb_max,
+                                  float *ptr_min, float *ptr_max)
+{
+    float *irgb;                /* intensity */
+    const float *r, *g, *b;
+    float min, max, t;
+    size_t i;
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+
+    if (NULL != roi) {
+        /* I is only computed in the region rectangle */
+        balance_roi_t rect;
+        size_t x, y, off;
+
+        rect.stride = roi->nx;
+        rect.x0 = 0;
+        rect.y0 = 0;
+        rect.nx = roi->nx;
+        rect.ny = roi->ny;
+        rect.mask = (NULL == roi->mask ? NULL
+                     : roi->mask + roi->y0 * roi->mask_stride + roi->x0);
+        rect.mask_stride = roi->mask_stride;
+        irgb = (float *) malloc(roi->nx * roi->ny * sizeof(float));
+        STATS_ALLOC(irgb, roi->nx * roi->ny * sizeof(float));
+        for (y = 0; y < roi->ny; y++) {
+            off = (roi->y0 + y) * roi->stride + roi->x0;
+            for (x = 0; x < roi->nx; x++)
+                irgb[y * roi->nx + x] =
+                    (r[off + x] + g[off + x]) + b[off + x];
+        }
+        balance_bounds_roi_f32(irgb, &rect, nb_min, nb_max, &min, &max);
+        STATS_FREE(irgb);
+        free(irgb);
+    }
+    else if (0 != nb_min || 0 != nb_max) {
+        irgb = (float *) malloc(size * sizeof(float));
+        STATS_ALLOC(irgb, size * sizeof(float));
+        for (i = 0; i < size; i++)
+            irgb[i] = (r[i] + g[i]) + b[i];
+        balance_bounds_f32(irgb, size, nb_min, nb_max, &min, &max);
+        STATS_FREE(irgb);
+        free(irgb);
+    }
+    else {
+        /* no quantile, I is not stored */
+        min = (r[0] + g[0]) + b[0];
+        max = min;
+        for (i = 1; i < size; i++) {
+            t = (r[i] + g[i]) + b[i];
+            min = (t < min ? t : min);
+            max = (t > max ? t : max);
+        }
+    }
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    STATS_BOUNDS(0, min, max);
+
+    *ptr_min = min;
+    *ptr_max = max;
+    return;
+}
+
+/**
+ * @brief add the I intensity of an unsigned char RGB image to an
+ * histogram
+ *
+ * With 8bit channels, I = R + G + B is an integer in
+ * [0, 3 x UCHAR_MAX] and its histogram is exact. The histogram can
+ * be filled by successive calls on several images, then used by
+ * colorbalance_irgb_bounds_histo().
+ *
+ * @param rgb input buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param histo histogram, 3 x UCHAR_MAX + 1 cells, updated
+ */
+void colorbalance_irgb_histo_u8(const unsigned char *rgb, size_t size,
+                                size_t *histo)
+{
+    const unsigned char *r, *g, *b;
+    size_t i;
+
+    /* sanity checks */
+    if (NULL == rgb || NULL == histo) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+    for (i = 0; i < size; i++)
+        histo[(size_t) r[i] + (size_t) g[i] + (size_t) b[i]] += 1;
+    return;
+}
+
+/**
+ * @brief add the I intensity of a float RGB image to an histogram
+ *
+ * Same as colorbalance_irgb_histo_u8(), for the [0,1] channels read
+ * from a 8bit image: I x UCHAR_MAX is rounded to the nearest integer.
+ *
+ * @param rgb input buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param histo histogram, 3 x UCHAR_MAX + 1 cells, updated
+ */
+void colorbalance_irgb_histo_f32(const float *rgb, size_t size,
+                                 size_t *histo)
+{
+    const float *r, *g, *b;
+    float t;
+    size_t i;
+
+    /* sanity checks */
+    if (NULL == rgb || NULL == histo) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+    for (i = 0; i < size; i++) {
+        t = ((r[i] + g[i]) + b[i]) * UCHAR_MAX + .5f;
+        t = (t < 0.f ? 0.f : (t > 3 * UCHAR_MAX ? 3 * UCHAR_MAX : t));
+        histo[(size_t) t] += 1;
+    }
+    return;
+}
+
+/**
+ * @brief get the irgb normalization bounds from an I histogram
+ *
+ * The bounds are computed on the histogram filled by
+ * colorbalance_irgb_histo_u8(), then scaled to the [0,1] channels
+ * of colorbalance_irgb_bounds_f32(). The float intensities of the
+ * pixels with the same integer I differ by a few 1e-7, so the bounds
+ * may differ by as much from the ones computed on the float image.
+ *
+ * @param histo histogram, 3 x UCHAR_MAX + 1 cells
+ * @param nb_min, nb_max number of pixels to flatten
+ * @param ptr_min, ptr_max pointers to the returned values
+ */
+void colorbalance_irgb_bounds_histo(const size_t *histo,
+                                    size_t nb_min, size_t nb_max,
+                                    float *ptr_min, float *ptr_max)
+{
+    size_t min, max;
+
+    /* sanity checks */
+    if (NULL == ptr_min || NULL == ptr_max) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    balance_bounds_histo(histo, 3 * UCHAR_MAX + 1, nb_min, nb_max,
+                         &min, &max);
+    *ptr_min = (float) min / UCHAR_MAX;
+    *ptr_max = (float) max / UCHAR_MAX;
+    return;
+}
+
+/**
+ * @brief normalization bounds of the I axis, for the irgb color
+ * balance of an unsigned char image
+ *
+ * Same as colorbalance_irgb_bounds_f32(), computed on the exact I
+ * histogram, see colorbalance_irgb_bounds_histo(). No intensity
+ * plane is needed.
+ *
+ * @param rgb input buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ * @param ptr_min, ptr_max pointers to the returned bounds
+ */
+void colorbalance_irgb_bounds_u8(const unsigned char *rgb, size_t size,
+                                 const balance_roi_t * roi,
+                                 size_t nb_min, size_t nb_max,
+                                 float *ptr_min, float *ptr_max)
+{
+    size_t histo[3 * UCHAR_MAX + 1];
+    const unsigned char *r, *g, *b, *mask;
+    size_t x, y, off;
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    memset(histo, 0x00, sizeof(histo));
+    if (NULL == roi)
+        colorbalance_irgb_histo_u8(rgb, size, histo);
+    else {
+        r = rgb;
+        g = rgb + size;
+        b = rgb + 2 * size;
+        for (y = 0; y < roi->ny; y++) {
+            off = (roi->y0 + y) * roi->stride + roi->x0;
+            mask = (NULL == roi->mask ? NULL : roi->mask
+                    + (roi->y0 + y) * roi->mask_stride + roi->x0);
+            for (x = 0; x < roi->nx; x++)
+                if (NULL == mask || 0 != mask[x])
+                    histo[(size_t) r[off + x] + (size_t) g[off + x]
+                          + (size_t) b[off + x]] += 1;
+        }
+    }
+    colorbalance_irgb_bounds_histo(histo, nb_min, nb_max, ptr_min, ptr_max);
+    STATS_TOGGLE(STATS_STATISTICS);
+    STATS_BOUNDS(0, *ptr_min, *ptr_max);
+    return;
+}
+
+/**
+ * @brief apply the irgb color balance to a row and quantize it
+ *
+ * This is the output stage of colorbalance_irgb_roi_f32() fused with
+ * the 8bit quantization and interlacing of io_png_write_flt_from():
+ * the row can be written by io_png_write_rows() without any
+ * normalized float image, and the PNG file is the same.
+ *
+ * @param row output row, 3 x n interlaced samples (RGB RGB RGB)
+ * @param r, g, b input channels, n pixels
+ * @param n number of pixels
+ * @param min, max normalization bounds, see
+ *        colorbalance_irgb_bounds_f32()
+ */
+void colorbalance_irgb_row_u8(unsigned char *row, const float *r,
+                              const float *g, const float *b, size_t n,
+                              float min, float max)
+{
+    float scale, bias;
+
+    STATS_TOGGLE(STATS_APPLY);
+    irgb_param_f32(min, max, &scale, &bias);
+    irgb_quant_u8(row, r, g, b, n, min, scale, bias);
+    STATS_TOGGLE(STATS_APPLY);
+    return;
+}
+
+/**
+ * @brief row callback of io_png_write_rows(), apply the irgb color
+ * balance to a row of the planes and quantize it
+ *
+ * See colorbalance_irgb_row_u8().
+ *
+ * @param row output row
+ * @param y row index
+ * @param ctx planes and bounds, a colorbalance_irgb_out_t structure
+ */
+void colorbalance_irgb_fill_u8(unsigned char *row, size_t y, void *ctx)
+{
+    const colorbalance_irgb_out_t *out;
+    size_t off;
+
+    out = (const colorbalance_irgb_out_t *) ctx;
+    off = y * out->stride;
+
+    colorbalance_irgb_row_u8(row, out->ch[0] + off, out->ch[1] + off,
+                             out->ch[2] + off, out->nx, out->min, out->max);
+    return;
+}
+
+/** @brief number of pixels converted per block by the compact irgb rows */
+#define IRGB_ROW_BLOCK 256
+
+/**
+ * @brief interlace an alpha channel in a row of RGB pixels
+ *
+ * The RGB samples are moved in place, from the end of the row, so
+ * the row is RGBA RGBA RGBA without any other buffer.
+ *
+ * @param row input RGB row, output RGBA row, 4 x n samples
+ * @param alpha alpha channel, n samples
+ * @param n number of pixels
+ */
+static void irgb_alpha_u8(unsigned char *row, const unsigned char *alpha,
+                          size_t n)
+{
+    size_t j;
+
+    for (j = n; j > 0; j--) {
+        row[4 * j - 1] = alpha[j - 1];
+        row[4 * j - 2] = row[3 * j - 1];
+        row[4 * j - 3] = row[3 * j - 2];
+        row[4 * j - 4] = row[3 * j - 3];
+    }
+    return;
+}
+
+/**
+ * @brief apply the irgb color balance to a row of unsigned char
+ * planes and quantize it
+ *
+ * Same as colorbalance_irgb_row_u8(), but the input planes are the
+ * 8bit samples decoded from the PNG file. They are converted to
+ * floats block by block, in a small buffer, so the whole image is
+ * kept in 3 bytes per pixel instead of 12.
+ *
+ * @param row output row, 3 x n interlaced samples (RGB RGB RGB)
+ * @param r, g, b input channels, n pixels
+ * @param n number of pixels
+ * @param min, max normalization bounds, see
+ *        colorbalance_irgb_bounds_u8()
+ */
+void colorbalance_irgb_row_from_u8(unsigned char *row,
+                                   const unsigned char *r,
+                                   const unsigned char *g,
+                                   const unsigned char *b, size_t n,
+                                   float min, float max)
+{
+    float fr[IRGB_ROW_BLOCK], fg[IRGB_ROW_BLOCK], fb[IRGB_ROW_BLOCK];
+    float scale, bias;
+    size_t j, k;
+
+    STATS_TOGGLE(STATS_APPLY);
+    irgb_param_f32(min, max, &scale, &bias);
+    for (j = 0; j < n; j += k) {
+        k = (n - j < IRGB_ROW_BLOCK ? n - j : IRGB_ROW_BLOCK);
+        irgb_u8_to_f32(fr, r + j, k);
+        irgb_u8_to_f32(fg, g + j, k);
+        irgb_u8_to_f32(fb, b + j, k);
+        irgb_quant_u8(row + 3 * j, fr, fg, fb, k, min, scale, bias);
+    }
+    STATS_TOGGLE(STATS_APPLY);
+    return;
+}
+
+/**
+ * @brief row callback of io_png_write_rows(), apply the irgb color
+ * balance to a row of unsigned char planes and quantize it
+ *
+ * See colorbalance_irgb_row_from_u8(). With an alpha plane, the
+ * alpha channel is interlaced in the row, unchanged, and the row is
+ * written as RGBA.
+ *
+ * @param row output row
+ * @param y row index
+ * @param ctx planes and bounds, a colorbalance_irgb_out_u8_t structure
+ */
+void colorbalance_irgb_fill_from_u8(unsigned char *row, size_t y, void *ctx)
+{
+    const colorbalance_irgb_out_u8_t *out;
+    size_t off;
+
+    out = (const colorbalance_irgb_out_u8_t *) ctx;
+    off = y * out->stride;
+
+    colorbalance_irgb_row_from_u8(row, out->ch[0] + off, out->ch[1] + off,
+                                  out->ch[2] + off, out->nx,
+                                  out->min, out->max);
+    if (NULL != out->alpha)
+        irgb_alpha_u8(row, out->alpha + off, out->nx);
+    return;
+}
+
 /**
  * @brief simplest color balance based on the I axis applied to the
  * RGB channels, bounded
@@ -75,43 +970,497 @@ unsigned char *colorbalance_rgb_u8(unsigned char *rgb, size_t size,
  * G and B channels. The RGB cube is not stable by this operation, so
  * some projections towards (0,0,0) on the RGB cube will be performed
  * if needed.
+ *
+ * I is computed as R + G + B, the normalization bounds are computed
+ * on this sum by colorbalance_irgb_bounds_f32(), then the image is
+ * normalized by irgb_scale_f32(), block by block. Compared to the
+ * (R + G + B) / 3 double precision formulation, the single precision
+ * rounding of the pixel scaling differs by a few 1e-7; after 8bit
+ * quantization, a few pixels close to a rounding boundary may differ
+ * by 1, none by more.
+ *
+ * The saturated pixels are counted in a region of the image, the
+ * normalization is applied to the whole image.
+ *
+ * @param rgb input/output buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ *
+ * @return rgb
+ */
+float *colorbalance_irgb_roi_f32(float *rgb, size_t size,
+                                 const balance_roi_t * roi,
+                                 size_t nb_min, size_t nb_max)
+{
+    float *r, *g, *b;
+    float min, max, scale, bias;
+    size_t i, n;
+
+    DBG_CLOCK_START(0);
+
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+
+    /* compute the normalization bounds of I */
+    colorbalance_irgb_bounds_f32(rgb, size, roi, nb_min, nb_max,
+                                 &min, &max);
+
+    /* apply the I normalization to the RGB channels */
+    STATS_TOGGLE(STATS_APPLY);
+    irgb_param_f32(min, max, &scale, &bias);
+    for (i = 0; i < size; i += IRGB_BLOCK) {
+        n = (size - i < IRGB_BLOCK ? size - i : IRGB_BLOCK);
+        irgb_scale_f32(r + i, g + i, b + i, n, min, scale, bias);
+    }
+    STATS_TOGGLE(STATS_APPLY);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("irgb\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return rgb;
+}
+
+/**
+ * @brief simplest color balance based on the I axis applied to the
+ * RGB channels, bounded
+ *
+ * See colorbalance_irgb_roi_f32(), with the statistics of the whole image.
  */
 float *colorbalance_irgb_f32(float *rgb, size_t size,
                              size_t nb_min, size_t nb_max)
 {
-    float *irgb, *inorm;        /* intensity scale */
-    double s, m;
+    return colorbalance_irgb_roi_f32(rgb, size, NULL, nb_min, nb_max);
+}
+
+/** @brief min of A and B */
+#define MIN(A,B) (((A) <= (B)) ? (A) : (B))
+
+/** @brief min of A, B, and C */
+#define MIN3(A,B,C) (((A) <= (B)) ? MIN(A,C) : MIN(B,C))
+
+/*
+ * FIXED-POINT COLOR SPACE BALANCE
+ */
+
+/*
+ * The ycbcr, hsv and hsl variants balance one axis (luma, value or
+ * lightness) computed from the 8bit RGB channels, then move the RGB
+ * pixels along this axis while preserving the other color
+ * coordinates. The axis is stored in a temporary 8bit plane and
+ * balanced with balance_u8(), or with the statistics of a region; the
+ * RGB channels are then updated from the original axis value,
+ * computed again, and the balanced one, with integer arithmetic and
+ * small per-axis-value tables, without any float conversion.
+ */
+
+/**
+ * @brief Y luma coefficients, Q15 fixed-point
+ *
+ * ITU BT.601 (JPEG full range) coefficients
+ * Y = 0.299 R + 0.587 G + 0.114 B, summing to 1 << 15 so that gray
+ * pixels have Y = R = G = B.
+ */
+#define LUMA_CR 9798
+#define LUMA_CG 19235
+#define LUMA_CB 3735
+#define LUMA_SHIFT 15
+
+/** @brief Y luma of an RGB pixel, rounded */
+#define LUMA(R,G,B) ((unsigned char)                    \
+                     ((LUMA_CR * (unsigned int) (R)     \
+                       + LUMA_CG * (unsigned int) (G)   \
+                       + LUMA_CB * (unsigned int) (B)   \
+                       + (1 << (LUMA_SHIFT - 1))) >> LUMA_SHIFT))
+
+#ifdef __SSE2__
+/**
+ * @brief Y luma of 16 RGB pixels, SSE2 version of LUMA()
+ *
+ * The luma is returned as two vectors of eight 16bit values.
+ */
+static void luma_sse2(__m128i vr, __m128i vg, __m128i vb,
+                      __m128i * ylo, __m128i * yhi)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i crg = _mm_set_epi16(LUMA_CG, LUMA_CR, LUMA_CG, LUMA_CR,
+                                      LUMA_CG, LUMA_CR, LUMA_CG, LUMA_CR);
+    const __m128i cbh = _mm_set_epi16(1 << (LUMA_SHIFT - 1), LUMA_CB,
+                                      1 << (LUMA_SHIFT - 1), LUMA_CB,
+                                      1 << (LUMA_SHIFT - 1), LUMA_CB,
+                                      1 << (LUMA_SHIFT - 1), LUMA_CB);
+    __m128i r16, g16, b16, t0, t1;
+
+    /* (R,G).(CR,CG) + (B,1).(CB,1/2) on 32bit lanes */
+    r16 = _mm_unpacklo_epi8(vr, zero);
+    g16 = _mm_unpacklo_epi8(vg, zero);
+    b16 = _mm_unpacklo_epi8(vb, zero);
+    t0 = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r16, g16), crg),
+                       _mm_madd_epi16(_mm_unpacklo_epi16(b16, one), cbh));
+    t1 = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r16, g16), crg),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(b16, one), cbh));
+    *ylo = _mm_packs_epi32(_mm_srli_epi32(t0, LUMA_SHIFT),
+                           _mm_srli_epi32(t1, LUMA_SHIFT));
+
+    r16 = _mm_unpackhi_epi8(vr, zero);
+    g16 = _mm_unpackhi_epi8(vg, zero);
+    b16 = _mm_unpackhi_epi8(vb, zero);
+    t0 = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r16, g16), crg),
+                       _mm_madd_epi16(_mm_unpacklo_epi16(b16, one), cbh));
+    t1 = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r16, g16), crg),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(b16, one), cbh));
+    *yhi = _mm_packs_epi32(_mm_srli_epi32(t0, LUMA_SHIFT),
+                           _mm_srli_epi32(t1, LUMA_SHIFT));
+    return;
+}
+#endif                          /* __SSE2__ */
+
+/**
+ * @brief simplest color balance on the Y luma axis of the YCbCr
+ * color space
+ *
+ * The input image is normalized by affine transformation on the Y
+ * axis, saturating a percentage of the pixels at the beginning and
+ * end of the axis. The Cb and Cr chroma components are preserved,
+ * which amounts to adding the Y variation to the R, G and B
+ * channels, with a saturation on the RGB cube.
+ *
+ * The saturated pixels are counted in a region of the image, the
+ * normalization is applied to the whole image.
+ *
+ * @param rgb input/output buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_ycbcr_roi_u8(unsigned char *rgb, size_t size,
+                                         const balance_roi_t * roi,
+                                         size_t nb_min, size_t nb_max)
+{
+    unsigned char *r, *g, *b;
+    unsigned char *y;           /* luma, then normalized luma */
     size_t i;
+    int d;
 
     DBG_CLOCK_START(0);
 
-    /** @todo compute I=R+G+B instead of (R+G+B)/3 to save a division */
-    irgb = (float *) malloc(size * sizeof(float));
-    for (i = 0; i < size; i++)
-        irgb[i] = (rgb[i] + rgb[i + size] + rgb[i + 2 * size]) / 3.;
-    /* copy and normalize I */
-    inorm = (float *) malloc(size * sizeof(float));
-    memcpy(inorm, irgb, size * sizeof(float));
-    (void) balance_f32(inorm, size, nb_min, nb_max);
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+
+    /* compute and normalize Y */
+    STATS_TOGGLE(STATS_APPLY);
+    y = (unsigned char *) malloc(size * sizeof(unsigned char));
+    STATS_ALLOC(y, size * sizeof(unsigned char));
+    i = 0;
+#ifdef __SSE2__
+    {
+        __m128i ylo, yhi;
+        for (; i + 16 <= size; i += 16) {
+            luma_sse2(_mm_loadu_si128((const __m128i *) (r + i)),
+                      _mm_loadu_si128((const __m128i *) (g + i)),
+                      _mm_loadu_si128((const __m128i *) (b + i)), &ylo, &yhi);
+            _mm_storeu_si128((__m128i *) (y + i), _mm_packus_epi16(ylo, yhi));
+        }
+    }
+#endif                          /* __SSE2__ */
+    for (; i < size; i++)
+        y[i] = LUMA(r[i], g[i], b[i]);
+    STATS_TOGGLE(STATS_APPLY);
+    balance_roi_u8(y, size, roi, nb_min, nb_max, 0);
+    STATS_TOGGLE(STATS_APPLY);
+
+    /*
+     * apply the Y normalization to the RGB channels:
+     * RGB = RGB + Ynorm - Y, with a saturation on the RGB cube
+     */
+    i = 0;
+#ifdef __SSE2__
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i vr, vg, vb, ylo, yhi, vyn, dlo, dhi;
+
+        for (; i + 16 <= size; i += 16) {
+            vr = _mm_loadu_si128((const __m128i *) (r + i));
+            vg = _mm_loadu_si128((const __m128i *) (g + i));
+            vb = _mm_loadu_si128((const __m128i *) (b + i));
+            luma_sse2(vr, vg, vb, &ylo, &yhi);
+            vyn = _mm_loadu_si128((const __m128i *) (y + i));
+            dlo = _mm_sub_epi16(_mm_unpacklo_epi8(vyn, zero), ylo);
+            dhi = _mm_sub_epi16(_mm_unpackhi_epi8(vyn, zero), yhi);
+            /* packus saturates to [0,255] */
+#define _ADD_SAT(V) _mm_packus_epi16(                             \
+                _mm_add_epi16(_mm_unpacklo_epi8((V), zero), dlo), \
+                _mm_add_epi16(_mm_unpackhi_epi8((V), zero), dhi))
+            _mm_storeu_si128((__m128i *) (r + i), _ADD_SAT(vr));
+            _mm_storeu_si128((__m128i *) (g + i), _ADD_SAT(vg));
+            _mm_storeu_si128((__m128i *) (b + i), _ADD_SAT(vb));
+#undef _ADD_SAT
+        }
+    }
+#endif                          /* __SSE2__ */
+    for (; i < size; i++) {
+        d = (int) y[i] - (int) LUMA(r[i], g[i], b[i]);
+        r[i] = (unsigned char) MIN(MAX((int) r[i] + d, 0), UCHAR_MAX);
+        g[i] = (unsigned char) MIN(MAX((int) g[i] + d, 0), UCHAR_MAX);
+        b[i] = (unsigned char) MIN(MAX((int) b[i] + d, 0), UCHAR_MAX);
+    }
+    STATS_FREE(y);
+    free(y);
+    STATS_TOGGLE(STATS_APPLY);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("ycbcr\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return rgb;
+}
+
+/**
+ * @brief simplest color balance on the Y luma axis of the YCbCr
+ * color space
+ *
+ * See colorbalance_ycbcr_roi_u8(), with the statistics of the whole image.
+ */
+unsigned char *colorbalance_ycbcr_u8(unsigned char *rgb, size_t size,
+                                     size_t nb_min, size_t nb_max)
+{
+    return colorbalance_ycbcr_roi_u8(rgb, size, NULL, nb_min, nb_max);
+}
+
+/** @brief fixed-point precision of the hsv reciprocal table */
+#define HSV_SHIFT 24
+
+/**
+ * @brief simplest color balance on the V value axis of the HSV
+ * color space
+ *
+ * The input image is normalized by affine transformation on the V
+ * axis, saturating a percentage of the pixels at the beginning and
+ * end of the axis. The H hue and S saturation are preserved, which
+ * amounts to scaling the R, G and B channels by Vnorm / V. The RGB
+ * cube is stable by this operation.
+ *
+ * RGB = Vnorm - (V - RGB) * Vnorm / V is computed with a table of
+ * 1 / V reciprocals in fixed-point, the error is below 1/100 of the
+ * 8bit quantization step.
+ *
+ * The saturated pixels are counted in a region of the image, the
+ * normalization is applied to the whole image.
+ *
+ * @param rgb input/output buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_hsv_roi_u8(unsigned char *rgb, size_t size,
+                                       const balance_roi_t * roi,
+                                       size_t nb_min, size_t nb_max)
+{
+    unsigned char *r, *g, *b;
+    unsigned char *v;           /* value, then normalized value */
+    unsigned long rcp[UCHAR_MAX + 1];   /* 1 / V, Q24 */
+    unsigned long vo, vn;
+    size_t i;
+
+    DBG_CLOCK_START(0);
+
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+
+    /* compute and normalize V */
+    STATS_TOGGLE(STATS_APPLY);
+    v = (unsigned char *) malloc(size * sizeof(unsigned char));
+    STATS_ALLOC(v, size * sizeof(unsigned char));
+    i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16)
+        _mm_storeu_si128((__m128i *) (v + i),
+                         _mm_max_epu8(_mm_loadu_si128((const __m128i *)
+                                                      (r + i)),
+                                      _mm_max_epu8(_mm_loadu_si128
+                                                   ((const __m128i *) (g + i)),
+                                                   _mm_loadu_si128
+                                                   ((const __m128i *)
+                                                    (b + i)))));
+#endif                          /* __SSE2__ */
+    for (; i < size; i++)
+        v[i] = MAX3(r[i], g[i], b[i]);
+    STATS_TOGGLE(STATS_APPLY);
+    balance_roi_u8(v, size, roi, nb_min, nb_max, 0);
+    STATS_TOGGLE(STATS_APPLY);
+
+    /* V = 0 means R = G = B = V, the reciprocal is never used */
+    rcp[0] = 0;
+    for (i = 1; i < UCHAR_MAX + 1; i++)
+        rcp[i] = ((1ul << HSV_SHIFT) + i / 2) / i;
+
     /*
-     * apply the I normalization to the RGB channels:
-     * RGB = RGB * Inorm / I, with a projection towards (0,0,0)
-     * on the RGB cube if needed
+     * apply the V normalization to the RGB channels:
+     * RGB = Vnorm - (V - RGB) * Vnorm / V
+     * (V - RGB) * (1 / V) <= 1 << 24 and Vnorm <= 255, the product
+     * holds in 32bit.
      */
     for (i = 0; i < size; i++) {
-        m = MAX3(rgb[i], rgb[i + size], rgb[i + 2 * size]);
-        s = inorm[i] / irgb[i];
-        /* if m * s > 1, a projection is needed by adjusting s */
-        s = (1. < m * s ? 1. / m : s);
-        rgb[i] *= s;
-        rgb[i + size] *= s;
-        rgb[i + 2 * size] *= s;
+        vo = MAX3(r[i], g[i], b[i]);
+        vn = v[i];
+#define _SCALE(C) (C) = (unsigned char)                                 \
+            (vn - (((vo - (C)) * rcp[vo] * vn                           \
+                    + (1ul << (HSV_SHIFT - 1))) >> HSV_SHIFT))
+        _SCALE(r[i]);
+        _SCALE(g[i]);
+        _SCALE(b[i]);
+#undef _SCALE
     }
-    free(irgb);
-    free(inorm);
+    STATS_FREE(v);
+    free(v);
+    STATS_TOGGLE(STATS_APPLY);
 
     DBG_CLOCK_TOGGLE(0);
-    DBG_PRINTF1("irgb\t%0.2fs\n", DBG_CLOCK_S(0));
+    DBG_PRINTF1("hsv\t%0.2fs\n", DBG_CLOCK_S(0));
 
     return rgb;
 }
+
+/**
+ * @brief simplest color balance on the V value axis of the HSV
+ * color space
+ *
+ * See colorbalance_hsv_roi_u8(), with the statistics of the whole image.
+ */
+unsigned char *colorbalance_hsv_u8(unsigned char *rgb, size_t size,
+                                   size_t nb_min, size_t nb_max)
+{
+    return colorbalance_hsv_roi_u8(rgb, size, NULL, nb_min, nb_max);
+}
+
+/** @brief fixed-point precision of the hsl reciprocal table */
+#define HSL_SHIFT 20
+
+/**
+ * @brief simplest color balance on the L lightness axis of the HSL
+ * color space
+ *
+ * The input image is normalized by affine transformation on the L
+ * axis, saturating a percentage of the pixels at the beginning and
+ * end of the axis. The H hue and S saturation are preserved: with
+ * M = max(R,G,B) + min(R,G,B) = 2L, the chroma C = max - min is
+ * scaled by min(Lnorm, 1 - Lnorm) / min(L, 1 - L). The RGB cube is
+ * stable by this operation.
+ *
+ * In 8bit units, with D = 2 RGB - M, N = 255 - |2 Lnorm - 255| and
+ * K = 255 - |M - 255|, the new value is RGB = Lnorm + D * N / (2 K),
+ * computed with a table of 1 / K reciprocals in fixed-point. |D| <= K
+ * so D / K is within [-1, 1], the error is below 1/50 of the 8bit
+ * quantization step and the result is always within [0, 255].
+ *
+ * The saturated pixels are counted in a region of the image, the
+ * normalization is applied to the whole image.
+ *
+ * @param rgb input/output buffer
+ * @param size size of the R, G and B arrays in the buffer
+ * @param roi statistics region, NULL for the whole image
+ * @param nb_min, nb_max number of pixels of the region to flatten
+ *
+ * @return rgb
+ */
+unsigned char *colorbalance_hsl_roi_u8(unsigned char *rgb, size_t size,
+                                       const balance_roi_t * roi,
+                                       size_t nb_min, size_t nb_max)
+{
+    unsigned char *r, *g, *b;
+    unsigned char *l;           /* lightness, then normalized lightness */
+    long rcp[2 * UCHAR_MAX + 1];        /* 1 / K, Q20 */
+    long m, k, n, rk, ln;
+    size_t i;
+
+    DBG_CLOCK_START(0);
+
+    r = rgb;
+    g = rgb + size;
+    b = rgb + 2 * size;
+
+    /* compute and normalize L */
+    STATS_TOGGLE(STATS_APPLY);
+    l = (unsigned char *) malloc(size * sizeof(unsigned char));
+    STATS_ALLOC(l, size * sizeof(unsigned char));
+    i = 0;
+#ifdef __SSE2__
+    {
+        __m128i vr, vg, vb;
+
+        for (; i + 16 <= size; i += 16) {
+            vr = _mm_loadu_si128((const __m128i *) (r + i));
+            vg = _mm_loadu_si128((const __m128i *) (g + i));
+            vb = _mm_loadu_si128((const __m128i *) (b + i));
+            /* pavgb is (a + b + 1) >> 1 */
+            _mm_storeu_si128((__m128i *) (l + i),
+                             _mm_avg_epu8(_mm_max_epu8(vr,
+                                                       _mm_max_epu8(vg, vb)),
+                                          _mm_min_epu8(vr,
+                                                       _mm_min_epu8(vg,
+                                                                    vb))));
+        }
+    }
+#endif                          /* __SSE2__ */
+    for (; i < size; i++)
+        l[i] = (unsigned char) ((MAX3(r[i], g[i], b[i])
+                                 + MIN3(r[i], g[i], b[i]) + 1) >> 1);
+    STATS_TOGGLE(STATS_APPLY);
+    balance_roi_u8(l, size, roi, nb_min, nb_max, 0);
+    STATS_TOGGLE(STATS_APPLY);
+
+    /* K = 0 means R = G = B, D = 0 and the reciprocal is never used */
+    rcp[0] = 0;
+    rcp[2 * UCHAR_MAX] = 0;
+    for (i = 1; i < 2 * UCHAR_MAX; i++) {
+        k = UCHAR_MAX - labs((long) i - UCHAR_MAX);
+        rcp[i] = ((1l << HSL_SHIFT) + k / 2) / k;
+    }
+
+    /*
+     * apply the L normalization to the RGB channels:
+     * RGB = (2 Lnorm + D * N / K) / 2
+     * |D * (1 / K)| <= 1 << 20 and N <= 255, the products hold in
+     * 32bit and the rounded sum is never negative.
+     */
+    for (i = 0; i < size; i++) {
+        m = (long) MAX3(r[i], g[i], b[i]) + (long) MIN3(r[i], g[i], b[i]);
+        rk = rcp[m];
+        ln = l[i];
+        n = UCHAR_MAX - labs(2 * ln - UCHAR_MAX);
+#define _SCALE(C) (C) = (unsigned char)                                 \
+            (((ln << (HSL_SHIFT + 1)) + (2 * (long) (C) - m) * rk * n   \
+              + (1l << HSL_SHIFT)) >> (HSL_SHIFT + 1))
+        _SCALE(r[i]);
+        _SCALE(g[i]);
+        _SCALE(b[i]);
+#undef _SCALE
+    }
+    STATS_FREE(l);
+    free(l);
+    STATS_TOGGLE(STATS_APPLY);
+
+    DBG_CLOCK_TOGGLE(0);
+    DBG_PRINTF1("hsl\t%0.2fs\n", DBG_CLOCK_S(0));
+
+    return rgb;
+}
+
+/**
+ * @brief simplest color balance on the L lightness axis of the HSL
+ * color space
+ *
+ * See colorbalance_hsl_roi_u8(), with the statistics of the whole image.
+ */
+unsigned char *colorbalance_hsl_u8(unsigned char *rgb, size_t size,
+                                   size_t nb_min, size_t nb_max)
+{
+    return colorbalance_hsl_roi_u8(rgb, size, NULL, nb_min, nb_max);
+}
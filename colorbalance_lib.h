@@ -1,3 +1,42 @@
+/** @brief irgb output rows, see colorbalance_irgb_fill_u8() */
+typedef struct colorbalance_irgb_out_s {
+    const float *const *ch;     /* R, G and B planes */
+    size_t nx, stride;          /* number of columns, plane row stride */
+    float min, max;             /* normalization bounds */
+} colorbalance_irgb_out_t;
+
+/** @brief irgb output rows, see colorbalance_irgb_fill_from_u8() */
+typedef struct colorbalance_irgb_out_u8_s {
+    const unsigned char *const *ch;     /* R, G and B planes */
+    const unsigned char *alpha; /* alpha plane for RGBA rows, or NULL */
+    size_t nx, stride;          /* number of columns, plane row stride */
+    float min, max;             /* normalization bounds */
+} colorbalance_irgb_out_u8_t;
+
 /* colorbalance_lib.c */
+unsigned char *colorbalance_rgb_roi_u8(unsigned char *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max);
 unsigned char *colorbalance_rgb_u8(unsigned char *rgb, size_t size, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_rgb_histo_u8(unsigned char *rgb, size_t size, const size_t *histo, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_rgb_local_u8(unsigned char *rgb, size_t nx, size_t ny, size_t gx, size_t gy, float smin, float smax, size_t nb_workers);
+unsigned char *colorbalance_rgb_pal_u8(unsigned char *pal, size_t size, const size_t *count, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_rgb24_u8(unsigned char *rgb, size_t size, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_gray_roi_u8(unsigned char *gray, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_gray_u8(unsigned char *gray, size_t size, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_gray_histo_u8(unsigned char *gray, size_t size, const size_t *histo, size_t nb_min, size_t nb_max);
+void colorbalance_irgb_bounds_f32(const float *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max, float *ptr_min, float *ptr_max);
+void colorbalance_irgb_histo_u8(const unsigned char *rgb, size_t size, size_t *histo);
+void colorbalance_irgb_histo_f32(const float *rgb, size_t size, size_t *histo);
+void colorbalance_irgb_bounds_histo(const size_t *histo, size_t nb_min, size_t nb_max, float *ptr_min, float *ptr_max);
+void colorbalance_irgb_bounds_u8(const unsigned char *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max, float *ptr_min, float *ptr_max);
+void colorbalance_irgb_row_u8(unsigned char *row, const float *r, const float *g, const float *b, size_t n, float min, float max);
+void colorbalance_irgb_fill_u8(unsigned char *row, size_t y, void *ctx);
+void colorbalance_irgb_row_from_u8(unsigned char *row, const unsigned char *r, const unsigned char *g, const unsigned char *b, size_t n, float min, float max);
+void colorbalance_irgb_fill_from_u8(unsigned char *row, size_t y, void *ctx);
+float *colorbalance_irgb_roi_f32(float *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max);
 float *colorbalance_irgb_f32(float *rgb, size_t size, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_ycbcr_roi_u8(unsigned char *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_ycbcr_u8(unsigned char *rgb, size_t size, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_hsv_roi_u8(unsigned char *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_hsv_u8(unsigned char *rgb, size_t size, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_hsl_roi_u8(unsigned char *rgb, size_t size, const balance_roi_t *roi, size_t nb_min, size_t nb_max);
+unsigned char *colorbalance_hsl_u8(unsigned char *rgb, size_t size, size_t nb_min, size_t nb_max);
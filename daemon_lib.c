@@ -0,0 +1,225 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file daemon_lib.c
+ * @brief balanced protocol and latency counters
+ *
+ * Framing helpers shared by the balanced daemon and its client, see
+ * daemon_lib.h for the protocol, and the latency histograms used for
+ * the p50/p99 counters.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* ensure consistency */
+#include "daemon_lib.h"
+
+/**
+ * @brief read exactly len bytes from a file descriptor
+ *
+ * @return 0 on success, -1 on error or end of file
+ */
+int daemon_read_full(int fd, void *buf, size_t len)
+{
+    char *ptr = (char *) buf;
+    ssize_t n;
+
+    while (0 < len) {
+        n = read(fd, ptr, len);
+        if (0 > n && EINTR == errno)
+            continue;
+        if (0 >= n)
+            return -1;
+        ptr += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * @brief write exactly len bytes to a file descriptor
+ *
+ * @return 0 on success, -1 on error
+ */
+int daemon_write_full(int fd, const void *buf, size_t len)
+{
+    const char *ptr = (const char *) buf;
+    ssize_t n;
+
+    while (0 < len) {
+        n = write(fd, ptr, len);
+        if (0 > n && EINTR == errno)
+            continue;
+        if (0 >= n)
+            return -1;
+        ptr += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * @brief read a header line from a file descriptor
+ *
+ * The line is read byte per byte, so nothing after the newline is
+ * consumed. The newline is replaced by a null character.
+ *
+ * @param fd file descriptor
+ * @param line output buffer
+ * @param size output buffer size
+ * @return 0 on success, -1 on error, end of file or too long line
+ */
+int daemon_read_line(int fd, char *line, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (0 != daemon_read_full(fd, line + i, 1))
+            return -1;
+        if ('\n' == line[i]) {
+            line[i] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief send a reply, "OK" or "ERROR" header and data
+ *
+ * @return 0 on success, -1 on error
+ */
+int daemon_send_reply(int fd, int ok, const void *buf, size_t len)
+{
+    char line[DAEMON_LINE_MAX];
+
+    sprintf(line, "%s %lu\n", (ok ? "OK" : "ERROR"), (unsigned long) len);
+    if (0 != daemon_write_full(fd, line, strlen(line)))
+        return -1;
+    return daemon_write_full(fd, buf, len);
+}
+
+/**
+ * @brief connect to a Unix domain socket
+ *
+ * @return the socket file descriptor, -1 on error
+ */
+int daemon_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+        return -1;
+    if (0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        (void) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief latency histogram bin of a duration
+ *
+ * The bins are exact below 8us, then each power of 2 is split in 8
+ * bins, so the relative resolution is 1/8. Durations above 2^31us
+ * are in the last bins.
+ *
+ * @param us duration, in microseconds
+ * @return bin index
+ */
+size_t daemon_lat_bin(unsigned long us)
+{
+    size_t h, bin;
+
+    if (8 > us)
+        return (size_t) us;
+    /* h is the index of the highest bit set, at least 3 */
+    h = 3;
+    while (h < 8 * sizeof(unsigned long) - 1 && 0 != (us >> (h + 1)))
+        h++;
+    bin = (h - 2) * 8 + (size_t) ((us >> (h - 3)) & 7);
+    return (bin < DAEMON_LAT_BINS ? bin : DAEMON_LAT_BINS - 1);
+}
+
+/**
+ * @brief upper value of a latency histogram bin
+ *
+ * @param bin bin index
+ * @return largest duration in this bin, in microseconds
+ */
+unsigned long daemon_lat_value(size_t bin)
+{
+    size_t h;
+
+    if (8 > bin)
+        return (unsigned long) bin;
+    h = bin / 8 + 2;
+    return ((8ul + bin % 8 + 1) << (h - 3)) - 1;
+}
+
+/**
+ * @brief quantile of a latency histogram
+ *
+ * @param lat histogram, DAEMON_LAT_BINS cells
+ * @param q quantile, in [0,1]
+ * @return the upper value of the bin of this quantile, 0 if the
+ *         histogram is empty
+ */
+unsigned long daemon_lat_quantile(const unsigned long *lat, double q)
+{
+    unsigned long total, rank, cumul;
+    size_t bin;
+
+    total = 0;
+    for (bin = 0; bin < DAEMON_LAT_BINS; bin++)
+        total += lat[bin];
+    if (0 == total)
+        return 0;
+
+    /* rank of the quantile, in [1,total] */
+    rank = (unsigned long) (q * total + .5);
+    if (1 > rank)
+        rank = 1;
+    if (total < rank)
+        rank = total;
+    cumul = 0;
+    for (bin = 0; bin < DAEMON_LAT_BINS; bin++) {
+        cumul += lat[bin];
+        if (cumul >= rank)
+            break;
+    }
+    return daemon_lat_value(bin);
+}
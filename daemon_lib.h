@@ -0,0 +1,42 @@
+#ifndef _DAEMON_LIB_H
+#define _DAEMON_LIB_H
+
+#include <stddef.h>
+
+/*
+ * balanced protocol, one request per connection
+ *
+ * request:
+ *   "BALANCE <mode> <Smin> <Smax> png <len>\n" + <len> bytes of PNG data
+ *   "BALANCE <mode> <Smin> <Smax> path <len>\n" + <len> bytes of file path
+ *   "STATS\n"
+ * reply:
+ *   "OK <len>\n" + <len> bytes of PNG data or statistics text
+ *   "ERROR <len>\n" + <len> bytes of error message
+ */
+
+/** @brief maximum length of a request or reply header line */
+#define DAEMON_LINE_MAX 256
+/** @brief maximum length of the request data */
+#define DAEMON_DATA_MAX (1ul << 30)
+/** @brief number of bins of the latency histograms */
+#define DAEMON_LAT_BINS 256
+
+/** @brief request counters, updated by one worker */
+typedef struct daemon_stats_s {
+    unsigned long nb_req;       /* served requests */
+    unsigned long nb_err;       /* rejected requests and worker failures */
+    unsigned long lat[DAEMON_LAT_BINS]; /* latency histogram */
+} daemon_stats_t;
+
+/* daemon_lib.c */
+int daemon_read_full(int fd, void *buf, size_t len);
+int daemon_write_full(int fd, const void *buf, size_t len);
+int daemon_read_line(int fd, char *line, size_t size);
+int daemon_send_reply(int fd, int ok, const void *buf, size_t len);
+int daemon_connect(const char *path);
+size_t daemon_lat_bin(unsigned long us);
+unsigned long daemon_lat_value(size_t bin);
+unsigned long daemon_lat_quantile(const unsigned long *lat, double q);
+
+#endif /* !_DAEMON_LIB_H */
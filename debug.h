@@ -249,11 +249,12 @@ static clock_t _dbg_clock_counter[DBG_CLOCK_NB];
 #if (defined(__amd64__) || defined(__amd64) || defined(_M_X64))
 /* from http://predef.sourceforge.net/prearch.html#sec3 */
 
-/** CPU cycles counter for x86 */
+/** CPU cycles counter for amd64 */
 static _LL _dbg_cpucycles(void)
 {
-    _LL result;
-    __asm__ volatile (".byte 15;.byte 49":"=A" (result));
+    unsigned _LL result;
+    __asm__ volatile (".byte 15;.byte 49;shlq $32,%%rdx;orq %%rdx,%%rax":"=a"
+                      (result)::"%rdx");
     return result;
 }
 
@@ -261,12 +262,11 @@ static _LL _dbg_cpucycles(void)
        || defined(__X86__) || defined(_X86_) || defined(__I86__))
 /* from http://predef.sourceforge.net/prearch.html#sec6 */
 
-/** CPU cycles counter for amd64 */
+/** CPU cycles counter for x86 */
 static _LL _dbg_cpucycles(void)
 {
-    unsigned _LL result;
-    __asm__ volatile (".byte 15;.byte 49;shlq $32,%%rdx;orq %%rdx,%%rax":"=a"
-                      (result)::"%rdx");
+    _LL result;
+    __asm__ volatile (".byte 15;.byte 49":"=A" (result));
     return result;
 }
 
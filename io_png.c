@@ -20,6 +20,12 @@
  * This is a front-end to libpng, with routines to:
  * @li read a PNG file into a de-interlaced unsigned char or float array
  * @li write an unsigned char or float array to a PNG file
+ * @li probe the size of a PNG image, then read it into or write it
+ *     from caller-provided planes, row by row, without full-image
+ *     temporary buffers
+ * @li read and write a palette image as indexes and palette
+ * @li split an animated PNG image in standalone PNG frames, and
+ *     splice them back
  *
  * Multi-channel images are handled: gray, gray+alpha, rgb and
  * rgb+alpha, as well as on-the-fly rgb/gray conversion.
@@ -38,6 +44,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 #include <assert.h>
 
 /* option to use a local version of the libpng */
@@ -62,6 +69,8 @@
 #include <fcntl.h>
 #endif
 
+#include "stats_lib.h"
+
 /* ensure consistency */
 #include "io_png.h"
 
@@ -95,6 +104,7 @@ static void *_io_png_safe_malloc(size_t size)
 
     if (NULL == (memptr = malloc(size)))
         _IO_PNG_ABORT("not enough memory");
+    STATS_ALLOC(memptr, size);
     return memptr;
 }
 
@@ -107,8 +117,10 @@ static void *_io_png_safe_realloc(void *memptr, size_t size)
 {
     void *newptr;
 
+    STATS_FREE(memptr);
     if (NULL == (newptr = realloc(memptr, size)))
         _IO_PNG_ABORT("not enough memory");
+    STATS_ALLOC(newptr, size);
     return newptr;
 }
 
@@ -116,6 +128,14 @@ static void *_io_png_safe_realloc(void *memptr, size_t size)
 #define _IO_PNG_SAFE_REALLOC(PTR, NB, TYPE)                             \
     ((TYPE *) _io_png_safe_realloc((void *) (PTR), (size_t) (NB) * sizeof(TYPE)))
 
+/** @brief free wrapper, for the memory accounting */
+static void _io_png_free(void *memptr)
+{
+    STATS_FREE(memptr);
+    free(memptr);
+    return;
+}
+
 /**
  * @brief local error structure
  * see http://www.libpng.org/pub/png/book/chapter14.htmlpointer
@@ -142,6 +162,188 @@ static void _io_png_err_hdl(png_structp png_ptr, png_const_charp msg)
     longjmp(err_ptr->jmpbuf, 1);
 }
 
+/*
+ * STREAMS
+ */
+
+/** @brief length of the PNG signature and IHDR chunk, read by io_png_probe() */
+#define _IO_PNG_HEAD_LEN 33
+/** @brief maximum length of the chunks before the palette image data */
+#define _IO_PNG_HEAD_MAX (1 << 20)
+
+/**
+ * @brief header bytes read from stdin by io_png_probe()
+ *
+ * stdin can't be rewound, so these bytes are replayed by the next read
+ * from stdin.
+ */
+static png_byte _io_png_stdin_head[_IO_PNG_HEAD_LEN];
+/** @brief position of the next header byte to replay from stdin */
+static size_t _io_png_stdin_head_pos = _IO_PNG_HEAD_LEN;
+/**
+ * @brief chunks read from stdin after the header of a palette image
+ *
+ * They are replayed after the header bytes, and freed once replayed.
+ */
+static png_byte *_io_png_stdin_more = NULL;
+/** @brief number of chunk bytes to replay from stdin */
+static size_t _io_png_stdin_more_len = 0;
+/** @brief position of the next chunk byte to replay from stdin */
+static size_t _io_png_stdin_more_pos = 0;
+
+/**
+ * @brief fread() wrapper, replaying the header bytes read from stdin
+ *
+ * @param buf output buffer
+ * @param len number of bytes to read
+ * @param fp input stream
+ * @return number of bytes read
+ */
+static size_t _io_png_fread(png_byte * buf, size_t len, FILE * fp)
+{
+    size_t n = 0;
+
+    if (stdin == fp) {
+        while (n < len && _io_png_stdin_head_pos < _IO_PNG_HEAD_LEN)
+            buf[n++] = _io_png_stdin_head[_io_png_stdin_head_pos++];
+        while (n < len && _io_png_stdin_more_pos < _io_png_stdin_more_len)
+            buf[n++] = _io_png_stdin_more[_io_png_stdin_more_pos++];
+        if (NULL != _io_png_stdin_more
+            && _io_png_stdin_more_pos == _io_png_stdin_more_len) {
+            _io_png_free(_io_png_stdin_more);
+            _io_png_stdin_more = NULL;
+            _io_png_stdin_more_len = 0;
+            _io_png_stdin_more_pos = 0;
+        }
+    }
+    if (n < len)
+        n += fread(buf + n, 1, len - n, fp);
+    return n;
+}
+
+/** @brief libpng read callback, via _io_png_fread() */
+static void _io_png_read_fn(png_structp png_ptr, png_bytep data,
+                            png_size_t length)
+{
+    FILE *fp;
+
+    fp = (FILE *) png_get_io_ptr(png_ptr);
+    if ((size_t) length != _io_png_fread(data, (size_t) length, fp))
+        png_error(png_ptr, "read error");
+    STATS_ADD(bytes_read, (unsigned long) length);
+    return;
+}
+
+/** @brief libpng write callback, to a standard C stream */
+static void _io_png_write_fn(png_structp png_ptr, png_bytep data,
+                             png_size_t length)
+{
+    FILE *fp;
+
+    fp = (FILE *) png_get_io_ptr(png_ptr);
+    if ((size_t) length != fwrite(data, 1, (size_t) length, fp))
+        png_error(png_ptr, "write error");
+    STATS_ADD(bytes_written, (unsigned long) length);
+    return;
+}
+
+/** @brief libpng flush callback, to a standard C stream */
+static void _io_png_flush_fn(png_structp png_ptr)
+{
+    (void) fflush((FILE *) png_get_io_ptr(png_ptr));
+    return;
+}
+
+/**
+ * @brief open a PNG file to read, "-" means stdin
+ */
+static FILE *_io_png_open_read(const char *fname)
+{
+    FILE *fp;
+
+    if (0 == strcmp(fname, "-")) {
+        fp = stdin;
+#ifdef WIN32                    /* set the stream to binary mode */
+        fflush(fp);
+        setmode(fileno(fp), O_BINARY);
+#endif
+    }
+    else {
+        if (NULL == (fp = fopen(fname, "rb")))
+            _IO_PNG_ABORT("failed to open file");
+    }
+    return fp;
+}
+
+/**
+ * @brief open a PNG file to write, "-" means stdout
+ */
+static FILE *_io_png_open_write(const char *fname)
+{
+    FILE *fp;
+
+    if (0 == strcmp(fname, "-")) {
+        fp = stdout;
+#ifdef WIN32                    /* set the stream to binary mode */
+        fflush(fp);
+        setmode(fileno(fp), O_BINARY);
+#endif
+    }
+    else {
+        if (NULL == (fp = fopen(fname, "wb")))
+            _IO_PNG_ABORT("failed to open file");
+    }
+    return fp;
+}
+
+/** @brief memory buffer used as a PNG stream */
+typedef struct _io_png_mem_s {
+    png_byte *buf;              /* data */
+    size_t len;                 /* data length */
+    size_t pos;                 /* read position */
+    size_t size;                /* allocated size, for writing */
+} _io_png_mem_t;
+
+/** @brief libpng read callback, from a memory buffer */
+static void _io_png_mem_read_fn(png_structp png_ptr, png_bytep data,
+                                png_size_t length)
+{
+    _io_png_mem_t *mem;
+
+    mem = (_io_png_mem_t *) png_get_io_ptr(png_ptr);
+    if ((size_t) length > mem->len - mem->pos)
+        png_error(png_ptr, "read error");
+    memcpy(data, mem->buf + mem->pos, (size_t) length);
+    mem->pos += (size_t) length;
+    STATS_ADD(bytes_read, (unsigned long) length);
+    return;
+}
+
+/** @brief libpng write callback, into a growing memory buffer */
+static void _io_png_mem_write_fn(png_structp png_ptr, png_bytep data,
+                                 png_size_t length)
+{
+    _io_png_mem_t *mem;
+
+    mem = (_io_png_mem_t *) png_get_io_ptr(png_ptr);
+    if ((size_t) length > mem->size - mem->len) {
+        /* at least double the buffer, to limit the reallocations */
+        mem->size = 2 * mem->size + (size_t) length;
+        mem->buf = _IO_PNG_SAFE_REALLOC(mem->buf, mem->size, png_byte);
+    }
+    memcpy(mem->buf + mem->len, data, (size_t) length);
+    mem->len += (size_t) length;
+    STATS_ADD(bytes_written, (unsigned long) length);
+    return;
+}
+
+/** @brief libpng flush callback, nothing to do in memory */
+static void _io_png_mem_flush_fn(png_structp png_ptr)
+{
+    (void) png_ptr;
+    return;
+}
+
 /*
  * TYPE AND IMAGE FORMAT CONVERSION
  */
@@ -361,6 +563,29 @@ static float *_io_png_rgb2gray(float *data, size_t size)
 
 #define PNG_SIG_LEN 4
 
+/**
+ * @brief set the integrity checks of a read
+ *
+ * The default profile checks the CRC of every chunk and the Adler-32
+ * checksum of the compressed data. With IO_PNG_OPT_TRUSTED, for the
+ * files written by a trusted program, these checksums are neither
+ * computed nor checked; a corrupted file gives wrong pixels instead
+ * of an error, but can not cause an invalid memory access.
+ *
+ * @param png_ptr libpng read structure
+ * @param opt read options
+ */
+static void _io_png_read_profile(png_structp png_ptr, io_png_opt_t opt)
+{
+    if (!(opt & IO_PNG_OPT_TRUSTED))
+        return;
+    png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#if defined(PNG_IGNORE_ADLER32) && defined(PNG_SET_OPTION_SUPPORTED)
+    (void) png_set_option(png_ptr, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+    return;
+}
+
 /**
  * @brief internal function used to read a PNG file into an array
  *
@@ -368,7 +593,7 @@ static float *_io_png_rgb2gray(float *data, size_t size)
  * @param nxp, nyp, ncp pointers to variables to be filled
  *        with the number of columns, lines and channels of the image
  * @param opt post-processing option, can be IO_PNG_OPT_RGB or IO_PNG_OPT_GRAY,
- *         IO_PNG_OPT_NONE to do nothing
+ *         IO_PNG_OPT_NONE to do nothing, and IO_PNG_OPT_TRUSTED
  * @return pointer to an array of float pixels, abort() on error
  *
  * @todo don't loose 16bit info
@@ -397,20 +622,10 @@ static float *_io_png_read(const char *fname,
     assert(NULL != fname && NULL != nxp && NULL != nyp && NULL != ncp);
 
     /* open the PNG input file */
-    if (0 == strcmp(fname, "-")) {
-        fp = stdin;
-#ifdef WIN32                    /* set the stream to binary mode */
-        fflush(fp);
-        setmode(fileno(fp), O_BINARY);
-#endif
-    }
-    else {
-        if (NULL == (fp = fopen(fname, "rb")))
-            _IO_PNG_ABORT("failed to open file");
-    }
+    fp = _io_png_open_read(fname);
 
     /* read in some of the signature bytes and check this signature */
-    if ((PNG_SIG_LEN != fread(png_sig, 1, PNG_SIG_LEN, fp))
+    if ((PNG_SIG_LEN != _io_png_fread(png_sig, PNG_SIG_LEN, fp))
         || 0 != png_sig_cmp(png_sig, (png_size_t) 0, PNG_SIG_LEN))
         _IO_PNG_ABORT("the file is not a PNG image");
 
@@ -430,10 +645,11 @@ static float *_io_png_read(const char *fname,
         _IO_PNG_ABORT("libpng reading error");
 
     /* set up the input control using standard C streams */
-    png_init_io(png_ptr, fp);
+    png_set_read_fn(png_ptr, (png_voidp) fp, &_io_png_read_fn);
 
     /* let libpng know that some bytes have been read */
     png_set_sig_bytes(png_ptr, PNG_SIG_LEN);
+    _io_png_read_profile(png_ptr, opt);
 
     /*
      * set the read filter transforms, to get 8bit RGB whatever the
@@ -447,24 +663,49 @@ static float *_io_png_read(const char *fname,
     png_transform = (PNG_TRANSFORM_IDENTITY
                      | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_STRIP_16);
 
-    /*
-     * read in the entire image at once
-     * then collect the image informations
-     */
-    png_read_png(png_ptr, info_ptr, png_transform, NULL);
-    nx = (size_t) png_get_image_width(png_ptr, info_ptr);
-    ny = (size_t) png_get_image_height(png_ptr, info_ptr);
-    nc = (size_t) png_get_channels(png_ptr, info_ptr);
-    size = nx * ny * nc;
-    row_pointers = png_get_rows(png_ptr, info_ptr);
-    rowbytes = (size_t) png_get_rowbytes(png_ptr, info_ptr);
-
-    /* dump the rows in a continuous array */
-    /* todo: first check if the data is continuous via row_pointers */
-    png_data = _IO_PNG_SAFE_MALLOC(size, png_byte);
-    for (i = 0; i < ny; i++)
-        memcpy((void *) (png_data + i * rowbytes),
-               (void *) row_pointers[i], rowbytes * sizeof(png_byte));
+    if (opt & IO_PNG_OPT_TRUSTED) {
+        /*
+         * same transforms, but the rows are decoded in place in the
+         * continuous array, without the libpng row buffers
+         */
+        png_read_info(png_ptr, info_ptr);
+        png_set_packing(png_ptr);
+        png_set_strip_16(png_ptr);
+        (void) png_set_interlace_handling(png_ptr);
+        png_read_update_info(png_ptr, info_ptr);
+        nx = (size_t) png_get_image_width(png_ptr, info_ptr);
+        ny = (size_t) png_get_image_height(png_ptr, info_ptr);
+        nc = (size_t) png_get_channels(png_ptr, info_ptr);
+        size = nx * ny * nc;
+        rowbytes = (size_t) png_get_rowbytes(png_ptr, info_ptr);
+        png_data = _IO_PNG_SAFE_MALLOC(size, png_byte);
+        row_pointers = _IO_PNG_SAFE_MALLOC(ny, png_bytep);
+        for (i = 0; i < ny; i++)
+            row_pointers[i] = png_data + i * rowbytes;
+        png_read_image(png_ptr, row_pointers);
+        png_read_end(png_ptr, NULL);
+        _io_png_free(row_pointers);
+    }
+    else {
+        /*
+         * read in the entire image at once
+         * then collect the image informations
+         */
+        png_read_png(png_ptr, info_ptr, png_transform, NULL);
+        nx = (size_t) png_get_image_width(png_ptr, info_ptr);
+        ny = (size_t) png_get_image_height(png_ptr, info_ptr);
+        nc = (size_t) png_get_channels(png_ptr, info_ptr);
+        size = nx * ny * nc;
+        row_pointers = png_get_rows(png_ptr, info_ptr);
+        rowbytes = (size_t) png_get_rowbytes(png_ptr, info_ptr);
+
+        /* dump the rows in a continuous array */
+        /* todo: first check if the data is continuous via row_pointers */
+        png_data = _IO_PNG_SAFE_MALLOC(size, png_byte);
+        for (i = 0; i < ny; i++)
+            memcpy((void *) (png_data + i * rowbytes),
+                   (void *) row_pointers[i], rowbytes * sizeof(png_byte));
+    }
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
     if (stdin != fp)
@@ -473,13 +714,13 @@ static float *_io_png_read(const char *fname,
     /* convert to float */
     /* todo: at the row step */
     tmp = _io_png_byte2flt(png_data, nx * ny * nc);
-    free(png_data);
+    _io_png_free(png_data);
     /* deinterlace RGBA RGBA RGBA to RRR GGG BBB AAA */
     data = _io_png_inter(tmp, nx * ny, nc, DEINTERLACE);
-    free(tmp);
+    _io_png_free(tmp);
 
     /* post-processing */
-    switch (opt) {
+    switch (opt & ~IO_PNG_OPT_TRUSTED) {
     case IO_PNG_OPT_RGB:
         if (4 == nc || 2 == nc) {
             /* strip alpha channel ... */
@@ -591,7 +832,7 @@ unsigned char *io_png_read_uchar_opt(const char *fname,
 
     flt_data = _io_png_read(fname, &nx, &ny, &nc, opt);
     data = _io_png_flt2uchar(flt_data, nx * ny * nc);
-    free(flt_data);
+    _io_png_free(flt_data);
 
     if (NULL != nxp)
         *nxp = nx;
@@ -639,7 +880,7 @@ unsigned short *io_png_read_ushrt_opt(const char *fname,
 
     flt_data = _io_png_read(fname, &nx, &ny, &nc, opt);
     data = _io_png_flt2ushrt(flt_data, nx * ny * nc);
-    free(flt_data);
+    _io_png_free(flt_data);
 
     if (NULL != nxp)
         *nxp = nx;
@@ -668,253 +909,1960 @@ unsigned short *io_png_read_ushrt(const char *fname,
 }
 
 /*
- * WRITE
+ * READ INTO CALLER BUFFERS
  */
 
 /**
- * @brief internal function used to write a byte array as a PNG file
+ * @brief internal function used to read a PNG stream row by row
  *
- * The PNG file is written as a 8bit image file, interlaced,
- * truecolor. Depending on the number of channels, the color model is
- * gray, gray+alpha, rgb, rgb+alpha.
- *
- * @param fname PNG file name, "-" means stdout
- * @param data non interlaced (RRRGGGBBBAAA) float image array
- * @param nx, ny, nc number of columns, lines and channels
- * @param opt processing option, can be IO_PNG_OPT_ADAM7,
- *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
- *         IO_PNG_OPT_NONE to do nothing
- * @return void, abort() on error
+ * See io_png_read_rows() and io_png_read_rows_passes().
  *
- * @todo handle 16bit
+ * @param io_ptr stream, passed to read_fn
+ * @param read_fn libpng read callback
+ * @param opt read option, IO_PNG_OPT_TRUSTED or IO_PNG_OPT_NONE
+ * @param max_passes number of Adam7 passes to read, 0 for all
+ * @param head_fn header callback
+ * @param row_fn row callback
+ * @param ctx caller context, passed to the callbacks
+ * @return the number of passes of the image, abort() on error
  */
-static void _io_png_write(const char *fname, const float *data,
-                          size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+static int _io_png_read_rows_io(png_voidp io_ptr, png_rw_ptr read_fn,
+                                io_png_opt_t opt, int max_passes,
+                                io_png_head_fn head_fn,
+                                io_png_row_fn row_fn, void *ctx)
 {
     png_structp png_ptr;
     png_infop info_ptr;
-    png_bytep *row_pointers;
-    png_byte *png_data;
-    png_byte bit_depth;
-    float *tmp;
-    /* volatile: because of setjmp/longjmp */
-    FILE *volatile fp;
-    int color_type, interlace, compression, compression_level, filter;
-    size_t i;
-    /* error structure */
+    png_byte *row;
+    size_t nx, ny, nc, y;
+    int color_type, bit_depth, passes, pass;
+    /* local error structure */
     _io_png_err_t err;
 
-    assert(NULL != fname && NULL != data && 0 < nx && 0 < ny && 0 < nc);
-
-    /* interlace RRR GGG BBB AAA to RGBA RGBA RGBA */
-    tmp = _io_png_inter(data, nx * ny, nc, INTERLACE);
-    /* convert to png_byte */
-    png_data = _io_png_flt2byte(tmp, nx * ny * nc);
-    free(tmp);
-
-    /* open the PNG output file */
-    if (0 == strcmp(fname, "-")) {
-        fp = stdout;
-#ifdef WIN32                    /* set the stream to binary mode */
-        fflush(fp);
-        setmode(fileno(fp), O_BINARY);
-#endif
-    }
-    else {
-        if (NULL == (fp = fopen(fname, "wb")))
-            _IO_PNG_ABORT("failed to open file");
-    }
-    /* allocate the row pointers */
-    row_pointers = _IO_PNG_SAFE_MALLOC(ny, png_bytep);
-
     /*
      * create and initialize the png_struct and png_info structures
      * with local error handling
      */
-    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                                   &err, &_io_png_err_hdl,
-                                                   NULL)))
+    if (NULL == (png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                  &err, &_io_png_err_hdl,
+                                                  NULL)))
         _IO_PNG_ABORT("libpng initialization error");
     if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
         _IO_PNG_ABORT("libpng initialization error");
 
-    /* if we get here, we had a problem writing to the file */
-    if (0 != setjmp(err.jmpbuf))
-        _IO_PNG_ABORT("libpng writing error");
+    /* if we get here, we had a problem reading from the file */
+    if (setjmp(err.jmpbuf))
+        _IO_PNG_ABORT("libpng reading error");
 
-    /* set up the input control using standard C streams */
-    png_init_io(png_ptr, fp);
+    /* set up the input control */
+    png_set_read_fn(png_ptr, io_ptr, read_fn);
+    _io_png_read_profile(png_ptr, opt);
+
+    /* read the header, set the transforms to get 8bit samples */
+    STATS_TOGGLE(STATS_READ);
+    png_read_info(png_ptr, info_ptr);
+    color_type = png_get_color_type(png_ptr, info_ptr);
+    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    if (PNG_COLOR_TYPE_PALETTE == color_type)
+        png_set_palette_to_rgb(png_ptr);
+    if (PNG_COLOR_TYPE_GRAY == color_type && 8 > bit_depth)
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+    if (16 == bit_depth)
+        png_set_strip_16(png_ptr);
+    passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
 
-    /* set image informations */
-    bit_depth = 8;
-    switch (nc) {
-    case 1:
-        color_type = PNG_COLOR_TYPE_GRAY;
-        break;
-    case 2:
-        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-        break;
-    case 3:
-        color_type = PNG_COLOR_TYPE_RGB;
-        break;
-    case 4:
-        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-        break;
-    default:
-        _IO_PNG_ABORT("bad parameters");
+    nx = (size_t) png_get_image_width(png_ptr, info_ptr);
+    ny = (size_t) png_get_image_height(png_ptr, info_ptr);
+    nc = (size_t) png_get_channels(png_ptr, info_ptr);
+    row = _IO_PNG_SAFE_MALLOC(png_get_rowbytes(png_ptr, info_ptr), png_byte);
+    STATS_TOGGLE(STATS_READ);
+    head_fn(nx, ny, nc, ctx);
+
+    /* read the rows, the callbacks are not timed as decoding */
+    if (1 == passes) {
+        for (y = 0; y < ny; y++) {
+            STATS_TOGGLE(STATS_READ);
+            png_read_row(png_ptr, row, NULL);
+            STATS_TOGGLE(STATS_READ);
+            row_fn(row, y, 0, 1, ctx);
+        }
+    }
+    else {
+        /*
+         * Adam7: each pass only sets its own pixels of its own rows
+         * in the row buffer, the other rows are still read
+         */
+        for (pass = 0; pass < passes; pass++) {
+            if (0 < max_passes && max_passes <= pass)
+                break;
+            for (y = 0; y < ny; y++) {
+                STATS_TOGGLE(STATS_READ);
+                png_read_row(png_ptr, NULL, row);
+                STATS_TOGGLE(STATS_READ);
+                if (PNG_ROW_IN_INTERLACE_PASS(y, pass)
+                    && (size_t) PNG_PASS_START_COL(pass) < nx)
+                    row_fn(row, y, (size_t) PNG_PASS_START_COL(pass),
+                           (size_t) PNG_PASS_COL_OFFSET(pass), ctx);
+            }
+        }
+    }
+    /* the end of an image partially read is not checked */
+    if (1 == passes || pass == passes) {
+        STATS_TOGGLE(STATS_READ);
+        png_read_end(png_ptr, NULL);
+        STATS_TOGGLE(STATS_READ);
     }
 
-    compression = PNG_COMPRESSION_TYPE_BASE;
-    filter = PNG_FILTER_TYPE_BASE;
-
-    interlace = PNG_INTERLACE_NONE;
-    if (opt & IO_PNG_OPT_ADAM7)
-        interlace = PNG_INTERLACE_ADAM7;
-
-    /* set image header */
-    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
-                 bit_depth, color_type, interlace, compression, filter);
-
-    compression_level = 5;
-    if (opt & IO_PNG_OPT_ZMIN)
-        compression_level = 0;
-    if (opt & IO_PNG_OPT_ZMAX)
-        compression_level = 9;
-    png_set_compression_level(png_ptr, compression_level);
-
-    /* TODO : significant bit (sBIT), gamma (gAMA) chunks */
-    png_write_info(png_ptr, info_ptr);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    _io_png_free(row);
+    return passes;
+}
 
-    /* set row pointers */
-    for (i = 0; i < ny; i++)
-        row_pointers[i] = (png_bytep) png_data + (size_t) (nc * nx * i);
+/**
+ * @brief read a PNG file row by row
+ *
+ * The rows are decoded as 8bit samples, gray, gray+alpha, rgb or
+ * rgb+alpha; palette images are expanded to rgb. Only one row is
+ * held in memory, and given to the row callback as soon as it is
+ * decoded. The header callback is called once, before the first row,
+ * with the number of columns, lines and channels of the rows.
+ *
+ * For interlaced images, the rows are received once per pass, and
+ * only the pixels x0, x0 + dx, x0 + 2 dx, ... of this pass are valid
+ * in the row; each pixel is received once.
+ *
+ * The IO_PNG_OPT_TRUSTED option skips the CRC and Adler-32 checks,
+ * for the files written by a trusted program.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param opt read option, IO_PNG_OPT_TRUSTED or IO_PNG_OPT_NONE
+ * @param head_fn header callback
+ * @param row_fn row callback
+ * @param ctx caller context, passed to the callbacks
+ * @return void, abort() on error
+ */
+void io_png_read_rows_opt(const char *fname, io_png_opt_t opt,
+                          io_png_head_fn head_fn, io_png_row_fn row_fn,
+                          void *ctx)
+{
+    FILE *fp;
 
-    /* write out the entire image and end it */
-    png_write_image(png_ptr, row_pointers);
-    png_write_end(png_ptr, info_ptr);
+    assert(NULL != fname && NULL != head_fn && NULL != row_fn);
 
-    /* clean up and free any memory allocated, close the file */
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    free(row_pointers);
-    free(png_data);
-    if (stdout != fp)
+    fp = _io_png_open_read(fname);
+    (void) _io_png_read_rows_io((png_voidp) fp, &_io_png_read_fn, opt, 0,
+                                head_fn, row_fn, ctx);
+    if (stdin != fp)
         (void) fclose(fp);
+    return;
+}
 
+/**
+ * @brief read a PNG file row by row
+ *
+ * See io_png_read_rows_opt().
+ */
+void io_png_read_rows(const char *fname,
+                      io_png_head_fn head_fn, io_png_row_fn row_fn,
+                      void *ctx)
+{
+    io_png_read_rows_opt(fname, IO_PNG_OPT_NONE, head_fn, row_fn, ctx);
     return;
 }
 
 /**
- * @brief write a float array into a PNG file with some options
+ * @brief read the first Adam7 passes of a PNG file row by row
  *
- * The array values are taken from the [0,1] interval and converted to
- * 8bit data.
+ * Same as io_png_read_rows(), but the decoding stops after the given
+ * number of passes of an interlaced image, without reading the rest
+ * of the file. The first pass holds one pixel out of 8 x 8, on a
+ * regular grid, the first two passes one out of 8 x 4, and so on.
+ * A non-interlaced image is read completely.
  *
- * @todo save as 16bit images
+ * @param fname PNG file name, "-" means stdin
+ * @param passes number of passes to read, in [1,7], 0 for all
+ * @param head_fn header callback
+ * @param row_fn row callback
+ * @param ctx caller context, passed to the callbacks
+ * @return the number of passes of the image, 7 for an interlaced
+ *         image and 1 otherwise, abort() on error
+ */
+int io_png_read_rows_passes(const char *fname, int passes,
+                            io_png_head_fn head_fn, io_png_row_fn row_fn,
+                            void *ctx)
+{
+    FILE *fp;
+    int nb_passes;
+
+    assert(NULL != fname && NULL != head_fn && NULL != row_fn);
+
+    fp = _io_png_open_read(fname);
+    nb_passes = _io_png_read_rows_io((png_voidp) fp, &_io_png_read_fn,
+                                     IO_PNG_OPT_NONE, passes,
+                                     head_fn, row_fn, ctx);
+    if (stdin != fp)
+        (void) fclose(fp);
+    return nb_passes;
+}
+
+/** @brief read a PNG image from a memory buffer row by row, with options */
+static void _io_png_read_rows_mem(const unsigned char *buf, size_t len,
+                                  io_png_opt_t opt, io_png_head_fn head_fn,
+                                  io_png_row_fn row_fn, void *ctx)
+{
+    _io_png_mem_t mem;
+
+    assert(NULL != buf && NULL != head_fn && NULL != row_fn);
+
+    mem.buf = (png_byte *) buf;
+    mem.len = len;
+    mem.pos = 0;
+    mem.size = len;
+    (void) _io_png_read_rows_io((png_voidp) & mem, &_io_png_mem_read_fn,
+                                opt, 0, head_fn, row_fn, ctx);
+    return;
+}
+
+/**
+ * @brief read a PNG image from a memory buffer row by row
+ *
+ * See io_png_read_rows().
+ *
+ * @param buf PNG file data
+ * @param len PNG file data length
+ * @param head_fn header callback
+ * @param row_fn row callback
+ * @param ctx caller context, passed to the callbacks
+ * @return void, abort() on error
+ */
+void io_png_read_rows_mem(const unsigned char *buf, size_t len,
+                          io_png_head_fn head_fn, io_png_row_fn row_fn,
+                          void *ctx)
+{
+    _io_png_read_rows_mem(buf, len, IO_PNG_OPT_NONE, head_fn, row_fn, ctx);
+    return;
+}
+
+/**
+ * @brief internal function used to read the PNG signature and header
+ *
+ * The signature and the IHDR chunk are read; for a palette image, the
+ * next chunks are also read, until the image data, to find the tRNS
+ * chunk. If fname is "-", the bytes read from stdin are kept and will
+ * be read again by the next read from stdin.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param head output buffer, _IO_PNG_HEAD_LEN bytes
+ * @param lenp pointer to the number of chunk bytes read after head
+ * @return the chunk bytes read after head, to be freed by
+ *         _io_png_free(), NULL if none, abort() on error
+ */
+static png_byte *_io_png_read_head(const char *fname, png_byte * head,
+                                   size_t * lenp)
+{
+    FILE *fp;
+    png_byte *more, *buf;
+    size_t len, size, n, clen, rest;
+
+    fp = _io_png_open_read(fname);
+    if (_IO_PNG_HEAD_LEN != _io_png_fread(head, _IO_PNG_HEAD_LEN, fp))
+        _IO_PNG_ABORT("the file is not a PNG image");
+    more = NULL;
+    len = 0;
+    size = 0;
+    while (PNG_COLOR_TYPE_PALETTE == head[25]) {
+        /* chunk length and type */
+        if (len + 8 > size) {
+            size = 2 * size + 8;
+            more = _IO_PNG_SAFE_REALLOC(more, size, png_byte);
+        }
+        n = _io_png_fread(more + len, 8, fp);
+        len += n;
+        if (8 != n || 0 == memcmp(more + len - 4, "IDAT", 4)
+            || 0 == memcmp(more + len - 4, "IEND", 4))
+            break;
+        /* chunk data and CRC */
+        clen = (size_t) png_get_uint_32(more + len - 8);
+        if (_IO_PNG_HEAD_MAX < clen + 4 || _IO_PNG_HEAD_MAX < len)
+            break;
+        if (len + clen + 4 > size) {
+            size = 2 * size + clen + 4;
+            more = _IO_PNG_SAFE_REALLOC(more, size, png_byte);
+        }
+        n = _io_png_fread(more + len, clen + 4, fp);
+        len += n;
+        if (clen + 4 != n)
+            break;
+    }
+    if (stdin == fp) {
+        memcpy(_io_png_stdin_head, head, _IO_PNG_HEAD_LEN);
+        _io_png_stdin_head_pos = 0;
+        /* replay these chunks before the chunks left from a previous
+         * read */
+        rest = _io_png_stdin_more_len - _io_png_stdin_more_pos;
+        if (0 < len) {
+            buf = _IO_PNG_SAFE_MALLOC(len + rest, png_byte);
+            memcpy(buf, more, len);
+            if (0 < rest)
+                memcpy(buf + len,
+                       _io_png_stdin_more + _io_png_stdin_more_pos, rest);
+            if (NULL != _io_png_stdin_more)
+                _io_png_free(_io_png_stdin_more);
+            _io_png_stdin_more = buf;
+            _io_png_stdin_more_len = len + rest;
+            _io_png_stdin_more_pos = 0;
+        }
+    }
+    else
+        (void) fclose(fp);
+    *lenp = len;
+    return more;
+}
+
+/**
+ * @brief internal function used to find the tRNS chunk of a palette
+ *
+ * @param more the chunks after the PNG signature and header
+ * @param len number of bytes
+ * @return 1 if a tRNS chunk is before the image data, 0 otherwise
+ */
+static int _io_png_head_trns(const png_byte * more, size_t len)
+{
+    size_t pos, clen;
+
+    pos = 0;
+    while (pos + 8 <= len) {
+        if (0 == memcmp(more + pos + 4, "tRNS", 4))
+            return 1;
+        if (0 == memcmp(more + pos + 4, "IDAT", 4)
+            || 0 == memcmp(more + pos + 4, "IEND", 4))
+            return 0;
+        clen = (size_t) png_get_uint_32((png_bytep) more + pos);
+        if (clen + 12 > len - pos)
+            return 0;
+        pos += clen + 12;
+    }
+    return 0;
+}
+
+/**
+ * @brief internal function used to parse the PNG signature and header
+ *
+ * See io_png_probe().
+ *
+ * @param head the PNG signature and header, _IO_PNG_HEAD_LEN bytes
+ * @param more the next chunks, for a palette image up to the image
+ *        data, NULL if none
+ * @param len number of bytes in more
+ * @param nxp, nyp, ncp, bdp see io_png_probe()
+ * @return void, abort() on error
+ */
+static void _io_png_parse_head(const png_byte * head, const png_byte * more,
+                               size_t len, size_t * nxp, size_t * nyp,
+                               size_t * ncp, size_t * bdp)
+{
+    size_t nc;
+
+    if (0 != png_sig_cmp((png_bytep) head, (png_size_t) 0, 8)
+        || 0 != memcmp(head + 12, "IHDR", 4))
+        _IO_PNG_ABORT("the file is not a PNG image");
+
+    switch (head[25]) {
+    case PNG_COLOR_TYPE_GRAY:
+        nc = 1;
+        break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        nc = 2;
+        break;
+    case PNG_COLOR_TYPE_RGB:
+        nc = 3;
+        break;
+    case PNG_COLOR_TYPE_PALETTE:
+        /* the palette expansion turns tRNS into an alpha channel */
+        nc = (NULL != more && _io_png_head_trns(more, len) ? 4 : 3);
+        break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        nc = 4;
+        break;
+    default:
+        _IO_PNG_ABORT("the file is not a PNG image");
+    }
+
+    if (NULL != nxp)
+        *nxp = (size_t) png_get_uint_32((png_bytep) head + 16);
+    if (NULL != nyp)
+        *nyp = (size_t) png_get_uint_32((png_bytep) head + 20);
+    if (NULL != ncp)
+        *ncp = nc;
+    if (NULL != bdp)
+        *bdp = (size_t) head[24];
+    return;
+}
+
+/**
+ * @brief get the size of a PNG image
+ *
+ * Only the signature and the header of the PNG file are read, and
+ * for a palette image the chunks before the image data. If fname is
+ * "-", the bytes read from stdin are kept and will be read again by
+ * the next read from stdin.
+ *
+ * The number of channels is the number of samples per decoded pixel:
+ * 1 for gray, 2 for gray+alpha, 3 for rgb and palette images, 4 for
+ * rgb+alpha and palette images with a tRNS chunk. The tRNS chunk of
+ * the other images is not an alpha channel. The read functions always
+ * decode 8bit samples.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp, ncp pointers to variables to be filled with the number of
+ *        columns, lines and channels of the image, if not NULL
+ * @param bdp pointer to a variable to be filled with the bit depth
+ *        of the image samples, if not NULL
+ * @return void, abort() on error
+ */
+void io_png_probe(const char *fname,
+                  size_t * nxp, size_t * nyp, size_t * ncp, size_t * bdp)
+{
+    png_byte head[_IO_PNG_HEAD_LEN], *more;
+    size_t len;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    more = _io_png_read_head(fname, head, &len);
+    _io_png_parse_head(head, more, len, nxp, nyp, ncp, bdp);
+    if (NULL != more)
+        _io_png_free(more);
+    return;
+}
+
+/**
+ * @brief check if a PNG image is a palette image
+ *
+ * Only the signature and the header of the PNG file are read, as in
+ * io_png_probe(). A palette image can be read as indexes with
+ * io_png_read_pal().
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @return 1 for a palette image, 0 otherwise, abort() on error
+ */
+int io_png_probe_pal(const char *fname)
+{
+    png_byte head[_IO_PNG_HEAD_LEN], *more;
+    size_t len;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    more = _io_png_read_head(fname, head, &len);
+    _io_png_parse_head(head, more, len, NULL, NULL, NULL, NULL);
+    if (NULL != more)
+        _io_png_free(more);
+    return (PNG_COLOR_TYPE_PALETTE == head[25] ? 1 : 0);
+}
+
+/**
+ * @brief get the size of a PNG image in a memory buffer
+ *
+ * See io_png_probe().
+ *
+ * @param buf PNG file data
+ * @param len PNG file data length
+ * @param nxp, nyp, ncp, bdp see io_png_probe()
+ * @return void, abort() on error
+ */
+void io_png_probe_mem(const unsigned char *buf, size_t len,
+                      size_t * nxp, size_t * nyp, size_t * ncp,
+                      size_t * bdp)
+{
+    if (NULL == buf)
+        _IO_PNG_ABORT("bad parameters");
+    if (_IO_PNG_HEAD_LEN > len)
+        _IO_PNG_ABORT("the file is not a PNG image");
+
+    _io_png_parse_head((const png_byte *) buf,
+                       (const png_byte *) buf + _IO_PNG_HEAD_LEN,
+                       len - _IO_PNG_HEAD_LEN, nxp, nyp, ncp, bdp);
+    return;
+}
+
+/** @brief destination of io_png_read_*_into() */
+typedef struct _io_png_into_s {
+    void *const *data;          /* channel planes */
+    size_t nx, ny, nc;          /* expected size and number of planes */
+    size_t stride;              /* plane row stride, in samples */
+    size_t ncf;                 /* number of channels in the file */
+    int alpha;                  /* the last plane is the alpha channel */
+    io_png_opt_t opt;           /* post-processing option */
+    int flt;                    /* float planes, else unsigned char */
+} _io_png_into_t;
+
+/** @brief header callback of io_png_read_*_into(), check the size */
+static void _io_png_into_head(size_t nx, size_t ny, size_t nc, void *ctx)
+{
+    _io_png_into_t *into = (_io_png_into_t *) ctx;
+    size_t ncd;
+
+    /* number of planes after post-processing */
+    switch (into->opt) {
+    case IO_PNG_OPT_RGB:
+        ncd = 3;
+        break;
+    case IO_PNG_OPT_GRAY:
+        ncd = 1;
+        break;
+    case IO_PNG_OPT_NONE:
+        ncd = nc;
+        break;
+    default:
+        _IO_PNG_ABORT("unsupported preprocessing option");
+    }
+    /* one more plane for the alpha channel, after RGB or gray */
+    into->alpha = (IO_PNG_OPT_NONE != into->opt && ncd + 1 == into->nc
+                   && (2 == nc || 4 == nc));
+    if (nx != into->nx || ny != into->ny
+        || (ncd != into->nc && !into->alpha))
+        _IO_PNG_ABORT("the image size differs from the buffer size");
+    into->ncf = nc;
+    return;
+}
+
+/**
+ * @brief row callback of io_png_read_*_into(), deinterlace one row
+ *
+ * The post-processing and type conversion give the same values as
+ * io_png_read_*_opt().
+ */
+static void _io_png_into_row(const png_byte * row, size_t y,
+                             size_t x0, size_t dx, void *ctx)
+{
+    _io_png_into_t *into = (_io_png_into_t *) ctx;
+    const png_byte *src;
+    size_t c, sc, x, ncf;
+    float tmp, max;
+
+    STATS_TOGGLE(STATS_INTERLACE);
+    /* same float division as _io_png_byte2flt() */
+    max = (float) 255;
+    ncf = into->ncf;
+    for (c = 0; c < into->nc; c++) {
+        if (IO_PNG_OPT_GRAY == into->opt && 3 <= ncf
+            && !(into->alpha && into->nc - 1 == c)) {
+            /* rgb->gray, see _io_png_rgb2gray() */
+            for (x = x0; x < into->nx; x += dx) {
+                src = row + x * ncf;
+                tmp = 0.212639005871510 * ((float) src[0] / max)
+                    + 0.715168678767756 * ((float) src[1] / max)
+                    + 0.072192315360734 * ((float) src[2] / max);
+                if (into->flt)
+                    ((float *) into->data[c])[y * into->stride + x] = tmp;
+                else {
+                    tmp = tmp * UCHAR_MAX + .5;
+                    ((unsigned char *) into->data[c])[y * into->stride + x]
+                        = (unsigned char) (tmp < 0. ? 0.
+                                           : (tmp > UCHAR_MAX ? UCHAR_MAX
+                                              : tmp));
+                }
+            }
+            continue;
+        }
+        /* source channel, gray->rgb reads the gray channel 3 times */
+        sc = ((IO_PNG_OPT_NONE != into->opt && 3 > ncf) ? 0 : c);
+        if (into->alpha && into->nc - 1 == c)
+            sc = ncf - 1;
+        if (into->flt) {
+            float *dst = (float *) into->data[c] + y * into->stride;
+            for (x = x0; x < into->nx; x += dx)
+                dst[x] = (float) row[x * ncf + sc] / max;
+        }
+        else {
+            unsigned char *dst =
+                (unsigned char *) into->data[c] + y * into->stride;
+            for (x = x0; x < into->nx; x += dx)
+                dst[x] = (unsigned char) row[x * ncf + sc];
+        }
+    }
+    STATS_TOGGLE(STATS_INTERLACE);
+    return;
+}
+
+/** @brief set up the destination of io_png_read_*_into() */
+static void _io_png_into_init(_io_png_into_t * into, void *const *data,
+                              size_t nx, size_t ny, size_t nc,
+                              size_t stride, io_png_opt_t opt, int flt)
+{
+    if (NULL == data || stride < nx)
+        _IO_PNG_ABORT("bad parameters");
+
+    into->data = data;
+    into->nx = nx;
+    into->ny = ny;
+    into->nc = nc;
+    into->stride = stride;
+    into->opt = (io_png_opt_t) (opt & ~IO_PNG_OPT_TRUSTED);
+    into->flt = flt;
+    return;
+}
+
+/**
+ * @brief read a PNG file into caller-provided float planes
+ *
+ * The image is read row by row into the channel planes, with values
+ * in [0,1], without any full-image temporary buffer. The image size
+ * must match the planes size, see io_png_probe(). The option
+ * parameter is the same as in io_png_read_flt_opt(): with
+ * IO_PNG_OPT_RGB there are 3 planes, with IO_PNG_OPT_GRAY there is 1
+ * plane, otherwise there is one plane per image channel. With
+ * IO_PNG_OPT_RGB or IO_PNG_OPT_GRAY and an image with an alpha
+ * channel, one more plane can be given to read the alpha channel
+ * instead of dropping it. IO_PNG_OPT_TRUSTED can be added to the
+ * option, see io_png_read_rows_opt().
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param data array of nc pointers to the channel planes
+ * @param nx, ny, nc number of columns, lines and planes
+ * @param stride distance between two rows in a plane, in samples,
+ *        at least nx
+ * @param opt post-processing option
+ * @return void, abort() on error
+ */
+void io_png_read_flt_into(const char *fname, float *const *data,
+                          size_t nx, size_t ny, size_t nc, size_t stride,
+                          io_png_opt_t opt)
+{
+    _io_png_into_t into;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_into_init(&into, (void *const *) data, nx, ny, nc, stride,
+                      opt, 1);
+    io_png_read_rows_opt(fname, (io_png_opt_t) (opt & IO_PNG_OPT_TRUSTED),
+                         &_io_png_into_head, &_io_png_into_row,
+                         (void *) &into);
+    return;
+}
+
+/**
+ * @brief read a PNG file into caller-provided unsigned char planes
+ *
+ * The values are in [0,UCHAR_MAX]. See io_png_read_flt_into() for
+ * details.
+ */
+void io_png_read_uchar_into(const char *fname, unsigned char *const *data,
+                            size_t nx, size_t ny, size_t nc, size_t stride,
+                            io_png_opt_t opt)
+{
+    _io_png_into_t into;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_into_init(&into, (void *const *) data, nx, ny, nc, stride,
+                      opt, 0);
+    io_png_read_rows_opt(fname, (io_png_opt_t) (opt & IO_PNG_OPT_TRUSTED),
+                         &_io_png_into_head, &_io_png_into_row,
+                         (void *) &into);
+    return;
+}
+
+/**
+ * @brief read a PNG image from a memory buffer into float planes
+ *
+ * See io_png_read_flt_into().
+ *
+ * @param buf PNG file data
+ * @param len PNG file data length
+ */
+void io_png_read_flt_into_mem(const unsigned char *buf, size_t len,
+                              float *const *data,
+                              size_t nx, size_t ny, size_t nc,
+                              size_t stride, io_png_opt_t opt)
+{
+    _io_png_into_t into;
+
+    if (NULL == buf)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_into_init(&into, (void *const *) data, nx, ny, nc, stride,
+                      opt, 1);
+    _io_png_read_rows_mem(buf, len,
+                          (io_png_opt_t) (opt & IO_PNG_OPT_TRUSTED),
+                          &_io_png_into_head, &_io_png_into_row,
+                          (void *) &into);
+    return;
+}
+
+/**
+ * @brief read a PNG image from a memory buffer into unsigned char planes
+ *
+ * See io_png_read_uchar_into().
+ *
+ * @param buf PNG file data
+ * @param len PNG file data length
+ */
+void io_png_read_uchar_into_mem(const unsigned char *buf, size_t len,
+                                unsigned char *const *data,
+                                size_t nx, size_t ny, size_t nc,
+                                size_t stride, io_png_opt_t opt)
+{
+    _io_png_into_t into;
+
+    if (NULL == buf)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_into_init(&into, (void *const *) data, nx, ny, nc, stride,
+                      opt, 0);
+    _io_png_read_rows_mem(buf, len,
+                          (io_png_opt_t) (opt & IO_PNG_OPT_TRUSTED),
+                          &_io_png_into_head, &_io_png_into_row,
+                          (void *) &into);
+    return;
+}
+
+/**
+ * @brief read a palette PNG image as indexes and palette
+ *
+ * The pixels are read as 8bit palette indexes, without expansion to
+ * rgb, in one plane of nx x ny samples; 1, 2 and 4 bit indexes are
+ * unpacked. The palette is returned in 3 planes of 256 entries, R in
+ * pal[0..255], G in pal[256..511] and B in pal[512..767], and the
+ * transparency of the entries in 256 alpha values; the unused
+ * entries are 0 in the palette and 255 (opaque) in the alpha values.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp pointers to variables to be filled with the number
+ *        of columns and lines of the image
+ * @param pal output palette, 3 x 256 samples
+ * @param npalp pointer to a variable to be filled with the number of
+ *        palette entries
+ * @param trns output alpha values, 256 samples
+ * @param ntrnsp pointer to a variable to be filled with the number of
+ *        alpha values in the file, 0 without tRNS chunk
+ * @param opt read option, IO_PNG_OPT_TRUSTED or IO_PNG_OPT_NONE
+ * @return pointer to an array of indexes, abort() on error or if the
+ *         image is not a palette image, see io_png_probe_pal()
+ */
+unsigned char *io_png_read_pal(const char *fname, size_t * nxp,
+                               size_t * nyp, unsigned char *pal,
+                               size_t * npalp, unsigned char *trns,
+                               size_t * ntrnsp, io_png_opt_t opt)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_colorp plte;
+    png_bytep alpha;
+    png_bytep *row_pointers;
+    png_byte *idx;
+    int nplte, nalpha;
+    size_t nx, ny, i;
+    /* volatile: because of setjmp/longjmp */
+    FILE *volatile fp;
+    /* local error structure */
+    _io_png_err_t err;
+
+    if (NULL == fname || NULL == nxp || NULL == nyp
+        || NULL == pal || NULL == npalp || NULL == trns || NULL == ntrnsp)
+        _IO_PNG_ABORT("bad parameters");
+
+    fp = _io_png_open_read(fname);
+    if (NULL == (png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                  &err, &_io_png_err_hdl,
+                                                  NULL)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem reading from the file */
+    if (setjmp(err.jmpbuf))
+        _IO_PNG_ABORT("libpng reading error");
+
+    png_set_read_fn(png_ptr, (png_voidp) fp, &_io_png_read_fn);
+    _io_png_read_profile(png_ptr, opt);
+
+    /* read the header and the palette, unpack the indexes */
+    STATS_TOGGLE(STATS_READ);
+    png_read_info(png_ptr, info_ptr);
+    if (PNG_COLOR_TYPE_PALETTE != png_get_color_type(png_ptr, info_ptr)
+        || 0 == png_get_PLTE(png_ptr, info_ptr, &plte, &nplte))
+        _IO_PNG_ABORT("the file is not a palette image");
+    if (0 == png_get_tRNS(png_ptr, info_ptr, &alpha, &nalpha, NULL))
+        nalpha = 0;
+    png_set_packing(png_ptr);
+    (void) png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    memset(pal, 0, 3 * 256);
+    memset(trns, 255, 256);
+    for (i = 0; i < (size_t) nplte && i < 256; i++) {
+        pal[i] = plte[i].red;
+        pal[256 + i] = plte[i].green;
+        pal[512 + i] = plte[i].blue;
+    }
+    for (i = 0; i < (size_t) nalpha && i < 256; i++)
+        trns[i] = alpha[i];
+    *npalp = (size_t) nplte;
+    *ntrnsp = (size_t) nalpha;
+
+    /* read the indexes, the interlacing is handled by libpng */
+    nx = (size_t) png_get_image_width(png_ptr, info_ptr);
+    ny = (size_t) png_get_image_height(png_ptr, info_ptr);
+    idx = _IO_PNG_SAFE_MALLOC(nx * ny, png_byte);
+    row_pointers = _IO_PNG_SAFE_MALLOC(ny, png_bytep);
+    for (i = 0; i < ny; i++)
+        row_pointers[i] = idx + nx * i;
+    png_read_image(png_ptr, row_pointers);
+    png_read_end(png_ptr, NULL);
+    STATS_TOGGLE(STATS_READ);
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    _io_png_free(row_pointers);
+    if (stdin != fp)
+        (void) fclose(fp);
+
+    *nxp = nx;
+    *nyp = ny;
+    return (unsigned char *) idx;
+}
+
+/*
+ * WRITE
+ */
+
+/**
+ * @brief internal function used to write a byte array as a PNG file
+ *
+ * The PNG file is written as a 8bit image file, interlaced,
+ * truecolor. Depending on the number of channels, the color model is
+ * gray, gray+alpha, rgb, rgb+alpha.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param data non interlaced (RRRGGGBBBAAA) float image array
+ * @param nx, ny, nc number of columns, lines and channels
+ * @param opt processing option, can be IO_PNG_OPT_ADAM7,
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
+ *         IO_PNG_OPT_NONE to do nothing
+ * @return void, abort() on error
+ *
+ * @todo handle 16bit
+ */
+static void _io_png_write(const char *fname, const float *data,
+                          size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep *row_pointers;
+    png_byte *png_data;
+    png_byte bit_depth;
+    float *tmp;
+    /* volatile: because of setjmp/longjmp */
+    FILE *volatile fp;
+    int color_type, interlace, compression, compression_level, filter;
+    size_t i;
+    /* error structure */
+    _io_png_err_t err;
+
+    assert(NULL != fname && NULL != data && 0 < nx && 0 < ny && 0 < nc);
+
+    /* interlace RRR GGG BBB AAA to RGBA RGBA RGBA */
+    tmp = _io_png_inter(data, nx * ny, nc, INTERLACE);
+    /* convert to png_byte */
+    png_data = _io_png_flt2byte(tmp, nx * ny * nc);
+    _io_png_free(tmp);
+
+    /* open the PNG output file */
+    fp = _io_png_open_write(fname);
+    /* allocate the row pointers */
+    row_pointers = _IO_PNG_SAFE_MALLOC(ny, png_bytep);
+
+    /*
+     * create and initialize the png_struct and png_info structures
+     * with local error handling
+     */
+    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                   &err, &_io_png_err_hdl,
+                                                   NULL)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem writing to the file */
+    if (0 != setjmp(err.jmpbuf))
+        _IO_PNG_ABORT("libpng writing error");
+
+    /* set up the input control using standard C streams */
+    png_init_io(png_ptr, fp);
+
+    /* set image informations */
+    bit_depth = 8;
+    switch (nc) {
+    case 1:
+        color_type = PNG_COLOR_TYPE_GRAY;
+        break;
+    case 2:
+        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        break;
+    case 3:
+        color_type = PNG_COLOR_TYPE_RGB;
+        break;
+    case 4:
+        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+        break;
+    default:
+        _IO_PNG_ABORT("bad parameters");
+    }
+
+    compression = PNG_COMPRESSION_TYPE_BASE;
+    filter = PNG_FILTER_TYPE_BASE;
+
+    interlace = PNG_INTERLACE_NONE;
+    if (opt & IO_PNG_OPT_ADAM7)
+        interlace = PNG_INTERLACE_ADAM7;
+
+    /* set image header */
+    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
+                 bit_depth, color_type, interlace, compression, filter);
+
+    compression_level = 5;
+    if (opt & IO_PNG_OPT_ZMIN)
+        compression_level = 0;
+    if (opt & IO_PNG_OPT_ZMAX)
+        compression_level = 9;
+    png_set_compression_level(png_ptr, compression_level);
+
+    /* TODO : significant bit (sBIT), gamma (gAMA) chunks */
+    png_write_info(png_ptr, info_ptr);
+
+    /* set row pointers */
+    for (i = 0; i < ny; i++)
+        row_pointers[i] = (png_bytep) png_data + (size_t) (nc * nx * i);
+
+    /* write out the entire image and end it */
+    png_write_image(png_ptr, row_pointers);
+    png_write_end(png_ptr, info_ptr);
+
+    /* clean up and free any memory allocated, close the file */
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    _io_png_free(row_pointers);
+    _io_png_free(png_data);
+    if (stdout != fp)
+        (void) fclose(fp);
+
+    return;
+}
+
+/**
+ * @brief write a float array into a PNG file with some options
+ *
+ * The array values are taken from the [0,1] interval and converted to
+ * 8bit data.
+ *
+ * @todo save as 16bit images
+ *
+ * @param fname PNG file name
+ * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @param opt processing option, can be IO_PNG_OPT_ADAM7,
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
+ *         IO_PNG_OPT_NONE to do nothing
+ * @return void, abort() on error
+ */
+void io_png_write_flt_opt(const char *fname, const float *data,
+                          size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+{
+    _io_png_write(fname, data, nx, ny, nc, opt);
+    return;
+}
+
+/**
+ * @brief write a float array into a PNG file
+ *
+ * The array values are taken from the [0,1] interval and converted to
+ * 8bit data.
+ *
+ * @param fname PNG file name
+ * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ */
+void io_png_write_flt(const char *fname, const float *data,
+                      size_t nx, size_t ny, size_t nc)
+{
+    io_png_write_flt_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
+    return;
+}
+
+/**
+ * @brief write an unsigned char array into a 8bit PNG file
+ *
+ * The array values are taken from the [0,UCHAR_MAX] interval and
+ * converted to float in the [0,1] interval before being saved as 8bit
+ * fixed-point data. See io_png_write_flt_opt() for details.
+ */
+void io_png_write_uchar_opt(const char *fname, const unsigned char *data,
+                            size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+{
+    float *flt_data;
+
+    flt_data = _io_png_uchar2flt(data, nx * ny * nc);
+    _io_png_write(fname, flt_data, nx, ny, nc, opt);
+    _io_png_free(flt_data);
+    return;
+}
+
+/**
+ * @brief write an unsigned char array into a 8bit PNG file
+ *
+ * The array values are taken from the [0,UCHAR_MAX] interval and
+ * converted to float in the [0,1] interval before being saved as 8bit
+ * fixed-point data.
+ *
+ * @param fname PNG file name
+ * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
+ * @param nx, ny, nc number of columns, lines and channels of the image
+ * @return void, abort() on error
+ */
+void io_png_write_uchar(const char *fname, const unsigned char *data,
+                        size_t nx, size_t ny, size_t nc)
+{
+    io_png_write_uchar_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
+    return;
+}
+
+/**
+ * @brief write an unsigned short array into a 8bit PNG file
+ *
+ * The array values are taken from the [0,USHRT_MAX] interval and
+ * converted to float in the [0,1] interval before being saved as 8bit
+ * fixed-point data. See io_png_write_flt_opt() for details.
+ */
+void io_png_write_ushrt_opt(const char *fname, const unsigned short *data,
+                            size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+{
+    float *flt_data;
+
+    flt_data = _io_png_ushrt2flt(data, nx * ny * nc);
+    _io_png_write(fname, flt_data, nx, ny, nc, opt);
+    _io_png_free(flt_data);
+    return;
+}
+
+/**
+ * @brief write an unsigned short array into a 8bit PNG file
+ *
+ * The array values are taken from the [0,USHRT_MAX] interval and
+ * converted to float in the [0,1] interval before being saved as 8bit
+ * fixed-point data.
  *
  * @param fname PNG file name
  * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
  * @param nx, ny, nc number of columns, lines and channels of the image
+ * @return void, abort() on error
+ *
+ * @todo save in 16bits
+ */
+void io_png_write_ushrt(const char *fname, const unsigned short *data,
+                        size_t nx, size_t ny, size_t nc)
+{
+    io_png_write_ushrt_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
+    return;
+}
+
+/*
+ * WRITE FROM CALLER BUFFERS
+ */
+
+/**
+ * @brief internal function used to write a PNG stream row by row
+ *
+ * The PNG file is written as a 8bit image file, with the same
+ * settings as _io_png_write(). Only one row is held in memory; with
+ * Adam7 interlacing, each row is requested once per pass.
+ *
+ * @param io_ptr stream, passed to write_fn, a FILE pointer if write_fn
+ *        is NULL
+ * @param write_fn, flush_fn libpng write and flush callbacks, NULL for
+ *        the standard C streams
+ * @param nx, ny, nc number of columns, lines and channels
+ * @param opt processing option, see _io_png_write()
+ * @param row_fn row callback
+ * @param ctx caller context, passed to the callback
+ * @return void, abort() on error
+ */
+static void _io_png_write_rows_io(png_voidp io_ptr, png_rw_ptr write_fn,
+                                  png_flush_ptr flush_fn,
+                                  size_t nx, size_t ny, size_t nc,
+                                  io_png_opt_t opt,
+                                  io_png_fill_fn row_fn, void *ctx)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_byte *row;
+    int color_type, interlace, compression_level, passes, pass;
+    size_t y;
+    /* error structure */
+    _io_png_err_t err;
+
+    assert(NULL != io_ptr && NULL != row_fn
+           && 0 < nx && 0 < ny && 0 < nc);
+
+    switch (nc) {
+    case 1:
+        color_type = PNG_COLOR_TYPE_GRAY;
+        break;
+    case 2:
+        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        break;
+    case 3:
+        color_type = PNG_COLOR_TYPE_RGB;
+        break;
+    case 4:
+        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+        break;
+    default:
+        _IO_PNG_ABORT("bad parameters");
+    }
+
+    row = _IO_PNG_SAFE_MALLOC(nx * nc, png_byte);
+
+    /*
+     * create and initialize the png_struct and png_info structures
+     * with local error handling
+     */
+    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                   &err, &_io_png_err_hdl,
+                                                   NULL)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem writing to the file */
+    if (0 != setjmp(err.jmpbuf))
+        _IO_PNG_ABORT("libpng writing error");
+
+    /* set up the output control */
+    if (NULL == write_fn)
+        png_set_write_fn(png_ptr, io_ptr, &_io_png_write_fn,
+                         &_io_png_flush_fn);
+    else
+        png_set_write_fn(png_ptr, io_ptr, write_fn, flush_fn);
+
+    /* set image header and compression */
+    interlace = ((opt & IO_PNG_OPT_ADAM7)
+                 ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE);
+    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
+                 8, color_type, interlace,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    compression_level = 5;
+    if (opt & IO_PNG_OPT_ZMIN)
+        compression_level = 0;
+    if (opt & IO_PNG_OPT_ZMAX)
+        compression_level = 9;
+    png_set_compression_level(png_ptr, compression_level);
+    STATS_TOGGLE(STATS_ENCODE);
+    png_write_info(png_ptr, info_ptr);
+    STATS_TOGGLE(STATS_ENCODE);
+
+    /* write the rows, once per pass, and end the image */
+    passes = png_set_interlace_handling(png_ptr);
+    for (pass = 0; pass < passes; pass++)
+        for (y = 0; y < ny; y++) {
+            row_fn(row, y, ctx);
+            STATS_TOGGLE(STATS_ENCODE);
+            png_write_row(png_ptr, row);
+            STATS_TOGGLE(STATS_ENCODE);
+        }
+    STATS_TOGGLE(STATS_ENCODE);
+    png_write_end(png_ptr, info_ptr);
+    STATS_TOGGLE(STATS_ENCODE);
+
+    /* clean up and free any memory allocated */
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    _io_png_free(row);
+    return;
+}
+
+/**
+ * @brief write a PNG file row by row
+ *
+ * The rows are filled by the caller, as interlaced 8bit samples
+ * (RGBA RGBA RGBA), just before they are compressed; only one row is
+ * held in memory. With Adam7 interlacing, each row is requested once
+ * per pass. The PNG file is the same as with io_png_write_uchar_opt().
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param nx, ny, nc number of columns, lines and channels
  * @param opt processing option, can be IO_PNG_OPT_ADAM7,
  *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
  *         IO_PNG_OPT_NONE to do nothing
+ * @param row_fn row callback
+ * @param ctx caller context, passed to the callback
  * @return void, abort() on error
  */
-void io_png_write_flt_opt(const char *fname, const float *data,
-                          size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+void io_png_write_rows(const char *fname,
+                       size_t nx, size_t ny, size_t nc, io_png_opt_t opt,
+                       io_png_fill_fn row_fn, void *ctx)
 {
-    _io_png_write(fname, data, nx, ny, nc, opt);
+    FILE *fp;
+
+    if (NULL == fname || NULL == row_fn)
+        _IO_PNG_ABORT("bad parameters");
+
+    fp = _io_png_open_write(fname);
+    _io_png_write_rows_io((png_voidp) fp, NULL, NULL,
+                          nx, ny, nc, opt, row_fn, ctx);
+    if (stdout != fp)
+        (void) fclose(fp);
     return;
 }
 
 /**
- * @brief write a float array into a PNG file
+ * @brief write a PNG image row by row in a memory buffer
  *
- * The array values are taken from the [0,1] interval and converted to
- * 8bit data.
+ * See io_png_write_rows(), and io_png_write_flt_from_mem() for the
+ * output buffer.
  *
- * @param fname PNG file name
- * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
- * @param nx, ny, nc number of columns, lines and channels of the image
+ * @param bufp pointer to the output buffer, NULL or allocated by
+ *        malloc(), reallocated if needed
+ * @param sizep pointer to the output buffer size, updated
+ * @return the PNG data length, abort() on error
  */
-void io_png_write_flt(const char *fname, const float *data,
-                      size_t nx, size_t ny, size_t nc)
+size_t io_png_write_rows_mem(unsigned char **bufp, size_t * sizep,
+                             size_t nx, size_t ny, size_t nc,
+                             io_png_opt_t opt,
+                             io_png_fill_fn row_fn, void *ctx)
 {
-    io_png_write_flt_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
+    _io_png_mem_t mem;
+
+    if (NULL == bufp || NULL == sizep || NULL == row_fn)
+        _IO_PNG_ABORT("bad parameters");
+
+    mem.buf = (png_byte *) * bufp;
+    mem.size = (NULL == *bufp ? 0 : *sizep);
+    mem.len = 0;
+    mem.pos = 0;
+    _io_png_write_rows_io((png_voidp) & mem, &_io_png_mem_write_fn,
+                          &_io_png_mem_flush_fn,
+                          nx, ny, nc, opt, row_fn, ctx);
+    *bufp = (unsigned char *) mem.buf;
+    *sizep = mem.size;
+    return mem.len;
+}
+
+/** @brief source of io_png_write_*_from() */
+typedef struct _io_png_from_s {
+    const void *const *data;    /* channel planes */
+    size_t nx, nc;              /* number of columns and planes */
+    size_t stride;              /* plane row stride, in samples */
+    int flt;                    /* float planes, else unsigned char */
+} _io_png_from_t;
+
+/**
+ * @brief row callback of io_png_write_*_from(), interlace one row
+ *
+ * The float quantization is the same as _io_png_flt2byte().
+ */
+static void _io_png_from_row(png_byte * row, size_t y, void *ctx)
+{
+    _io_png_from_t *from = (_io_png_from_t *) ctx;
+    size_t c, x, nc;
+    float tmp, max;
+
+    STATS_TOGGLE(STATS_INTERLACE);
+    nc = from->nc;
+    max = (float) 255;
+    for (c = 0; c < nc; c++) {
+        if (from->flt) {
+            const float *src = (const float *) from->data[c]
+                + y * from->stride;
+            for (x = 0; x < from->nx; x++) {
+                tmp = src[x] * max + .5;
+                row[x * nc + c] = (png_byte) (tmp < 0. ? 0.
+                                              : (tmp > max ? max : tmp));
+            }
+        }
+        else {
+            const unsigned char *src = (const unsigned char *) from->data[c]
+                + y * from->stride;
+            for (x = 0; x < from->nx; x++)
+                row[x * nc + c] = (png_byte) src[x];
+        }
+    }
+    STATS_TOGGLE(STATS_INTERLACE);
+    return;
+}
+
+/** @brief set up the source of io_png_write_*_from() */
+static void _io_png_from_init(_io_png_from_t * from,
+                              const void *const *data,
+                              size_t nx, size_t nc, size_t stride, int flt)
+{
+    if (NULL == data || stride < nx)
+        _IO_PNG_ABORT("bad parameters");
+
+    from->data = data;
+    from->nx = nx;
+    from->nc = nc;
+    from->stride = stride;
+    from->flt = flt;
     return;
 }
 
 /**
- * @brief write an unsigned char array into a 8bit PNG file
+ * @brief write caller-provided float planes into a PNG file
  *
- * The array values are taken from the [0,UCHAR_MAX] interval and
- * converted to float in the [0,1] interval before being saved as 8bit
- * fixed-point data. See io_png_write_flt_opt() for details.
+ * The image is written row by row from the channel planes, with
+ * values taken from the [0,1] interval and converted to 8bit data,
+ * without any full-image temporary buffer. The PNG file is the same
+ * as with io_png_write_flt_opt().
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param data array of nc pointers to the channel planes
+ * @param nx, ny, nc number of columns, lines and channels
+ * @param stride distance between two rows in a plane, in samples,
+ *        at least nx
+ * @param opt processing option, can be IO_PNG_OPT_ADAM7,
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
+ *         IO_PNG_OPT_NONE to do nothing
+ * @return void, abort() on error
  */
-void io_png_write_uchar_opt(const char *fname, const unsigned char *data,
-                            size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+void io_png_write_flt_from(const char *fname, const float *const *data,
+                           size_t nx, size_t ny, size_t nc, size_t stride,
+                           io_png_opt_t opt)
 {
-    float *flt_data;
+    _io_png_from_t from;
 
-    flt_data = _io_png_uchar2flt(data, nx * ny * nc);
-    _io_png_write(fname, flt_data, nx, ny, nc, opt);
-    free(flt_data);
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_from_init(&from, (const void *const *) data, nx, nc, stride, 1);
+    io_png_write_rows(fname, nx, ny, nc, opt, &_io_png_from_row,
+                       (void *) &from);
     return;
 }
 
 /**
- * @brief write an unsigned char array into a 8bit PNG file
+ * @brief write caller-provided unsigned char planes into a PNG file
  *
- * The array values are taken from the [0,UCHAR_MAX] interval and
- * converted to float in the [0,1] interval before being saved as 8bit
- * fixed-point data.
+ * The array values are taken from the [0,UCHAR_MAX] interval. See
+ * io_png_write_flt_from() for details.
+ */
+void io_png_write_uchar_from(const char *fname,
+                             const unsigned char *const *data,
+                             size_t nx, size_t ny, size_t nc, size_t stride,
+                             io_png_opt_t opt)
+{
+    _io_png_from_t from;
+
+    if (NULL == fname)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_from_init(&from, (const void *const *) data, nx, nc, stride, 0);
+    io_png_write_rows(fname, nx, ny, nc, opt, &_io_png_from_row,
+                       (void *) &from);
+    return;
+}
+
+/**
+ * @brief write caller-provided float planes as a PNG image in a
+ * memory buffer
  *
- * @param fname PNG file name
- * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
- * @param nx, ny, nc number of columns, lines and channels of the image
+ * The PNG data is the same as with io_png_write_flt_from(). The
+ * output buffer is handled like in getline(): *bufp is NULL or a
+ * buffer of *sizep bytes allocated by malloc(), and it is reallocated
+ * if needed, so the same buffer can be used for successive images.
+ *
+ * @param bufp pointer to the output buffer
+ * @param sizep pointer to the output buffer size
+ * @param data array of nc pointers to the channel planes
+ * @param nx, ny, nc number of columns, lines and channels
+ * @param stride distance between two rows in a plane, in samples
+ * @param opt processing option, see io_png_write_flt_from()
+ * @return the PNG data length, abort() on error
+ */
+size_t io_png_write_flt_from_mem(unsigned char **bufp, size_t * sizep,
+                                 const float *const *data,
+                                 size_t nx, size_t ny, size_t nc,
+                                 size_t stride, io_png_opt_t opt)
+{
+    _io_png_from_t from;
+
+    if (NULL == bufp || NULL == sizep)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_from_init(&from, (const void *const *) data, nx, nc, stride, 1);
+    return io_png_write_rows_mem(bufp, sizep, nx, ny, nc, opt,
+                                  &_io_png_from_row, (void *) &from);
+}
+
+/**
+ * @brief write caller-provided unsigned char planes as a PNG image in
+ * a memory buffer
+ *
+ * See io_png_write_flt_from_mem().
+ */
+size_t io_png_write_uchar_from_mem(unsigned char **bufp, size_t * sizep,
+                                   const unsigned char *const *data,
+                                   size_t nx, size_t ny, size_t nc,
+                                   size_t stride, io_png_opt_t opt)
+{
+    _io_png_from_t from;
+
+    if (NULL == bufp || NULL == sizep)
+        _IO_PNG_ABORT("bad parameters");
+
+    _io_png_from_init(&from, (const void *const *) data, nx, nc, stride, 0);
+    return io_png_write_rows_mem(bufp, sizep, nx, ny, nc, opt,
+                                  &_io_png_from_row, (void *) &from);
+}
+
+/**
+ * @brief write palette indexes and a palette as a palette PNG image
+ *
+ * The palette and alpha values are in the io_png_read_pal() format;
+ * the indexes are packed in 1, 2, 4 or 8 bits, depending on the
+ * number of palette entries. Without alpha values, there is no tRNS
+ * chunk.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param idx palette indexes, nx x ny samples
+ * @param nx, ny number of columns and lines
+ * @param pal palette, 3 x 256 samples
+ * @param npal number of palette entries, in [1,256]
+ * @param trns alpha values, 256 samples
+ * @param ntrns number of alpha values to write, 0 for none
+ * @param opt processing option, can be IO_PNG_OPT_ADAM7,
+ *         IO_PNG_OPT_ZMIN or IO_PNG_OPT_ZMAX,
+ *         IO_PNG_OPT_NONE to do nothing
  * @return void, abort() on error
  */
-void io_png_write_uchar(const char *fname, const unsigned char *data,
-                        size_t nx, size_t ny, size_t nc)
+void io_png_write_pal(const char *fname, const unsigned char *idx,
+                      size_t nx, size_t ny,
+                      const unsigned char *pal, size_t npal,
+                      const unsigned char *trns, size_t ntrns,
+                      io_png_opt_t opt)
 {
-    io_png_write_uchar_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_color plte[256];
+    png_bytep *row_pointers;
+    int bit_depth, interlace, compression_level;
+    size_t i;
+    /* volatile: because of setjmp/longjmp */
+    FILE *volatile fp;
+    /* error structure */
+    _io_png_err_t err;
+
+    if (NULL == fname || NULL == idx || NULL == pal || NULL == trns
+        || 0 == nx || 0 == ny || 0 == npal || 256 < npal || 256 < ntrns)
+        _IO_PNG_ABORT("bad parameters");
+
+    for (i = 0; i < npal; i++) {
+        plte[i].red = pal[i];
+        plte[i].green = pal[256 + i];
+        plte[i].blue = pal[512 + i];
+    }
+    bit_depth = (2 >= npal ? 1 : (4 >= npal ? 2 : (16 >= npal ? 4 : 8)));
+
+    fp = _io_png_open_write(fname);
+    row_pointers = _IO_PNG_SAFE_MALLOC(ny, png_bytep);
+    for (i = 0; i < ny; i++)
+        row_pointers[i] = (png_bytep) idx + nx * i;
+
+    if (NULL == (png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                   &err, &_io_png_err_hdl,
+                                                   NULL)))
+        _IO_PNG_ABORT("libpng initialization error");
+    if (NULL == (info_ptr = png_create_info_struct(png_ptr)))
+        _IO_PNG_ABORT("libpng initialization error");
+
+    /* if we get here, we had a problem writing to the file */
+    if (0 != setjmp(err.jmpbuf))
+        _IO_PNG_ABORT("libpng writing error");
+
+    png_set_write_fn(png_ptr, (png_voidp) fp, &_io_png_write_fn,
+                     &_io_png_flush_fn);
+
+    /* set image header, palette and compression */
+    interlace = ((opt & IO_PNG_OPT_ADAM7)
+                 ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE);
+    png_set_IHDR(png_ptr, info_ptr, (png_uint_32) nx, (png_uint_32) ny,
+                 bit_depth, PNG_COLOR_TYPE_PALETTE, interlace,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_set_PLTE(png_ptr, info_ptr, plte, (int) npal);
+    if (0 < ntrns)
+        png_set_tRNS(png_ptr, info_ptr, (png_bytep) trns, (int) ntrns,
+                     NULL);
+    compression_level = 5;
+    if (opt & IO_PNG_OPT_ZMIN)
+        compression_level = 0;
+    if (opt & IO_PNG_OPT_ZMAX)
+        compression_level = 9;
+    png_set_compression_level(png_ptr, compression_level);
+
+    /* write the packed indexes, the interlacing is handled by libpng */
+    STATS_TOGGLE(STATS_ENCODE);
+    png_write_info(png_ptr, info_ptr);
+    png_set_packing(png_ptr);
+    png_write_image(png_ptr, row_pointers);
+    png_write_end(png_ptr, info_ptr);
+    STATS_TOGGLE(STATS_ENCODE);
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    _io_png_free(row_pointers);
+    if (stdout != fp)
+        (void) fclose(fp);
     return;
 }
 
+/*
+ * ANIMATED PNG
+ */
+
+/*
+ * An APNG image is a PNG image with an acTL chunk, and an fcTL chunk
+ * before the data of each frame; the first frame is in the IDAT
+ * chunks, the next ones in fdAT chunks, the IDAT data with a sequence
+ * number. The IDAT image without fcTL chunk is only the default image
+ * for the PNG decoders, not a frame of the animation.
+ *
+ * Each frame is handled as a standalone PNG image, with the header
+ * of the frame size and the chunks of the APNG image before its data
+ * (PLTE, tRNS, ...): the frames are read and written as any other PNG
+ * image, possibly in parallel, and only their data is spliced into
+ * the APNG image.
+ */
+
+/** @brief PNG signature */
+static const png_byte _io_png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+/** @brief the APNG image is not valid */
+#define _IO_PNG_ANIM_ABORT() _IO_PNG_ABORT("the file is not a valid APNG image")
+
 /**
- * @brief write an unsigned short array into a 8bit PNG file
+ * @brief update a CRC-32 of the PNG chunks
  *
- * The array values are taken from the [0,USHRT_MAX] interval and
- * converted to float in the [0,1] interval before being saved as 8bit
- * fixed-point data. See io_png_write_flt_opt() for details.
+ * The ISO 3309 CRC, computed 4 bits at a time with a small table.
+ *
+ * @param crc CRC of the previous bytes, 0 for the first ones
+ * @param buf, len new bytes
+ * @return the updated CRC
  */
-void io_png_write_ushrt_opt(const char *fname, const unsigned short *data,
-                            size_t nx, size_t ny, size_t nc, io_png_opt_t opt)
+static png_uint_32 _io_png_crc(png_uint_32 crc, const png_byte * buf,
+                               size_t len)
 {
-    float *flt_data;
+    static const png_uint_32 table[16] = {
+        0x00000000UL, 0x1db71064UL, 0x3b6e20c8UL, 0x26d930acUL,
+        0x76dc4190UL, 0x6b6b51f4UL, 0x4db26158UL, 0x5005713cUL,
+        0xedb88320UL, 0xf00f9344UL, 0xd6d6a3e8UL, 0xcb61b38cUL,
+        0x9b64c2b0UL, 0x86d3d2d4UL, 0xa00ae278UL, 0xbdbdf21cUL
+    };
+    size_t i;
 
-    flt_data = _io_png_ushrt2flt(data, nx * ny * nc);
-    _io_png_write(fname, flt_data, nx, ny, nc, opt);
-    free(flt_data);
+    crc = ~crc & 0xffffffffUL;
+    for (i = 0; i < len; i++) {
+        crc = table[(crc ^ buf[i]) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (buf[i] >> 4)) & 0x0f] ^ (crc >> 4);
+    }
+    return ~crc & 0xffffffffUL;
+}
+
+/** @brief append bytes to a growing memory buffer */
+static void _io_png_mem_put(_io_png_mem_t * mem,
+                            const png_byte * data, size_t len)
+{
+    if (len > mem->size - mem->len) {
+        mem->size = 2 * mem->size + len;
+        mem->buf = _IO_PNG_SAFE_REALLOC(mem->buf, mem->size, png_byte);
+    }
+    memcpy(mem->buf + mem->len, data, len);
+    mem->len += len;
     return;
 }
 
 /**
- * @brief write an unsigned short array into a 8bit PNG file
+ * @brief append a PNG chunk to a growing memory buffer
  *
- * The array values are taken from the [0,USHRT_MAX] interval and
- * converted to float in the [0,1] interval before being saved as 8bit
- * fixed-point data.
+ * @param mem output buffer
+ * @param type chunk type
+ * @param seq sequence number written before the data, NULL for none
+ * @param data, len chunk data
+ */
+static void _io_png_mem_chunk(_io_png_mem_t * mem, const char *type,
+                              const png_byte * seq,
+                              const png_byte * data, size_t len)
+{
+    png_byte buf[4];
+    png_uint_32 crc;
+
+    png_save_uint_32(buf, (png_uint_32) (len + (NULL != seq ? 4 : 0)));
+    _io_png_mem_put(mem, buf, 4);
+    _io_png_mem_put(mem, (const png_byte *) type, 4);
+    crc = _io_png_crc(0, (const png_byte *) type, 4);
+    if (NULL != seq) {
+        _io_png_mem_put(mem, seq, 4);
+        crc = _io_png_crc(crc, seq, 4);
+    }
+    _io_png_mem_put(mem, data, len);
+    crc = _io_png_crc(crc, data, len);
+    png_save_uint_32(buf, crc);
+    _io_png_mem_put(mem, buf, 4);
+    return;
+}
+
+/**
+ * @brief next chunk of a PNG image in memory
  *
- * @param fname PNG file name
- * @param data deinterlaced (RRR.GGG.BBB.AAA.) array to write
- * @param nx, ny, nc number of columns, lines and channels of the image
+ * @param buf, len PNG image
+ * @param pos position of the chunk, updated to the next one
+ * @param check check the chunk CRC
+ * @param type output chunk type, 4 characters
+ * @param datap, lenp output chunk data and length
+ * @return 0, or -1 at the end of the image, abort() on error
+ */
+static int _io_png_next_chunk(const png_byte * buf, size_t len,
+                              size_t * pos, int check, char *type,
+                              const png_byte ** datap, size_t * lenp)
+{
+    size_t clen;
+
+    if (*pos == len)
+        return -1;
+    if (12 > len - *pos)
+        _IO_PNG_ANIM_ABORT();
+    clen = (size_t) png_get_uint_32((png_bytep) buf + *pos);
+    if (clen > len - *pos - 12)
+        _IO_PNG_ANIM_ABORT();
+    if (check && png_get_uint_32((png_bytep) buf + *pos + 8 + clen)
+        != _io_png_crc(0, buf + *pos + 4, clen + 4))
+        _IO_PNG_ABORT("libpng error: CRC error");
+    memcpy(type, buf + *pos + 4, 4);
+    *datap = buf + *pos + 8;
+    *lenp = clen;
+    *pos += clen + 12;
+    return 0;
+}
+
+/**
+ * @brief start the standalone PNG image of a frame
+ *
+ * @param frame frame, its buffer is reset
+ * @param ihdr image header data
+ * @param nx, ny frame size
+ * @param head chunks of the image before its data
+ */
+static void _io_png_frame_start(io_png_frame_t * frame,
+                                const png_byte * ihdr, size_t nx, size_t ny,
+                                const _io_png_mem_t * head)
+{
+    _io_png_mem_t mem;
+    png_byte hdr[13];
+
+    memcpy(hdr, ihdr, 13);
+    png_save_uint_32(hdr, (png_uint_32) nx);
+    png_save_uint_32(hdr + 4, (png_uint_32) ny);
+    mem.buf = NULL;
+    mem.len = 0;
+    mem.size = 0;
+    mem.pos = 0;
+    _io_png_mem_put(&mem, _io_png_sig, 8);
+    _io_png_mem_chunk(&mem, "IHDR", NULL, hdr, 13);
+    _io_png_mem_put(&mem, head->buf, head->len);
+    frame->png = (unsigned char *) mem.buf;
+    frame->len = mem.len;
+    frame->size = mem.size;
+    return;
+}
+
+/** @brief append a chunk to the standalone PNG image of a frame */
+static void _io_png_frame_chunk(io_png_frame_t * frame, const char *type,
+                                const png_byte * data, size_t len)
+{
+    _io_png_mem_t mem;
+
+    mem.buf = (png_byte *) frame->png;
+    mem.len = frame->len;
+    mem.size = frame->size;
+    mem.pos = 0;
+    _io_png_mem_chunk(&mem, type, NULL, data, len);
+    frame->png = (unsigned char *) mem.buf;
+    frame->len = mem.len;
+    frame->size = mem.size;
+    return;
+}
+
+/**
+ * @brief read an animated PNG image as standalone frames
+ *
+ * The file is read in memory and split in frames; each frame is a
+ * standalone PNG image of the frame size, to be decoded with the
+ * io_png_*_mem() functions, with the position, delay and dispose and
+ * blend operations of the APNG fcTL chunk. The default image of an
+ * APNG image is the first frame; if it is not part of the animation,
+ * anim->hidden is set. A PNG image without acTL chunk is read as a
+ * still image of one frame.
+ *
+ * The number of channels of the frames is the number of channels of
+ * their decoded rows, see io_png_probe(): with a tRNS chunk, the
+ * palette images have 4 channels.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param anim output animation, to be freed by io_png_free_anim()
+ * @param opt read option, IO_PNG_OPT_TRUSTED to skip the CRC checks,
+ *        or IO_PNG_OPT_NONE
+ * @return void, abort() on error
+ */
+void io_png_read_anim(const char *fname, io_png_anim_t * anim,
+                      io_png_opt_t opt)
+{
+    FILE *fp;
+    _io_png_mem_t file, head;
+    const png_byte *ihdr, *data;
+    char type[4];
+    size_t pos, len, nb_fctl, k, nx, ny, x0, y0;
+    int check, idat;
+    io_png_frame_t *frame;
+
+    if (NULL == fname || NULL == anim)
+        _IO_PNG_ABORT("bad parameters");
+
+    /* read the whole file */
+    fp = _io_png_open_read(fname);
+    file.buf = NULL;
+    file.len = 0;
+    file.size = 0;
+    file.pos = 0;
+    do {
+        if (file.size == file.len) {
+            file.size = 2 * file.size + 65536;
+            file.buf = _IO_PNG_SAFE_REALLOC(file.buf, file.size, png_byte);
+        }
+        file.len += _io_png_fread(file.buf + file.len,
+                                  file.size - file.len, fp);
+    } while (file.size == file.len);
+    if (stdin != fp)
+        (void) fclose(fp);
+    io_png_probe_mem(file.buf, file.len, &anim->nx, &anim->ny,
+                     &anim->nc, NULL);
+    ihdr = file.buf + 16;
+    check = !(opt & IO_PNG_OPT_TRUSTED);
+
+    /* first pass: animation control, and the chunks before the data */
+    head.buf = NULL;
+    head.len = 0;
+    head.size = 0;
+    head.pos = 0;
+    anim->animated = 0;
+    anim->hidden = 0;
+    anim->nb_plays = 0;
+    nb_fctl = 0;
+    idat = 0;
+    pos = 8;
+    while (0 == _io_png_next_chunk(file.buf, file.len, &pos, check,
+                                   type, &data, &len)) {
+        if (0 == memcmp(type, "IEND", 4))
+            break;
+        else if (0 == memcmp(type, "acTL", 4) && 8 == len && !idat) {
+            anim->animated = 1;
+            anim->nb_plays = (unsigned long) png_get_uint_32((png_bytep)
+                                                             data + 4);
+        }
+        else if (0 == memcmp(type, "fcTL", 4))
+            nb_fctl++;
+        else if (0 == memcmp(type, "IDAT", 4)) {
+            if (!idat && 0 == nb_fctl)
+                anim->hidden = 1;
+            idat = 1;
+        }
+        else if (!idat && 0 != memcmp(type, "IHDR", 4)
+                 && 0 != memcmp(type, "fdAT", 4)) {
+            /* PLTE, tRNS and the other chunks of the frames */
+            _io_png_mem_put(&head, file.buf + pos - len - 12, len + 12);
+        }
+    }
+    if (!idat)
+        _IO_PNG_ANIM_ABORT();
+    if (!anim->animated) {
+        anim->hidden = 0;
+        nb_fctl = 0;
+    }
+    anim->nb_frames = (anim->animated ? nb_fctl + anim->hidden : 1);
+    anim->frame = _IO_PNG_SAFE_MALLOC(anim->nb_frames, io_png_frame_t);
+    memset(anim->frame, 0x00, anim->nb_frames * sizeof(io_png_frame_t));
+
+    /* second pass: the frames, in the fcTL order */
+    frame = NULL;
+    k = 0;
+    pos = 8;
+    while (0 == _io_png_next_chunk(file.buf, file.len, &pos, 0,
+                                   type, &data, &len)) {
+        if (0 == memcmp(type, "IEND", 4))
+            break;
+        else if (0 == memcmp(type, "fcTL", 4) && anim->animated) {
+            if (26 != len || k == anim->nb_frames)
+                _IO_PNG_ANIM_ABORT();
+            nx = (size_t) png_get_uint_32((png_bytep) data + 4);
+            ny = (size_t) png_get_uint_32((png_bytep) data + 8);
+            x0 = (size_t) png_get_uint_32((png_bytep) data + 12);
+            y0 = (size_t) png_get_uint_32((png_bytep) data + 16);
+            if (0 == nx || 0 == ny || x0 > anim->nx || nx > anim->nx - x0
+                || y0 > anim->ny || ny > anim->ny - y0)
+                _IO_PNG_ANIM_ABORT();
+            frame = anim->frame + k++;
+            _io_png_frame_start(frame, ihdr, nx, ny, &head);
+            frame->x0 = x0;
+            frame->y0 = y0;
+            frame->delay_num = png_get_uint_16((png_bytep) data + 20);
+            frame->delay_den = png_get_uint_16((png_bytep) data + 22);
+            frame->dispose = data[24];
+            frame->blend = data[25];
+        }
+        else if (0 == memcmp(type, "IDAT", 4)) {
+            if (NULL == frame) {
+                /* default image */
+                frame = anim->frame + k++;
+                _io_png_frame_start(frame, ihdr, anim->nx, anim->ny, &head);
+            }
+            _io_png_frame_chunk(frame, "IDAT", data, len);
+        }
+        else if (0 == memcmp(type, "fdAT", 4) && anim->animated) {
+            if (4 > len || NULL == frame || anim->frame == frame)
+                _IO_PNG_ANIM_ABORT();
+            _io_png_frame_chunk(frame, "IDAT", data + 4, len - 4);
+        }
+    }
+    for (k = 0; k < anim->nb_frames; k++) {
+        if (NULL == anim->frame[k].png)
+            _IO_PNG_ANIM_ABORT();
+        _io_png_frame_chunk(anim->frame + k, "IEND", NULL, 0);
+    }
+
+    _io_png_free(head.buf);
+    _io_png_free(file.buf);
+    return;
+}
+
+/**
+ * @brief write an animated PNG image from standalone frames
+ *
+ * The frames are standalone PNG images with the same bit depth and
+ * color type, for example written by io_png_write_uchar_from_mem(),
+ * with the canvas size for the first frame; their IDAT data is
+ * spliced in the APNG image, with the frame control of anim. The
+ * chunks of the first frame before its data (PLTE, tRNS, ...) are
+ * kept for all the frames. A still image is written as it is.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param anim animation, see io_png_read_anim()
  * @return void, abort() on error
+ */
+void io_png_write_anim(const char *fname, const io_png_anim_t * anim)
+{
+    FILE *fp;
+    _io_png_mem_t out;
+    const io_png_frame_t *frame;
+    const png_byte *png, *data;
+    png_byte ihdr[13], buf[26], seq[4];
+    char type[4];
+    size_t pos, len, k, nx, ny;
+    png_uint_32 nb_seq;
+
+    if (NULL == fname || NULL == anim || NULL == anim->frame
+        || 0 == anim->nb_frames || anim->nb_frames <= (size_t) anim->hidden)
+        _IO_PNG_ABORT("bad parameters");
+
+    out.buf = NULL;
+    out.len = 0;
+    out.size = 0;
+    out.pos = 0;
+    nb_seq = 0;
+    for (k = 0; k < anim->nb_frames; k++) {
+        frame = anim->frame + k;
+        png = (const png_byte *) frame->png;
+        io_png_probe_mem(png, frame->len, &nx, &ny, NULL, NULL);
+        if (!anim->animated) {
+            _io_png_mem_put(&out, png, frame->len);
+            break;
+        }
+        if (0 == k) {
+            /* signature, header and animation control */
+            memcpy(ihdr, png + 16, 13);
+            png_save_uint_32(ihdr, (png_uint_32) anim->nx);
+            png_save_uint_32(ihdr + 4, (png_uint_32) anim->ny);
+            _io_png_mem_put(&out, _io_png_sig, 8);
+            _io_png_mem_chunk(&out, "IHDR", NULL, ihdr, 13);
+            png_save_uint_32(buf, (png_uint_32)
+                             (anim->nb_frames - anim->hidden));
+            png_save_uint_32(buf + 4, (png_uint_32) anim->nb_plays);
+            _io_png_mem_chunk(&out, "acTL", NULL, buf, 8);
+            /* the chunks before the data, for all the frames */
+            pos = 33;
+            while (0 == _io_png_next_chunk(png, frame->len, &pos, 0,
+                                           type, &data, &len)
+                   && 0 != memcmp(type, "IDAT", 4)
+                   && 0 != memcmp(type, "IEND", 4))
+                _io_png_mem_put(&out, data - 8, len + 12);
+        }
+        else if (0 != memcmp(png + 24, ihdr + 8, 5))
+            _IO_PNG_ABORT("the frames differ in bit depth or color type");
+        if (0 != k || !anim->hidden) {
+            /* frame control */
+            png_save_uint_32(buf, nb_seq++);
+            png_save_uint_32(buf + 4, (png_uint_32) nx);
+            png_save_uint_32(buf + 8, (png_uint_32) ny);
+            png_save_uint_32(buf + 12, (png_uint_32) frame->x0);
+            png_save_uint_32(buf + 16, (png_uint_32) frame->y0);
+            png_save_uint_16(buf + 20, (png_uint_16) frame->delay_num);
+            png_save_uint_16(buf + 22, (png_uint_16) frame->delay_den);
+            buf[24] = (png_byte) frame->dispose;
+            buf[25] = (png_byte) frame->blend;
+            _io_png_mem_chunk(&out, "fcTL", NULL, buf, 26);
+        }
+        /* frame data */
+        pos = 33;
+        while (0 == _io_png_next_chunk(png, frame->len, &pos, 0,
+                                       type, &data, &len)) {
+            if (0 != memcmp(type, "IDAT", 4))
+                continue;
+            else if (0 == k)
+                _io_png_mem_chunk(&out, "IDAT", NULL, data, len);
+            else {
+                png_save_uint_32(seq, nb_seq++);
+                _io_png_mem_chunk(&out, "fdAT", seq, data, len);
+            }
+        }
+    }
+    if (anim->animated)
+        _io_png_mem_chunk(&out, "IEND", NULL, NULL, 0);
+
+    /* write the image */
+    fp = _io_png_open_write(fname);
+    if (out.len != fwrite(out.buf, 1, out.len, fp))
+        _IO_PNG_ABORT("write error");
+    if (stdout != fp)
+        (void) fclose(fp);
+    else
+        (void) fflush(fp);
+    _io_png_free(out.buf);
+    return;
+}
+
+/**
+ * @brief free the frames of an animated PNG image
  *
- * @todo save in 16bits
+ * @param anim animation, see io_png_read_anim()
  */
-void io_png_write_ushrt(const char *fname, const unsigned short *data,
-                        size_t nx, size_t ny, size_t nc)
+void io_png_free_anim(io_png_anim_t * anim)
 {
-    io_png_write_ushrt_opt(fname, data, nx, ny, nc, IO_PNG_OPT_NONE);
+    size_t k;
+
+    if (NULL == anim)
+        _IO_PNG_ABORT("bad parameters");
+
+    for (k = 0; k < anim->nb_frames; k++)
+        _io_png_free(anim->frame[k].png);
+    _io_png_free(anim->frame);
+    anim->frame = NULL;
+    anim->nb_frames = 0;
     return;
 }
@@ -15,9 +15,40 @@ typedef enum io_png_opt_e {
     IO_PNG_OPT_GRAY = 0x02,
     IO_PNG_OPT_ADAM7 = 0x10,
     IO_PNG_OPT_ZMIN = 0x20,
-    IO_PNG_OPT_ZMAX = 0x40
+    IO_PNG_OPT_ZMAX = 0x40,
+    IO_PNG_OPT_TRUSTED = 0x80
 } io_png_opt_t;
 
+/** @brief header callback of io_png_read_rows() */
+typedef void (*io_png_head_fn) (size_t nx, size_t ny, size_t nc, void *ctx);
+/** @brief row callback of io_png_read_rows() */
+typedef void (*io_png_row_fn) (const unsigned char *row, size_t y,
+                               size_t x0, size_t dx, void *ctx);
+/** @brief row callback of io_png_write_rows() */
+typedef void (*io_png_fill_fn) (unsigned char *row, size_t y, void *ctx);
+
+/** @brief frame of an animated PNG image, see io_png_read_anim() */
+typedef struct io_png_frame_s {
+    unsigned char *png;         /* standalone PNG image of the frame */
+    size_t len;                 /* PNG image length, in bytes */
+    size_t size;                /* allocated size of png */
+    size_t x0, y0;              /* frame offset in the canvas */
+    unsigned int delay_num, delay_den;  /* frame delay, in seconds */
+    unsigned int dispose, blend;        /* fcTL dispose and blend ops */
+} io_png_frame_t;
+
+/** @brief animated PNG image, see io_png_read_anim() */
+typedef struct io_png_anim_s {
+    size_t nx, ny;              /* canvas size */
+    size_t nc;                  /* number of channels of the frames */
+    int animated;               /* APNG image, else a still PNG image */
+    int hidden;                 /* the first frame is the default image,
+                                 * not part of the animation */
+    unsigned long nb_plays;     /* number of loops, 0 for infinite */
+    size_t nb_frames;           /* number of frames */
+    io_png_frame_t *frame;      /* frames */
+} io_png_anim_t;
+
 /* io_png.c */
 char *io_png_info(void);
 float *io_png_read_flt_opt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, io_png_opt_t opt);
@@ -26,9 +57,34 @@ unsigned char *io_png_read_uchar_opt(const char *fname, size_t *nxp, size_t *nyp
 unsigned char *io_png_read_uchar(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
 unsigned short *io_png_read_ushrt_opt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, io_png_opt_t opt);
 unsigned short *io_png_read_ushrt(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp);
+void io_png_read_rows_opt(const char *fname, io_png_opt_t opt, io_png_head_fn head_fn, io_png_row_fn row_fn, void *ctx);
+void io_png_read_rows(const char *fname, io_png_head_fn head_fn, io_png_row_fn row_fn, void *ctx);
+int io_png_read_rows_passes(const char *fname, int passes, io_png_head_fn head_fn, io_png_row_fn row_fn, void *ctx);
+void io_png_read_rows_mem(const unsigned char *buf, size_t len, io_png_head_fn head_fn, io_png_row_fn row_fn, void *ctx);
+void io_png_probe(const char *fname, size_t *nxp, size_t *nyp, size_t *ncp, size_t *bdp);
+void io_png_probe_mem(const unsigned char *buf, size_t len, size_t *nxp, size_t *nyp, size_t *ncp, size_t *bdp);
+int io_png_probe_pal(const char *fname);
+void io_png_read_flt_into(const char *fname, float *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+void io_png_read_uchar_into(const char *fname, unsigned char *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+void io_png_read_flt_into_mem(const unsigned char *buf, size_t len, float *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+void io_png_read_uchar_into_mem(const unsigned char *buf, size_t len, unsigned char *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+unsigned char *io_png_read_pal(const char *fname, size_t *nxp, size_t *nyp, unsigned char *pal, size_t *npalp, unsigned char *trns, size_t *ntrnsp, io_png_opt_t opt);
+void io_png_write_flt_opt(const char *fname, const float *data, size_t nx, size_t ny, size_t nc, io_png_opt_t opt);
 void io_png_write_flt(const char *fname, const float *data, size_t nx, size_t ny, size_t nc);
+void io_png_write_uchar_opt(const char *fname, const unsigned char *data, size_t nx, size_t ny, size_t nc, io_png_opt_t opt);
 void io_png_write_uchar(const char *fname, const unsigned char *data, size_t nx, size_t ny, size_t nc);
+void io_png_write_ushrt_opt(const char *fname, const unsigned short *data, size_t nx, size_t ny, size_t nc, io_png_opt_t opt);
 void io_png_write_ushrt(const char *fname, const unsigned short *data, size_t nx, size_t ny, size_t nc);
+void io_png_write_rows(const char *fname, size_t nx, size_t ny, size_t nc, io_png_opt_t opt, io_png_fill_fn row_fn, void *ctx);
+size_t io_png_write_rows_mem(unsigned char **bufp, size_t *sizep, size_t nx, size_t ny, size_t nc, io_png_opt_t opt, io_png_fill_fn row_fn, void *ctx);
+void io_png_write_flt_from(const char *fname, const float *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+void io_png_write_uchar_from(const char *fname, const unsigned char *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+size_t io_png_write_flt_from_mem(unsigned char **bufp, size_t *sizep, const float *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+size_t io_png_write_uchar_from_mem(unsigned char **bufp, size_t *sizep, const unsigned char *const *data, size_t nx, size_t ny, size_t nc, size_t stride, io_png_opt_t opt);
+void io_png_write_pal(const char *fname, const unsigned char *idx, size_t nx, size_t ny, const unsigned char *pal, size_t npal, const unsigned char *trns, size_t ntrns, io_png_opt_t opt);
+void io_png_read_anim(const char *fname, io_png_anim_t *anim, io_png_opt_t opt);
+void io_png_write_anim(const char *fname, const io_png_anim_t *anim);
+void io_png_free_anim(io_png_anim_t *anim);
 
 #ifdef __cplusplus
 }
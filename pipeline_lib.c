@@ -0,0 +1,856 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file pipeline_lib.c
+ * @brief streaming image read, statistics and write
+ *
+ * The PNG image is decoded by a reader thread, and the decoded rows
+ * are passed through a ring buffer to the calling thread, which
+ * deinterleaves them and updates the channel histograms. When the
+ * last row is received, the histograms are complete and only the
+ * rescaling is left to do.
+ *
+ * The reader thread is used if the code is compiled with POSIX
+ * threads (-pthread, which defines _REENTRANT); otherwise the rows
+ * are processed in the libpng row callback, in the same order.
+ *
+ * With normalization tables known in advance, for example from preview
+ * statistics computed on the first Adam7 pass, the rows are also
+ * normalized by blocks while the image is decoded.
+ *
+ * On the output side, downscaled copies of the image are computed from
+ * the rows being encoded, and encoded by their own threads.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#ifdef _REENTRANT
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+
+#include "io_png.h"
+#include "balance_lib.h"
+#include "stats_lib.h"
+#include "pool_lib.h"
+
+/* ensure consistency */
+#include "pipeline_lib.h"
+
+/** @brief number of rows in the ring buffer */
+#define PIPELINE_SLOTS 64
+
+/** @brief minimum number of samples per channel counted at once */
+#define PIPELINE_HISTO_MIN (1 << 16)
+
+/** @brief consumer state, the planes and histograms being filled */
+typedef struct pipeline_dst_s {
+    unsigned char *rgb;         /* R, G and B planes, or gray plane */
+    size_t *histo;              /* R, G and B histograms */
+    const unsigned char *lut;   /* R, G and B normalization, or NULL */
+    int gray;                   /* gray images read in one plane */
+    size_t nx, ny, nc;          /* image size, channels in the rows */
+    size_t np;                  /* number of planes, 1 or 3 */
+    size_t y_histo, y_seq;      /* first row not counted, next in sequence */
+} pipeline_dst_t;
+
+/**
+ * @brief allocate the planes when the image size is known
+ */
+static void dst_head(pipeline_dst_t * dst, size_t nx, size_t ny, size_t nc)
+{
+    dst->nx = nx;
+    dst->ny = ny;
+    dst->nc = nc;
+    dst->np = (dst->gray && 3 > nc ? 1 : 3);
+    dst->y_histo = 0;
+    dst->y_seq = 0;
+    if (NULL == (dst->rgb = (unsigned char *)
+                 malloc(dst->np * nx * ny * sizeof(unsigned char))))
+        pool_abort("not enough memory");
+    STATS_ALLOC(dst->rgb, dst->np * nx * ny * sizeof(unsigned char));
+    return;
+}
+
+/**
+ * @brief update the histograms with the rows received in sequence,
+ * then normalize these rows if there is a normalization table
+ */
+static void dst_flush(pipeline_dst_t * dst)
+{
+    size_t c, size;
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    size = (dst->y_seq - dst->y_histo) * dst->nx;
+    for (c = 0; c < dst->np; c++)
+        balance_histo_u8(dst->rgb + c * dst->nx * dst->ny
+                         + dst->y_histo * dst->nx, size,
+                         dst->histo + c * (UCHAR_MAX + 1));
+    STATS_TOGGLE(STATS_STATISTICS);
+    if (NULL != dst->lut) {
+        /* the block is still in cache */
+        STATS_TOGGLE(STATS_APPLY);
+        balance_lut_apply_u8(dst->rgb + dst->y_histo * dst->nx, size,
+                             dst->nx * dst->ny, dst->np, dst->lut);
+        STATS_TOGGLE(STATS_APPLY);
+    }
+    dst->y_histo = dst->y_seq;
+    return;
+}
+
+/**
+ * @brief deinterleave one row and update the histograms
+ *
+ * The channels are the same as with io_png_read_uchar_into() and
+ * IO_PNG_OPT_RGB: gray is copied in R, G and B, alpha is dropped;
+ * or gray is only copied in one plane, see pipeline_read_lut_u8().
+ * Only the pixels x0, x0 + dx, ... are set, see io_png_read_rows().
+ *
+ * The complete rows received in sequence, all of them for a
+ * non-interlaced image, are counted by blocks of at least
+ * PIPELINE_HISTO_MIN pixels, with the faster balance_histo_u8().
+ * The other rows are counted pixel per pixel. The histograms are
+ * always the ones of the decoded values, before the normalization.
+ */
+static void dst_row(pipeline_dst_t * dst, const unsigned char *row,
+                    size_t y, size_t x0, size_t dx)
+{
+    unsigned char *plane;
+    size_t *histo;
+    size_t c, sc, x, nc;
+    int seq;
+
+    STATS_TOGGLE(STATS_INTERLACE);
+    nc = dst->nc;
+    seq = (1 == dx && y == dst->y_seq);
+    for (c = 0; c < dst->np; c++) {
+        /* source channel, gray->rgb reads the gray channel 3 times */
+        sc = (3 > nc ? 0 : c);
+        plane = dst->rgb + c * dst->nx * dst->ny + y * dst->nx;
+        histo = dst->histo + c * (UCHAR_MAX + 1);
+        if (seq) {
+            /* common case, no interlace, counted later */
+            const unsigned char *src = row + sc;
+            for (x = 0; x < dst->nx; x++) {
+                plane[x] = *src;
+                src += nc;
+            }
+        }
+        else if (NULL == dst->lut) {
+            for (x = x0; x < dst->nx; x += dx) {
+                plane[x] = row[x * nc + sc];
+                histo[(size_t) plane[x]] += 1;
+            }
+        }
+        else {
+            const unsigned char *lut = dst->lut + c * (UCHAR_MAX + 1);
+            for (x = x0; x < dst->nx; x += dx) {
+                histo[(size_t) row[x * nc + sc]] += 1;
+                plane[x] = lut[(size_t) row[x * nc + sc]];
+            }
+        }
+    }
+    STATS_TOGGLE(STATS_INTERLACE);
+    if (seq) {
+        dst->y_seq++;
+        if (dst->ny == dst->y_seq
+            || PIPELINE_HISTO_MIN <= (dst->y_seq - dst->y_histo) * dst->nx)
+            dst_flush(dst);
+    }
+    return;
+}
+
+#ifdef _REENTRANT
+
+/** @brief one decoded row in the ring buffer */
+typedef struct pipeline_slot_s {
+    unsigned char *row;         /* row samples */
+    size_t y, x0, dx;           /* row index and pixels set */
+} pipeline_slot_t;
+
+/** @brief ring buffer shared by the reader and the consumer */
+typedef struct pipeline_ring_s {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;   /* signaled on push, header and end */
+    pthread_cond_t not_full;    /* signaled on pop */
+    pipeline_slot_t slot[PIPELINE_SLOTS];
+    size_t head, count;         /* first used slot, number of used slots */
+    size_t nx, ny, nc;          /* image size, set by the header */
+    int has_head, done;         /* header received, last row pushed */
+    const char *fname;          /* file to read */
+    io_png_opt_t opt;           /* read option */
+} pipeline_ring_t;
+
+/**
+ * @brief reader header callback, allocate the slots and wake the consumer
+ */
+static void ring_head(size_t nx, size_t ny, size_t nc, void *ctx)
+{
+    pipeline_ring_t *ring = (pipeline_ring_t *) ctx;
+    size_t i;
+
+    for (i = 0; i < PIPELINE_SLOTS; i++) {
+        if (NULL == (ring->slot[i].row = (unsigned char *)
+                     malloc(nx * nc * sizeof(unsigned char))))
+            pool_abort("not enough memory");
+        STATS_ALLOC(ring->slot[i].row, nx * nc * sizeof(unsigned char));
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->nx = nx;
+    ring->ny = ny;
+    ring->nc = nc;
+    ring->has_head = 1;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+    return;
+}
+
+/**
+ * @brief reader row callback, copy the row into a free slot
+ */
+static void ring_row(const unsigned char *row, size_t y,
+                     size_t x0, size_t dx, void *ctx)
+{
+    pipeline_ring_t *ring = (pipeline_ring_t *) ctx;
+    pipeline_slot_t *slot;
+
+    pthread_mutex_lock(&ring->lock);
+    while (PIPELINE_SLOTS == ring->count)
+        pthread_cond_wait(&ring->not_full, &ring->lock);
+    slot = ring->slot + (ring->head + ring->count) % PIPELINE_SLOTS;
+    pthread_mutex_unlock(&ring->lock);
+
+    /* only the reader fills this slot until it is counted */
+    memcpy(slot->row, row, ring->nx * ring->nc * sizeof(unsigned char));
+    slot->y = y;
+    slot->x0 = x0;
+    slot->dx = dx;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->count++;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+    return;
+}
+
+/**
+ * @brief reader thread, decode the image and signal the end
+ */
+static void *ring_reader(void *ctx)
+{
+    pipeline_ring_t *ring = (pipeline_ring_t *) ctx;
+
+    io_png_read_rows_opt(ring->fname, ring->opt, &ring_head, &ring_row, ctx);
+
+    pthread_mutex_lock(&ring->lock);
+    ring->done = 1;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+#else                           /* !_REENTRANT */
+
+/** @brief header callback, without threads */
+static void direct_head(size_t nx, size_t ny, size_t nc, void *ctx)
+{
+    dst_head((pipeline_dst_t *) ctx, nx, ny, nc);
+    return;
+}
+
+/** @brief row callback, without threads */
+static void direct_row(const unsigned char *row, size_t y,
+                       size_t x0, size_t dx, void *ctx)
+{
+    dst_row((pipeline_dst_t *) ctx, row, y, x0, dx);
+    return;
+}
+
+#endif                          /* !_REENTRANT */
+
+/**
+ * @brief read a PNG image into the planes of a consumer state
+ *
+ * See pipeline_read_histo_u8().
+ */
+static void read_dst(const char *fname, io_png_opt_t opt,
+                     pipeline_dst_t * dst)
+{
+#ifdef _REENTRANT
+    pipeline_ring_t ring;
+    pipeline_slot_t *slot;
+    pthread_t reader;
+    size_t i;
+#endif
+
+#ifdef _REENTRANT
+    memset(&ring, 0x00, sizeof(ring));
+    ring.fname = fname;
+    ring.opt = opt;
+    if (0 != pthread_mutex_init(&ring.lock, NULL)
+        || 0 != pthread_cond_init(&ring.not_empty, NULL)
+        || 0 != pthread_cond_init(&ring.not_full, NULL)
+        || 0 != pthread_create(&reader, NULL, &ring_reader, &ring))
+        pool_abort("thread initialization error");
+
+    /* wait for the header */
+    pthread_mutex_lock(&ring.lock);
+    while (!ring.has_head)
+        pthread_cond_wait(&ring.not_empty, &ring.lock);
+    pthread_mutex_unlock(&ring.lock);
+    dst_head(dst, ring.nx, ring.ny, ring.nc);
+
+    /* consume the rows until the reader is done */
+    for (;;) {
+        pthread_mutex_lock(&ring.lock);
+        while (0 == ring.count && !ring.done)
+            pthread_cond_wait(&ring.not_empty, &ring.lock);
+        if (0 == ring.count) {
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        pthread_mutex_unlock(&ring.lock);
+
+        /* only the consumer uses this slot until it is released */
+        slot = ring.slot + ring.head;
+        dst_row(dst, slot->row, slot->y, slot->x0, slot->dx);
+
+        pthread_mutex_lock(&ring.lock);
+        ring.head = (ring.head + 1) % PIPELINE_SLOTS;
+        ring.count--;
+        pthread_cond_signal(&ring.not_full);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&ring.not_full);
+    pthread_cond_destroy(&ring.not_empty);
+    pthread_mutex_destroy(&ring.lock);
+    for (i = 0; i < PIPELINE_SLOTS; i++) {
+        STATS_FREE(ring.slot[i].row);
+        free(ring.slot[i].row);
+    }
+#else
+    io_png_read_rows_opt(fname, opt, &direct_head, &direct_row, dst);
+#endif
+    return;
+}
+
+/**
+ * @brief read a PNG image and compute its RGB histograms
+ *
+ * The image is read as with io_png_read_uchar_into() and
+ * IO_PNG_OPT_RGB, into a new buffer with the R, G and B planes. The
+ * histograms of the three channels are computed while the image is
+ * decoded.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp pointers to variables to be filled with the number of
+ *        columns and lines of the image
+ * @param npp pointer to a variable to be filled with the number of
+ *        planes, see pipeline_read_lut_u8(), NULL for 3 planes
+ * @param histo R, G and B histograms, 3 x (UCHAR_MAX + 1) cells, filled
+ * @param opt read option, IO_PNG_OPT_TRUSTED or IO_PNG_OPT_NONE, see
+ *        io_png_read_rows_opt()
+ *
+ * @return the R, G and B planes, to be freed by the caller,
+ *         abort() on error
+ */
+unsigned char *pipeline_read_histo_u8(const char *fname,
+                                      size_t * nxp, size_t * nyp,
+                                      size_t * npp, size_t * histo,
+                                      io_png_opt_t opt)
+{
+    return pipeline_read_lut_u8(fname, nxp, nyp, npp, NULL, histo, opt);
+}
+
+/**
+ * @brief read a PNG image, compute its RGB histograms and normalize it
+ *
+ * Same as pipeline_read_histo_u8(), and the planes are normalized by
+ * the tables while the image is decoded, see balance_lut_u8(). The
+ * histograms are the ones of the image before the normalization.
+ *
+ * If npp is not NULL, a gray image, with or without alpha, is read
+ * in one gray plane instead of three identical R, G and B planes,
+ * with only the first histogram and table; *npp is set to 1 for a
+ * gray image and to 3 otherwise.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param nxp, nyp pointers to variables to be filled with the number of
+ *        columns and lines of the image
+ * @param npp pointer to a variable to be filled with the number of
+ *        planes, NULL to always read 3 planes
+ * @param lut R, G and B normalization tables, 3 x (UCHAR_MAX + 1)
+ *        cells, NULL for no normalization
+ * @param histo R, G and B histograms, 3 x (UCHAR_MAX + 1) cells, filled
+ * @param opt read option
+ *
+ * @return the R, G and B planes, or the gray plane, to be freed by
+ *         the caller, abort() on error
+ */
+unsigned char *pipeline_read_lut_u8(const char *fname,
+                                    size_t * nxp, size_t * nyp,
+                                    size_t * npp,
+                                    const unsigned char *lut, size_t * histo,
+                                    io_png_opt_t opt)
+{
+    pipeline_dst_t dst;
+
+    /* sanity checks */
+    if (NULL == fname || NULL == nxp || NULL == nyp || NULL == histo) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    memset(histo, 0x00, 3 * (UCHAR_MAX + 1) * sizeof(size_t));
+    dst.histo = histo;
+    dst.lut = lut;
+    dst.gray = (NULL != npp);
+    read_dst(fname, opt, &dst);
+
+    *nxp = dst.nx;
+    *nyp = dst.ny;
+    if (NULL != npp)
+        *npp = dst.np;
+    return dst.rgb;
+}
+
+/*
+ * PREVIEW STATISTICS
+ */
+
+/** @brief preview state, the sample histograms being filled */
+typedef struct pipeline_preview_s {
+    size_t *histo;              /* R, G and B, or I histograms */
+    int irgb;                   /* I histogram */
+    size_t nx, ny, nc;          /* image size, channels in the rows */
+    size_t nb_sample;           /* pixels counted */
+} pipeline_preview_t;
+
+/** @brief header callback of the preview */
+static void preview_head(size_t nx, size_t ny, size_t nc, void *ctx)
+{
+    pipeline_preview_t *pv = (pipeline_preview_t *) ctx;
+
+    pv->nx = nx;
+    pv->ny = ny;
+    pv->nc = nc;
+    return;
+}
+
+/**
+ * @brief row callback of the preview, count the pixels of the row
+ *
+ * The channels are the same as in dst_row(), and I = R + G + B as in
+ * colorbalance_irgb_histo_u8().
+ */
+static void preview_row(const unsigned char *row, size_t y,
+                        size_t x0, size_t dx, void *ctx)
+{
+    pipeline_preview_t *pv = (pipeline_preview_t *) ctx;
+    const unsigned char *src;
+    size_t x, nc;
+
+    STATS_TOGGLE(STATS_STATISTICS);
+    nc = pv->nc;
+    for (x = x0; x < pv->nx; x += dx) {
+        src = row + x * nc;
+        if (3 > nc) {
+            /* gray->rgb */
+            if (pv->irgb)
+                pv->histo[3 * (size_t) src[0]] += 1;
+            else {
+                pv->histo[(size_t) src[0]] += 1;
+                pv->histo[UCHAR_MAX + 1 + (size_t) src[0]] += 1;
+                pv->histo[2 * (UCHAR_MAX + 1) + (size_t) src[0]] += 1;
+            }
+        }
+        else if (pv->irgb)
+            pv->histo[(size_t) src[0] + (size_t) src[1]
+                      + (size_t) src[2]] += 1;
+        else {
+            pv->histo[(size_t) src[0]] += 1;
+            pv->histo[UCHAR_MAX + 1 + (size_t) src[1]] += 1;
+            pv->histo[2 * (UCHAR_MAX + 1) + (size_t) src[2]] += 1;
+        }
+    }
+    pv->nb_sample += (pv->nx - x0 + dx - 1) / dx;
+    STATS_TOGGLE(STATS_STATISTICS);
+    (void) y;
+    return;
+}
+
+/**
+ * @brief compute the histograms of the first Adam7 passes of a PNG
+ * image
+ *
+ * Only the first passes of an interlaced image are decoded, see
+ * io_png_read_rows_passes(): with one pass, the histograms are the
+ * ones of a regular 1/64 subsample, decoded about 60 times faster
+ * than the whole image. A non-interlaced image is completely decoded
+ * and its histograms are exact.
+ *
+ * The histograms are the R, G and B histograms of
+ * pipeline_read_histo_u8(), or the I = R + G + B histogram of
+ * colorbalance_irgb_histo_u8(). No image plane is allocated.
+ *
+ * @param fname PNG file name, "-" means stdin
+ * @param passes number of Adam7 passes to decode, in [1,7]
+ * @param irgb compute the I histogram instead of the R, G and B ones
+ * @param histo histograms, 3 x (UCHAR_MAX + 1) cells, filled
+ * @param sizep pointer to a variable to be filled with the number of
+ *        pixels of the image
+ *
+ * @return the number of pixels in the histograms, abort() on error
+ */
+size_t pipeline_preview_u8(const char *fname, int passes, int irgb,
+                           size_t * histo, size_t * sizep)
+{
+    pipeline_preview_t pv;
+
+    /* sanity checks */
+    if (NULL == fname || NULL == histo || NULL == sizep) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    memset(histo, 0x00, 3 * (UCHAR_MAX + 1) * sizeof(size_t));
+    pv.histo = histo;
+    pv.irgb = irgb;
+    pv.nb_sample = 0;
+    (void) io_png_read_rows_passes(fname, passes, &preview_head,
+                                   &preview_row, &pv);
+
+    *sizep = pv.nx * pv.ny;
+    return pv.nb_sample;
+}
+
+/*
+ * DOWNSCALED OUTPUTS
+ */
+
+/** @brief one downscaled image, filled by the full-size rows */
+typedef struct pipeline_small_s {
+    const char *fname;          /* output file */
+    size_t k;                   /* downscale factor */
+    size_t nx, ny, nc;          /* downscaled image size */
+    unsigned char *data;        /* downscaled rows, interleaved */
+    size_t *sum;                /* box sums of the current row */
+    size_t y_ready;             /* number of complete rows */
+#ifdef _REENTRANT
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* signaled when a row is complete */
+    pthread_t writer;           /* encoder thread */
+#endif
+} pipeline_small_t;
+
+/** @brief write state, the caller rows and the downscaled images */
+typedef struct pipeline_write_s {
+    io_png_fill_fn row_fn;      /* caller row callback */
+    void *ctx;                  /* caller context */
+    size_t nx, ny, nc;          /* full image size */
+    size_t y_next;              /* next row to downscale */
+    pipeline_small_t *small;    /* downscaled images */
+    size_t nb_small;            /* number of downscaled images */
+} pipeline_write_t;
+
+/**
+ * @brief add a full-size row to the box sums of a downscaled image,
+ * and complete the downscaled row after its last full-size row
+ *
+ * The border boxes, partly outside the image, are the average of
+ * their pixels inside the image.
+ */
+static void small_add(pipeline_small_t * sm, const unsigned char *row,
+                      size_t y, size_t nx, size_t ny)
+{
+    size_t xs, c, i, n, nc, kx, ky, cnt;
+    const unsigned char *src, *end;
+    size_t *sum;
+
+    nc = sm->nc;
+    src = row;
+    for (xs = 0; xs < sm->nx; xs++) {
+        sum = sm->sum + xs * nc;
+        n = (nx - xs * sm->k < sm->k ? nx - xs * sm->k : sm->k) * nc;
+        for (end = src + n; src < end; src += nc)
+            for (c = 0; c < nc; c++)
+                sum[c] += src[c];
+    }
+    if (0 != (y + 1) % sm->k && ny != y + 1)
+        return;
+
+    /* last row of the boxes */
+    ky = y % sm->k + 1;
+    for (xs = 0; xs < sm->nx; xs++) {
+        kx = (nx - xs * sm->k < sm->k ? nx - xs * sm->k : sm->k);
+        cnt = kx * ky;
+        for (c = 0; c < nc; c++) {
+            i = xs * nc + c;
+            sm->data[(y / sm->k) * sm->nx * nc + i] =
+                (unsigned char) ((sm->sum[i] + cnt / 2) / cnt);
+            sm->sum[i] = 0;
+        }
+    }
+#ifdef _REENTRANT
+    pthread_mutex_lock(&sm->lock);
+    sm->y_ready = y / sm->k + 1;
+    pthread_cond_signal(&sm->ready);
+    pthread_mutex_unlock(&sm->lock);
+#else
+    sm->y_ready = y / sm->k + 1;
+#endif
+    return;
+}
+
+/**
+ * @brief row callback of the full-size image, fill the row with the
+ * caller callback, then downscale it while it is in cache
+ *
+ * With Adam7 interlacing, the rows are requested once per pass and
+ * only downscaled the first time.
+ */
+static void write_row(unsigned char *row, size_t y, void *ctx)
+{
+    pipeline_write_t *wr = (pipeline_write_t *) ctx;
+    size_t i;
+
+    wr->row_fn(row, y, wr->ctx);
+    if (y != wr->y_next)
+        return;
+    STATS_TOGGLE(STATS_APPLY);
+    for (i = 0; i < wr->nb_small; i++)
+        small_add(wr->small + i, row, y, wr->nx, wr->ny);
+    STATS_TOGGLE(STATS_APPLY);
+    wr->y_next++;
+    return;
+}
+
+/**
+ * @brief row callback of a downscaled image, wait for the row and
+ * copy it
+ */
+static void small_fill(unsigned char *row, size_t y, void *ctx)
+{
+    pipeline_small_t *sm = (pipeline_small_t *) ctx;
+
+#ifdef _REENTRANT
+    pthread_mutex_lock(&sm->lock);
+    while (sm->y_ready <= y)
+        pthread_cond_wait(&sm->ready, &sm->lock);
+    pthread_mutex_unlock(&sm->lock);
+#endif
+    memcpy(row, sm->data + y * sm->nx * sm->nc,
+           sm->nx * sm->nc * sizeof(unsigned char));
+    return;
+}
+
+#ifdef _REENTRANT
+/**
+ * @brief encoder thread of a downscaled image
+ */
+static void *small_writer(void *ctx)
+{
+    pipeline_small_t *sm = (pipeline_small_t *) ctx;
+
+    io_png_write_rows(sm->fname, sm->nx, sm->ny, sm->nc, IO_PNG_OPT_NONE,
+                      &small_fill, ctx);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief write a PNG file row by row, with downscaled copies
+ *
+ * The full-size image is written as with io_png_write_rows(). Each
+ * row is also added, just after the caller callback filled it, to
+ * the box filters of the downscaled images: a pixel of a downscaled
+ * image is the average of a box of k x k full-size pixels. These
+ * images are small, 1 / k^2 of the full size, and kept in memory.
+ *
+ * With POSIX threads, each downscaled image is encoded by its own
+ * thread, while its rows are completed, in parallel with the
+ * full-size image. With the runtime statistics enabled, or without
+ * threads, they are encoded after the full-size image, so the stage
+ * timers are only toggled by one thread. No image is decoded again.
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param nx, ny, nc number of columns, lines and channels
+ * @param row_fn row callback, see io_png_write_rows()
+ * @param ctx caller context, passed to the callback
+ * @param down downscaled images, nb_down items
+ * @param nb_down number of downscaled images, 0 for none
+ * @return void, abort() on error
+ */
+void pipeline_write_rows(const char *fname,
+                         size_t nx, size_t ny, size_t nc,
+                         io_png_fill_fn row_fn, void *ctx,
+                         const pipeline_down_t * down, size_t nb_down)
+{
+    pipeline_write_t wr;
+    pipeline_small_t *sm;
+    size_t i;
+#ifdef _REENTRANT
+    int threads;
+#endif
+
+    /* sanity checks */
+    if (NULL == fname || NULL == row_fn || (0 < nb_down && NULL == down)) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    wr.row_fn = row_fn;
+    wr.ctx = ctx;
+    wr.nx = nx;
+    wr.ny = ny;
+    wr.nc = nc;
+    wr.y_next = 0;
+    wr.nb_small = nb_down;
+    wr.small = NULL;
+    if (0 < nb_down) {
+        if (NULL == (wr.small = (pipeline_small_t *)
+                     malloc(nb_down * sizeof(pipeline_small_t))))
+            pool_abort("not enough memory");
+        STATS_ALLOC(wr.small, nb_down * sizeof(pipeline_small_t));
+    }
+    for (i = 0; i < nb_down; i++) {
+        sm = wr.small + i;
+        if (NULL == down[i].fname || 0 == down[i].factor)
+            pool_abort("bad downscaled image");
+        sm->fname = down[i].fname;
+        sm->k = down[i].factor;
+        sm->nx = (nx + sm->k - 1) / sm->k;
+        sm->ny = (ny + sm->k - 1) / sm->k;
+        sm->nc = nc;
+        sm->y_ready = 0;
+        if (NULL == (sm->data = (unsigned char *)
+                     malloc(sm->nx * sm->ny * nc * sizeof(unsigned char)))
+            || NULL == (sm->sum = (size_t *)
+                        calloc(sm->nx * nc, sizeof(size_t))))
+            pool_abort("not enough memory");
+        STATS_ALLOC(sm->data, sm->nx * sm->ny * nc * sizeof(unsigned char));
+        STATS_ALLOC(sm->sum, sm->nx * nc * sizeof(size_t));
+    }
+
+#ifdef _REENTRANT
+    threads = !stats.on;
+    for (i = 0; i < nb_down; i++) {
+        sm = wr.small + i;
+        if (0 != pthread_mutex_init(&sm->lock, NULL)
+            || 0 != pthread_cond_init(&sm->ready, NULL)
+            || (threads
+                && 0 != pthread_create(&sm->writer, NULL,
+                                       &small_writer, sm)))
+            pool_abort("thread initialization error");
+    }
+#endif
+
+    io_png_write_rows(fname, nx, ny, nc, IO_PNG_OPT_NONE, &write_row, &wr);
+
+    for (i = 0; i < nb_down; i++) {
+        sm = wr.small + i;
+#ifdef _REENTRANT
+        if (threads)
+            pthread_join(sm->writer, NULL);
+        else
+#endif
+            io_png_write_rows(sm->fname, sm->nx, sm->ny, nc,
+                              IO_PNG_OPT_NONE, &small_fill, sm);
+#ifdef _REENTRANT
+        pthread_cond_destroy(&sm->ready);
+        pthread_mutex_destroy(&sm->lock);
+#endif
+        STATS_FREE(sm->data);
+        STATS_FREE(sm->sum);
+        free(sm->data);
+        free(sm->sum);
+    }
+    STATS_FREE(wr.small);
+    free(wr.small);
+    return;
+}
+
+/** @brief planes of pipeline_write_u8() */
+typedef struct pipeline_planes_s {
+    const unsigned char *const *ch;     /* channel planes */
+    size_t nx, nc, stride;      /* columns, planes, plane row stride */
+} pipeline_planes_t;
+
+/** @brief row callback of pipeline_write_u8(), interleave one row */
+static void planes_fill(unsigned char *row, size_t y, void *ctx)
+{
+    pipeline_planes_t *pl = (pipeline_planes_t *) ctx;
+    const unsigned char *src;
+    size_t c, x;
+
+    STATS_TOGGLE(STATS_INTERLACE);
+    for (c = 0; c < pl->nc; c++) {
+        src = pl->ch[c] + y * pl->stride;
+        for (x = 0; x < pl->nx; x++)
+            row[x * pl->nc + c] = src[x];
+    }
+    STATS_TOGGLE(STATS_INTERLACE);
+    return;
+}
+
+/**
+ * @brief write unsigned char planes as a PNG file, with downscaled
+ * copies
+ *
+ * Same as io_png_write_uchar_from(), with the downscaled images of
+ * pipeline_write_rows().
+ *
+ * @param fname PNG file name, "-" means stdout
+ * @param ch nc pointers to the channel planes
+ * @param nx, ny, nc number of columns, lines and channels
+ * @param stride plane row stride, in samples
+ * @param down downscaled images, nb_down items
+ * @param nb_down number of downscaled images, 0 for none
+ * @return void, abort() on error
+ */
+void pipeline_write_u8(const char *fname, const unsigned char *const *ch,
+                       size_t nx, size_t ny, size_t nc, size_t stride,
+                       const pipeline_down_t * down, size_t nb_down)
+{
+    pipeline_planes_t pl;
+
+    /* sanity checks */
+    if (NULL == ch) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    pl.ch = ch;
+    pl.nx = nx;
+    pl.nc = nc;
+    pl.stride = stride;
+    pipeline_write_rows(fname, nx, ny, nc, &planes_fill, (void *) &pl,
+                        down, nb_down);
+    return;
+}
@@ -0,0 +1,12 @@
+/** @brief downscaled output, see pipeline_write_rows() */
+typedef struct pipeline_down_s {
+    size_t factor;              /* downscale factor */
+    const char *fname;          /* PNG file name */
+} pipeline_down_t;
+
+/* pipeline_lib.c */
+unsigned char *pipeline_read_histo_u8(const char *fname, size_t *nxp, size_t *nyp, size_t *npp, size_t *histo, io_png_opt_t opt);
+unsigned char *pipeline_read_lut_u8(const char *fname, size_t *nxp, size_t *nyp, size_t *npp, const unsigned char *lut, size_t *histo, io_png_opt_t opt);
+size_t pipeline_preview_u8(const char *fname, int passes, int irgb, size_t *histo, size_t *sizep);
+void pipeline_write_rows(const char *fname, size_t nx, size_t ny, size_t nc, io_png_fill_fn row_fn, void *ctx, const pipeline_down_t *down, size_t nb_down);
+void pipeline_write_u8(const char *fname, const unsigned char *const *ch, size_t nx, size_t ny, size_t nc, size_t stride, const pipeline_down_t *down, size_t nb_down);
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file pool_lib.c
+ * @brief worker pool and fatal errors, shared by the libraries
+ *
+ * A pass over a set of work items is run by a pool of workers, each
+ * with its own state: every worker takes the next item left until
+ * none is, so the items of different costs are balanced between the
+ * workers. The calling thread is the first worker.
+ *
+ * The worker threads are used if the code is compiled with POSIX
+ * threads (-pthread, which defines _REENTRANT); otherwise the first
+ * worker processes all the items in sequence. The item function must
+ * give the same result in both cases.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#ifdef _REENTRANT
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+
+/* ensure consistency */
+#include "pool_lib.h"
+
+/** @brief pass state, shared by the workers */
+typedef struct pool_s {
+    pool_fn_t fn;               /* item function */
+    size_t nb_items;            /* number of items */
+    size_t next;                /* next item to process */
+#ifdef _REENTRANT
+    pthread_mutex_t lock;       /* next item lock */
+#endif
+} pool_t;
+
+/** @brief worker, its pass and its state */
+typedef struct pool_worker_s {
+    pool_t *pool;
+    void *state;
+} pool_worker_t;
+
+/**
+ * @brief abort() with an error message
+ *
+ * @param msg error message, without end of line
+ */
+void pool_abort(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    abort();
+}
+
+/**
+ * @brief worker loop, process the next item until none is left
+ */
+static void *pool_work(void *arg)
+{
+    pool_worker_t *w = (pool_worker_t *) arg;
+    pool_t *p = w->pool;
+    size_t i;
+
+    for (;;) {
+#ifdef _REENTRANT
+        pthread_mutex_lock(&p->lock);
+#endif
+        i = p->next++;
+#ifdef _REENTRANT
+        pthread_mutex_unlock(&p->lock);
+#endif
+        if (i >= p->nb_items)
+            break;
+        p->fn(w->state, i);
+    }
+    return NULL;
+}
+
+/**
+ * @brief run a pass on all the items with a worker pool
+ *
+ * The items 0 to nb_items - 1 are processed by fn(), with the calling
+ * thread and nb_workers - 1 more threads, at most one per item. The
+ * worker k uses the state at worker + k worker_size.
+ *
+ * @param nb_items number of items
+ * @param nb_workers number of workers, in [1-POOL_WORKERS_MAX]
+ * @param fn item function
+ * @param worker worker states, nb_workers x worker_size bytes
+ * @param worker_size size of a worker state, in bytes
+ * @return void, abort() on error
+ */
+void pool_run(size_t nb_items, size_t nb_workers, pool_fn_t fn,
+              void *worker, size_t worker_size)
+{
+    pool_t pool;
+    pool_worker_t w[POOL_WORKERS_MAX];
+#ifdef _REENTRANT
+    pthread_t thread[POOL_WORKERS_MAX];
+#endif
+    size_t k;
+
+    /* sanity checks */
+    if (NULL == fn || NULL == worker) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+    if (1 > nb_workers || POOL_WORKERS_MAX < nb_workers) {
+        fprintf(stderr, "bad parameters\n");
+        abort();
+    }
+
+    if (nb_workers > nb_items)
+        nb_workers = nb_items;
+    pool.fn = fn;
+    pool.nb_items = nb_items;
+    pool.next = 0;
+    for (k = 0; k < nb_workers; k++) {
+        w[k].pool = &pool;
+        w[k].state = (void *) ((char *) worker + k * worker_size);
+    }
+    if (0 == nb_workers)
+        return;
+#ifdef _REENTRANT
+    if (0 != pthread_mutex_init(&pool.lock, NULL))
+        pool_abort("thread initialization error");
+    for (k = 1; k < nb_workers; k++)
+        if (0 != pthread_create(thread + k, NULL, &pool_work,
+                                (void *) (w + k)))
+            pool_abort("thread initialization error");
+    (void) pool_work((void *) w);
+    for (k = 1; k < nb_workers; k++)
+        pthread_join(thread[k], NULL);
+    pthread_mutex_destroy(&pool.lock);
+#else
+    /* without threads, the first worker does everything */
+    (void) pool_work((void *) w);
+#endif
+    return;
+}
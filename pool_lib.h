@@ -0,0 +1,21 @@
+#ifndef _POOL_LIB_H
+#define _POOL_LIB_H
+
+#include <stddef.h>
+
+/** @brief maximum number of worker threads */
+#define POOL_WORKERS_MAX 256
+
+/**
+ * @brief work item function
+ *
+ * The item i is processed with the worker state, used by one thread
+ * at a time.
+ */
+typedef void (*pool_fn_t) (void *worker, size_t i);
+
+/* pool_lib.c */
+void pool_abort(const char *msg);
+void pool_run(size_t nb_items, size_t nb_workers, pool_fn_t fn, void *worker, size_t worker_size);
+
+#endif /* !_POOL_LIB_H */
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file stats_lib.c
+ * @brief runtime statistics
+ *
+ * Unlike the debug.h counters, these counters are always compiled,
+ * and enabled at runtime by stats_enable(). When they are disabled,
+ * each STATS_*() macro only costs one test.
+ *
+ * The counters are not protected by a lock: each counter must only be
+ * updated by one thread at a time. With the pipeline_lib reader
+ * thread, the decoding runs in parallel with the other stages, so the
+ * stage times may add up to more than the total time.
+ *
+ * The allocations are the exception: the downscaled outputs writers
+ * allocate their rows in parallel, so the memory accounting is locked
+ * when compiled with threads. The live allocations are kept with their
+ * size in a small table, to know the size of the released ones; the
+ * memory peak is recorded globally and for each running stage. Only
+ * the library buffers are counted, not the libpng internal memory.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+
+/* ensure consistency */
+#include "stats_lib.h"
+
+/** @brief the runtime statistics, disabled */
+stats_t stats;
+
+/** @brief maximum number of live allocations counted, more than the
+ * pipeline_lib ring rows */
+#define STATS_BLOCKS 256
+
+/** @brief live allocations, NULL pointer for a free entry */
+static struct {
+    const void *ptr;
+    size_t size;
+} stats_block[STATS_BLOCKS];
+
+/** @brief running stages, set and reset by stats_toggle() */
+static int stats_running[STATS_STAGES];
+
+#ifdef _REENTRANT
+/** @brief memory accounting lock */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK() pthread_mutex_lock(&stats_mutex)
+#define STATS_UNLOCK() pthread_mutex_unlock(&stats_mutex)
+#else
+#define STATS_LOCK()
+#define STATS_UNLOCK()
+#endif
+
+/** @brief stage names, in the JSON output */
+static const char *stats_stage_name[STATS_STAGES] = {
+    "read", "interlace", "statistics", "apply", "encode"
+};
+
+/**
+ * @brief wall clock time, in seconds since stats_enable()
+ */
+static double stats_now(void)
+{
+    struct timeval tv;
+
+    (void) gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + 1e-6 * (double) tv.tv_usec - stats.t0;
+}
+
+/**
+ * @brief reset and enable the runtime statistics
+ */
+void stats_enable(void)
+{
+    memset(&stats, 0x00, sizeof(stats));
+    memset(stats_block, 0x00, sizeof(stats_block));
+    memset(stats_running, 0x00, sizeof(stats_running));
+    stats.t0 = stats_now();
+    stats.on = 1;
+    return;
+}
+
+/**
+ * @brief toggle (start/stop) a stage timer
+ *
+ * Successive start/stop pairs of the same stage add up, see
+ * DBG_CLOCK_TOGGLE().
+ */
+void stats_toggle(stats_stage_t stage)
+{
+    stats.time[stage] = stats_now() - stats.time[stage];
+    stats_running[stage] = !stats_running[stage];
+    if (stats_running[stage]) {
+        /* the memory allocated before the stage is used in the stage */
+        STATS_LOCK();
+        if (stats.mem_stage[stage] < stats.mem_bytes)
+            stats.mem_stage[stage] = stats.mem_bytes;
+        STATS_UNLOCK();
+    }
+    return;
+}
+
+/**
+ * @brief count an allocation
+ *
+ * The allocation is added to the live memory if there is room for it
+ * in the table, and it is released by stats_free().
+ *
+ * @param ptr allocated memory
+ * @param size allocated size
+ */
+void stats_alloc(void *ptr, size_t size)
+{
+    size_t i;
+
+    STATS_LOCK();
+    stats.nb_alloc++;
+    stats.alloc_bytes += (unsigned long) size;
+    for (i = 0; i < STATS_BLOCKS; i++)
+        if (NULL == stats_block[i].ptr)
+            break;
+    if (NULL != ptr && STATS_BLOCKS > i) {
+        stats_block[i].ptr = ptr;
+        stats_block[i].size = size;
+        stats.mem_bytes += (unsigned long) size;
+        if (stats.mem_peak < stats.mem_bytes)
+            stats.mem_peak = stats.mem_bytes;
+        for (i = 0; i < STATS_STAGES; i++)
+            if (stats_running[i] && stats.mem_stage[i] < stats.mem_bytes)
+                stats.mem_stage[i] = stats.mem_bytes;
+    }
+    STATS_UNLOCK();
+    return;
+}
+
+/**
+ * @brief count the release of an allocation
+ *
+ * @param ptr allocated memory, ignored if not counted by stats_alloc()
+ */
+void stats_free(const void *ptr)
+{
+    size_t i;
+
+    if (NULL == ptr)
+        return;
+    STATS_LOCK();
+    for (i = 0; i < STATS_BLOCKS; i++)
+        if (ptr == stats_block[i].ptr) {
+            stats.mem_bytes -= (unsigned long) stats_block[i].size;
+            stats_block[i].ptr = NULL;
+            break;
+        }
+    STATS_UNLOCK();
+    return;
+}
+
+/**
+ * @brief record the normalization bounds of a channel
+ *
+ * @param c channel index, ignored if not below STATS_CHANNELS
+ * @param min, max bounds
+ */
+void stats_bounds(size_t c, double min, double max)
+{
+    if (STATS_CHANNELS <= c)
+        return;
+    stats.min[c] = min;
+    stats.max[c] = max;
+    if (stats.nb_bounds <= c)
+        stats.nb_bounds = c + 1;
+    return;
+}
+
+/**
+ * @brief print the runtime statistics as a JSON object, on one line
+ */
+void stats_print_json(FILE * fp)
+{
+    size_t i;
+
+    fprintf(fp, "{\"bytes_read\": %lu, \"bytes_written\": %lu, "
+            "\"pixels\": %lu, ", stats.bytes_read, stats.bytes_written,
+            stats.pixels);
+    fprintf(fp, "\"time\": {");
+    for (i = 0; i < STATS_STAGES; i++)
+        fprintf(fp, "%s\"%s\": %.6f", (0 == i ? "" : ", "),
+                stats_stage_name[i], stats.time[i]);
+    fprintf(fp, ", \"total\": %.6f}, ", stats_now());
+    fprintf(fp, "\"bounds\": [");
+    for (i = 0; i < stats.nb_bounds; i++)
+        fprintf(fp, "%s[%.9g, %.9g]", (0 == i ? "" : ", "),
+                stats.min[i], stats.max[i]);
+    fprintf(fp, "], \"allocs\": %lu, \"alloc_bytes\": %lu, ",
+            stats.nb_alloc, stats.alloc_bytes);
+    fprintf(fp, "\"peak_bytes\": %lu, \"peak\": {", stats.mem_peak);
+    for (i = 0; i < STATS_STAGES; i++)
+        fprintf(fp, "%s\"%s\": %lu", (0 == i ? "" : ", "),
+                stats_stage_name[i], stats.mem_stage[i]);
+    fprintf(fp, "}, ");
+    fprintf(fp, "\"cache_hits\": %lu, \"cache_misses\": %lu}\n",
+            stats.cache_hits, stats.cache_misses);
+    return;
+}
@@ -0,0 +1,62 @@
+#ifndef _STATS_LIB_H
+#define _STATS_LIB_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/** @brief processing stages timed by the runtime statistics */
+typedef enum stats_stage_e {
+    STATS_READ = 0,             /* PNG decoding */
+    STATS_INTERLACE,            /* (de)interlacing rows and planes */
+    STATS_STATISTICS,           /* histograms, quantiles and bounds */
+    STATS_APPLY,                /* color conversions and rescaling */
+    STATS_ENCODE,               /* PNG encoding */
+    STATS_STAGES                /* number of stages */
+} stats_stage_t;
+
+/** @brief maximum number of channel bounds recorded */
+#define STATS_CHANNELS 3
+
+/** @brief runtime statistics, only updated if on is not 0 */
+typedef struct stats_s {
+    int on;                     /* statistics enabled */
+    double t0;                  /* clock origin */
+    double time[STATS_STAGES];  /* time per stage, in seconds */
+    unsigned long bytes_read, bytes_written;    /* PNG data */
+    unsigned long pixels;       /* pixels processed */
+    unsigned long nb_alloc, alloc_bytes;        /* allocations */
+    unsigned long mem_bytes, mem_peak;  /* live and peak allocated bytes */
+    unsigned long mem_stage[STATS_STAGES];      /* peak bytes per stage */
+    unsigned long cache_hits, cache_misses;     /* result cache lookups */
+    size_t nb_bounds;           /* channel bounds recorded */
+    double min[STATS_CHANNELS], max[STATS_CHANNELS];
+} stats_t;
+
+extern stats_t stats;
+
+/*
+ * The macros cost one test when the statistics are disabled. The
+ * STATS_TOGGLE() pairs follow the debug.h DBG_CLOCK_TOGGLE() model,
+ * but measure the wall clock time.
+ */
+
+/** @brief toggle (start/stop) a stage timer */
+#define STATS_TOGGLE(STAGE) { if (stats.on) stats_toggle(STAGE); }
+/** @brief count an allocation */
+#define STATS_ALLOC(PTR, SIZE) { if (stats.on) stats_alloc(PTR, SIZE); }
+/** @brief count the release of a counted allocation */
+#define STATS_FREE(PTR) { if (stats.on) stats_free(PTR); }
+/** @brief add to a counter */
+#define STATS_ADD(FIELD, N) { if (stats.on) stats.FIELD += (N); }
+/** @brief record the bounds of a channel */
+#define STATS_BOUNDS(C, MIN, MAX) { if (stats.on) stats_bounds(C, MIN, MAX); }
+
+/* stats_lib.c */
+void stats_enable(void);
+void stats_toggle(stats_stage_t stage);
+void stats_alloc(void *ptr, size_t size);
+void stats_free(const void *ptr);
+void stats_bounds(size_t c, double min, double max);
+void stats_print_json(FILE *fp);
+
+#endif /* !_STATS_LIB_H */
@@ -12,12 +12,190 @@ _test_run() {
     test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
 	= "$(md5sum $TEMPFILE)"
     ./balance irgb 10 20 data/colors.png $TEMPFILE
-    test "4b271d168e536d5a916ba5a03889f763  $TEMPFILE" \
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
 	= "$(md5sum $TEMPFILE)"
     ./balance irgb 10 20 - - < data/colors.png > $TEMPFILE
-    test "4b271d168e536d5a916ba5a03889f763  $TEMPFILE" \
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
 	= "$(md5sum $TEMPFILE)"
-    rm -f $TEMPFILE
+    ./balance hsl 10 20 data/colors.png $TEMPFILE
+    test "0500657e062b4168ae72dc2db4efaa48  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance hsl 10 20 - - < data/colors.png > $TEMPFILE
+    test "0500657e062b4168ae72dc2db4efaa48  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance hsv 10 20 data/colors.png $TEMPFILE
+    test "6db93105b8550f70832619408b26a979  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance hsv 10 20 - - < data/colors.png > $TEMPFILE
+    test "6db93105b8550f70832619408b26a979  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance ycbcr 10 20 data/colors.png $TEMPFILE
+    test "479960f1e4ba5bac80116cb079bb43e9  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance ycbcr 10 20 - - < data/colors.png > $TEMPFILE
+    test "479960f1e4ba5bac80116cb079bb43e9  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -r 0,0,225,150 rgb 10 20 data/colors.png $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # a region of the whole image gives the same result
+    ./balance -r 0,0,225,150 irgb 10 20 data/colors.png $TEMPFILE
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -r 10,10,50,40 irgb 10 20 data/colors.png $TEMPFILE
+    test "d1d3ad7ab32d7754fcd9718cbc812b7f  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # gray images are balanced and written in one plane
+    ./balance rgb 10 20 data/colors_gray.png $TEMPFILE
+    test "578e56c5808aa3965d91f93a5e485619  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance ycbcr 10 20 - - < data/colors_gray.png > $TEMPFILE
+    test "578e56c5808aa3965d91f93a5e485619  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -r 0,0,225,150 hsl 10 20 data/colors_gray.png $TEMPFILE
+    test "578e56c5808aa3965d91f93a5e485619  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # the alpha channel is kept, the transparent pixels are excluded
+    # from the statistics
+    ./balance rgb 10 20 data/colors_rgba.png $TEMPFILE
+    test "cced51f0ba25c66997df575d0512c26f  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance irgb 10 20 data/colors_rgba.png $TEMPFILE
+    test "24cbb75566ff4797c9d3df8f8920807f  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -r 10,10,150,100 ycbcr 10 20 - - < data/colors_rgba.png \
+	> $TEMPFILE
+    test "63b90e31e19e9d038b77a25dfcbb769a  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # palette images are balanced on the palette in rgb mode
+    ./balance rgb 10 20 data/colors_pal.png $TEMPFILE
+    test "8948550b8ca890468dcce370ac28d679  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -r 0,0,60,60 rgb 10 20 - - < data/colors_pal.png > $TEMPFILE
+    test "49fdd8adbb4b4de74ab919b31e506bf6  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance hsv 10 20 data/colors_pal.png $TEMPFILE
+    test "66b355986bc6ff5b69bc2ff1340e1529  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # with a tRNS chunk, they are decoded with an alpha channel
+    ./balance hsl 10 20 data/colors_pal_trns.png $TEMPFILE
+    test "5c0fe8a2ef1de69501117a3ef990c1b4  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -d 2 $TEMPFILE.2 irgb 10 20 - - < data/colors_pal_trns.png \
+	> $TEMPFILE
+    test "2084f4510fb064cc8fe4299271cbaf86  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    test "07b4959c0f91734be93877ec7f23d92c  $TEMPFILE.2" \
+	= "$(md5sum $TEMPFILE.2)"
+    rm -f $TEMPFILE.2
+    # the downscaled outputs are box-filtered from the output rows
+    ./balance -d 4 $TEMPFILE.4 -d 3 $TEMPFILE.3 irgb 10 20 \
+	data/colors.png $TEMPFILE
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    test "e79b8ccf81d4592af6d2476b6a79e50b  $TEMPFILE.4" \
+	= "$(md5sum $TEMPFILE.4)"
+    test "d01b4d5958d53bb247c37fb3c5a101d9  $TEMPFILE.3" \
+	= "$(md5sum $TEMPFILE.3)"
+    ./balance -d 2 $TEMPFILE.2 hsl 10 20 - - < data/colors_rgba.png \
+	> $TEMPFILE
+    test "7c300c1c44b9faf2d395165bb98b40fa  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    test "9c99c5bc20f067c9e2c01ae8b3ec8c9a  $TEMPFILE.2" \
+	= "$(md5sum $TEMPFILE.2)"
+    rm -f $TEMPFILE.4 $TEMPFILE.3 $TEMPFILE.2
+    ./balance --stats rgb 10 20 data/colors.png $TEMPFILE 2> $TEMPFILE.err
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    grep -q '"pixels": 33750, .*"bounds": \[\[' $TEMPFILE.err
+    # the second identical run is a cache hit
+    for RUN in 1 2; do
+	./balance --stats -c 1 $TEMPFILE.cache -r 10,10,50,40 irgb 10 20 \
+	    data/colors.png $TEMPFILE 2> $TEMPFILE.err
+	test "d1d3ad7ab32d7754fcd9718cbc812b7f  $TEMPFILE" \
+	    = "$(md5sum $TEMPFILE)"
+    done
+    grep -q '"cache_hits": 1, "cache_misses": 0' $TEMPFILE.err
+    ./balance -c 1 $TEMPFILE.cache irgb 10 20 data/colors.png $TEMPFILE
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    test 2 = $(wc -c < $TEMPFILE.cache/misses)
+    rm -rf $TEMPFILE.cache
+    # the trusted profile does not check the chunk CRC
+    head -c $(( $(wc -c < data/colors.png) - 4 )) data/colors.png \
+	> $TEMPFILE.crc
+    printf '\000\000\000\000' >> $TEMPFILE.crc
+    ./balance rgb 10 20 $TEMPFILE.crc $TEMPFILE && return 1
+    ./balance -t rgb 10 20 $TEMPFILE.crc $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    rm -f $TEMPFILE.crc
+    # raw video streams are balanced frame by frame, only the Y plane
+    # of the YUV frames
+    head -c 101250 data/colors_large.png > $TEMPFILE.raw
+    cat $TEMPFILE.raw $TEMPFILE.raw \
+	| ./balance -f rgb24 -s 225x150 rgb 10 20 - - > $TEMPFILE
+    test "1db2f4d437990f445876eeba758d8e17  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    head -c 50700 data/colors_large.png > $TEMPFILE.raw
+    (printf 'YUV4MPEG2 W225 H150 F25:1 C420jpeg\nFRAME\n'; cat $TEMPFILE.raw) \
+	| ./balance -f y4m rgb 10 20 - - > $TEMPFILE
+    test "9ed74b9d7a2b7f606f26042ad3668c25  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -f yuv420 -s 225x150 rgb 10 20 $TEMPFILE.raw $TEMPFILE
+    test "ee1acddd406a48c27dfce8d28d262e1d  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    tail -c 16950 $TEMPFILE.raw | cmp -i 0:33750 - $TEMPFILE
+    # the full range Y plane is balanced to [0-255]
+    ./balance -f yuvj420 -s 225x150 rgb 10 20 $TEMPFILE.raw $TEMPFILE
+    test "7b04c03eed831a22f851bd5f7323ebc4  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    (printf 'YUV4MPEG2 W225 H150 C420jpeg XCOLORRANGE=FULL\nFRAME\n'; \
+	cat $TEMPFILE.raw) | ./balance -f y4m rgb 10 20 - - \
+	| tail -c 50700 | cmp - $TEMPFILE
+    rm -f $TEMPFILE.raw
+    # local balance, a 1x1 grid is the global balance and the result
+    # does not depend on the number of threads
+    ./balance -l 1x1 rgb 10 20 data/colors.png $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    for WORKERS in 1 3; do
+	./balance -j $WORKERS -l 4x3 rgb 10 20 data/colors.png $TEMPFILE
+	test "5f829ef61d56a874c24318eca2c654af  $TEMPFILE" \
+	    = "$(md5sum $TEMPFILE)"
+    done
+    ./balance -l 3x2 rgb 10 20 - - < data/colors_gray.png > $TEMPFILE
+    test "8a74feab6e88660a656d1e3c8dc89a72  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # animated images, the frames are balanced with their own or with
+    # shared statistics, a still image is one frame
+    ./balance -a frames rgb 10 20 data/colors.png $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    for WORKERS in 1 3; do
+	./balance -j $WORKERS -a frames rgb 10 20 data/colors_anim.png \
+	    $TEMPFILE
+	test "c2ce99e7bcd5bf8578dd52fb729fa7e6  $TEMPFILE" \
+	    = "$(md5sum $TEMPFILE)"
+    done
+    ./balance -a shared rgb 10 20 - - < data/colors_anim.png > $TEMPFILE
+    test "5f912589437cdadd93c3506779b84fcc  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # the tRNS chunk of a 2-bit gray image is not an alpha channel
+    ./balance -a frames rgb 10 20 data/colors_anim_g2.png $TEMPFILE
+    test "d01548e869d4b3a94796a1227c41b1c8  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # preview statistics, exact on a non-interlaced image
+    ./balance -p 1 rgb 10 20 data/colors.png $TEMPFILE 2> $TEMPFILE.err
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    grep -q "measured rank error 0%" $TEMPFILE.err
+    ./balance -p 1 irgb 10 20 data/colors.png $TEMPFILE
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance -p 1 rgb 10 20 data/colors.10_20_rgb.png > $TEMPFILE.err
+    grep -q "^preview: 551 of 33750 pixels" $TEMPFILE.err
+    rm -f $TEMPFILE $TEMPFILE.err
 }
 
 ################################################
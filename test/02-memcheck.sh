@@ -1,11 +1,66 @@
 #!/bin/sh -e
 #
-# Check there is no memory leak with valgrind/memcheck.
+# Check there is no memory leak with valgrind/memcheck, and no peak
+# memory regression against a stored budget.
+#
+# The peak memory is the high-water mark of the library buffers, from
+# the --stats output, globally and for each stage. It is compared in
+# bytes per pixel with test/mem.budget and must not be larger, and
+# every budgeted stage must be measured. Use MEM_UPDATE=1 to write a
+# new budget after an intended change.
+
+MEM_BUDGET=${MEM_BUDGET:-${0%/*}/mem.budget}
 
 _test_memcheck() {
     test "0" = "$( valgrind --tool=memcheck $* 2>&1 | grep -c 'LEAK' )"
 }
 
+# measure one workload, output "image name stage bytes/pixel" lines
+_mem_run() {
+    NAME=$1
+    MODE=$2
+    shift 2
+    ./balance --stats "$@" 1 1 data/$NAME.png $TEMPFILE 2>&1 \
+	| sed -n 's/.*"pixels": \([0-9]*\), .*"peak_bytes": \([0-9]*\), "peak": {\([^}]*\)}.*/\1 peak: \2, \3/p' \
+	| tr -d '",' | awk -v n="$NAME" -v m="$MODE" '{
+	    for (i = 2; i < NF; i += 2)
+		printf "%s %s %s %.2f\n", n, m, substr($i, 1, length($i) - 1),
+		    $(i + 1) / $1 }'
+}
+
+# compare the measures on stdin with the budget, report each regression
+_mem_check() {
+    awk 'FNR == NR { base[$1 " " $2 " " $3] = $4; next }
+	{ cur[$1 " " $2 " " $3] = $4 }
+	($1 " " $2 " " $3) in base && $4 > base[$1 " " $2 " " $3] {
+	    printf "regression %s %s %s: budget %s, now %s\n",
+		$1, $2, $3, base[$1 " " $2 " " $3], $4
+	    nbad++
+	}
+	END {
+	    for (key in base)
+		if (!(key in cur)) {
+		    printf "missing %s: budget %s\n", key, base[key]
+		    nbad++
+		}
+	    exit (nbad ? 1 : 0)
+	}' $MEM_BUDGET -
+}
+
+# all the workloads, irgb also with a statistics region
+_test_mem() {
+    for MODE in rgb irgb hsl hsv ycbcr; do
+	_mem_run colors_large $MODE $MODE
+    done > mem.log
+    _mem_run colors_large irgb_roi -r 0,0,450,299 irgb >> mem.log
+    if [ -n "$MEM_UPDATE" ]; then
+	cp mem.log $MEM_BUDGET
+    else
+	_mem_check < mem.log
+    fi
+    rm -f mem.log
+}
+
 ################################################
 
 _log_init
@@ -13,11 +68,19 @@ _log_init
 echo "* check memory leaks"
 _log make -B
 TEMPFILE=$(tempfile)
-for MODE in rgb irgb; do
+for MODE in rgb irgb hsl hsv ycbcr; do
     _log _test_memcheck ./balance $MODE 0 0 data/colors.png $TEMPFILE
     _log _test_memcheck ./balance $MODE 23 42 data/colors.png $TEMPFILE
     _log _test_memcheck ./balance $MODE 50 50 data/colors.png $TEMPFILE
 done
+for MODE in rgb irgb; do
+    _log _test_memcheck ./balance_mosaic -j 2 $MODE 1 1 \
+	data/colors.png $TEMPFILE data/colors.png $TEMPFILE.2
+done
+rm -f $TEMPFILE.2
+
+echo "* check peak memory"
+_log _test_mem
 rm -f $TEMPFILE
 
 
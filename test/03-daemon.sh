@@ -0,0 +1,64 @@
+#!/bin/sh -e
+#
+# Test the balanced daemon and its client.
+
+_test_daemon() {
+    SOCKET=$1
+    TEMPFILE=$(tempfile)
+    ./balance_client $SOCKET rgb 10 20 data/colors.png $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client -p $SOCKET rgb 10 20 data/colors.png $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET irgb 10 20 - - < data/colors.png > $TEMPFILE
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET hsl 10 20 data/colors.png $TEMPFILE
+    test "0500657e062b4168ae72dc2db4efaa48  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET hsv 10 20 data/colors.png $TEMPFILE
+    test "6db93105b8550f70832619408b26a979  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET ycbcr 10 20 data/colors.png $TEMPFILE
+    test "479960f1e4ba5bac80116cb079bb43e9  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET hsv 10 20 data/colors_gray.png $TEMPFILE
+    test "578e56c5808aa3965d91f93a5e485619  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET hsl 10 20 data/colors_rgba.png $TEMPFILE
+    test "7c300c1c44b9faf2d395165bb98b40fa  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    # invalid requests and images are rejected, the daemon still works
+    ./balance_client $SOCKET foo 10 20 data/colors.png $TEMPFILE \
+	&& return 1
+    ./balance_client $SOCKET rgb 10 20 README.txt $TEMPFILE \
+	&& return 1
+    ./balance_client $SOCKET rgb 10 20 data/colors.png $TEMPFILE
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPFILE" \
+	= "$(md5sum $TEMPFILE)"
+    ./balance_client $SOCKET stats > $TEMPFILE
+    grep -q "^requests 9$" $TEMPFILE
+    grep -q "^errors 2$" $TEMPFILE
+    grep -q "^p99_us [1-9]" $TEMPFILE
+    rm -f $TEMPFILE
+}
+
+################################################
+
+_log_init
+
+echo "* daemon requests"
+_log make -B
+SOCKET=$(tempfile)
+./balanced $SOCKET 2 2>> $LOGFILE &
+DAEMON=$!
+sleep 1
+_log _test_daemon $SOCKET
+kill $DAEMON
+wait $DAEMON
+test ! -e $SOCKET
+
+_log make distclean
+
+_log_clean
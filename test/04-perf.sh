@@ -0,0 +1,159 @@
+#!/bin/sh -e
+#
+# Check there is no performance regression against a stored baseline.
+#
+# Each workload (image and mode) is run $PERF_RUNS times with the
+# debug stage timers, and the median values are compared with
+# test/perf.baseline:
+# - stage CPU times and wall time, in seconds, must not be larger
+#   than the baseline times $PERF_TOL, plus $PERF_MIN for the timer
+#   resolution;
+# - the megapixels per second must not be smaller than the baseline
+#   divided by $PERF_TOL, for the workloads longer than 10 x $PERF_MIN;
+# - the number of allocations, from the --stats output, must not be
+#   larger than the baseline;
+# - every measure of the baseline must be in the run.
+# The timings depend on the machine, so they are compared relative to
+# a calibration workload independent of this code (gzip), timed in the
+# baseline and in the run. Use PERF_UPDATE=1 to write a new baseline
+# before changing the code.
+
+PERF_BASELINE=${PERF_BASELINE:-${0%/*}/perf.baseline}
+PERF_RUNS=${PERF_RUNS:-3}
+PERF_TOL=${PERF_TOL:-2}
+PERF_MIN=${PERF_MIN:-0.05}
+
+# median of the numbers on stdin
+_median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# number of pixels of a PNG image, from the IHDR chunk
+_pixels() {
+    od -A n -t u1 -j 16 -N 8 $1 | awk '{
+	print ($1 * 16777216 + $2 * 65536 + $3 * 256 + $4) \
+	    * ($5 * 16777216 + $6 * 65536 + $7 * 256 + $8) }'
+}
+
+# measure one workload, output "image mode stage value" lines
+_perf_run() {
+    IMAGE=$1
+    MODE=$2
+    NAME=${IMAGE##*/}
+    NAME=${NAME%.png}
+    RUNDIR=$(mktemp -d)
+    for RUN in $(seq $PERF_RUNS); do
+	T0=$(date +%s%N)
+	./balance $MODE 1 1 $IMAGE $RUNDIR/out.png 2> $RUNDIR/err
+	T1=$(date +%s%N)
+	# debug stage lines are "stage<TAB>0.12s"
+	grep "^[a-z]*	[0-9.]*s$" $RUNDIR/err | sed "s/s$//" >> $RUNDIR/stages
+	echo "wall	$(( (T1 - T0) / 1000000 ))e-3" >> $RUNDIR/stages
+    done
+    for STAGE in $(cut -f 1 $RUNDIR/stages | sort -u); do
+	V=$(grep "^$STAGE	" $RUNDIR/stages \
+	    | awk '{ printf "%.3f\n", $2 }' | _median)
+	echo "$NAME $MODE $STAGE $V"
+    done
+    echo "$NAME $MODE mps $(grep "^wall	" $RUNDIR/stages \
+	| awk '{ printf "%.3f\n", $2 }' | _median \
+	| awk -v p=$(_pixels $IMAGE) '{ printf "%.1f", p / 1e6 / $1 }')"
+    echo "$NAME $MODE allocs $(./balance --stats $MODE 1 1 \
+	$IMAGE $RUNDIR/out.png 2>&1 \
+	| sed -n 's/.*"allocs": \([0-9]*\),.*/\1/p')"
+    rm -rf $RUNDIR
+}
+
+# time the calibration workload, output a "calib gzip wall value" line
+_perf_calib() {
+    for RUN in $(seq $PERF_RUNS); do
+	T0=$(date +%s%N)
+	seq 1 2000000 | gzip -6 > /dev/null
+	T1=$(date +%s%N)
+	echo "$(( (T1 - T0) / 1000000 ))e-3" | awk '{ printf "%.3f\n", $1 }'
+    done | _median | sed "s/^/calib gzip wall /"
+}
+
+# compare the measures on stdin with the baseline, report each regression
+_perf_check() {
+    awk -v tol=$PERF_TOL -v min=$PERF_MIN '
+	FNR == NR { base[$1 " " $2 " " $3] = $4; next }
+	{ cur[$1 " " $2 " " $3] = $4 }
+	END {
+	    calib = "calib gzip wall"
+	    if (!(calib in base) || !(calib in cur) \
+		|| 0 >= base[calib] || 0 >= cur[calib]) {
+		print "missing calibration time"
+		exit 1
+	    }
+	    # machine speed, relative to the baseline machine
+	    speed = base[calib] / cur[calib]
+	    for (key in base) {
+		if (key == calib)
+		    continue
+		if (!(key in cur) || "" == cur[key]) {
+		    printf "missing %s: baseline %s\n", key, base[key]
+		    nbad++
+		    continue
+		}
+		b = base[key]; v = cur[key]
+		split(key, k, " ")
+		if ("mps" == k[3])
+		    # too noisy on the small images
+		    bad = (v / speed < b / tol \
+			   && base[k[1] " " k[2] " wall"] > 10 * min)
+		else if ("allocs" == k[3])
+		    bad = (v > b)
+		else
+		    bad = (v * speed > b * tol + min)
+		if (bad) {
+		    printf "regression %s: baseline %s, now %s\n", key, b, v
+		    nbad++
+		}
+	    }
+	    exit (nbad ? 1 : 0)
+	}' $PERF_BASELINE -
+}
+
+# all the workloads
+_test_perf() {
+    {
+	_perf_calib
+	for IMAGE in data/colors.png data/colors_large.png $PERFIMAGE; do
+	    for MODE in rgb irgb hsl hsv ycbcr; do
+		_perf_run $IMAGE $MODE
+	    done
+	done
+    } > perf.log
+    if [ -n "$PERF_UPDATE" ]; then
+	cp perf.log $PERF_BASELINE
+    else
+	_perf_check < perf.log
+    fi
+    rm -f perf.log
+}
+
+################################################
+
+_log_init
+
+echo "* performance"
+# debug build for the stage timers, without the efence allocator
+_log make -B CPPFLAGS="-I. -UNDEBUG"
+# fixed compiler, $CC is left over by the build tests
+_log cc -O2 -I. -o perf_image test/perf_image.c io_png.o \
+    stats_lib.o -lpng
+PERFDIR=$(mktemp -d)
+PERFIMAGE=$PERFDIR/generated_2000x1500.png
+_log ./perf_image 2000 1500 $PERFIMAGE
+_log _test_perf
+rm -rf $PERFDIR perf_image
+
+echo "* kernel microbenchmarks"
+_log make bench_kernels
+_log ./bench_kernels 65536 3
+rm -f bench_kernels
+
+_log make distclean
+
+_log_clean
@@ -0,0 +1,45 @@
+#!/bin/sh -e
+#
+# Test the mosaic mode, with global statistics over the tiles.
+
+_test_mosaic() {
+    TEMPDIR=$(mktemp -d)
+    # identical tiles have the statistics of one of them
+    ./balance_mosaic rgb 10 20 data/colors.png $TEMPDIR/a.png \
+	data/colors.png $TEMPDIR/b.png
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPDIR/a.png" \
+	= "$(md5sum $TEMPDIR/a.png)"
+    test "3624544f3ba96489eb45d2ae7042e640  $TEMPDIR/b.png" \
+	= "$(md5sum $TEMPDIR/b.png)"
+    ./balance_mosaic irgb 10 20 data/colors.png $TEMPDIR/a.png \
+	data/colors.png $TEMPDIR/b.png
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPDIR/a.png" \
+	= "$(md5sum $TEMPDIR/a.png)"
+    test "396a17da1186cb47731763b82f6a2acb  $TEMPDIR/b.png" \
+	= "$(md5sum $TEMPDIR/b.png)"
+    # the result does not depend on the workers or the tile order
+    for MODE in rgb irgb; do
+	./balance_mosaic -j 1 $MODE 1 1 data/colors.png $TEMPDIR/a1.png \
+	    data/colors_large.png $TEMPDIR/b1.png
+	./balance_mosaic -j 4 $MODE 1 1 data/colors_large.png $TEMPDIR/b4.png \
+	    data/colors.png $TEMPDIR/a4.png
+	cmp $TEMPDIR/a1.png $TEMPDIR/a4.png
+	cmp $TEMPDIR/b1.png $TEMPDIR/b4.png
+    done
+    # invalid parameters are rejected
+    ./balance_mosaic hsv 1 1 data/colors.png $TEMPDIR/a.png && return 1
+    ./balance_mosaic rgb 1 1 - $TEMPDIR/a.png && return 1
+    rm -rf $TEMPDIR
+}
+
+################################################
+
+_log_init
+
+echo "* mosaic"
+_log make -B
+_log _test_mosaic
+
+_log make distclean
+
+_log_clean
@@ -0,0 +1,368 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file bench_kernels.c
+ * @brief microbenchmarks of the balance_lib and io_png kernels
+ *
+ * The kernels are static functions. They are reached by including
+ * the library sources in this file, so they are only exported to
+ * this program and the library objects are not changed.
+ *
+ * The SIMD versions of the table lookup are first checked against
+ * the scalar version, and only the ones supported by the CPU run.
+ *
+ * Each kernel runs on arrays of increasing size, from the L1 cache
+ * to the DRAM range. For each size, the kernel runs once to warm the
+ * caches up, then the measure is repeated and the median time and
+ * cycles per element are reported. The cycles are counted by the
+ * debug.h DBG_CYCLE counters, with the time stamp counter: on recent
+ * CPUs, it runs at a constant reference frequency, not at the actual
+ * core frequency.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+/* the cycle counters are only available in debug builds */
+#undef NDEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+
+/* test-only export of the static kernels */
+#include "io_png.c"
+#include "balance_lib.c"
+
+/** @brief default largest array size, in elements */
+#define SIZE_MAX_DEFAULT (16 * 1024 * 1024)
+/** @brief smallest array size, in elements */
+#define SIZE_MIN 1024
+/** @brief minimum number of elements processed per measure */
+#define ELEMENTS_MIN (1024 * 1024)
+/** @brief default number of measures */
+#define RUNS_DEFAULT 11
+
+/** @brief input arrays, as large as the largest size */
+static unsigned char *bench_u8;
+static float *bench_f32;
+/** @brief results sink, to keep the kernels from being optimized out */
+static volatile double bench_sink;
+/** @brief identity table, to keep the arrays unchanged between the runs */
+static unsigned char bench_lut[UCHAR_MAX + 1];
+
+/** @brief a kernel and its memory traffic */
+typedef struct kernel_s {
+    const char *name;
+    size_t bytes;               /* bytes read and written per element */
+    void (*run) (size_t n);     /* run on n elements of the arrays */
+    int (*supported) (void);    /* CPU support, always if NULL */
+} kernel_t;
+
+static void run_minmax_u8(size_t n)
+{
+    unsigned char min, max;
+
+    minmax_u8(bench_u8, n, &min, &max);
+    bench_sink += min + max;
+}
+
+static void run_minmax_f32(size_t n)
+{
+    balance_roi_t roi;
+    float min, max;
+
+    roi_full(&roi, n);
+    minmax_f32(bench_f32, &roi, &min, &max);
+    bench_sink += min + max;
+}
+
+static void run_quantiles_u8(size_t n)
+{
+    unsigned char min, max;
+
+    quantiles_u8(bench_u8, n, n / 100, n / 100, &min, &max);
+    bench_sink += min + max;
+}
+
+static void run_quantiles_f32(size_t n)
+{
+    balance_roi_t roi;
+    float min, max;
+
+    roi_full(&roi, n);
+    quantiles_f32(bench_f32, &roi, n, n / 100, n / 100, &min, &max);
+    bench_sink += min + max;
+}
+
+/* the identity bounds keep the arrays unchanged between the runs */
+static void run_rescale_u8(size_t n)
+{
+    bench_sink += rescale_u8(bench_u8, n, 0, UCHAR_MAX)[0];
+}
+
+static void run_rescale_f32(size_t n)
+{
+    bench_sink += rescale_f32(bench_f32, n, 0., 1.)[0];
+}
+
+static void run_lut_u8(size_t n)
+{
+    lut_u8(bench_u8, n, bench_lut);
+    bench_sink += bench_u8[0];
+}
+
+static void run_lut_scalar_u8(size_t n)
+{
+    lut_scalar_u8(bench_u8, n, bench_lut);
+    bench_sink += bench_u8[0];
+}
+
+#ifdef LUT_DISPATCH
+static void run_lut_avx2_u8(size_t n)
+{
+    lut_avx2_u8(bench_u8, n, bench_lut);
+    bench_sink += bench_u8[0];
+}
+
+static void run_lut_vbmi_u8(size_t n)
+{
+    lut_vbmi_u8(bench_u8, n, bench_lut);
+    bench_sink += bench_u8[0];
+}
+
+static int has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int has_vbmi(void)
+{
+    return (__builtin_cpu_supports("avx512vbmi")
+            && __builtin_cpu_supports("avx512bw"));
+}
+#endif
+
+static void run_inter(size_t n)
+{
+    float *tmp;
+
+    tmp = _io_png_inter(bench_f32, n / 3, 3, INTERLACE);
+    bench_sink += tmp[0];
+    free(tmp);
+}
+
+static void run_byte2flt(size_t n)
+{
+    float *tmp;
+
+    tmp = _io_png_byte2flt(bench_u8, n);
+    bench_sink += tmp[0];
+    free(tmp);
+}
+
+static void run_flt2byte(size_t n)
+{
+    png_byte *tmp;
+
+    tmp = _io_png_flt2byte(bench_f32, n);
+    bench_sink += tmp[0];
+    free(tmp);
+}
+
+/** @brief the benchmarked kernels */
+static const kernel_t kernels[] = {
+    {"minmax_u8", 1, &run_minmax_u8, NULL},
+    {"minmax_f32", 4, &run_minmax_f32, NULL},
+    {"quantiles_u8", 1, &run_quantiles_u8, NULL},
+    {"quantiles_f32", 4, &run_quantiles_f32, NULL},
+    {"rescale_u8", 2, &run_rescale_u8, NULL},
+    {"rescale_f32", 8, &run_rescale_f32, NULL},
+    {"lut_u8", 2, &run_lut_u8, NULL},
+    {"lut_scalar_u8", 2, &run_lut_scalar_u8, NULL},
+#ifdef LUT_DISPATCH
+    {"lut_avx2_u8", 2, &run_lut_avx2_u8, &has_avx2},
+    {"lut_vbmi_u8", 2, &run_lut_vbmi_u8, &has_vbmi},
+#endif
+    {"_io_png_inter", 8, &run_inter, NULL},
+    {"_io_png_byte2flt", 5, &run_byte2flt, NULL},
+    {"_io_png_flt2byte", 5, &run_flt2byte, NULL},
+    {NULL, 0, NULL, NULL}
+};
+
+/**
+ * @brief compare two doubles, for qsort()
+ */
+static int cmp_dbl(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+/**
+ * @brief check the SIMD table lookups against the scalar version
+ *
+ * A random table is applied to the random arrays, with all the
+ * lengths of the left over bytes.
+ *
+ * @return 0 if the outputs are the same, -1 otherwise
+ */
+static int check_lut(size_t size_max)
+{
+    unsigned char lut[UCHAR_MAX + 1];
+    unsigned char *ref, *tmp;
+    size_t n, len, i;
+    int ret = 0;
+
+    n = (size_max < 4096 ? size_max : 4096);
+    ref = (unsigned char *) malloc(n);
+    tmp = (unsigned char *) malloc(n);
+    if (NULL == ref || NULL == tmp) {
+        fprintf(stderr, "not enough memory\n");
+        abort();
+    }
+    for (i = 0; i <= UCHAR_MAX; i++)
+        lut[i] = bench_u8[(7 * i) % n];
+    for (len = n - 64; len <= n; len++) {
+        memcpy(ref, bench_u8, len);
+        lut_scalar_u8(ref, len, lut);
+        memcpy(tmp, bench_u8, len);
+        lut_u8(tmp, len, lut);
+        ret |= memcmp(ref, tmp, len);
+#ifdef LUT_DISPATCH
+        if (has_avx2()) {
+            memcpy(tmp, bench_u8, len);
+            lut_avx2_u8(tmp, len, lut);
+            ret |= memcmp(ref, tmp, len);
+        }
+        if (has_vbmi()) {
+            memcpy(tmp, bench_u8, len);
+            lut_vbmi_u8(tmp, len, lut);
+            ret |= memcmp(ref, tmp, len);
+        }
+#endif
+    }
+    free(ref);
+    free(tmp);
+    return (0 == ret ? 0 : -1);
+}
+
+/**
+ * @brief measure a kernel on n elements
+ *
+ * Small arrays are processed several times per measure, so each
+ * measure is long enough for the clock resolution.
+ *
+ * @param k kernel
+ * @param n number of elements
+ * @param runs number of measures
+ * @param ns, cycles output median time and cycles per element
+ * @param tmp work array, 2 x runs values
+ */
+static void measure(const kernel_t * k, size_t n, size_t runs,
+                    double *ns, double *cycles, double *tmp)
+{
+    size_t reps, i, r;
+
+    reps = (n < ELEMENTS_MIN ? ELEMENTS_MIN / n : 1);
+    k->run(n);                  /* warm-up */
+    for (r = 0; r < runs; r++) {
+        DBG_CLOCK_START(0);
+        DBG_CYCLE_START(0);
+        for (i = 0; i < reps; i++)
+            k->run(n);
+        DBG_CYCLE_TOGGLE(0);
+        DBG_CLOCK_TOGGLE(0);
+        tmp[r] = (double) DBG_CLOCK(0) * 1e9 / CLOCKS_PER_SEC
+            / (double) (reps * n);
+        tmp[runs + r] = (double) DBG_CYCLE(0) / (double) (reps * n);
+    }
+    qsort(tmp, runs, sizeof(double), &cmp_dbl);
+    qsort(tmp + runs, runs, sizeof(double), &cmp_dbl);
+    *ns = tmp[runs / 2];
+    *cycles = tmp[runs + runs / 2];
+    return;
+}
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    unsigned long seed;
+    size_t size_max, runs, n, i;
+    double ns, cycles, *tmp;
+    const kernel_t *k;
+
+    if (3 < argc || (2 <= argc && '-' == argv[1][0])) {
+        fprintf(stderr, "usage : %s [size_max [runs]]\n", argv[0]);
+        fprintf(stderr, "        size_max is the largest array size,"
+                " default %d elements\n", SIZE_MAX_DEFAULT);
+        fprintf(stderr, "        runs is the number of measures,"
+                " default %d\n", RUNS_DEFAULT);
+        return EXIT_FAILURE;
+    }
+    size_max = (2 <= argc ? (size_t) atol(argv[1]) : SIZE_MAX_DEFAULT);
+    runs = (3 <= argc ? (size_t) atol(argv[2]) : RUNS_DEFAULT);
+    if (SIZE_MIN > size_max || 0 == runs) {
+        fprintf(stderr, "size_max must be at least %d, runs at least 1\n",
+                SIZE_MIN);
+        return EXIT_FAILURE;
+    }
+
+    /* noisy data in [0,1], LCG from K&R2 p.46 */
+    bench_u8 = (unsigned char *) malloc(size_max);
+    bench_f32 = (float *) malloc(size_max * sizeof(float));
+    tmp = (double *) malloc(2 * runs * sizeof(double));
+    if (NULL == bench_u8 || NULL == bench_f32 || NULL == tmp) {
+        fprintf(stderr, "not enough memory\n");
+        return EXIT_FAILURE;
+    }
+    seed = 1;
+    for (i = 0; i < size_max; i++) {
+        seed = (seed * 1103515245ul + 12345ul) & 0xfffffffful;
+        bench_u8[i] = (unsigned char) ((seed >> 16) & 0xff);
+        bench_f32[i] = (float) bench_u8[i] / 255.f;
+    }
+    for (i = 0; i <= UCHAR_MAX; i++)
+        bench_lut[i] = (unsigned char) i;
+    if (0 != check_lut(size_max)) {
+        fprintf(stderr, "the SIMD table lookups differ from the scalar one\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("kernel\telements\tbytes\tns/elt\tcycles/elt\n");
+    for (k = kernels; NULL != k->name; k++) {
+        if (NULL != k->supported && !k->supported())
+            continue;
+        for (n = SIZE_MIN; n <= size_max; n *= 4) {
+            measure(k, n, runs, &ns, &cycles, tmp);
+            printf("%s\t%lu\t%lu\t%.3f\t%.3f\n", k->name,
+                   (unsigned long) n, (unsigned long) (n * k->bytes),
+                   ns, cycles);
+        }
+    }
+
+    free(bench_u8);
+    free(bench_f32);
+    free(tmp);
+    return EXIT_SUCCESS;
+}
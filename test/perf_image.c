@@ -0,0 +1,80 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file perf_image.c
+ * @brief generate the large test images of the performance tests
+ *
+ * The image is a smooth color gradient with some pseudo-random noise,
+ * always the same for a given size, so the PNG compression and the
+ * statistics are close to those of a photograph.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "io_png.h"
+
+/**
+ * @brief main function call
+ */
+int main(int argc, char *const *argv)
+{
+    unsigned char *rgb, *ch[3];
+    unsigned long seed;
+    size_t nx, ny, x, y, c;
+    int v;
+
+    if (4 != argc) {
+        fprintf(stderr, "usage : %s nx ny out.png\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    nx = (size_t) atol(argv[1]);
+    ny = (size_t) atol(argv[2]);
+    if (0 == nx || 0 == ny
+        || NULL == (rgb = (unsigned char *) malloc(3 * nx * ny))) {
+        fprintf(stderr, "bad image size\n");
+        return EXIT_FAILURE;
+    }
+    for (c = 0; c < 3; c++)
+        ch[c] = rgb + c * nx * ny;
+
+    /* gradients in [16,240[ and noise in [-8,8[, LCG from K&R2 p.46 */
+    seed = 1;
+    for (y = 0; y < ny; y++) {
+        for (x = 0; x < nx; x++) {
+            for (c = 0; c < 3; c++) {
+                seed = (seed * 1103515245ul + 12345ul) & 0xfffffffful;
+                v = (int) ((seed >> 16) & 15) - 8;
+                if (0 == c)
+                    v += 16 + (int) (224 * x / nx);
+                else if (1 == c)
+                    v += 16 + (int) (224 * y / ny);
+                else
+                    v += 16 + (int) (224 * (x + y) / (nx + ny));
+                ch[c][y * nx + x] = (unsigned char) v;
+            }
+        }
+    }
+
+    io_png_write_uchar_from(argv[3], (const unsigned char *const *) ch,
+                            nx, ny, 3, nx, IO_PNG_OPT_NONE);
+    free(rgb);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2009-2011 IPOL Image Processing On Line http://www.ipol.im/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file video_lib.c
+ * @brief raw video streams, balanced frame by frame
+ *
+ * The frames are read from a Y4M stream (YUV4MPEG2, the ffmpeg
+ * yuv4mpegpipe format), or as raw planar 4:2:0 frames (ffmpeg rawvideo
+ * yuv420p) or raw interleaved RGB frames (rawvideo rgb24), and written
+ * in the same format, without any PNG encoding or decoding.
+ *
+ * Each frame is balanced with its own statistics. In the YUV frames,
+ * only the Y plane is balanced, as a gray image, and the chroma planes
+ * are copied. The Y plane keeps the color range of the stream: it is
+ * balanced to [16-235] in the limited range (the video default, ffmpeg
+ * yuv420p) and to [0-255] in the full range (ffmpeg yuvj420p, or a Y4M
+ * stream with the XCOLORRANGE=FULL tag). The RGB frames are balanced
+ * as in the rgb mode.
+ *
+ * The frame buffers are allocated once for the whole stream. With
+ * POSIX threads (-pthread, which defines _REENTRANT), a reader thread
+ * reads the next frame in a second buffer while the current frame is
+ * balanced and written; otherwise the frames are read, balanced and
+ * written in sequence, in one buffer.
+ *
+ * @author Nicolas Limare <nicolas.limare@cmla.ens-cachan.fr>
+ */
+
+#ifdef _REENTRANT
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+
+#include "balance_lib.h"
+#include "colorbalance_lib.h"
+#include "stats_lib.h"
+#include "pool_lib.h"
+
+/* ensure consistency */
+#include "video_lib.h"
+
+/** @brief number of frame buffers, read ahead by the reader thread */
+#ifdef _REENTRANT
+#define VIDEO_SLOTS 2
+#else
+#define VIDEO_SLOTS 1
+#endif
+
+/** @brief maximum length of a Y4M stream or frame header line */
+#define VIDEO_LINE_MAX 1024
+
+/** @brief Y range of the limited range frames */
+#define VIDEO_Y_MIN 16
+#define VIDEO_Y_MAX 235
+
+/** @brief input stream */
+typedef struct video_in_s {
+    FILE *fp;                   /* input file */
+    video_fmt_t fmt;            /* stream format */
+    size_t frame_size;          /* frame samples, in bytes */
+    int full;                   /* 1 for the full range YUV frames */
+} video_in_t;
+
+/** @brief one frame */
+typedef struct video_slot_s {
+    unsigned char *data;        /* frame samples */
+    char head[VIDEO_LINE_MAX];  /* Y4M frame header line */
+    int status;                 /* 1 for a frame, 0 at the end, -1 on error */
+} video_slot_t;
+
+/**
+ * @brief parse a stream format name
+ *
+ * @param name "y4m", "yuv420", "yuvj420" or "rgb24"
+ * @param fmt pointer to the format
+ * @return 0 on success, -1 for an unknown name
+ */
+int video_fmt(const char *name, video_fmt_t * fmt)
+{
+    /* sanity check */
+    if (NULL == name || NULL == fmt) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    if (0 == strcmp(name, "y4m"))
+        *fmt = VIDEO_Y4M;
+    else if (0 == strcmp(name, "yuv420"))
+        *fmt = VIDEO_YUV420;
+    else if (0 == strcmp(name, "yuvj420"))
+        *fmt = VIDEO_YUVJ420;
+    else if (0 == strcmp(name, "rgb24"))
+        *fmt = VIDEO_RGB24;
+    else
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief read a header line, with its end of line
+ *
+ * @return line length, 0 at the end of the file, -1 for an incomplete
+ *         or too long line
+ */
+static int read_line(FILE * fp, char *line)
+{
+    int c, len;
+
+    len = 0;
+    while (EOF != (c = getc(fp))) {
+        if (VIDEO_LINE_MAX - 1 == len)
+            return -1;
+        line[len++] = (char) c;
+        if ('\n' == c)
+            break;
+    }
+    line[len] = '\0';
+    if (0 < len && '\n' != line[len - 1])
+        return -1;
+    return len;
+}
+
+/**
+ * @brief parse a Y4M stream header
+ *
+ * The frame size is the Y plane and the chroma planes size; the 4:2:0,
+ * 4:2:2, 4:4:4 and mono 8bit color spaces are supported, 4:2:0 by
+ * default. The color range is limited, unless the stream has the
+ * XCOLORRANGE=FULL tag.
+ *
+ * @param line header line
+ * @param nxp, nyp pointers to the frame size
+ * @param sizep pointer to the frame samples size, in bytes
+ * @param fullp pointer to the color range, 1 for the full range
+ * @return 0 on success, -1 on error with a message
+ */
+static int y4m_head(const char *line, size_t *nxp, size_t *nyp,
+                    size_t *sizep, int *fullp)
+{
+    char cs[16];                /* color space */
+    char range[16];             /* color range */
+    size_t nx, ny, cx, cy;
+    const char *tok;
+
+    if (0 != strncmp(line, "YUV4MPEG2 ", 10)) {
+        fprintf(stderr, "not a Y4M stream\n");
+        return -1;
+    }
+    nx = 0;
+    ny = 0;
+    strcpy(cs, "420jpeg");
+    strcpy(range, "LIMITED");
+    for (tok = line + 9; NULL != tok; tok = strchr(tok + 1, ' ')) {
+        if ('W' == tok[1])
+            nx = (size_t) strtoul(tok + 2, NULL, 10);
+        else if ('H' == tok[1])
+            ny = (size_t) strtoul(tok + 2, NULL, 10);
+        else if ('C' == tok[1])
+            (void) sscanf(tok + 2, "%15[^ \n]", cs);
+        else if (0 == strncmp(tok + 1, "XCOLORRANGE=", 12))
+            (void) sscanf(tok + 13, "%15[^ \n]", range);
+    }
+    if (0 == nx || 0 == ny) {
+        fprintf(stderr, "the Y4M frame size is missing\n");
+        return -1;
+    }
+    if (0 != strcmp(range, "LIMITED") && 0 != strcmp(range, "FULL")) {
+        fprintf(stderr, "unsupported Y4M color range %s\n", range);
+        return -1;
+    }
+
+    /* chroma planes size */
+    if (0 == strcmp(cs, "420jpeg") || 0 == strcmp(cs, "420paldv")
+        || 0 == strcmp(cs, "420mpeg2") || 0 == strcmp(cs, "420")) {
+        cx = (nx + 1) / 2;
+        cy = (ny + 1) / 2;
+    }
+    else if (0 == strcmp(cs, "422")) {
+        cx = (nx + 1) / 2;
+        cy = ny;
+    }
+    else if (0 == strcmp(cs, "444")) {
+        cx = nx;
+        cy = ny;
+    }
+    else if (0 == strcmp(cs, "mono")) {
+        cx = 0;
+        cy = 0;
+    }
+    else {
+        fprintf(stderr, "unsupported Y4M color space %s\n", cs);
+        return -1;
+    }
+    *nxp = nx;
+    *nyp = ny;
+    *sizep = nx * ny + 2 * cx * cy;
+    *fullp = (0 == strcmp(range, "FULL"));
+    return 0;
+}
+
+/**
+ * @brief read one frame
+ *
+ * @return 1 for a frame, 0 at the end of the stream, -1 on error with
+ *         a message
+ */
+static int read_frame(video_in_t * in, video_slot_t * slot)
+{
+    size_t n;
+    int len;
+
+    STATS_TOGGLE(STATS_READ);
+    len = 0;
+    if (VIDEO_Y4M == in->fmt) {
+        if (0 == (len = read_line(in->fp, slot->head))) {
+            STATS_TOGGLE(STATS_READ);
+            return 0;
+        }
+        if (0 > len || 0 != strncmp(slot->head, "FRAME", 5)) {
+            STATS_TOGGLE(STATS_READ);
+            fprintf(stderr, "bad Y4M frame header\n");
+            return -1;
+        }
+    }
+    n = fread(slot->data, 1, in->frame_size, in->fp);
+    STATS_TOGGLE(STATS_READ);
+    STATS_ADD(bytes_read, (unsigned long) (len + n));
+    if (0 == n && 0 == len && feof(in->fp))
+        return 0;
+    if (in->frame_size != n) {
+        fprintf(stderr, "truncated video frame\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief balance one frame
+ *
+ * @param data frame samples
+ * @param in input stream
+ * @param size number of pixels
+ * @param nb_min, nb_max number of pixels to flatten
+ */
+static void balance_frame(unsigned char *data, const video_in_t * in,
+                          size_t size, size_t nb_min, size_t nb_max)
+{
+    size_t histo[UCHAR_MAX + 1];
+    unsigned char lut[UCHAR_MAX + 1];
+    unsigned char min, max;
+    size_t v;
+
+    if (VIDEO_RGB24 == in->fmt)
+        (void) colorbalance_rgb24_u8(data, size, nb_min, nb_max);
+    else {
+        /* the Y plane is first */
+        STATS_TOGGLE(STATS_STATISTICS);
+        memset(histo, 0x00, sizeof(histo));
+        balance_histo_u8(data, size, histo);
+        STATS_TOGGLE(STATS_STATISTICS);
+        if (in->full)
+            (void) colorbalance_gray_histo_u8(data, size, histo,
+                                              nb_min, nb_max);
+        else {
+            /* the [0-255] table, scaled to the limited range */
+            STATS_TOGGLE(STATS_STATISTICS);
+            balance_bounds_histo_u8(histo, nb_min, nb_max, &min, &max);
+            STATS_TOGGLE(STATS_STATISTICS);
+            STATS_BOUNDS(0, min, max);
+            STATS_TOGGLE(STATS_APPLY);
+            balance_lut_u8(min, max, lut);
+            for (v = 0; v <= UCHAR_MAX; v++)
+                lut[v] = (unsigned char) (VIDEO_Y_MIN
+                                          + ((VIDEO_Y_MAX - VIDEO_Y_MIN)
+                                             * (size_t) lut[v]
+                                             + UCHAR_MAX / 2) / UCHAR_MAX);
+            balance_lut_apply_u8(data, size, size, 1, lut);
+            STATS_TOGGLE(STATS_APPLY);
+        }
+    }
+    STATS_ADD(pixels, (unsigned long) size);
+    return;
+}
+
+/**
+ * @brief write one frame
+ *
+ * @return 0 on success, -1 on error with a message
+ */
+static int write_frame(FILE * fp, video_fmt_t fmt,
+                       const video_slot_t * slot, size_t frame_size)
+{
+    size_t len;
+    int err;
+
+    STATS_TOGGLE(STATS_ENCODE);
+    len = (VIDEO_Y4M == fmt ? strlen(slot->head) : 0);
+    err = (len != fwrite(slot->head, 1, len, fp)
+           || frame_size != fwrite(slot->data, 1, frame_size, fp));
+    STATS_TOGGLE(STATS_ENCODE);
+    STATS_ADD(bytes_written, (unsigned long) (len + frame_size));
+    if (err) {
+        fprintf(stderr, "video write error\n");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef _REENTRANT
+
+/** @brief frame buffers shared by the reader and the consumer */
+typedef struct video_ring_s {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;   /* signaled on push */
+    pthread_cond_t not_full;    /* signaled on pop and stop */
+    video_slot_t *slot;         /* VIDEO_SLOTS frames */
+    size_t head, count;         /* first used slot, number of used slots */
+    int stop;                   /* the consumer stopped */
+    video_in_t *in;             /* stream to read */
+} video_ring_t;
+
+/**
+ * @brief reader thread, read the frames until the end, an error or
+ * the consumer stop
+ */
+static void *ring_reader(void *ctx)
+{
+    video_ring_t *ring = (video_ring_t *) ctx;
+    video_slot_t *slot;
+    int status;
+
+    do {
+        pthread_mutex_lock(&ring->lock);
+        while (VIDEO_SLOTS == ring->count && !ring->stop)
+            pthread_cond_wait(&ring->not_full, &ring->lock);
+        if (ring->stop) {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        slot = ring->slot + (ring->head + ring->count) % VIDEO_SLOTS;
+        pthread_mutex_unlock(&ring->lock);
+
+        /* only the reader fills this slot until it is counted */
+        status = read_frame(ring->in, slot);
+        slot->status = status;
+
+        pthread_mutex_lock(&ring->lock);
+        ring->count++;
+        pthread_cond_signal(&ring->not_empty);
+        pthread_mutex_unlock(&ring->lock);
+    } while (1 == status);
+    return NULL;
+}
+
+#endif                          /* _REENTRANT */
+
+/**
+ * @brief balance a raw video stream, frame by frame
+ *
+ * @param fname_in input file name, "-" for stdin
+ * @param fname_out output file name, "-" for stdout
+ * @param fmt stream format
+ * @param nx, ny frame size, ignored for the Y4M streams
+ * @param smin, smax saturated percentages
+ * @return number of frames, -1 on error with a message
+ */
+long video_balance(const char *fname_in, const char *fname_out,
+                   video_fmt_t fmt, size_t nx, size_t ny,
+                   float smin, float smax)
+{
+    video_in_t in;
+    video_slot_t *slot;
+    char head[VIDEO_LINE_MAX];  /* Y4M stream header */
+    size_t size, nb_min, nb_max, i;
+    FILE *fp_out;
+    long nb_frames;
+    int status;
+#ifdef _REENTRANT
+    video_ring_t ring;
+    pthread_t reader;
+#endif
+
+    /* sanity check */
+    if (NULL == fname_in || NULL == fname_out) {
+        fprintf(stderr, "a pointer is NULL and should not be so\n");
+        abort();
+    }
+
+    /* stream header */
+    in.fmt = fmt;
+    in.full = (VIDEO_YUVJ420 == fmt);
+    if (0 == strcmp(fname_in, "-"))
+        in.fp = stdin;
+    else if (NULL == (in.fp = fopen(fname_in, "rb"))) {
+        fprintf(stderr, "failed to open %s\n", fname_in);
+        return -1;
+    }
+    if (VIDEO_Y4M == fmt) {
+        if (0 >= read_line(in.fp, head))
+            head[0] = '\0';
+        if (0 != y4m_head(head, &nx, &ny, &in.frame_size, &in.full)) {
+            if (stdin != in.fp)
+                (void) fclose(in.fp);
+            return -1;
+        }
+    }
+    else if (VIDEO_YUV420 == fmt || VIDEO_YUVJ420 == fmt)
+        in.frame_size = nx * ny + 2 * ((nx + 1) / 2) * ((ny + 1) / 2);
+    else
+        in.frame_size = 3 * nx * ny;
+    if (0 == nx * ny) {
+        fprintf(stderr, "the video frame size is missing\n");
+        if (stdin != in.fp)
+            (void) fclose(in.fp);
+        return -1;
+    }
+    if (0 == strcmp(fname_out, "-"))
+        fp_out = stdout;
+    else if (NULL == (fp_out = fopen(fname_out, "wb"))) {
+        fprintf(stderr, "failed to open %s\n", fname_out);
+        if (stdin != in.fp)
+            (void) fclose(in.fp);
+        return -1;
+    }
+    if (VIDEO_Y4M == fmt)
+        (void) fputs(head, fp_out);
+
+    /* frame buffers, allocated once */
+    if (NULL == (slot = (video_slot_t *)
+                 malloc(VIDEO_SLOTS * sizeof(video_slot_t))))
+        pool_abort("not enough memory");
+    STATS_ALLOC(slot, VIDEO_SLOTS * sizeof(video_slot_t));
+    for (i = 0; i < VIDEO_SLOTS; i++) {
+        if (NULL == (slot[i].data = (unsigned char *)
+                     malloc(in.frame_size * sizeof(unsigned char))))
+            pool_abort("not enough memory");
+        STATS_ALLOC(slot[i].data, in.frame_size * sizeof(unsigned char));
+        slot[i].head[0] = '\0';
+    }
+
+    size = nx * ny;
+    nb_min = size * (smin / 100.);
+    nb_max = size * (smax / 100.);
+    nb_frames = 0;
+#ifdef _REENTRANT
+    memset(&ring, 0x00, sizeof(ring));
+    ring.slot = slot;
+    ring.in = &in;
+    if (0 != pthread_mutex_init(&ring.lock, NULL)
+        || 0 != pthread_cond_init(&ring.not_empty, NULL)
+        || 0 != pthread_cond_init(&ring.not_full, NULL)
+        || 0 != pthread_create(&reader, NULL, &ring_reader, &ring))
+        pool_abort("thread initialization error");
+
+    /* consume the frames until the reader is done */
+    for (;;) {
+        video_slot_t *cur;
+
+        pthread_mutex_lock(&ring.lock);
+        while (0 == ring.count)
+            pthread_cond_wait(&ring.not_empty, &ring.lock);
+        cur = ring.slot + ring.head;
+        pthread_mutex_unlock(&ring.lock);
+
+        /* only the consumer uses this slot until it is released */
+        status = cur->status;
+        if (1 == status) {
+            balance_frame(cur->data, &in, size, nb_min, nb_max);
+            if (0 == write_frame(fp_out, fmt, cur, in.frame_size))
+                nb_frames++;
+            else
+                status = -1;
+        }
+
+        pthread_mutex_lock(&ring.lock);
+        if (1 != status) {
+            ring.stop = 1;
+            pthread_cond_signal(&ring.not_full);
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        ring.head = (ring.head + 1) % VIDEO_SLOTS;
+        ring.count--;
+        pthread_cond_signal(&ring.not_full);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&ring.not_full);
+    pthread_cond_destroy(&ring.not_empty);
+    pthread_mutex_destroy(&ring.lock);
+#else
+    while (1 == (status = read_frame(&in, slot))) {
+        balance_frame(slot->data, &in, size, nb_min, nb_max);
+        if (0 != write_frame(fp_out, fmt, slot, in.frame_size)) {
+            status = -1;
+            break;
+        }
+        nb_frames++;
+    }
+#endif
+
+    for (i = 0; i < VIDEO_SLOTS; i++) {
+        STATS_FREE(slot[i].data);
+        free(slot[i].data);
+    }
+    STATS_FREE(slot);
+    free(slot);
+    if (stdin != in.fp)
+        (void) fclose(in.fp);
+    if (0 != (stdout == fp_out ? fflush(fp_out) : fclose(fp_out))) {
+        fprintf(stderr, "video write error\n");
+        status = -1;
+    }
+    return (0 > status ? -1 : nb_frames);
+}
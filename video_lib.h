@@ -0,0 +1,18 @@
+#ifndef _VIDEO_LIB_H
+#define _VIDEO_LIB_H
+
+#include <stddef.h>
+
+/** @brief raw video stream formats */
+typedef enum video_fmt_e {
+    VIDEO_Y4M = 0,              /* YUV4MPEG2, planar YUV with headers */
+    VIDEO_YUV420,               /* raw planar 4:2:0 frames, I420 */
+    VIDEO_YUVJ420,              /* raw planar full range 4:2:0 frames */
+    VIDEO_RGB24                 /* raw interleaved RGB frames */
+} video_fmt_t;
+
+/* video_lib.c */
+int video_fmt(const char *name, video_fmt_t *fmt);
+long video_balance(const char *fname_in, const char *fname_out, video_fmt_t fmt, size_t nx, size_t ny, float smin, float smax);
+
+#endif /* !_VIDEO_LIB_H */